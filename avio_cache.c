@@ -0,0 +1,396 @@
+#include <string.h>
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include <rthreads/rthreads.h>
+
+#include "include/avio_cache.h"
+
+/* Size of the buffer FFmpeg reads through, and most read from the
+ * source at once. */
+#define AVIO_CACHE_BUFFER_SIZE (64 * 1024)
+#define AVIO_CACHE_CHUNK_SIZE  (256 * 1024)
+/* A failed source read is retried this often, from the same offset,
+ * before the reader gets the error. */
+#define AVIO_CACHE_RETRIES     5
+#define AVIO_CACHE_RETRY_US    200000
+
+struct avio_cache
+{
+   AVIOContext *source;
+   AVIOContext *ctx;
+   sthread_t *thread;
+   slock_t *lock;
+   /* Signalled when data, EOF, an error or a finished seek arrives. */
+   scond_t *data_cond;
+   /* Signalled when the reader moves on, seeks or closes. */
+   scond_t *space_cond;
+   /* Ring of the bytes from base to base + fill of the source, base
+    * is at ring index head. */
+   uint8_t *ring;
+   size_t size;
+   size_t behind;
+   size_t head;
+   size_t fill;
+   int64_t base;
+   int64_t pos;
+   int64_t file_size;
+   int64_t seek_target;
+   volatile bool seek_pending;
+   volatile bool closing;
+   bool eof;
+   int error;
+   struct avio_cache_stats stats;
+};
+
+/* Aborts a blocking source read when the reader needs the thread for
+ * something else. */
+static int avio_cache_interrupt(void *opaque)
+{
+   avio_cache_t *cache = (avio_cache_t*)opaque;
+   return cache->closing || cache->seek_pending;
+}
+
+static void avio_cache_thread(void *data)
+{
+   avio_cache_t *cache = (avio_cache_t*)data;
+   unsigned retries    = 0;
+
+   slock_lock(cache->lock);
+
+   while (!cache->closing)
+   {
+      size_t tail;
+      size_t len;
+      int64_t start;
+      int64_t write_pos;
+      int ret;
+
+      if (cache->seek_pending)
+      {
+         int64_t target = cache->seek_target;
+         int64_t pos;
+
+         cache->seek_pending = false;
+         slock_unlock(cache->lock);
+         pos = avio_seek(cache->source, target, SEEK_SET);
+         slock_lock(cache->lock);
+
+         /* Another seek came in meanwhile. */
+         if (cache->seek_pending)
+            continue;
+
+         cache->base  = target;
+         cache->head  = 0;
+         cache->fill  = 0;
+         cache->eof   = false;
+         cache->error = pos < 0 ? (int)pos : 0;
+         retries      = 0;
+         scond_signal(cache->data_cond);
+         continue;
+      }
+
+      if (cache->eof || cache->error)
+      {
+         scond_wait(cache->space_cond, cache->lock);
+         continue;
+      }
+
+      /* Make room by forgetting what lies well behind the reader. */
+      if (cache->fill == cache->size)
+      {
+         int64_t drop = cache->pos - cache->base - (int64_t)cache->behind;
+
+         if (drop <= 0)
+         {
+            scond_wait(cache->space_cond, cache->lock);
+            continue;
+         }
+         if (drop > (int64_t)cache->fill)
+            drop = (int64_t)cache->fill;
+
+         cache->base += drop;
+         cache->head  = (cache->head + (size_t)drop) % cache->size;
+         cache->fill -= (size_t)drop;
+      }
+
+      /* Only this thread writes past fill, so the read can go straight
+       * into the ring without the lock. */
+      tail      = (cache->head + cache->fill) % cache->size;
+      len       = MIN(cache->size - cache->fill, cache->size - tail);
+      len       = MIN(len, AVIO_CACHE_CHUNK_SIZE);
+      write_pos = cache->base + (int64_t)cache->fill;
+      slock_unlock(cache->lock);
+
+      start = av_gettime_relative();
+      ret   = avio_read_partial(cache->source, cache->ring + tail, (int)len);
+
+      slock_lock(cache->lock);
+
+      /* Read for the position before a seek. */
+      if (cache->seek_pending || cache->closing)
+         continue;
+
+      if (ret > 0)
+      {
+         cache->fill                += (size_t)ret;
+         cache->stats.bytes_fetched += (uint64_t)ret;
+         cache->stats.fetch_us      += av_gettime_relative() - start;
+         retries                     = 0;
+         scond_signal(cache->data_cond);
+      }
+      else if (ret == 0 || ret == AVERROR_EOF)
+      {
+         cache->eof = true;
+         scond_signal(cache->data_cond);
+      }
+      else if (retries < AVIO_CACHE_RETRIES)
+      {
+         /* Network sources reconnect when seeked. */
+         retries++;
+         cache->stats.retries++;
+         scond_wait_timeout(cache->space_cond, cache->lock,
+               AVIO_CACHE_RETRY_US * retries);
+         if (cache->seek_pending || cache->closing)
+            continue;
+         slock_unlock(cache->lock);
+         avio_seek(cache->source, write_pos, SEEK_SET);
+         slock_lock(cache->lock);
+      }
+      else
+      {
+         cache->error = ret;
+         scond_signal(cache->data_cond);
+      }
+   }
+
+   slock_unlock(cache->lock);
+}
+
+/* Moves the reader to @target, seeking the source only if @target is
+ * neither kept nor shortly ahead of what has been read. */
+static void avio_cache_locate_locked(avio_cache_t *cache, int64_t target)
+{
+   int64_t end = cache->base + (int64_t)cache->fill;
+
+   cache->pos = target;
+
+   if (!cache->seek_pending && target >= cache->base &&
+         target <= end + (int64_t)cache->behind)
+   {
+      if (target < end)
+         cache->stats.seeks_reused++;
+      scond_signal(cache->space_cond);
+      return;
+   }
+
+   cache->seek_target  = target;
+   cache->seek_pending = true;
+   cache->stats.seeks_source++;
+   scond_signal(cache->space_cond);
+}
+
+static int avio_cache_read(void *opaque, uint8_t *buf, int buf_size)
+{
+   avio_cache_t *cache = (avio_cache_t*)opaque;
+   int64_t stall_start = 0;
+   size_t offset;
+   size_t len;
+   size_t first;
+   int ret;
+
+   slock_lock(cache->lock);
+
+   for (;;)
+   {
+      if (cache->closing)
+      {
+         ret = AVERROR_EXIT;
+         goto end;
+      }
+
+      if (!cache->seek_pending)
+      {
+         int64_t end = cache->base + (int64_t)cache->fill;
+
+         if (cache->pos >= cache->base && cache->pos < end)
+            break;
+         if (cache->pos >= end && cache->error)
+         {
+            ret = cache->error;
+            goto end;
+         }
+         if (cache->pos >= end && cache->eof)
+         {
+            ret = AVERROR_EOF;
+            goto end;
+         }
+         if (cache->pos < cache->base)
+            avio_cache_locate_locked(cache, cache->pos);
+      }
+
+      if (!stall_start)
+      {
+         stall_start = av_gettime_relative();
+         cache->stats.stalls++;
+      }
+      scond_wait(cache->data_cond, cache->lock);
+   }
+
+   offset = (cache->head + (size_t)(cache->pos - cache->base)) % cache->size;
+   len    = (size_t)(cache->base + (int64_t)cache->fill - cache->pos);
+   len    = MIN(len, (size_t)buf_size);
+   first  = MIN(len, cache->size - offset);
+
+   memcpy(buf, cache->ring + offset, first);
+   if (len > first)
+      memcpy(buf + first, cache->ring, len - first);
+
+   cache->pos += (int64_t)len;
+   ret         = (int)len;
+   scond_signal(cache->space_cond);
+
+end:
+   if (stall_start)
+      cache->stats.stall_us += av_gettime_relative() - stall_start;
+   slock_unlock(cache->lock);
+   return ret;
+}
+
+static int64_t avio_cache_seek(void *opaque, int64_t offset, int whence)
+{
+   avio_cache_t *cache = (avio_cache_t*)opaque;
+   int64_t target;
+
+   if (whence & AVSEEK_SIZE)
+      return cache->file_size >= 0 ? cache->file_size : AVERROR(ENOSYS);
+
+   slock_lock(cache->lock);
+
+   switch (whence & ~AVSEEK_FORCE)
+   {
+      case SEEK_SET:
+         target = offset;
+         break;
+      case SEEK_CUR:
+         target = cache->pos + offset;
+         break;
+      case SEEK_END:
+         target = cache->file_size >= 0 ?
+               cache->file_size + offset : AVERROR(ENOSYS);
+         break;
+      default:
+         target = AVERROR(EINVAL);
+         break;
+   }
+
+   if (target >= 0)
+      avio_cache_locate_locked(cache, target);
+
+   slock_unlock(cache->lock);
+   return target;
+}
+
+avio_cache_t *avio_cache_open(const char *url, size_t size)
+{
+   AVIOInterruptCB int_cb;
+   uint8_t *buffer     = NULL;
+   avio_cache_t *cache = (avio_cache_t*)calloc(1, sizeof(avio_cache_t));
+
+   if (!cache)
+      return NULL;
+
+   cache->size       = size;
+   cache->behind     = size / 4;
+   cache->file_size  = -1;
+   cache->ring       = (uint8_t*)malloc(size);
+   cache->lock       = slock_new();
+   cache->data_cond  = scond_new();
+   cache->space_cond = scond_new();
+   if (!size || !cache->ring || !cache->lock ||
+         !cache->data_cond || !cache->space_cond)
+      goto fail;
+
+   int_cb.callback = avio_cache_interrupt;
+   int_cb.opaque   = cache;
+   if (avio_open2(&cache->source, url, AVIO_FLAG_READ, &int_cb, NULL) < 0)
+      goto fail;
+   cache->file_size = avio_size(cache->source);
+
+   buffer = (uint8_t*)av_malloc(AVIO_CACHE_BUFFER_SIZE);
+   if (!buffer)
+      goto fail;
+   cache->ctx = avio_alloc_context(buffer, AVIO_CACHE_BUFFER_SIZE, 0, cache,
+         avio_cache_read, NULL, avio_cache_seek);
+   if (!cache->ctx)
+   {
+      av_free(buffer);
+      goto fail;
+   }
+   cache->ctx->seekable = cache->source->seekable;
+
+   cache->thread = sthread_create(avio_cache_thread, cache);
+   if (!cache->thread)
+      goto fail;
+
+   return cache;
+
+fail:
+   avio_cache_close(cache);
+   return NULL;
+}
+
+void avio_cache_close(avio_cache_t *cache)
+{
+   if (!cache)
+      return;
+
+   if (cache->thread)
+   {
+      slock_lock(cache->lock);
+      cache->closing = true;
+      scond_signal(cache->space_cond);
+      scond_signal(cache->data_cond);
+      slock_unlock(cache->lock);
+      sthread_join(cache->thread);
+   }
+
+   if (cache->ctx)
+   {
+      av_freep(&cache->ctx->buffer);
+      avio_context_free(&cache->ctx);
+   }
+   avio_closep(&cache->source);
+
+   slock_free(cache->lock);
+   scond_free(cache->data_cond);
+   scond_free(cache->space_cond);
+   free(cache->ring);
+   free(cache);
+}
+
+AVIOContext *avio_cache_context(avio_cache_t *cache)
+{
+   return cache ? cache->ctx : NULL;
+}
+
+void avio_cache_get_stats(avio_cache_t *cache,
+      struct avio_cache_stats *stats, bool reset)
+{
+   int64_t end;
+
+   memset(stats, 0, sizeof(*stats));
+   if (!cache)
+      return;
+
+   slock_lock(cache->lock);
+   *stats = cache->stats;
+   end    = cache->base + (int64_t)cache->fill;
+   if (!cache->seek_pending && end > cache->pos)
+      stats->ahead = (size_t)(end - cache->pos);
+   if (reset)
+      memset(&cache->stats, 0, sizeof(cache->stats));
+   slock_unlock(cache->lock);
+}
@@ -0,0 +1,288 @@
+/* Media files are often larger than 2 GB, 32-bit systems need the
+ * 64-bit file calls. */
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include <rthreads/rthreads.h>
+
+#include "include/avio_file.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef _WIN32
+typedef struct _stati64 avio_file_stat_t;
+#define avio_file_lseek _lseeki64
+#define avio_file_fstat _fstati64
+#else
+typedef struct stat avio_file_stat_t;
+#define avio_file_lseek lseek
+#define avio_file_fstat fstat
+#endif
+
+/* Size of the buffer FFmpeg reads through. */
+#define AVIO_FILE_BUFFER_SIZE (64 * 1024)
+/* Blocks start at multiples of this, and after a seek only this much
+ * is read at once, so that probing and seeking stay cheap. */
+#define AVIO_FILE_ALIGN       (64 * 1024)
+#define AVIO_FILE_SEEK_READ   (256 * 1024)
+
+struct avio_file
+{
+   AVIOContext *ctx;
+   int fd;
+   int64_t file_size;
+   uint8_t *block;
+   size_t block_size;
+   size_t block_fill;
+   /* File offset of block[0]. */
+   int64_t block_pos;
+   int64_t pos;
+   /* Start of what has not been released from the file cache yet. */
+   int64_t released;
+   /* Guards stats, which the frontend reads. */
+   slock_t *lock;
+   struct avio_file_stats stats;
+};
+
+/* Asks the kernel for the next block and to forget the ones well
+ * behind, which are only read again after a seek. */
+static void avio_file_advise(avio_file_t *file)
+{
+#if defined(POSIX_FADV_WILLNEED) && defined(POSIX_FADV_DONTNEED)
+   int64_t end    = file->block_pos + (int64_t)file->block_fill;
+   int64_t behind = file->block_pos - (int64_t)file->block_size;
+
+   if (file->file_size < 0 || end < file->file_size)
+      posix_fadvise(file->fd, end, (off_t)file->block_size, POSIX_FADV_WILLNEED);
+
+   if (behind < file->released)
+      file->released = behind > 0 ? behind : 0;
+   else if (behind > file->released)
+   {
+      posix_fadvise(file->fd, file->released, behind - file->released,
+            POSIX_FADV_DONTNEED);
+      file->released = behind;
+   }
+#else
+   (void)file;
+#endif
+}
+
+/* Reads the block holding the read position. Reading on from the last
+ * block fills a whole block, anything else only AVIO_FILE_SEEK_READ. */
+static int avio_file_fill(avio_file_t *file)
+{
+   int64_t start  = file->pos - file->pos % AVIO_FILE_ALIGN;
+   bool sequential = file->block_fill &&
+         start == file->block_pos + (int64_t)file->block_fill;
+   size_t want    = sequential ? file->block_size :
+         MIN(file->block_size, AVIO_FILE_SEEK_READ);
+   size_t len     = 0;
+   int64_t begin;
+   int64_t elapsed;
+
+   if (file->file_size >= 0 && file->pos >= file->file_size)
+      return AVERROR_EOF;
+   if (avio_file_lseek(file->fd, start, SEEK_SET) < 0)
+      return AVERROR(errno);
+
+   begin = av_gettime_relative();
+   while (len < want)
+   {
+      ssize_t ret = read(file->fd, file->block + len, want - len);
+
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         if (!len)
+            return AVERROR(errno);
+         break;
+      }
+      if (ret == 0)
+         break;
+      len += (size_t)ret;
+   }
+   elapsed = av_gettime_relative() - begin;
+
+   file->block_pos   = start;
+   file->block_fill  = len;
+
+   slock_lock(file->lock);
+   file->stats.bytes_read += len;
+   file->stats.read_us    += elapsed;
+   file->stats.blocks++;
+   if (elapsed > file->stats.read_max_us)
+      file->stats.read_max_us = elapsed;
+   slock_unlock(file->lock);
+
+   if (file->pos >= start + (int64_t)len)
+      return AVERROR_EOF;
+
+   avio_file_advise(file);
+   return 0;
+}
+
+static int avio_file_read(void *opaque, uint8_t *buf, int buf_size)
+{
+   avio_file_t *file = (avio_file_t*)opaque;
+   size_t offset;
+   size_t len;
+
+   if (file->pos < file->block_pos ||
+         file->pos >= file->block_pos + (int64_t)file->block_fill)
+   {
+      int ret = avio_file_fill(file);
+      if (ret < 0)
+         return ret;
+   }
+
+   offset = (size_t)(file->pos - file->block_pos);
+   len    = MIN(file->block_fill - offset, (size_t)buf_size);
+   memcpy(buf, file->block + offset, len);
+   file->pos += (int64_t)len;
+
+   return (int)len;
+}
+
+/* Only moves the read position, the block is read on the next read. */
+static int64_t avio_file_seek(void *opaque, int64_t offset, int whence)
+{
+   avio_file_t *file = (avio_file_t*)opaque;
+   int64_t target;
+
+   if (whence & AVSEEK_SIZE)
+      return file->file_size >= 0 ? file->file_size : AVERROR(ENOSYS);
+
+   switch (whence & ~AVSEEK_FORCE)
+   {
+      case SEEK_SET:
+         target = offset;
+         break;
+      case SEEK_CUR:
+         target = file->pos + offset;
+         break;
+      case SEEK_END:
+         if (file->file_size < 0)
+            return AVERROR(ENOSYS);
+         target = file->file_size + offset;
+         break;
+      default:
+         return AVERROR(EINVAL);
+   }
+
+   if (target < 0)
+      return AVERROR(EINVAL);
+
+   file->pos = target;
+   return target;
+}
+
+avio_file_t *avio_file_open(const char *path, size_t block_size)
+{
+   avio_file_stat_t st;
+   uint8_t *buffer   = NULL;
+   avio_file_t *file = NULL;
+
+#ifndef _WIN32
+   /* Without 64-bit offsets, large files are left to FFmpeg. */
+   if (sizeof(off_t) < sizeof(int64_t))
+      return NULL;
+#endif
+
+   file = (avio_file_t*)calloc(1, sizeof(avio_file_t));
+   if (!file)
+      return NULL;
+
+   /* Whole alignment units, so blocks never straddle one. */
+   block_size       -= block_size % AVIO_FILE_ALIGN;
+   file->fd          = -1;
+   file->file_size   = -1;
+   file->block_size  = block_size;
+   file->block       = block_size ? (uint8_t*)av_malloc(block_size) : NULL;
+   file->lock        = slock_new();
+   if (!file->block || !file->lock)
+      goto fail;
+
+   file->fd = open(path, O_RDONLY | O_BINARY);
+   if (file->fd < 0)
+      goto fail;
+   if (avio_file_fstat(file->fd, &st) == 0 && S_ISREG(st.st_mode))
+      file->file_size = (int64_t)st.st_size;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+   /* Larger kernel read-ahead for the file as a whole. */
+   posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+   buffer = (uint8_t*)av_malloc(AVIO_FILE_BUFFER_SIZE);
+   if (!buffer)
+      goto fail;
+   file->ctx = avio_alloc_context(buffer, AVIO_FILE_BUFFER_SIZE, 0, file,
+         avio_file_read, NULL, avio_file_seek);
+   if (!file->ctx)
+   {
+      av_free(buffer);
+      goto fail;
+   }
+   file->ctx->seekable = file->file_size >= 0 ? AVIO_SEEKABLE_NORMAL : 0;
+
+   return file;
+
+fail:
+   avio_file_close(file);
+   return NULL;
+}
+
+void avio_file_close(avio_file_t *file)
+{
+   if (!file)
+      return;
+
+   if (file->ctx)
+   {
+      av_freep(&file->ctx->buffer);
+      avio_context_free(&file->ctx);
+   }
+   if (file->fd >= 0)
+      close(file->fd);
+
+   slock_free(file->lock);
+   av_freep(&file->block);
+   free(file);
+}
+
+AVIOContext *avio_file_context(avio_file_t *file)
+{
+   return file ? file->ctx : NULL;
+}
+
+void avio_file_get_stats(avio_file_t *file,
+      struct avio_file_stats *stats, bool reset)
+{
+   memset(stats, 0, sizeof(*stats));
+   if (!file)
+      return;
+
+   slock_lock(file->lock);
+   *stats = file->stats;
+   if (reset)
+      memset(&file->stats, 0, sizeof(file->stats));
+   slock_unlock(file->lock);
+}
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <math.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -19,19 +20,26 @@
 #include <ass/ass.h>
 #include "include/ffmpeg_core.h"
 #include "include/ffmpeg_fft.h"
+#include "include/ffmpeg_fft_cpu.h"
 
 #include <glsym/glsym.h>
 #include <features/features_cpu.h>
 #include <retro_miscellaneous.h>
 #include <rthreads/rthreads.h>
 #include <rthreads/tpool.h>
-#include <queues/fifo_queue.h>
 #include <string/stdstring.h>
 #include "include/packet_buffer.h"
+#include "include/packet_history.h"
+#include "include/avio_cache.h"
+#include "include/avio_file.h"
 #include "include/video_buffer.h"
+#include "include/spsc_ring.h"
 
 #include <libretro.h>
+#include <memmap.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <string.h>
 #include <ctype.h>
@@ -74,6 +82,46 @@ retro_log_printf_t log_cb;
 #define APLAYER_VIDEO_ZOOM_MAX 1.35f
 #define APLAYER_AUDIO_PACKET_BUFFER_LIMIT 128
 #define APLAYER_AUDIO_SWITCH_PREROLL_SECONDS 0.15
+/* Share of one core the standby audio track may decode with. */
+#define APLAYER_AUDIO_STANDBY_CPU_BUDGET 0.05
+/* A standby track must cover the playback time within this slack,
+ * and at least this much past it, to take over without a gap. */
+#define APLAYER_AUDIO_STANDBY_SLACK_SECONDS 0.05
+#define APLAYER_AUDIO_STANDBY_MIN_SECONDS 0.2
+/* Share of the frame period retro_run() may wait on the decoder for
+ * when it must never block the frontend. */
+#define APLAYER_PRESENT_WAIT_BUDGET 0.25
+/* Native frame rates outside this range come from variable rate or
+ * badly tagged streams and fall back to 50/60 Hz timing. */
+#define APLAYER_NATIVE_FPS_MIN 10.0
+#define APLAYER_NATIVE_FPS_MAX 120.0
+/* Length of the fades around silence padded in for late audio. */
+#define APLAYER_AUDIO_FADE_FRAMES 64
+/* Frame time smoothing: the share of a new interval taken into the
+ * running average, and the ratio above which an interval counts as a
+ * hiccup and is taken as is so the clock catches up. */
+#define APLAYER_FRAME_TIME_SMOOTHING 0.0625
+#define APLAYER_FRAME_TIME_HICCUP 1.5
+/* Longest interval, in frames, the clock advances in one run. */
+#define APLAYER_FRAME_TIME_MAX_FRAMES 8.0
+/* Frontend audio buffer occupancy, in percent, below which the device
+ * counts as about to starve. */
+#define APLAYER_AUDIO_STARVING_OCCUPANCY 25
+/* Frontend audio latency asked for, in frame periods. */
+#define APLAYER_AUDIO_LATENCY_FRAMES 6
+/* Holding left or right this long starts a keyframe scan at 4x, which
+ * doubles every APLAYER_SCAN_STEP_US up to 16x. */
+#define APLAYER_SCAN_HOLD_US 500000
+#define APLAYER_SCAN_STEP_US 2000000
+#define APLAYER_SCAN_MAX_SPEED 16
+/* A keyframe hop that shows no frame for this long is given up on. */
+#define APLAYER_TRICK_HOP_TIMEOUT_US 1000000
+/* Longest span of media the seek cache keeps, its size is an option. */
+#define APLAYER_PACKET_HISTORY_SECONDS 60.0
+/* Start of the track kept in memory so that loops need no seek: up to
+ * the first keyframe this far in, within the byte budget. */
+#define APLAYER_LOOP_HEAD_SECONDS 5.0
+#define APLAYER_LOOP_HEAD_BYTES (32 * 1024 * 1024)
 
 enum aplayer_deinterlace_mode
 {
@@ -82,6 +130,13 @@ enum aplayer_deinterlace_mode
    APLAYER_DEINTERLACE_FORCED
 };
 
+enum aplayer_frame_rate_mode
+{
+   APLAYER_FRAME_RATE_STANDARD = 0,
+   APLAYER_FRAME_RATE_NATIVE,
+   APLAYER_FRAME_RATE_NATIVE_DOUBLE
+};
+
 struct aplayer_avfilter_api
 {
    bool load_attempted;
@@ -311,8 +366,12 @@ static tpool_t *tpool;
 #define SUBTITLE_STREAM_DISABLED (-1)
 #define SUBTITLE_UNKNOWN_DURATION_MS (((INT_MAX / 1000) * 1000))
 #define SUBTITLE_FIX_TIMING_THRESHOLD_MS 210
-#define BITMAP_SUBTITLE_MAX_EVENTS 64
+#define BITMAP_SUBTITLE_PRUNE_SLACK_MS 500
+#define BITMAP_SUBTITLE_MEMORY_CAP (16 * 1024 * 1024)
 #define BITMAP_SUBTITLE_TRAILING_LIMIT_MS (60 * 1000)
+#define SUBTITLE_TEXT_PRUNE_BEHIND_MS (60 * 1000)
+#define SUBTITLE_TEXT_PRUNE_MIN_EVENTS 64
+#define APLAYER_STATS_INTERVAL_US (10 * 1000000)
 #define APLAYER_AUDIO_LANGUAGE_DEFAULT "default"
 static AVCodecContext *actx[MAX_STREAMS];
 static AVCodecContext *sctx[MAX_STREAMS];
@@ -329,7 +388,6 @@ static bool subtitle_uses_native_text_header[MAX_STREAMS];
 
 /* ASS/SSA and text-based subtitles via libass. */
 static ASS_Library *ass;
-static ASS_Renderer *ass_render;
 static ASS_Track *ass_track[MAX_STREAMS];
 static uint8_t *ass_extra_data[MAX_STREAMS];
 static size_t ass_extra_data_size[MAX_STREAMS];
@@ -340,13 +398,29 @@ static bool first_ass_image_logged[MAX_STREAMS];
 static bool first_ass_after_sub_logged[MAX_STREAMS];
 static int64_t first_subtitle_start_ms[MAX_STREAMS];
 
+/* Premultiplied copy of a rect scaled and clipped to the output size.
+ * Refcounted, so that workers can blend it after dropping ass_lock
+ * while the event gets rescaled or dropped. */
+struct bitmap_subtitle_surface
+{
+   int refs;
+   int x;
+   int y;
+   int w;
+   int h;
+   uint32_t pixels[];
+};
+
 struct bitmap_subtitle_rect
 {
    int x;
    int y;
    int w;
    int h;
-   uint32_t *pixels;
+   /* Decoded 8-bit indices into the premultiplied palette. */
+   uint8_t *indices;
+   uint32_t palette[256];
+   struct bitmap_subtitle_surface *scaled;
 };
 
 struct bitmap_subtitle_event
@@ -356,13 +430,111 @@ struct bitmap_subtitle_event
    bool end_known;
    int canvas_w;
    int canvas_h;
+   unsigned scaled_width;
+   unsigned scaled_height;
    unsigned rect_count;
+   size_t bytes;
    struct bitmap_subtitle_rect *rects;
 };
 
+/* Per slot, events are kept sorted by start time. */
 static struct bitmap_subtitle_event *bitmap_subtitle_events[MAX_STREAMS];
 static size_t bitmap_subtitle_event_count[MAX_STREAMS];
 static size_t bitmap_subtitle_event_cap[MAX_STREAMS];
+static size_t bitmap_subtitle_bytes[MAX_STREAMS];
+static int64_t bitmap_subtitle_playhead_ms[MAX_STREAMS];
+
+enum external_subtitle_format
+{
+   EXTERNAL_SUBTITLE_SRT = 0,
+   EXTERNAL_SUBTITLE_VTT,
+   EXTERNAL_SUBTITLE_ASS
+};
+
+/* Sidecar subtitles are parsed on their own thread so playback can start
+ * right away; events land in the track under ass_lock in batches. */
+struct external_subtitle_ingest
+{
+   sthread_t *thread;
+   ASS_Track *track;
+   char *buf;
+   size_t size;
+   size_t map_size;
+   unsigned slot;
+   enum external_subtitle_format format;
+   volatile bool cancel;
+};
+
+static struct external_subtitle_ingest external_subtitle_ingest;
+
+/* Subtitle events decoded by the decode thread. They are staged here and
+ * applied to the tracks by whoever renders next, so demuxing never waits
+ * on ass_lock while a worker is busy in ass_render_frame(). */
+struct subtitle_staged_event
+{
+   unsigned slot;
+   int64_t start_ms;
+   int64_t end_ms;
+   bool is_bitmap;
+   char *ass;
+   char *text;
+   struct bitmap_subtitle_event bitmap;
+};
+
+#define SUBTITLE_STAGE_CAPACITY 256
+
+static spsc_ring_t *subtitle_stage;
+
+/* Demux time and byte position of every embedded subtitle packet. Tracks
+ * that are not selected are only indexed, never decoded, and get
+ * backfilled around the playhead from this index once selected. */
+struct subtitle_packet_entry
+{
+   int64_t pts_ms;
+   int64_t pos;
+};
+
+struct subtitle_packet_index
+{
+   struct subtitle_packet_entry *entries;
+   size_t count;
+   size_t cap;
+};
+
+static struct subtitle_packet_index subtitle_packet_index[MAX_STREAMS];
+
+#define SUBTITLE_BACKFILL_LOOKBEHIND_MS (30 * 1000)
+
+/* Decodes the packets a newly selected track skipped, on a second
+ * demuxer so the decode thread keeps going. */
+struct subtitle_backfill
+{
+   sthread_t *thread;
+   char *url;
+   unsigned slot;
+   int stream_index;
+   int64_t from_ms;
+   int64_t to_ms;
+   int64_t from_pos;
+   volatile bool cancel;
+};
+
+static struct subtitle_backfill subtitle_backfill;
+
+/* Text tracks whose packets carry no duration end each event at the
+ * next one. These remember the start of the events still waiting for
+ * that and the latest start added, per slot. */
+static int64_t subtitle_text_pending_ms[MAX_STREAMS];
+/* Text events staged since the slot was last pruned, decode thread. */
+static unsigned subtitle_text_staged[MAX_STREAMS];
+/* Heap held by the strings of each text track's events, kept up to
+ * date under ass_lock wherever events are added or dropped. */
+static size_t subtitle_text_bytes[MAX_STREAMS];
+static int64_t subtitle_text_latest_ms[MAX_STREAMS];
+
+static int64_t stats_last_log_us;
+static int64_t stats_wakeups_since_us;
+static unsigned stats_wakeups_count;
 
 static struct attachment *attachments;
 static size_t attachments_size;
@@ -371,23 +543,171 @@ static fft_t *fft;
 unsigned fft_width;
 unsigned fft_height;
 static bool fft_enabled;
+/* Render scale bounds of the GL visualizer, see fft_set_resolution(). */
+static float fft_scale_min = 0.5f;
+static float fft_scale_max = 1.0f;
+static int64_t fft_last_frame_us;
+/* Visualizer fallback without GLES3, drawn into cpu_fft_frame and
+ * either uploaded to the HW context or handed over as a software
+ * frame when there is none. */
+static cpu_fft_t *cpu_fft;
+static uint32_t *cpu_fft_frame;
+static size_t cpu_fft_frame_size;
+static bool hw_render_enabled;
 
 /* A/V timing. */
 static uint64_t frame_cnt;
 static uint64_t audio_frames;
 static double pts_bias;
 
+/* Frontend frame time. With the callback, the clock follows the real
+ * interval between runs: frame_clock_frac is the part of a frame it
+ * is ahead of frame_cnt, and frame_clock_period the smoothed interval
+ * in frames. */
+static bool frame_time_enabled;
+static retro_usec_t frame_time_usec;
+static double frame_clock_frac;
+static double frame_clock_period = 1.0;
+static unsigned stats_frame_times;
+static unsigned stats_frame_hiccups;
+static double stats_frame_jitter_sum;
+static double stats_frame_jitter_max;
+
+/* Frontend audio buffer status. audio_device_starving is set before
+ * each run and read by the decode thread to put audio first. */
+static bool audio_status_enabled;
+static bool audio_latency_pending;
+static volatile bool audio_device_starving;
+static unsigned audio_device_occupancy_min = 100;
+static unsigned stats_audio_starving;
+
 /* Threaded FIFOs. */
 static volatile bool decode_thread_dead;
-static fifo_buffer_t *audio_decode_fifo;
 static scond_t *fifo_cond;
 static scond_t *fifo_decode_cond;
 static slock_t *fifo_lock;
 static slock_t *decode_thread_lock;
 static sthread_t *decode_thread_handle;
-static double decode_last_audio_time;
 static bool main_sleeping;
 
+/* Resampled S16 stereo audio of one track. The decode thread writes it
+ * in batches and retro_run() hands it to the frontend straight from the
+ * ring, neither side takes fifo_lock unless it has to sleep. */
+struct audio_queue
+{
+   spsc_ring_t *ring;
+   /* End time of the ring contents. The decode thread makes clock_seq
+    * odd while it updates both, so retro_run() can read a consistent
+    * pair lock-free. */
+   double end_time;
+   unsigned clock_seq;
+   /* Audio slot written into the ring, only set by the decode thread. */
+   int track;
+};
+
+/* The frontend plays audio_queues[audio_queue_playing]. With
+ * aplayer_audio_standby the other queue is kept filled with the next
+ * audio track, and switching to it only flips this index. */
+static struct audio_queue audio_queues[2];
+static int audio_queue_playing;
+static bool audio_standby_enabled;
+/* Usable depth in bytes, see aplayer_audio_buffer. The rings themselves
+ * are rounded up to a power of two. */
+static size_t audio_ring_depth;
+static unsigned audio_buffer_ms = 2000;
+static bool audio_ring_producer_waiting;
+/* Queue space the waiting decode thread wants before it is woken. */
+static size_t audio_ring_producer_need;
+/* Audio files with the visualizer disabled or showing cover art.
+ * There is no HW context, and the decode thread refills the queue in
+ * large batches so it wakes up as rarely as possible. */
+static bool audio_low_power;
+/* Embedded cover art of an audio file, decoded and scaled to the
+ * output once at load and then presented by frame duping. */
+static bool cover_art_enabled = true;
+static int cover_art_stream = -1;
+static uint32_t *cover_art_frame;
+static bool cover_art_presented;
+static bool frontend_can_dupe;
+
+/* What the last video present drew. When nothing changed since, the
+ * frontend repeats it instead of us redrawing the same frame. */
+static uint64_t video_upload_seq;
+static uint64_t video_presented_seq;
+static float video_presented_mix;
+static GLfloat video_quad_vertices[16];
+static bool video_present_valid;
+static unsigned stats_presents;
+static unsigned stats_presents_elided;
+
+/* Never hold the frontend thread longer than the wait budget, even
+ * when that means repeating a frame or padding audio. */
+static bool present_never_block;
+/* Runs where video or audio was not ready in time. */
+static unsigned stats_late_video;
+static unsigned stats_late_audio;
+/* Last sample handed to the frontend, and whether the output was
+ * faded to silence after it. */
+static int16_t audio_last_sample[2];
+static bool audio_faded_out = true;
+
+/* Trick-play: while the frontend fast-forwards or a scan is held, only
+ * keyframes are decoded, audio is skipped, and playback hops from one
+ * keyframe to the next with seeks. trick_play_speed is 0 for frontend
+ * fast-forward, which advances one frame of content per run. */
+static volatile bool trick_play_active;
+static int trick_play_dir;
+static unsigned trick_play_speed;
+static bool trick_hop_pending;
+static int64_t trick_hop_us;
+static int64_t trick_last_run_us;
+static double trick_shown_pts;
+static double trick_advance;
+/* Direction of the pending hop for decode_thread_seek(), under
+ * fifo_lock. */
+static int trick_seek_dir;
+static int scan_hold_dir;
+static int64_t scan_hold_since_us;
+
+/* Seek cache: recently demuxed packets, owned by the decode thread.
+ * Seeks inside it replay packets from memory instead of seeking the
+ * demuxer. */
+static packet_history_t *packet_history;
+static size_t packet_history_max_bytes = 64 * 1024 * 1024;
+static unsigned stats_seeks_cached;
+static unsigned stats_seeks_demuxed;
+static size_t stats_history_bytes;
+static double stats_history_span;
+
+/* Seamless loops, see loop_start(). The head of the track and the
+ * resync state belong to the decode thread, the offsets are written
+ * under time_lock. */
+static packet_history_t *loop_head;
+static bool loop_head_filling;
+static bool loop_head_started;
+static bool loop_head_complete;
+static double loop_head_start;
+static double loop_head_end;
+static unsigned loop_head_streams;
+static int64_t *loop_head_last_ts;
+static int64_t *loop_resync_ts;
+static bool loop_replaying;
+static bool loop_resync;
+static double loop_iteration_end;
+static double loop_offset;
+static double loop_offset_prev;
+static double loop_offset_from;
+static unsigned stats_loops;
+
+/* Read-ahead for network media, see avio_cache.h. */
+static avio_cache_t *io_cache;
+static size_t io_cache_max_bytes = 16 * 1024 * 1024;
+/* Block reads for local media, see avio_file.h. */
+static avio_file_t *io_file;
+static size_t io_file_block_bytes = 4 * 1024 * 1024;
+/* Times the decode thread woke from a wait, for the stats. */
+static unsigned decode_wakeups;
+
 /* Seeking, play, pause, loop */
 static bool do_seek;
 static double seek_time;
@@ -405,6 +725,10 @@ static unsigned video_crop_right = 0;
 static unsigned video_crop_bottom = 0;
 static char preferred_audio_language[16] = APLAYER_AUDIO_LANGUAGE_DEFAULT;
 static enum aplayer_deinterlace_mode video_deinterlace_mode = APLAYER_DEINTERLACE_AUTO;
+static enum aplayer_frame_rate_mode video_frame_rate_mode = APLAYER_FRAME_RATE_STANDARD;
+/* The loaded video runs at its own frame rate, one frame per run and
+ * no blending. */
+static bool video_native_timing;
 static volatile bool video_filter_reset_pending = false;
 static volatile bool playback_restart_request = false;
 static volatile bool playback_restart_pending = false;
@@ -483,6 +807,7 @@ static void media_reset_defaults(void)
 static void aplayer_reset_playback_timing_to_start(void)
 {
    frame_cnt = 0;
+   frame_clock_frac = 0.0;
    audio_frames = 0;
    pts_bias = 0.0;
    frames[0].pts = 0.0;
@@ -508,6 +833,9 @@ static bool aplayer_consume_playback_restart_pending(void)
 }
 
 static void sws_worker_thread(void *arg);
+static bool subtitle_selection_is_valid(int subtitle_ptr);
+static void subtitle_stage_drain_locked(bool apply);
+static void aplayer_stats_log(enum retro_log_level level);
 
 static const char *video_deinterlace_mode_name(enum aplayer_deinterlace_mode mode)
 {
@@ -683,16 +1011,23 @@ error:
 }
 
 static void video_submit_frame_to_worker(video_decoder_context_t *ctx,
-      ASS_Track *ass_track_active)
+      int subtitle_ptr)
 {
    if (!ctx)
       return;
 
-   ctx->ass_track_active = ass_track_active;
+   /* The worker composites subtitles itself, so hand it the selection
+    * that was active when the frame was decoded. */
+   ctx->subtitle_ptr     = subtitle_ptr;
+   ctx->ass_track_active = subtitle_selection_is_valid(subtitle_ptr) ?
+         ass_track[subtitle_ptr] : NULL;
+   /* The playback clock is only read here, workers run unsynchronized
+    * with retro_run(). */
+   ctx->fallback_time    = frame_cnt / media.interpolate_fps + pts_bias;
    tpool_add_work(tpool, sws_worker_thread, ctx);
 }
 
-static bool video_filter_drain_to_buffer(ASS_Track *ass_track_active)
+static bool video_filter_drain_to_buffer(int subtitle_ptr)
 {
    bool drained = false;
 
@@ -735,7 +1070,7 @@ static bool video_filter_drain_to_buffer(ASS_Track *ass_track_active)
       }
 
       drained = true;
-      video_submit_frame_to_worker(ctx, ass_track_active);
+      video_submit_frame_to_worker(ctx, subtitle_ptr);
    }
 
    return drained;
@@ -906,7 +1241,7 @@ error:
 }
 
 static bool video_filter_queue_frame(video_decoder_context_t *ctx,
-      ASS_Track *ass_track_active)
+      int subtitle_ptr)
 {
    int ret;
 
@@ -943,7 +1278,7 @@ static bool video_filter_queue_frame(video_decoder_context_t *ctx,
 
    av_frame_unref(ctx->source);
    video_buffer_return_open_slot(video_buffer, ctx);
-   video_filter_drain_to_buffer(ass_track_active);
+   video_filter_drain_to_buffer(subtitle_ptr);
    return true;
 }
 
@@ -1562,9 +1897,8 @@ static void get_video_texture_window(float *u_min, float *u_max,
    *v_max = *v_min + visible_height;
 }
 
-static void update_video_quad(void)
+static void get_video_quad(GLfloat *vertex_data)
 {
-   GLfloat vertex_data[16];
    float u_min;
    float u_max;
    float v_min;
@@ -1592,9 +1926,12 @@ static void update_video_quad(void)
    vertex_data[13] = quad_scale;
    vertex_data[14] = u_max;
    vertex_data[15] = v_max;
+}
 
+static void update_video_quad(const GLfloat *vertex_data)
+{
    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-   glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertex_data), vertex_data);
+   glBufferSubData(GL_ARRAY_BUFFER, 0, 16 * sizeof(GLfloat), vertex_data);
    glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
@@ -1802,6 +2139,30 @@ static double aplayer_get_content_refresh_rate(void)
    double source_fps = aplayer_get_video_stream_fps();
    unsigned height = vctx && vctx->height > 0 ? (unsigned)vctx->height : media.height;
 
+   video_native_timing = false;
+
+   if (video_stream_index >= 0 && source_fps > 0.0 &&
+         video_frame_rate_mode != APLAYER_FRAME_RATE_STANDARD)
+   {
+      double fps = source_fps;
+
+      if (video_frame_rate_mode == APLAYER_FRAME_RATE_NATIVE_DOUBLE && fps < 40.0)
+         fps *= 2.0;
+
+      if (fps >= APLAYER_NATIVE_FPS_MIN && fps <= APLAYER_NATIVE_FPS_MAX)
+      {
+         log_cb(RETRO_LOG_INFO,
+               "[APLAYER] Native video timing from source FPS %.3f; using %.3f Hz.\n",
+               source_fps, fps);
+         video_native_timing = true;
+         return fps;
+      }
+
+      log_cb(RETRO_LOG_WARN,
+            "[APLAYER] Source FPS %.3f out of range for native timing.\n",
+            source_fps);
+   }
+
    if (video_stream_index >= 0)
    {
       if (aplayer_frame_rate_is_pal(source_fps))
@@ -1852,7 +2213,7 @@ static double aplayer_get_content_refresh_rate(void)
 
 static bool aplayer_uses_pal_timing(void)
 {
-   return aplayer_fps_matches(media.interpolate_fps, 50.0, 0.50);
+   return aplayer_frame_rate_is_pal(media.interpolate_fps);
 }
 
 static unsigned aplayer_get_content_region(void)
@@ -2002,6 +2363,29 @@ static bool aplayer_bookmark_build_path(const char *content_path,
    return out_path[0] != '\0';
 }
 
+/* Anything FFmpeg reads through a protocol other than plain files. */
+static bool aplayer_path_is_network(const char *path)
+{
+   const char *protocol = avio_find_protocol_name(path);
+   return protocol && !string_is_equal(protocol, "file");
+}
+
+/* Loops played from memory run the clock on past the end of the
+ * track, this is how far for a presentation time. */
+static double aplayer_loop_offset_at(double time)
+{
+   double offset = 0.0;
+
+   if (!time_lock)
+      return 0.0;
+
+   slock_lock(time_lock);
+   offset = time >= loop_offset_from ? loop_offset : loop_offset_prev;
+   slock_unlock(time_lock);
+
+   return offset;
+}
+
 static double aplayer_get_current_playback_time(void)
 {
    double total_duration = media.duration.time;
@@ -2019,6 +2403,7 @@ static double aplayer_get_current_playback_time(void)
 
    if (audio_streams_num > 0 && video_stream_index < 0 && media.sample_rate > 0)
       fallback_time = (double)audio_frames / media.sample_rate;
+   fallback_time -= aplayer_loop_offset_at(fallback_time + pts_bias);
 
    current_time = pts_time;
    if (video_stream_index < 0 ||
@@ -2303,9 +2688,9 @@ void retro_get_system_av_info(struct retro_system_av_info *info)
 
    if (audio_streams_num > 0 && video_stream_index < 0)
    {
-      width = fft_width;
-      height = fft_height;
-      aspect = (float)fft_width / (float)fft_height;
+      width = audio_low_power && !cover_art_frame ? 1 : fft_width;
+      height = audio_low_power && !cover_art_frame ? 1 : fft_height;
+      aspect = (float)width / (float)height;
    }
 
    info->timing.fps = media.interpolate_fps;
@@ -2377,6 +2762,25 @@ void retro_set_environment(retro_environment_t cb)
             {NULL, NULL}
          }, "auto"
       },
+      {
+         "aplayer_video_frame_rate", "Frame Rate", "50/60 Hz runs PAL-like video at 50 Hz and everything else at 60 Hz, blending frames in between. Native runs at the video's own frame rate and shows every frame exactly once, for displays that switch refresh rate or support VRR. Native x2 doubles frame rates below 40 fps. Applied when content is loaded.",
+         NULL, NULL, "video",
+         {
+            {"standard", "50/60 Hz"},
+            {"native", "Native"},
+            {"native_double", "Native x2"},
+            {NULL, NULL}
+         }, "standard"
+      },
+      {
+         "aplayer_never_block", "Never Block Frontend", "Never lets the frontend wait more than a fraction of a frame on the decoder. A frame that is not ready in time repeats the previous one, and late audio dips to silence with a short fade, while decoding catches up in the background.",
+         NULL, NULL, "video",
+         {
+            {"disabled", "Disabled"},
+            {"enabled", "Enabled"},
+            {NULL, NULL}
+         }, "disabled"
+      },
       {
          "aplayer_audio_language", "Preferred Language", "Selects the default audio track language when matching streams are tagged in the media file. Falls back to the file default track, or the first audio track when no default is flagged.",
          NULL, NULL, "audio",
@@ -2411,6 +2815,26 @@ void retro_set_environment(retro_environment_t cb)
             {NULL, NULL}
          }, "default"
       },
+      {
+         "aplayer_audio_buffer", "Audio Buffer", "Amount of decoded audio queued ahead of playback. Larger values ride out slow storage or network hiccups, smaller ones use less memory. Applied when content is loaded.",
+         NULL, NULL, "audio",
+         {
+            {"500", "500 ms"},
+            {"1000", "1 s"},
+            {"2000", "2 s"},
+            {"4000", "4 s"},
+            {NULL, NULL}
+         }, "2000"
+      },
+      {
+         "aplayer_audio_standby", "Instant Audio Track Switching", "Keep the next audio track decoded alongside the playing one, so switching to it is immediate. Costs a little CPU and a second audio buffer. Applied when content is loaded.",
+         NULL, NULL, "audio",
+         {
+            {"disabled", "Disabled"},
+            {"enabled", "Enabled"},
+            {NULL, NULL}
+         }, "disabled"
+      },
       {
          "aplayer_visualizer", "Visualizer", NULL, NULL, NULL, "music",
          {
@@ -2419,6 +2843,26 @@ void retro_set_environment(retro_environment_t cb)
             {NULL, NULL}
          }, "enabled"
       },
+      {
+         "aplayer_visualizer_resolution", "Visualizer Resolution", "Dynamic lowers the visualizer's render resolution while the GPU cannot keep up, and raises it again when it can.",
+         NULL, NULL, "music",
+         {
+            {"dynamic", "Dynamic"},
+            {"100", "100%"},
+            {"75", "75%"},
+            {"50", "50%"},
+            {NULL, NULL}
+         }, "dynamic"
+      },
+      {
+         "aplayer_cover_art", "Cover Art", "Shows the cover art embedded in audio files instead of the visualizer. Applied when content is loaded.",
+         NULL, NULL, "music",
+         {
+            {"enabled", "Enabled"},
+            {"disabled", "Disabled"},
+            {NULL, NULL}
+         }, "enabled"
+      },
       {
          "aplayer_auto_resume", "Auto Resume", NULL, NULL, NULL, NULL,
          {
@@ -2427,6 +2871,44 @@ void retro_set_environment(retro_environment_t cb)
             {NULL, NULL}
          }, "disabled"
       },
+      {
+         "aplayer_seek_cache", "Seek Cache", "Keeps the last minute of recently read media in memory, up to the chosen size, so that short seeks such as a 15 s rewind are replayed from memory instead of reading the file again. Applied on the next content load.",
+         NULL, NULL, NULL,
+         {
+            {"disabled", "OFF"},
+            {"32", "32 MB"},
+            {"64", "64 MB"},
+            {"128", "128 MB"},
+            {"256", "256 MB"},
+            {NULL, NULL}
+         }, "64"
+      },
+      {
+         "aplayer_network_cache", "Network Read-Ahead", "Reads network media (http://, smb:// and other stream URLs) ahead of playback into memory on a thread of its own, so that short network stalls do not stall playback. Applied on the next content load.",
+         NULL, NULL, NULL,
+         {
+            {"disabled", "OFF"},
+            {"4", "4 MB"},
+            {"8", "8 MB"},
+            {"16", "16 MB"},
+            {"32", "32 MB"},
+            {"64", "64 MB"},
+            {NULL, NULL}
+         }, "16"
+      },
+      {
+         "aplayer_file_read_ahead", "File Read-Ahead", "Reads local media in large blocks and has the system prefetch the next block while the current one plays, releasing played blocks from the file cache. Helps high bitrate media on SD cards and USB drives. OFF uses FFmpeg's own small reads. Applied on the next content load.",
+         NULL, NULL, NULL,
+         {
+            {"disabled", "OFF"},
+            {"1", "1 MB"},
+            {"2", "2 MB"},
+            {"4", "4 MB"},
+            {"8", "8 MB"},
+            {"16", "16 MB"},
+            {NULL, NULL}
+         }, "4"
+      },
       {
          "aplayer_loop_content", "Loop Mode", NULL, NULL, NULL, NULL,
          {
@@ -2508,18 +2990,38 @@ static bool subtitle_track_is_bitmap(unsigned slot)
    return slot < MAX_STREAMS && subtitle_is_bitmap[slot];
 }
 
-static void bitmap_subtitle_clear_event(struct bitmap_subtitle_event *event)
+static size_t bitmap_subtitle_surface_bytes(
+      const struct bitmap_subtitle_surface *surface)
+{
+   if (!surface)
+      return 0;
+   return (size_t)surface->w * (size_t)surface->h * sizeof(*surface->pixels);
+}
+
+static void bitmap_subtitle_surface_unref(struct bitmap_subtitle_surface *surface)
+{
+   if (surface && __atomic_sub_fetch(&surface->refs, 1, __ATOMIC_ACQ_REL) == 0)
+      free(surface);
+}
+
+static size_t bitmap_subtitle_clear_event(struct bitmap_subtitle_event *event)
 {
    unsigned i = 0;
+   size_t bytes = 0;
 
    if (!event)
-      return;
+      return 0;
 
    for (i = 0; i < event->rect_count; i++)
-      free(event->rects[i].pixels);
+   {
+      free(event->rects[i].indices);
+      bitmap_subtitle_surface_unref(event->rects[i].scaled);
+   }
    free(event->rects);
 
+   bytes = event->bytes;
    memset(event, 0, sizeof(*event));
+   return bytes;
 }
 
 static void bitmap_subtitle_clear_slot(unsigned slot)
@@ -2536,6 +3038,45 @@ static void bitmap_subtitle_clear_slot(unsigned slot)
    bitmap_subtitle_events[slot] = NULL;
    bitmap_subtitle_event_count[slot] = 0;
    bitmap_subtitle_event_cap[slot] = 0;
+   bitmap_subtitle_bytes[slot] = 0;
+   bitmap_subtitle_playhead_ms[slot] = 0;
+}
+
+static void bitmap_subtitle_remove_locked(unsigned slot, size_t index)
+{
+   size_t count = bitmap_subtitle_event_count[slot];
+
+   if (index >= count)
+      return;
+
+   bitmap_subtitle_bytes[slot] -= bitmap_subtitle_clear_event(
+         &bitmap_subtitle_events[slot][index]);
+
+   if (index + 1 < count)
+      memmove(bitmap_subtitle_events[slot] + index,
+            bitmap_subtitle_events[slot] + index + 1,
+            (count - index - 1) * sizeof(bitmap_subtitle_events[slot][0]));
+
+   bitmap_subtitle_event_count[slot]--;
+}
+
+/* Returns the number of events starting at or before time_ms. */
+static size_t bitmap_subtitle_upper_bound_locked(unsigned slot, int64_t time_ms)
+{
+   size_t lo = 0;
+   size_t hi = bitmap_subtitle_event_count[slot];
+
+   while (lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (bitmap_subtitle_events[slot][mid].start_ms <= time_ms)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return lo;
 }
 
 static void bitmap_subtitle_prune_locked(unsigned slot, int64_t now_ms)
@@ -2558,7 +3099,7 @@ static void bitmap_subtitle_prune_locked(unsigned slot, int64_t now_ms)
       if (!expired)
          break;
 
-      bitmap_subtitle_clear_event(event);
+      bitmap_subtitle_bytes[slot] -= bitmap_subtitle_clear_event(event);
       remove_count++;
    }
 
@@ -2579,11 +3120,18 @@ static void bitmap_subtitle_prune_locked(unsigned slot, int64_t now_ms)
 static void bitmap_subtitle_end_previous_locked(unsigned slot, int64_t end_ms)
 {
    struct bitmap_subtitle_event *prev = NULL;
+   size_t index = 0;
 
    if (slot >= MAX_STREAMS || bitmap_subtitle_event_count[slot] == 0)
       return;
 
-   prev = &bitmap_subtitle_events[slot][bitmap_subtitle_event_count[slot] - 1];
+   /* The event right before end_ms, which is the tail unless a
+    * backfill inserted older events. */
+   index = bitmap_subtitle_upper_bound_locked(slot, end_ms - 1);
+   if (index == 0)
+      return;
+
+   prev = &bitmap_subtitle_events[slot][index - 1];
    if (!prev->end_known || prev->end_ms > end_ms)
    {
       prev->end_ms = end_ms;
@@ -2591,11 +3139,36 @@ static void bitmap_subtitle_end_previous_locked(unsigned slot, int64_t end_ms)
    }
 }
 
+/* Keeps the slot below BITMAP_SUBTITLE_MEMORY_CAP by dropping whichever
+ * end of the timeline lies farthest from the playhead. The event at
+ * index @keep, if any, is in use and never dropped. */
+static void bitmap_subtitle_enforce_cap_locked(unsigned slot, size_t keep)
+{
+   while (bitmap_subtitle_bytes[slot] > BITMAP_SUBTITLE_MEMORY_CAP &&
+         bitmap_subtitle_event_count[slot] > 1)
+   {
+      size_t last = bitmap_subtitle_event_count[slot] - 1;
+      int64_t playhead = bitmap_subtitle_playhead_ms[slot];
+      int64_t behind = playhead - bitmap_subtitle_events[slot][0].start_ms;
+      int64_t ahead = bitmap_subtitle_events[slot][last].start_ms - playhead;
+
+      if (keep != 0 && (behind >= ahead || keep == last))
+      {
+         bitmap_subtitle_remove_locked(slot, 0);
+         if (keep != SIZE_MAX)
+            keep--;
+      }
+      else
+         bitmap_subtitle_remove_locked(slot, last);
+   }
+}
+
 static bool bitmap_subtitle_append_locked(unsigned slot,
       const struct bitmap_subtitle_event *event)
 {
    struct bitmap_subtitle_event *events = NULL;
    size_t new_cap = 0;
+   size_t index = 0;
 
    if (slot >= MAX_STREAMS || !event)
       return false;
@@ -2612,18 +3185,29 @@ static bool bitmap_subtitle_append_locked(unsigned slot,
       bitmap_subtitle_event_cap[slot] = new_cap;
    }
 
-   bitmap_subtitle_events[slot][bitmap_subtitle_event_count[slot]++] = *event;
+   /* Packets normally arrive in order, so this is almost always the tail. */
+   index = bitmap_subtitle_upper_bound_locked(slot, event->start_ms);
+   if (index < bitmap_subtitle_event_count[slot])
+      memmove(bitmap_subtitle_events[slot] + index + 1,
+            bitmap_subtitle_events[slot] + index,
+            (bitmap_subtitle_event_count[slot] - index) *
+            sizeof(bitmap_subtitle_events[slot][0]));
+
+   bitmap_subtitle_events[slot][index] = *event;
+   bitmap_subtitle_event_count[slot]++;
+   bitmap_subtitle_bytes[slot] += event->bytes;
 
-   if (bitmap_subtitle_event_count[slot] > BITMAP_SUBTITLE_MAX_EVENTS)
+   /* An event inserted before a later one ends where that one starts. */
+   if (index + 1 < bitmap_subtitle_event_count[slot] &&
+         !bitmap_subtitle_events[slot][index].end_known)
    {
-      bitmap_subtitle_clear_event(&bitmap_subtitle_events[slot][0]);
-      memmove(bitmap_subtitle_events[slot],
-            bitmap_subtitle_events[slot] + 1,
-            (bitmap_subtitle_event_count[slot] - 1) *
-            sizeof(bitmap_subtitle_events[slot][0]));
-      bitmap_subtitle_event_count[slot]--;
+      bitmap_subtitle_events[slot][index].end_ms =
+         bitmap_subtitle_events[slot][index + 1].start_ms;
+      bitmap_subtitle_events[slot][index].end_known = true;
    }
 
+   bitmap_subtitle_enforce_cap_locked(slot, SIZE_MAX);
+
    return true;
 }
 
@@ -2631,24 +3215,25 @@ static struct bitmap_subtitle_event *bitmap_subtitle_current_locked(unsigned slo
       int64_t now_ms)
 {
    size_t i = 0;
+   size_t end = 0;
 
    if (slot >= MAX_STREAMS)
       return NULL;
 
-   for (i = bitmap_subtitle_event_count[slot]; i > 0; i--)
+   bitmap_subtitle_playhead_ms[slot] = now_ms;
+
+   /* No event stays up past BITMAP_SUBTITLE_TRAILING_LIMIT_MS, so only
+    * those that started within that window can be active. Walk them
+    * back from the latest start, an earlier long event may outlast
+    * later short ones. */
+   end = bitmap_subtitle_upper_bound_locked(slot, now_ms);
+   for (i = end; i > 0; i--)
    {
       struct bitmap_subtitle_event *event = &bitmap_subtitle_events[slot][i - 1];
-      bool active = false;
-
-      if (now_ms < event->start_ms)
-         continue;
-
-      if (event->end_known)
-         active = now_ms < event->end_ms;
-      else
-         active = now_ms < event->start_ms + BITMAP_SUBTITLE_TRAILING_LIMIT_MS;
 
-      if (active)
+      if (event->start_ms + BITMAP_SUBTITLE_TRAILING_LIMIT_MS <= now_ms)
+         break;
+      if (!event->end_known || now_ms < event->end_ms)
          return event;
    }
 
@@ -2757,12 +3342,21 @@ static void check_variables(bool firststart)
 {
    struct retro_variable loop_content = {0};
    struct retro_variable auto_resume_var = {0};
+   struct retro_variable seek_cache_var = {0};
+   struct retro_variable network_cache_var = {0};
+   struct retro_variable file_read_ahead_var = {0};
    struct retro_variable audio_language_var = {0};
    struct retro_variable replay_is_crt = {0};
    struct retro_variable fft_toggle_var = {0};
+   struct retro_variable fft_resolution_var = {0};
+   struct retro_variable cover_art_var = {0};
    struct retro_variable video_blending_var = {0};
    struct retro_variable video_zoom_var = {0};
    struct retro_variable video_deinterlace_var = {0};
+   struct retro_variable video_frame_rate_var = {0};
+   struct retro_variable never_block_var = {0};
+   struct retro_variable audio_buffer_var = {0};
+   struct retro_variable audio_standby_var = {0};
    enum aplayer_deinterlace_mode old_deinterlace_mode = video_deinterlace_mode;
 
    fft_width  = 640;
@@ -2776,6 +3370,26 @@ static void check_variables(bool firststart)
          fft_enabled = false;
    }
 
+   cover_art_enabled = true;
+   cover_art_var.key = "aplayer_cover_art";
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &cover_art_var) &&
+         cover_art_var.value &&
+         string_is_equal(cover_art_var.value, "disabled"))
+      cover_art_enabled = false;
+
+   fft_scale_min = 0.5f;
+   fft_scale_max = 1.0f;
+   fft_resolution_var.key = "aplayer_visualizer_resolution";
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &fft_resolution_var) &&
+         fft_resolution_var.value &&
+         !string_is_equal(fft_resolution_var.value, "dynamic"))
+   {
+      fft_scale_min = (float)atoi(fft_resolution_var.value) / 100.0f;
+      if (fft_scale_min < 0.5f || fft_scale_min > 1.0f)
+         fft_scale_min = 1.0f;
+      fft_scale_max = fft_scale_min;
+   }
+
    subtitle_font_name = "sans-serif";
 
    video_blend_strength = 1.0f;
@@ -2812,6 +3426,24 @@ static void check_variables(bool firststart)
          video_deinterlace_mode = APLAYER_DEINTERLACE_FORCED;
    }
 
+   present_never_block = false;
+   never_block_var.key = "aplayer_never_block";
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &never_block_var) &&
+         never_block_var.value &&
+         string_is_equal(never_block_var.value, "enabled"))
+      present_never_block = true;
+
+   video_frame_rate_mode = APLAYER_FRAME_RATE_STANDARD;
+   video_frame_rate_var.key = "aplayer_video_frame_rate";
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &video_frame_rate_var) &&
+         video_frame_rate_var.value)
+   {
+      if (string_is_equal(video_frame_rate_var.value, "native"))
+         video_frame_rate_mode = APLAYER_FRAME_RATE_NATIVE;
+      else if (string_is_equal(video_frame_rate_var.value, "native_double"))
+         video_frame_rate_mode = APLAYER_FRAME_RATE_NATIVE_DOUBLE;
+   }
+
    if (!firststart && old_deinterlace_mode != video_deinterlace_mode)
    {
       if (decode_thread_lock)
@@ -2835,6 +3467,22 @@ static void check_variables(bool firststart)
       audio_language_normalize_tag(audio_language_var.value,
             preferred_audio_language, sizeof(preferred_audio_language));
 
+   audio_buffer_ms = 2000;
+   audio_buffer_var.key = "aplayer_audio_buffer";
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &audio_buffer_var) &&
+         audio_buffer_var.value)
+   {
+      unsigned value = (unsigned)strtoul(audio_buffer_var.value, NULL, 10);
+      if (value >= 100)
+         audio_buffer_ms = value;
+   }
+
+   audio_standby_enabled = false;
+   audio_standby_var.key = "aplayer_audio_standby";
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &audio_standby_var) &&
+         audio_standby_var.value)
+      audio_standby_enabled = string_is_equal(audio_standby_var.value, "enabled");
+
    update_subtitle_font_settings();
    auto_resume_enabled = false;
    auto_resume_var.key = "aplayer_auto_resume";
@@ -2844,6 +3492,36 @@ static void check_variables(bool firststart)
       if (string_is_equal(auto_resume_var.value, "enabled"))
          auto_resume_enabled = true;
    }
+   packet_history_max_bytes = 64 * 1024 * 1024;
+   seek_cache_var.key = "aplayer_seek_cache";
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &seek_cache_var) &&
+         seek_cache_var.value)
+   {
+      if (string_is_equal(seek_cache_var.value, "disabled"))
+         packet_history_max_bytes = 0;
+      else
+         packet_history_max_bytes = (size_t)strtoul(seek_cache_var.value, NULL, 10) * 1024 * 1024;
+   }
+   io_cache_max_bytes = 16 * 1024 * 1024;
+   network_cache_var.key = "aplayer_network_cache";
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &network_cache_var) &&
+         network_cache_var.value)
+   {
+      if (string_is_equal(network_cache_var.value, "disabled"))
+         io_cache_max_bytes = 0;
+      else
+         io_cache_max_bytes = (size_t)strtoul(network_cache_var.value, NULL, 10) * 1024 * 1024;
+   }
+   io_file_block_bytes = 4 * 1024 * 1024;
+   file_read_ahead_var.key = "aplayer_file_read_ahead";
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &file_read_ahead_var) &&
+         file_read_ahead_var.value)
+   {
+      if (string_is_equal(file_read_ahead_var.value, "disabled"))
+         io_file_block_bytes = 0;
+      else
+         io_file_block_bytes = (size_t)strtoul(file_read_ahead_var.value, NULL, 10) * 1024 * 1024;
+   }
    /* M3U */
    loop_content.key = "aplayer_loop_content";
    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &loop_content) && loop_content.value)
@@ -2879,6 +3557,7 @@ static void check_variables(bool firststart)
 
 static void seek_frame(int seek_frames)
 {
+   unsigned i;
    char msg[256];
    char seek_time_str[16];
    char total_time_str[16];
@@ -2886,6 +3565,7 @@ static void seek_frame(int seek_frames)
    int seek_frames_capped           = seek_frames;
    int8_t seek_progress             = -1;
    bool duration_valid              = duration_is_valid(media.duration.time);
+   uint64_t loop_frames             = 0;
 
    msg[0] = '\0';
 
@@ -2895,6 +3575,13 @@ static void seek_frame(int seek_frames)
       return;
    }
 
+   /* Seek from the position in the file, not from past the end of
+    * the track where loops played from memory leave the clock. */
+   loop_frames = (uint64_t)(aplayer_loop_offset_at(
+         (double)frame_cnt / media.interpolate_fps + pts_bias) *
+         media.interpolate_fps + 0.5);
+   frame_cnt   = frame_cnt > loop_frames ? frame_cnt - loop_frames : 0;
+
    /* Handle resets + attempts to seek to a location
     * before the start of the video */
    if ((seek_frames < 0 && (unsigned)-seek_frames > frame_cnt) || reset_triggered)
@@ -2984,10 +3671,14 @@ static void seek_frame(int seek_frames)
    frames[1].pts = 0.0;
    frames[0].valid = false;
    frames[1].valid = false;
+   frame_clock_frac = 0.0;
    audio_frames = frame_cnt * media.sample_rate / media.interpolate_fps;
 
-   if (audio_decode_fifo)
-      fifo_clear(audio_decode_fifo);
+   /* Frontend side, so the queued audio can be dropped directly. */
+   for (i = 0; i < ARRAY_SIZE(audio_queues); i++)
+      if (audio_queues[i].ring)
+         spsc_ring_consume(audio_queues[i].ring,
+               spsc_ring_read_avail(audio_queues[i].ring));
    scond_signal(fifo_decode_cond);
 
    while (!decode_thread_dead && do_seek)
@@ -3185,9 +3876,6 @@ static long long subtitle_adjust_render_time_ms(ASS_Track *track,
    return now_ms;
 }
 
-static void render_subtitles_on_buffer(uint32_t *buffer, unsigned width,
-      unsigned height, double time_sec);
-
 static void ensure_video_textures_allocated(unsigned width, unsigned height)
 {
    unsigned i;
@@ -3216,6 +3904,7 @@ static void ensure_video_textures_allocated(unsigned width, unsigned height)
 
    frames_tex_width  = width;
    frames_tex_height = height;
+   video_present_valid = false;
 }
 
 static bool aplayer_reload_current_from_start(void)
@@ -3267,311 +3956,915 @@ static bool aplayer_reload_current_from_start(void)
    return true;
 }
 
-void retro_run(void)
+/* Bytes the decode thread may still queue within audio_ring_depth. */
+static size_t audio_queue_space(struct audio_queue *q)
 {
-   static bool last_left;
-   static bool last_right;
-   static bool last_up;
-   static bool last_down;
-   static bool last_start;
-   static bool last_a;
-   static bool last_b;
-   static bool last_x;
-   static bool last_y;
-   static bool last_l;
-   static bool last_r;
-   static bool last_l2;
-   static bool last_r2;
-   static bool audio_wait_timeout_logged;
-   static bool video_wait_timeout_logged;
-   double min_pts;
-   int16_t audio_buffer[2048];
-   bool left, right, up, down, start, a, b, x, y, l, r, l2, r2;
-   int16_t ret                  = 0;
-   size_t to_read_frames        = 0;
-   int seek_frames              = 0;
-   bool updated                 = false;
-   unsigned old_fft_width       = fft_width;
-   unsigned old_fft_height      = fft_height;
-   float old_video_aspect       = video_stream_index >= 0 ? get_video_output_aspect() : 0.0f;
-   float old_video_zoom         = get_video_zoom();
-   bool geometry_changed        = false;
-   double old_interpolate_fps   = media.interpolate_fps;
-   uint64_t old_frame_cnt       = frame_cnt;
-   bool timing_changed          = false;
+   size_t used = spsc_ring_capacity(q->ring) - spsc_ring_write_avail(q->ring);
 
-   refresh_video_fill_target_aspect();
+   return used < audio_ring_depth ? audio_ring_depth - used : 0;
+}
 
-   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
-      check_variables(false);
+/* Decode thread side. Queues @size bytes of audio ending at @end_time,
+ * @size may be 0 to move the clock only. */
+static void audio_queue_publish(struct audio_queue *q, double end_time,
+      const int16_t *data, size_t size)
+{
+   __atomic_add_fetch(&q->clock_seq, 1, __ATOMIC_ACQ_REL);
+   q->end_time = end_time;
+   if (size)
+      spsc_ring_write(q->ring, data, size);
+   __atomic_add_fetch(&q->clock_seq, 1, __ATOMIC_RELEASE);
 
-   if (old_video_zoom < get_video_zoom() - 0.0005f ||
-       old_video_zoom > get_video_zoom() + 0.0005f)
+   /* Pairs with the fence in retro_run() so a sleeping frontend thread
+    * cannot miss this write. */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (main_sleeping)
    {
-      if (use_fill_zoom())
-         log_cb(RETRO_LOG_INFO,
-               "[APLAYER] Zoom updated: %.2f -> %.2f (auto fill %.3f)\n",
-               old_video_zoom, get_video_zoom(), video_fill_target_aspect);
-      else
-         log_cb(RETRO_LOG_INFO,
-               "[APLAYER] Zoom updated: %.2f -> %.2f\n",
-               old_video_zoom, get_video_zoom());
+      slock_lock(fifo_lock);
+      scond_signal(fifo_cond);
+      slock_unlock(fifo_lock);
    }
+}
 
-   timing_changed = playback_rates_differ(old_interpolate_fps, media.interpolate_fps);
+/* Decode thread side. Reassigns @q to @track, dropping what it held. */
+static void audio_queue_assign(struct audio_queue *q, int track, double time)
+{
+   spsc_ring_flush(q->ring);
+   audio_queue_publish(q, time, NULL, 0);
+   /* Pairs with audio_standby_ready(), the flush is requested first. */
+   __atomic_store_n(&q->track, track, __ATOMIC_RELEASE);
+}
 
-   geometry_changed = fft_width != old_fft_width ||
-      fft_height != old_fft_height ||
-      (video_stream_index >= 0 &&
-       aspect_values_differ(old_video_aspect, get_video_output_aspect()));
+/* Decode thread side. The queue @track is written to, if any. */
+static struct audio_queue *audio_queue_for_track(int track)
+{
+   unsigned i;
 
-   if (geometry_changed || timing_changed)
-   {
-      struct retro_system_av_info info;
-      retro_get_system_av_info(&info);
+   for (i = 0; i < ARRAY_SIZE(audio_queues); i++)
+      if (audio_queues[i].ring && audio_queues[i].track == track)
+         return &audio_queues[i];
 
-      if (geometry_changed)
-      {
-         log_cb(RETRO_LOG_INFO,
-               "[APLAYER] Runtime geometry update: %ux%u aspect %.3f zoom %.2f\n",
-               info.geometry.base_width, info.geometry.base_height,
-               info.geometry.aspect_ratio, get_video_zoom());
-         environ_cb(RETRO_ENVIRONMENT_SET_GEOMETRY, &info.geometry);
-      }
+   return NULL;
+}
 
-      if (!environ_cb(RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO, &info))
-      {
-         fft_width = old_fft_width;
-         fft_height = old_fft_height;
-         media.interpolate_fps = old_interpolate_fps;
-         frame_cnt = old_frame_cnt;
-         timing_changed = false;
-      }
-      else if (timing_changed)
-      {
-         log_cb(RETRO_LOG_INFO,
-               "[APLAYER] Applied updated playback timing during playback: %.3f -> %.3f Hz\n",
-               old_interpolate_fps, media.interpolate_fps);
-      }
-   }
+/* Frontend thread side. Returns the end time of the queued audio
+ * together with the number of bytes it is the end of. */
+static double audio_queue_clock(struct audio_queue *q, size_t *avail)
+{
+   unsigned seq;
+   double time;
 
-   input_poll_cb();
+   do
    {
-      unsigned port;
-      unsigned ports = input_ports;
+      seq    = __atomic_load_n(&q->clock_seq, __ATOMIC_ACQUIRE);
+      time   = q->end_time;
+      *avail = spsc_ring_fill(q->ring);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   } while ((seq & 1) || seq != __atomic_load_n(&q->clock_seq, __ATOMIC_ACQUIRE));
 
-      if (ports > APLAYER_MAX_PORTS)
-         ports = APLAYER_MAX_PORTS;
+   return time;
+}
 
-      for (port = 0; port < ports; port++)
-      {
-         if (!aplayer_device_is_joypad(controller_port_devices[port]))
-            continue;
+/* Frontend thread side. Start time of the queued audio. */
+static double audio_queue_start(struct audio_queue *q, size_t *avail)
+{
+   double end = audio_queue_clock(q, avail);
 
-         ret |= aplayer_poll_input_mask(port);
-      }
-   }
+   return end - (double)*avail / (media.sample_rate * sizeof(int16_t) * 2);
+}
 
-   left  = ret & (1 << RETRO_DEVICE_ID_JOYPAD_LEFT);
-   right = ret & (1 << RETRO_DEVICE_ID_JOYPAD_RIGHT);
-   up    = ret & (1 << RETRO_DEVICE_ID_JOYPAD_UP);
-   down  = ret & (1 << RETRO_DEVICE_ID_JOYPAD_DOWN);
-   start = ret & (1 << RETRO_DEVICE_ID_JOYPAD_START);
-   a     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_A);
-   b     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_B);
-   x     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_X);
-   y     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_Y);
-   l     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_L);
-   r     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_R);
-   l2    = ret & (1 << RETRO_DEVICE_ID_JOYPAD_L2);
-   r2    = ret & (1 << RETRO_DEVICE_ID_JOYPAD_R2);
+/* Frontend thread side. Drops standby audio older than @play_time, so
+ * the standby track keeps pace with the one being played. */
+static void audio_standby_trim(double play_time)
+{
+   struct audio_queue *q  = &audio_queues[!audio_queue_playing];
+   size_t bytes_per_frame = sizeof(int16_t) * 2;
+   size_t avail           = 0;
+   size_t drop            = 0;
+   double start;
 
-   if (!decode_thread_dead)
+   if (!q->ring)
+      return;
+
+   /* Nothing is peeked from the standby queue, so its flushes can be
+    * applied right away. */
+   spsc_ring_begin_read(q->ring);
+   start = audio_queue_start(q, &avail);
+   if (avail && start < play_time)
    {
-      /* Play/Pause */
-      if (start && !last_start) {
-         // Toggle the pause state.
-         paused = !paused;
-         {
-            // Send an on-screen message informing the user.
-            char msg[32];
-            struct retro_message_ext msg_obj = {0};
-            
-            if (paused) {
-               snprintf(msg, sizeof(msg), "Paused");
-            } else {
-               snprintf(msg, sizeof(msg), "Resumed");
-            }
-            
-            msg_obj.msg      = msg;
-            msg_obj.duration = 3000;  // Duration in ms for the message display
-            msg_obj.priority = 1;
-            msg_obj.level    = RETRO_LOG_INFO;
-            msg_obj.target   = RETRO_MESSAGE_TARGET_OSD;
-            msg_obj.type     = RETRO_MESSAGE_TYPE_NOTIFICATION;
-            msg_obj.progress = -1;
-            environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &msg_obj);
-         }
-      }
-      /* M3U */
-      /* Handle Next/Previous Track with L/R buttons */
-      if (playlist_count > 0)
-      {
-         if (r && !last_r)
-         {
-            slock_lock(decode_thread_lock);
-            unsigned new_index = (playlist_index + 1) % playlist_count;
-            if (new_index != playlist_index)
-            {
-               playlist_index = new_index;
-               do_seek = true;
-               seek_time = 0.0;
-               // Display track change message with file name only
-               char msg[256];
-               struct retro_message_ext msg_obj = {0};
+      drop = (size_t)((play_time - start) * media.sample_rate) * bytes_per_frame;
+      if (drop > avail)
+         drop = avail;
+   }
+   spsc_ring_consume(q->ring, drop);
+}
 
-               // Extract the file name from the full path
-               const char *full_path = playlist[playlist_index];
-               const char *filename = strrchr(full_path, '/');
-               if (filename)
-                  filename++;  // Skip the '/' character
-               else
-                  filename = full_path;
+/* Frontend thread side. Whether the standby queue holds @track from
+ * @play_time on, so it can be played without a gap. */
+static bool audio_standby_ready(int track, double play_time)
+{
+   struct audio_queue *q = &audio_queues[!audio_queue_playing];
+   size_t avail          = 0;
+   double start;
 
-               snprintf(msg, sizeof(msg), "%d/%d %s", playlist_index + 1, playlist_count, filename);
-               msg_obj.msg = msg;
-               msg_obj.duration = 3000;
-               msg_obj.priority = 1;
-               msg_obj.level = RETRO_LOG_INFO;
-               msg_obj.target = RETRO_MESSAGE_TARGET_OSD;
-               msg_obj.type = RETRO_MESSAGE_TYPE_NOTIFICATION;
-               msg_obj.progress = -1;
-               environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &msg_obj);
-            }
-            slock_unlock(decode_thread_lock);
-         }
-         else if (l && !last_l)
-         {
-            slock_lock(decode_thread_lock);
-            unsigned new_index = (playlist_index - 1 + playlist_count) % playlist_count;
-            if (new_index != playlist_index)
-            {
-               playlist_index = new_index;
-               do_seek = true;
-               seek_time = 0.0;
-               // Display track change message with file name only
-               char msg[256];
-               struct retro_message_ext msg_obj = {0};
+   if (!q->ring || __atomic_load_n(&q->track, __ATOMIC_ACQUIRE) != track)
+      return false;
 
-               // Extract the file name from the full path
-               const char *full_path = playlist[playlist_index];
-               const char *filename = strrchr(full_path, '/');
-               if (filename)
-                  filename++;  // Skip the '/' character
-               else
-                  filename = full_path;
+   start = audio_queue_start(q, &avail);
+   return start <= play_time + APLAYER_AUDIO_STANDBY_SLACK_SECONDS &&
+         start + (double)avail / (media.sample_rate * sizeof(int16_t) * 2) >=
+         play_time + APLAYER_AUDIO_STANDBY_MIN_SECONDS;
+}
 
-               snprintf(msg, sizeof(msg), "%d/%d %s", playlist_index + 1, playlist_count, filename);
-               msg_obj.msg = msg;
-               msg_obj.duration = 3000;
-               msg_obj.priority = 1;
-               msg_obj.level = RETRO_LOG_INFO;
-               msg_obj.target = RETRO_MESSAGE_TARGET_OSD;
-               msg_obj.type = RETRO_MESSAGE_TYPE_NOTIFICATION;
-               msg_obj.progress = -1;
-               environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &msg_obj);
-            }
-            slock_unlock(decode_thread_lock);
-         }
-      }
+/* Frontend thread side, after releasing ring space. */
+static void audio_ring_wake_producer(void)
+{
+   struct audio_queue *q;
 
-      /* Display info */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (!audio_ring_producer_waiting)
+      return;
 
-      if (b && !last_b)
-         display_media_title();
-      if (a && !last_a)
-         dispaly_time();
+   /* Only once there is as much room as the decode thread asked for.
+    * It only ever waits on the playing queue, the standby one is kept
+    * short and would wake it on every run. */
+   q = &audio_queues[audio_queue_playing];
+   if (q->ring &&
+         spsc_ring_fill(q->ring) + audio_ring_producer_need <= audio_ring_depth)
+   {
+      slock_lock(fifo_lock);
+      scond_signal(fifo_decode_cond);
+      slock_unlock(fifo_lock);
+   }
+}
 
-      /* Seek and subtitles */
+static const int16_t audio_silence[2 * 2048];
 
-      if (left && !last_left)
-         seek_frames -= 15 * media.interpolate_fps;
-      if (right && !last_right)
-         seek_frames += 15 * media.interpolate_fps;
-      if (up && !last_up)
-         seek_frames += 180 * media.interpolate_fps;
-      if (down && !last_down)
-         seek_frames -= 180 * media.interpolate_fps;
-      if (l2 && !last_l2)
-         seek_frames -= 300 * media.interpolate_fps;
-      if (r2 && !last_r2)
-         seek_frames += 300 * media.interpolate_fps;
+/* Feeds @frames of audio, or silence when @buffer is NULL, to the
+ * visualizer. */
+static void fft_step_audio(const int16_t *buffer, size_t frames)
+{
+   while (frames)
+   {
+      unsigned to_read = frames;
 
+      /* FFT size we use (1 << 11). Really shouldn't happen,
+       * unless we use a crazy high sample rate. */
+      if (to_read > (1 << 11))
+         to_read = 1 << 11;
 
-      int media_type = get_media_type();
+      if (fft)
+         fft_step_fft(fft, buffer ? buffer : audio_silence, to_read);
+      else
+         cpu_fft_step(cpu_fft, buffer ? buffer : audio_silence, to_read);
+      if (buffer)
+         buffer += to_read * 2;
+      frames -= to_read;
+   }
+}
 
-      if (media_type == MEDIA_TYPE_VIDEO && y && !last_y)
-      {
-         char msg[256];
-         struct retro_message_ext msg_obj = {0};
+/* Sizes cpu_fft_frame for the current visualizer resolution. */
+static bool cpu_fft_frame_prepare(void)
+{
+   size_t size = (size_t)fft_width * fft_height * sizeof(uint32_t);
 
-         msg[0] = '\0';
+   if (size != cpu_fft_frame_size)
+   {
+      free(cpu_fft_frame);
+      cpu_fft_frame      = (uint32_t*)calloc(1, size);
+      cpu_fft_frame_size = cpu_fft_frame ? size : 0;
+   }
 
-         if (audio_streams_num > 1)
-         {
-            int next_audio_stream_ptr;
+   return cpu_fft_frame != NULL;
+}
 
-            /* Select the new audio track without disturbing video decode state.
-             * A full seek here can restart H.264 between reference frames. */
-            slock_lock(decode_thread_lock);
-            audio_streams_ptr = (audio_streams_ptr + 1) % audio_streams_num;
-            next_audio_stream_ptr = audio_streams_ptr;
-            audio_switch_requested = true;
-            slock_unlock(decode_thread_lock);
+/* Draws cpu_fft_frame into the HW framebuffer with the video program. */
+static void cpu_fft_present_gl(void)
+{
+   /* Flipped, the visualizer context has a bottom-left origin. */
+   static const GLfloat vertex_data[] = {
+      -1, -1, 0, 1,
+       1, -1, 1, 1,
+      -1,  1, 0, 0,
+       1,  1, 1, 0,
+   };
 
-            slock_lock(fifo_lock);
-            scond_signal(fifo_cond);
-            scond_signal(fifo_decode_cond);
-            slock_unlock(fifo_lock);
-            audio_selection_label(next_audio_stream_ptr, msg, sizeof(msg));
-         }
-         else
-            snprintf(msg, sizeof(msg), "No alternate audio tracks");
+   glBindTexture(GL_TEXTURE_2D, frames[0].tex);
+   if (frames_tex_width != fft_width || frames_tex_height != fft_height)
+   {
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+            (GLsizei)fft_width, (GLsizei)fft_height, 0,
+            GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+      frames_tex_width  = fft_width;
+      frames_tex_height = fft_height;
+   }
+   glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+         (GLsizei)fft_width, (GLsizei)fft_height,
+         GL_RGBA, GL_UNSIGNED_BYTE, cpu_fft_frame);
 
-         msg_obj.msg      = msg;
-         msg_obj.duration = 3000;
-         msg_obj.priority = 1;
-         msg_obj.level    = RETRO_LOG_INFO;
-         msg_obj.target   = RETRO_MESSAGE_TARGET_OSD;
-         msg_obj.type     = RETRO_MESSAGE_TYPE_NOTIFICATION;
-         msg_obj.progress = -1;
-         environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &msg_obj);
-      }
-      else if (media_type == MEDIA_TYPE_VIDEO && x && !last_x)
-      {
-         char msg[256];
-         struct retro_message_ext msg_obj = {0};
-         msg[0] = '\0';
+   glBindFramebuffer(GL_FRAMEBUFFER, hw_render.get_current_framebuffer());
+   glViewport(0, 0, fft_width, fft_height);
 
-         if (subtitle_streams_num > 0)
-         {
-            int next_subtitle_stream_ptr;
+   glUseProgram(prog);
+   glUniform1f(mix_loc, 0.0f);
+   glActiveTexture(GL_TEXTURE1);
+   glBindTexture(GL_TEXTURE_2D, frames[0].tex);
+   glActiveTexture(GL_TEXTURE0);
 
-            slock_lock(decode_thread_lock);
-            subtitle_streams_ptr = subtitle_next_selection(subtitle_streams_ptr);
-            next_subtitle_stream_ptr = subtitle_streams_ptr;
-            slock_unlock(decode_thread_lock);
-            subtitle_selection_label(next_subtitle_stream_ptr, msg, sizeof(msg));
-         }
-         else
-         {
-            snprintf(msg, sizeof(msg), "Subtitles not available");
-         }
+   glBindBuffer(GL_ARRAY_BUFFER, vbo);
+   glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertex_data), vertex_data);
+   glVertexAttribPointer(vertex_loc, 2, GL_FLOAT, GL_FALSE,
+         4 * sizeof(GLfloat), (const GLvoid*)(0 * sizeof(GLfloat)));
+   glVertexAttribPointer(tex_loc, 2, GL_FLOAT, GL_FALSE,
+         4 * sizeof(GLfloat), (const GLvoid*)(2 * sizeof(GLfloat)));
+   glEnableVertexAttribArray(vertex_loc);
+   glEnableVertexAttribArray(tex_loc);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-         msg_obj.msg      = msg;
-         msg_obj.duration = 3000;
-         msg_obj.priority = 1;
-         msg_obj.level    = RETRO_LOG_INFO;
+   glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+   glDisableVertexAttribArray(vertex_loc);
+   glDisableVertexAttribArray(tex_loc);
+
+   glUseProgram(0);
+   glActiveTexture(GL_TEXTURE1);
+   glBindTexture(GL_TEXTURE_2D, 0);
+   glActiveTexture(GL_TEXTURE0);
+   glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/* Same for the frontend. */
+static void audio_submit(const int16_t *buffer, size_t frames)
+{
+   while (frames)
+   {
+      size_t to_write = frames;
+
+      if (!buffer && to_write > 2048)
+         to_write = 2048;
+
+      audio_batch_cb(buffer ? buffer : audio_silence, to_write);
+      if (buffer)
+         buffer += to_write * 2;
+      frames -= to_write;
+   }
+}
+
+/* Hands a run's audio to the frontend. Silence padded in for late
+ * audio fades out from the last sample instead of cutting to zero,
+ * and the audio after it fades back in, so a late decoder is a short
+ * dip rather than a click. */
+static void audio_submit_run(const int16_t *const *region,
+      const size_t *region_frames, size_t silence_frames)
+{
+   unsigned i, j;
+   int16_t fade[2 * APLAYER_AUDIO_FADE_FRAMES];
+
+   for (i = 0; i < 2; i++)
+   {
+      const int16_t *buffer = region[i];
+      size_t frames         = region_frames[i];
+
+      if (!frames)
+         continue;
+
+      audio_last_sample[0] = buffer[(frames - 1) * 2];
+      audio_last_sample[1] = buffer[(frames - 1) * 2 + 1];
+
+      if (audio_faded_out)
+      {
+         size_t fade_frames = MIN(frames, APLAYER_AUDIO_FADE_FRAMES);
+
+         for (j = 0; j < fade_frames; j++)
+         {
+            fade[j * 2]     = (int16_t)(buffer[j * 2] * (int)j / APLAYER_AUDIO_FADE_FRAMES);
+            fade[j * 2 + 1] = (int16_t)(buffer[j * 2 + 1] * (int)j / APLAYER_AUDIO_FADE_FRAMES);
+         }
+         audio_submit(fade, fade_frames);
+         buffer += fade_frames * 2;
+         frames -= fade_frames;
+         audio_faded_out = false;
+      }
+
+      audio_submit(buffer, frames);
+   }
+
+   if (!silence_frames)
+      return;
+
+   if (!audio_faded_out)
+   {
+      size_t fade_frames = MIN(silence_frames, APLAYER_AUDIO_FADE_FRAMES);
+
+      for (j = 0; j < fade_frames; j++)
+      {
+         int gain        = APLAYER_AUDIO_FADE_FRAMES - 1 - (int)j;
+         fade[j * 2]     = (int16_t)(audio_last_sample[0] * gain / APLAYER_AUDIO_FADE_FRAMES);
+         fade[j * 2 + 1] = (int16_t)(audio_last_sample[1] * gain / APLAYER_AUDIO_FADE_FRAMES);
+      }
+      audio_submit(fade, fade_frames);
+      silence_frames -= fade_frames;
+      audio_faded_out = true;
+   }
+
+   audio_submit(NULL, silence_frames);
+}
+
+static void aplayer_audio_buffer_status_cb(bool active, unsigned occupancy,
+      bool underrun_likely)
+{
+   bool starving = active &&
+         (underrun_likely || occupancy < APLAYER_AUDIO_STARVING_OCCUPANCY);
+
+   if (active && occupancy < audio_device_occupancy_min)
+      audio_device_occupancy_min = occupancy;
+   if (starving)
+      stats_audio_starving++;
+
+   if (starving && !audio_device_starving && fifo_lock)
+   {
+      /* Let a waiting decode thread pick up audio now. */
+      audio_device_starving = true;
+      slock_lock(fifo_lock);
+      scond_signal(fifo_decode_cond);
+      slock_unlock(fifo_lock);
+   }
+   audio_device_starving = starving;
+}
+
+static void aplayer_frame_time_cb(retro_usec_t usec)
+{
+   frame_time_usec = usec;
+}
+
+/* Content time retro_run() presents, in seconds before pts_bias. */
+static double aplayer_clock_time(void)
+{
+   return ((double)frame_cnt + frame_clock_frac) / media.interpolate_fps;
+}
+
+/* Advances the clock by one run. Without the frame time callback that
+ * is exactly one frame. With it, the smoothed real interval, so frame
+ * selection and the audio produced both follow the frontend's actual
+ * rate under VRR or a mismatched refresh. */
+static void aplayer_advance_clock(void)
+{
+   double elapsed;
+   double deviation;
+   double whole;
+
+   if (!frame_time_enabled || frame_time_usec <= 0)
+   {
+      frame_cnt++;
+      return;
+   }
+
+   elapsed         = (double)frame_time_usec * media.interpolate_fps / AV_TIME_BASE;
+   frame_time_usec = 0;
+
+   deviation = fabs(elapsed - frame_clock_period) * 1000.0 / media.interpolate_fps;
+   stats_frame_times++;
+   stats_frame_jitter_sum += deviation;
+   if (deviation > stats_frame_jitter_max)
+      stats_frame_jitter_max = deviation;
+
+   if (elapsed > frame_clock_period * APLAYER_FRAME_TIME_HICCUP)
+   {
+      /* A late run, catch up at once. */
+      stats_frame_hiccups++;
+      elapsed = MIN(elapsed, APLAYER_FRAME_TIME_MAX_FRAMES);
+   }
+   else
+   {
+      frame_clock_period += (elapsed - frame_clock_period) * APLAYER_FRAME_TIME_SMOOTHING;
+      elapsed             = frame_clock_period;
+   }
+
+   frame_clock_frac += elapsed;
+   whole             = floor(frame_clock_frac);
+   frame_cnt        += (uint64_t)whole;
+   frame_clock_frac -= whole;
+}
+
+/* How long retro_run() may wait on the decoder next, in microseconds.
+ * Without a @deadline that is a 2 ms slice, as before. */
+static int64_t present_wait_us(int64_t deadline)
+{
+   int64_t remaining;
+
+   if (!deadline)
+      return 2000;
+
+   remaining = deadline - av_gettime_relative();
+   return remaining > 0 ? MIN(remaining, 2000) : 0;
+}
+
+static void trick_play_message(void)
+{
+   char msg[32];
+   struct retro_message_ext msg_obj = {0};
+
+   snprintf(msg, sizeof(msg), "%s %ux", trick_play_dir > 0 ? ">>" : "<<",
+         trick_play_speed);
+   msg_obj.msg      = msg;
+   msg_obj.duration = 1000;
+   msg_obj.priority = 1;
+   msg_obj.level    = RETRO_LOG_INFO;
+   msg_obj.target   = RETRO_MESSAGE_TARGET_OSD;
+   msg_obj.type     = RETRO_MESSAGE_TYPE_NOTIFICATION;
+   msg_obj.progress = -1;
+   environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &msg_obj);
+}
+
+/* Trick-play runs for video only, while playing. */
+static bool trick_play_allowed(void)
+{
+   return !decode_thread_dead && seek_supported && video_stream_index >= 0 &&
+         !paused && !reset_triggered;
+}
+
+static void trick_play_start(int dir, unsigned speed)
+{
+   trick_play_active = true;
+   trick_play_dir    = dir;
+   trick_play_speed  = speed;
+   trick_shown_pts   = frames[1].valid ? frames[1].pts : aplayer_clock_time() + pts_bias;
+   trick_hop_pending = false;
+   trick_advance     = 0.0;
+   trick_last_run_us = av_gettime_relative();
+
+   if (speed)
+   {
+      trick_play_message();
+      log_cb(RETRO_LOG_INFO, "[APLAYER] Keyframe scan %s at %ux.\n",
+            dir > 0 ? "forward" : "backward", speed);
+   }
+   else
+      log_cb(RETRO_LOG_INFO, "[APLAYER] Frontend fast-forward, keyframes only.\n");
+}
+
+/* Back to normal playback from the last keyframe shown. */
+static void trick_play_stop(void)
+{
+   int64_t target = (int64_t)((trick_shown_pts - pts_bias) * media.interpolate_fps);
+
+   trick_play_active = false;
+   trick_hop_pending = false;
+   if (target < 0)
+      target = 0;
+   seek_frame((int)(target - (int64_t)frame_cnt));
+}
+
+/* Requests the next keyframe hop from the decode thread. */
+static void trick_play_hop(double time)
+{
+   slock_lock(fifo_lock);
+   seek_time      = time;
+   trick_seek_dir = trick_play_dir;
+   do_seek        = true;
+   scond_signal(fifo_decode_cond);
+   slock_unlock(fifo_lock);
+
+   trick_hop_pending = true;
+   trick_hop_us      = av_gettime_relative();
+   trick_advance     = 0.0;
+}
+
+/* One trick-play run: shows the frame the last hop landed on once it
+ * is decoded and asks for the next hop. Never waits on the decoder. */
+static void trick_play_run(void)
+{
+   int64_t now = av_gettime_relative();
+   video_decoder_context_t *ctx = NULL;
+   bool shown = false;
+
+   if (trick_play_speed)
+      trick_advance += trick_play_speed * (double)(now - trick_last_run_us) / AV_TIME_BASE;
+   else
+      trick_advance += 1.0 / media.interpolate_fps;
+   trick_last_run_us = now;
+
+   /* Keyframes decoded past the one a hop landed on, or before a hop
+    * was taken up, are dropped so the decoder never waits on a slot. */
+   while (video_buffer_has_finished_slot(video_buffer))
+   {
+      ctx = NULL;
+      video_buffer_get_finished_slot(video_buffer, &ctx);
+      if (!ctx)
+         break;
+
+      if (!shown && !do_seek)
+      {
+         ensure_video_textures_allocated(media.width, media.height);
+         glBindTexture(GL_TEXTURE_2D, frames[1].tex);
+         glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+               (GLsizei)media.width, (GLsizei)media.height,
+               GL_RGBA, GL_UNSIGNED_BYTE, ctx->target->data[0]);
+         glBindTexture(GL_TEXTURE_2D, 0);
+         video_upload_seq++;
+
+         if (ctx->pts != AV_NOPTS_VALUE)
+            trick_shown_pts = av_q2d(fctx->streams[video_stream_index]->time_base) * ctx->pts;
+         frames[1].pts     = trick_shown_pts;
+         frames[1].valid   = true;
+         trick_hop_pending = false;
+         shown             = true;
+      }
+      video_buffer_open_slot(video_buffer, ctx);
+   }
+
+   if (trick_hop_pending && now - trick_hop_us > APLAYER_TRICK_HOP_TIMEOUT_US)
+      trick_hop_pending = false;
+
+   if (!trick_hop_pending && !do_seek)
+   {
+      double shown  = trick_shown_pts - aplayer_loop_offset_at(trick_shown_pts);
+      double target = shown + trick_play_dir * trick_advance;
+
+      if (target < 0.0)
+         target = 0.0;
+      if (duration_is_valid(media.duration.time) && target > media.duration.time - 1.0)
+         target = media.duration.time - 1.0;
+
+      if (trick_play_dir > 0 ? target > shown : target < shown)
+         trick_play_hop(target);
+   }
+}
+
+/* The art never changes, let the frontend repeat it. */
+static void cover_art_present(void)
+{
+   if (cover_art_presented && frontend_can_dupe)
+      video_cb(NULL, fft_width, fft_height, fft_width * sizeof(uint32_t));
+   else
+      video_cb(cover_art_frame, fft_width, fft_height,
+            fft_width * sizeof(uint32_t));
+   cover_art_presented = true;
+}
+
+/* Nothing changes while paused, repeat the last frame. Without a HW
+ * context there is no framebuffer to repeat, the software frame is
+ * sent again instead. */
+static void present_paused_frame(void)
+{
+   unsigned width  = video_stream_index >= 0 ? media.width : fft_width;
+   unsigned height = video_stream_index >= 0 ? media.height : fft_height;
+
+   stats_presents++;
+   if (video_stream_index < 0 && cover_art_frame)
+      cover_art_present();
+   else if (frontend_can_dupe)
+   {
+      stats_presents_elided++;
+      video_cb(NULL, width, height, width * sizeof(uint32_t));
+   }
+   else if (hw_render_enabled)
+      video_cb(RETRO_HW_FRAME_BUFFER_VALID, width, height, width * sizeof(uint32_t));
+   else if (cpu_fft && cpu_fft_frame)
+      video_cb(cpu_fft_frame, fft_width, fft_height, fft_width * sizeof(uint32_t));
+   else
+      video_cb(NULL, 1, 1, sizeof(uint32_t));
+}
+
+void retro_run(void)
+{
+   static bool last_left;
+   static bool last_right;
+   static bool last_up;
+   static bool last_down;
+   static bool last_start;
+   static bool last_a;
+   static bool last_b;
+   static bool last_x;
+   static bool last_y;
+   static bool last_l;
+   static bool last_r;
+   static bool last_l2;
+   static bool last_r2;
+   static bool audio_wait_timeout_logged;
+   static bool video_wait_timeout_logged;
+   double min_pts;
+   /* Audio handed to the frontend straight from the playing queue. The
+    * regions are released once audio_batch_cb() has consumed them. */
+   struct audio_queue *audio_queue = NULL;
+   const int16_t *audio_region[2] = {NULL, NULL};
+   size_t audio_region_frames[2]  = {0, 0};
+   size_t audio_silence_frames    = 0;
+   bool left, right, up, down, start, a, b, x, y, l, r, l2, r2;
+   /* End of the decoder wait budget in never-block mode. */
+   int64_t wait_deadline        = 0;
+   int16_t ret                  = 0;
+   size_t to_read_frames        = 0;
+   int seek_frames              = 0;
+   bool updated                 = false;
+   unsigned old_fft_width       = fft_width;
+   unsigned old_fft_height      = fft_height;
+   float old_video_aspect       = video_stream_index >= 0 ? get_video_output_aspect() : 0.0f;
+   float old_video_zoom         = get_video_zoom();
+   bool geometry_changed        = false;
+   double old_interpolate_fps   = media.interpolate_fps;
+   uint64_t old_frame_cnt       = frame_cnt;
+   bool timing_changed          = false;
+
+   refresh_video_fill_target_aspect();
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
+      check_variables(false);
+
+   if (av_gettime_relative() - stats_last_log_us >= APLAYER_STATS_INTERVAL_US)
+   {
+      stats_last_log_us = av_gettime_relative();
+      aplayer_stats_log(RETRO_LOG_DEBUG);
+   }
+
+   if (old_video_zoom < get_video_zoom() - 0.0005f ||
+       old_video_zoom > get_video_zoom() + 0.0005f)
+   {
+      if (use_fill_zoom())
+         log_cb(RETRO_LOG_INFO,
+               "[APLAYER] Zoom updated: %.2f -> %.2f (auto fill %.3f)\n",
+               old_video_zoom, get_video_zoom(), video_fill_target_aspect);
+      else
+         log_cb(RETRO_LOG_INFO,
+               "[APLAYER] Zoom updated: %.2f -> %.2f\n",
+               old_video_zoom, get_video_zoom());
+   }
+
+   timing_changed = playback_rates_differ(old_interpolate_fps, media.interpolate_fps);
+
+   geometry_changed = fft_width != old_fft_width ||
+      fft_height != old_fft_height ||
+      (video_stream_index >= 0 &&
+       aspect_values_differ(old_video_aspect, get_video_output_aspect()));
+
+   if (geometry_changed || timing_changed)
+   {
+      struct retro_system_av_info info;
+      retro_get_system_av_info(&info);
+      video_present_valid = false;
+
+      if (geometry_changed)
+      {
+         log_cb(RETRO_LOG_INFO,
+               "[APLAYER] Runtime geometry update: %ux%u aspect %.3f zoom %.2f\n",
+               info.geometry.base_width, info.geometry.base_height,
+               info.geometry.aspect_ratio, get_video_zoom());
+         environ_cb(RETRO_ENVIRONMENT_SET_GEOMETRY, &info.geometry);
+      }
+
+      if (!environ_cb(RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO, &info))
+      {
+         fft_width = old_fft_width;
+         fft_height = old_fft_height;
+         media.interpolate_fps = old_interpolate_fps;
+         frame_cnt = old_frame_cnt;
+         timing_changed = false;
+      }
+      else if (timing_changed)
+      {
+         /* The smoothed interval is in frames of the old rate. */
+         frame_clock_period = 1.0;
+         log_cb(RETRO_LOG_INFO,
+               "[APLAYER] Applied updated playback timing during playback: %.3f -> %.3f Hz\n",
+               old_interpolate_fps, media.interpolate_fps);
+      }
+   }
+
+   input_poll_cb();
+   {
+      unsigned port;
+      unsigned ports = input_ports;
+
+      if (ports > APLAYER_MAX_PORTS)
+         ports = APLAYER_MAX_PORTS;
+
+      for (port = 0; port < ports; port++)
+      {
+         if (!aplayer_device_is_joypad(controller_port_devices[port]))
+            continue;
+
+         ret |= aplayer_poll_input_mask(port);
+      }
+   }
+
+   left  = ret & (1 << RETRO_DEVICE_ID_JOYPAD_LEFT);
+   right = ret & (1 << RETRO_DEVICE_ID_JOYPAD_RIGHT);
+   up    = ret & (1 << RETRO_DEVICE_ID_JOYPAD_UP);
+   down  = ret & (1 << RETRO_DEVICE_ID_JOYPAD_DOWN);
+   start = ret & (1 << RETRO_DEVICE_ID_JOYPAD_START);
+   a     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_A);
+   b     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_B);
+   x     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_X);
+   y     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_Y);
+   l     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_L);
+   r     = ret & (1 << RETRO_DEVICE_ID_JOYPAD_R);
+   l2    = ret & (1 << RETRO_DEVICE_ID_JOYPAD_L2);
+   r2    = ret & (1 << RETRO_DEVICE_ID_JOYPAD_R2);
+
+   if (!decode_thread_dead)
+   {
+      /* Play/Pause */
+      if (start && !last_start) {
+         // Toggle the pause state.
+         paused = !paused;
+         {
+            // Send an on-screen message informing the user.
+            char msg[32];
+            struct retro_message_ext msg_obj = {0};
+            
+            if (paused) {
+               snprintf(msg, sizeof(msg), "Paused");
+            } else {
+               snprintf(msg, sizeof(msg), "Resumed");
+            }
+            
+            msg_obj.msg      = msg;
+            msg_obj.duration = 3000;  // Duration in ms for the message display
+            msg_obj.priority = 1;
+            msg_obj.level    = RETRO_LOG_INFO;
+            msg_obj.target   = RETRO_MESSAGE_TARGET_OSD;
+            msg_obj.type     = RETRO_MESSAGE_TYPE_NOTIFICATION;
+            msg_obj.progress = -1;
+            environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &msg_obj);
+         }
+      }
+      /* M3U */
+      /* Handle Next/Previous Track with L/R buttons */
+      if (playlist_count > 0)
+      {
+         if (r && !last_r)
+         {
+            slock_lock(decode_thread_lock);
+            unsigned new_index = (playlist_index + 1) % playlist_count;
+            if (new_index != playlist_index)
+            {
+               playlist_index = new_index;
+               do_seek = true;
+               seek_time = 0.0;
+               // Display track change message with file name only
+               char msg[256];
+               struct retro_message_ext msg_obj = {0};
+
+               // Extract the file name from the full path
+               const char *full_path = playlist[playlist_index];
+               const char *filename = strrchr(full_path, '/');
+               if (filename)
+                  filename++;  // Skip the '/' character
+               else
+                  filename = full_path;
+
+               snprintf(msg, sizeof(msg), "%d/%d %s", playlist_index + 1, playlist_count, filename);
+               msg_obj.msg = msg;
+               msg_obj.duration = 3000;
+               msg_obj.priority = 1;
+               msg_obj.level = RETRO_LOG_INFO;
+               msg_obj.target = RETRO_MESSAGE_TARGET_OSD;
+               msg_obj.type = RETRO_MESSAGE_TYPE_NOTIFICATION;
+               msg_obj.progress = -1;
+               environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &msg_obj);
+            }
+            slock_unlock(decode_thread_lock);
+         }
+         else if (l && !last_l)
+         {
+            slock_lock(decode_thread_lock);
+            unsigned new_index = (playlist_index - 1 + playlist_count) % playlist_count;
+            if (new_index != playlist_index)
+            {
+               playlist_index = new_index;
+               do_seek = true;
+               seek_time = 0.0;
+               // Display track change message with file name only
+               char msg[256];
+               struct retro_message_ext msg_obj = {0};
+
+               // Extract the file name from the full path
+               const char *full_path = playlist[playlist_index];
+               const char *filename = strrchr(full_path, '/');
+               if (filename)
+                  filename++;  // Skip the '/' character
+               else
+                  filename = full_path;
+
+               snprintf(msg, sizeof(msg), "%d/%d %s", playlist_index + 1, playlist_count, filename);
+               msg_obj.msg = msg;
+               msg_obj.duration = 3000;
+               msg_obj.priority = 1;
+               msg_obj.level = RETRO_LOG_INFO;
+               msg_obj.target = RETRO_MESSAGE_TARGET_OSD;
+               msg_obj.type = RETRO_MESSAGE_TYPE_NOTIFICATION;
+               msg_obj.progress = -1;
+               environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &msg_obj);
+            }
+            slock_unlock(decode_thread_lock);
+         }
+      }
+
+      /* Display info */
+
+      if (b && !last_b)
+         display_media_title();
+      if (a && !last_a)
+         dispaly_time();
+
+      /* Seek and subtitles */
+
+      if (!trick_play_allowed())
+      {
+         if (left && !last_left)
+            seek_frames -= 15 * media.interpolate_fps;
+         if (right && !last_right)
+            seek_frames += 15 * media.interpolate_fps;
+      }
+      else
+      {
+         /* Where holding left or right scans, a tap seeks on release,
+          * so that a hold does not seek before the scan starts. The
+          * hold is tracked by the trick-play code below. */
+         int hold_dir = right != left ? (right ? 1 : -1) : 0;
+
+         if (scan_hold_dir && hold_dir != scan_hold_dir &&
+               av_gettime_relative() - scan_hold_since_us < APLAYER_SCAN_HOLD_US)
+            seek_frames += scan_hold_dir * 15 * media.interpolate_fps;
+      }
+      if (up && !last_up)
+         seek_frames += 180 * media.interpolate_fps;
+      if (down && !last_down)
+         seek_frames -= 180 * media.interpolate_fps;
+      if (l2 && !last_l2)
+         seek_frames -= 300 * media.interpolate_fps;
+      if (r2 && !last_r2)
+         seek_frames += 300 * media.interpolate_fps;
+
+
+      int media_type = get_media_type();
+
+      if (media_type == MEDIA_TYPE_VIDEO && y && !last_y)
+      {
+         char msg[256];
+         struct retro_message_ext msg_obj = {0};
+
+         msg[0] = '\0';
+
+         if (audio_streams_num > 1)
+         {
+            int next_audio_stream_ptr;
+
+            /* Select the new audio track without disturbing video decode state.
+             * A full seek here can restart H.264 between reference frames. */
+            slock_lock(decode_thread_lock);
+            audio_streams_ptr = (audio_streams_ptr + 1) % audio_streams_num;
+            next_audio_stream_ptr = audio_streams_ptr;
+            /* A warm standby track is played from the next frame on,
+             * the decode thread only catches up with the swap. */
+            if (audio_standby_ready(next_audio_stream_ptr,
+                     (double)audio_frames / media.sample_rate + pts_bias))
+               audio_queue_playing = !audio_queue_playing;
+            audio_switch_requested = true;
+            slock_unlock(decode_thread_lock);
+
+            slock_lock(fifo_lock);
+            scond_signal(fifo_cond);
+            scond_signal(fifo_decode_cond);
+            slock_unlock(fifo_lock);
+            audio_selection_label(next_audio_stream_ptr, msg, sizeof(msg));
+         }
+         else
+            snprintf(msg, sizeof(msg), "No alternate audio tracks");
+
+         msg_obj.msg      = msg;
+         msg_obj.duration = 3000;
+         msg_obj.priority = 1;
+         msg_obj.level    = RETRO_LOG_INFO;
+         msg_obj.target   = RETRO_MESSAGE_TARGET_OSD;
+         msg_obj.type     = RETRO_MESSAGE_TYPE_NOTIFICATION;
+         msg_obj.progress = -1;
+         environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &msg_obj);
+      }
+      else if (media_type == MEDIA_TYPE_VIDEO && x && !last_x)
+      {
+         char msg[256];
+         struct retro_message_ext msg_obj = {0};
+         msg[0] = '\0';
+
+         if (subtitle_streams_num > 0)
+         {
+            int next_subtitle_stream_ptr;
+
+            slock_lock(decode_thread_lock);
+            subtitle_streams_ptr = subtitle_next_selection(subtitle_streams_ptr);
+            next_subtitle_stream_ptr = subtitle_streams_ptr;
+            slock_unlock(decode_thread_lock);
+            subtitle_selection_label(next_subtitle_stream_ptr, msg, sizeof(msg));
+         }
+         else
+         {
+            snprintf(msg, sizeof(msg), "Subtitles not available");
+         }
+
+         msg_obj.msg      = msg;
+         msg_obj.duration = 3000;
+         msg_obj.priority = 1;
+         msg_obj.level    = RETRO_LOG_INFO;
          msg_obj.target   = RETRO_MESSAGE_TARGET_OSD;
          msg_obj.type     = RETRO_MESSAGE_TYPE_NOTIFICATION;
          msg_obj.progress = -1;
@@ -3579,1540 +4872,2661 @@ void retro_run(void)
       }
    }
 
-   last_left  = left;
-   last_right = right;
-   last_up    = up;
-   last_down  = down;
-   last_start = start;
-   last_a     = a;
-   last_b     = b;
-   last_x     = x;
-   last_y     = y;
-   last_l     = l;
-   last_r     = r;
-   last_l2    = l2;
-   last_r2    = r2;
+   /* Trick-play: the frontend's fast-forward, or left or right held
+    * for APLAYER_SCAN_HOLD_US. */
+   if (trick_play_allowed())
+   {
+      bool fast_forward = false;
+      int hold_dir      = right != left ? (right ? 1 : -1) : 0;
+      int64_t now       = av_gettime_relative();
+      int want_dir      = 0;
+      unsigned speed    = 0;
+
+      if (hold_dir != scan_hold_dir)
+      {
+         scan_hold_dir      = hold_dir;
+         scan_hold_since_us = now;
+      }
+
+      if (hold_dir && now - scan_hold_since_us >= APLAYER_SCAN_HOLD_US)
+      {
+         int64_t held = now - scan_hold_since_us - APLAYER_SCAN_HOLD_US;
+
+         want_dir = hold_dir;
+         speed    = 4;
+         while (speed < APLAYER_SCAN_MAX_SPEED && held >= APLAYER_SCAN_STEP_US)
+         {
+            speed *= 2;
+            held  -= APLAYER_SCAN_STEP_US;
+         }
+      }
+      else if (environ_cb(RETRO_ENVIRONMENT_GET_FASTFORWARDING, &fast_forward) &&
+            fast_forward)
+         want_dir = 1;
+
+      if (trick_play_active && (!want_dir || want_dir != trick_play_dir))
+      {
+         trick_play_stop();
+         seek_frames = 0;
+      }
+      if (want_dir && !trick_play_active)
+         trick_play_start(want_dir, speed);
+      else if (want_dir && speed != trick_play_speed)
+      {
+         trick_play_speed = speed;
+         if (speed)
+            trick_play_message();
+      }
+   }
+   else if (trick_play_active)
+      trick_play_stop();
+
+   last_left  = left;
+   last_right = right;
+   last_up    = up;
+   last_down  = down;
+   last_start = start;
+   last_a     = a;
+   last_b     = b;
+   last_x     = x;
+   last_y     = y;
+   last_l     = l;
+   last_r     = r;
+   last_l2    = l2;
+   last_r2    = r2;
+
+   // If paused, simply display the last rendered video frame and skip further processing.
+   if (paused) {
+      present_paused_frame();
+      // Do not process audio or advance frames.
+      return;
+   }
+
+   aplayer_consume_playback_restart_pending();
+
+   /* M3U */
+   if (do_seek && seek_time == 0.0 && playlist_count > 0 && !trick_hop_pending)
+   {
+      internal_playlist_reload_pending = true;
+      retro_unload_game();
+      struct retro_game_info next_info = {0};
+      next_info.path = playlist[playlist_index];
+      unsigned  tries = 0;
+      while (tries < playlist_count &&
+             !retro_load_game(&next_info))
+      {
+         /* Advance and try the next entry                       */
+         playlist_index = (playlist_index + 1) % playlist_count;
+         next_info.path = playlist[playlist_index];
+         tries++;
+      }
+
+      if (tries == playlist_count)
+      {
+         internal_playlist_reload_pending = false;
+         struct retro_message_ext m = {
+            .msg = "Playlist finished - no playable entries.",
+            .duration = 5000,
+            .priority = 3,
+            .level = RETRO_LOG_ERROR,
+            .target = RETRO_MESSAGE_TARGET_ALL,
+            .type = RETRO_MESSAGE_TYPE_NOTIFICATION,
+            .progress = -1
+         };
+         environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &m);
+         return;   /* stop running gracefully */
+      }
+      do_seek = false;
+      internal_playlist_reload_pending = false;
+
+      struct retro_system_av_info info;
+      retro_get_system_av_info(&info);
+      environ_cb(RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO, &info);
+   }
+
+   if (reset_triggered)
+   {
+      bool reset_handled = true;
+
+      if (decode_thread_dead)
+         reset_handled = aplayer_reload_current_from_start();
+      else
+      {
+         seek_frames = -1;
+         seek_frame(seek_frames);
+         if (decode_thread_dead)
+            reset_handled = aplayer_reload_current_from_start();
+      }
+
+      if (!reset_handled)
+         log_cb(RETRO_LOG_ERROR, "[APLAYER] Failed to reload media for reset.\n");
+
+      reset_triggered = false;
+   }
+
+   /* Push seek request to thread,
+    * wait for seek to complete. */
+   if (seek_frames)
+      seek_frame(seek_frames);
+
+   if (decode_thread_dead)
+   {
+      video_cb(NULL, 1, 1, sizeof(uint32_t));
+      return;
+   }
+
+   /* The clock holds during trick-play, it is set again from the
+    * keyframe shown when playback resumes. */
+   if (!trick_play_active)
+      aplayer_advance_clock();
+
+   /* Only honoured from retro_run(). Enough for the decode thread to
+    * catch up after a late frame before the device runs dry. */
+   if (audio_latency_pending)
+   {
+      unsigned latency_ms = (unsigned)(APLAYER_AUDIO_LATENCY_FRAMES * 1000.0 /
+            media.interpolate_fps + 0.5);
+
+      environ_cb(RETRO_ENVIRONMENT_SET_MINIMUM_AUDIO_LATENCY, &latency_ms);
+      audio_latency_pending = false;
+   }
+
+   if (present_never_block)
+      wait_deadline = av_gettime_relative() +
+            (int64_t)(APLAYER_PRESENT_WAIT_BUDGET * AV_TIME_BASE / media.interpolate_fps);
+
+   /* Have to decode audio before video
+    * incase there are PTS fuckups due
+    * to seeking. */
+   if (trick_play_active)
+      audio_silence_frames = (size_t)(media.sample_rate / media.interpolate_fps);
+   else if (audio_streams_num > 0)
+   {
+      /* Audio */
+      double reading_pts;
+      double expected_pts;
+      double old_pts_bias;
+      size_t to_read_bytes;
+      size_t avail_bytes = 0;
+      size_t bytes_per_frame = sizeof(int16_t) * 2;
+      uint64_t expected_audio_frames = (uint64_t)(aplayer_clock_time() * media.sample_rate);
+
+      to_read_frames = expected_audio_frames - audio_frames;
+      to_read_bytes = to_read_frames * bytes_per_frame;
+      audio_queue   = &audio_queues[audio_queue_playing];
+
+      if (spsc_ring_fill(audio_queue->ring) < to_read_bytes)
+      {
+         int64_t wait_us;
+
+         slock_lock(fifo_lock);
+         for (;;)
+         {
+            /* Pairs with the fence in audio_queue_publish(). */
+            main_sleeping = true;
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (decode_thread_dead ||
+                  spsc_ring_fill(audio_queue->ring) >= to_read_bytes)
+               break;
+
+            scond_signal(fifo_decode_cond);
+            wait_us = present_wait_us(wait_deadline);
+            if (!wait_us || !scond_wait_timeout(fifo_cond, fifo_lock, wait_us))
+            {
+               if (!audio_wait_timeout_logged)
+               {
+                  log_cb(RETRO_LOG_WARN,
+                        "[APLAYER] Audio decode wait timed out, padding silence.\n");
+                  audio_wait_timeout_logged = true;
+               }
+               stats_late_audio++;
+               break;
+            }
+         }
+         main_sleeping = false;
+         slock_unlock(fifo_lock);
+      }
+
+      /* Flushes requested from here on are applied next run, the
+       * regions peeked below stay the decode thread's to keep. */
+      spsc_ring_begin_read(audio_queue->ring);
+      reading_pts  = audio_queue_clock(audio_queue, &avail_bytes);
+      if (avail_bytes >= to_read_bytes)
+         audio_wait_timeout_logged = false;
+      reading_pts -= (double)avail_bytes / (media.sample_rate * bytes_per_frame);
+      expected_pts = (double)audio_frames / media.sample_rate;
+      old_pts_bias = pts_bias;
+      pts_bias     = reading_pts - expected_pts;
+
+      if (pts_bias < old_pts_bias - 1.0)
+      {
+         log_cb(RETRO_LOG_INFO, "[APLAYER] Resetting PTS (bias).\n");
+         frames[0].pts = 0.0;
+         frames[1].pts = 0.0;
+      }
+
+      if (!decode_thread_dead)
+      {
+         size_t read_bytes   = avail_bytes < to_read_bytes ? avail_bytes : to_read_bytes;
+         size_t region_bytes = 0;
+
+         /* At most two regions when the data wraps around. */
+         audio_region[0] = (const int16_t*)spsc_ring_peek(audio_queue->ring, 0, &region_bytes);
+         if (region_bytes > read_bytes)
+            region_bytes = read_bytes;
+         audio_region_frames[0] = region_bytes / bytes_per_frame;
+
+         if (region_bytes < read_bytes)
+         {
+            size_t rest = 0;
+            audio_region[1] = (const int16_t*)spsc_ring_peek(audio_queue->ring,
+                  region_bytes, &rest);
+            if (rest > read_bytes - region_bytes)
+               rest = read_bytes - region_bytes;
+            audio_region_frames[1] = rest / bytes_per_frame;
+         }
+      }
+      audio_silence_frames = to_read_frames -
+            audio_region_frames[0] - audio_region_frames[1];
+
+      audio_frames += to_read_frames;
+   }
+
+   min_pts = aplayer_clock_time() + pts_bias;
+
+   if (video_stream_index >= 0)
+   {
+      /* Video */
+      float mix_factor;
+      GLfloat quad[16];
+      /* With native timing every run shows the next frame. Aim half a
+       * frame early so jitter in the audio clock cannot fetch two
+       * frames in one run and none in the next. */
+      double native_offset = video_native_timing ? 0.5 / media.interpolate_fps : 0.0;
+
+      min_pts -= native_offset;
+
+      if (trick_play_active)
+         trick_play_run();
+
+      while (!trick_play_active && !decode_thread_dead &&
+            (!frames[1].valid || min_pts > frames[1].pts))
+      {
+         int64_t pts = 0;
+
+         if (!decode_thread_dead)
+         {
+            video_decoder_context_t *ctx = NULL;
+            uint32_t               *pixels = NULL;
+
+            /* With the audio device about to starve, a late frame is
+             * not waited for, the audio has to go out first. */
+            if (!video_buffer_wait_for_finished_slot_timeout(video_buffer,
+                     audio_device_starving ? 0 : present_wait_us(wait_deadline)))
+            {
+               if (aplayer_consume_playback_restart_pending())
+               {
+                  min_pts = aplayer_clock_time() + pts_bias - native_offset;
+                  continue;
+               }
+               if (!video_wait_timeout_logged)
+               {
+                  log_cb(RETRO_LOG_WARN,
+                        "[APLAYER] Video frame wait timed out, reusing last frame.\n");
+                  video_wait_timeout_logged = true;
+               }
+               stats_late_video++;
+               break;
+            }
+
+            if (aplayer_consume_playback_restart_pending())
+               min_pts = aplayer_clock_time() + pts_bias - native_offset;
+
+            /* Only now that a new frame is in, so that a timed out wait
+             * keeps showing the newest frame. */
+            if (frames[1].valid)
+            {
+               struct frame tmp = frames[1];
+               frames[1] = frames[0];
+               frames[0] = tmp;
+            }
+
+            video_buffer_get_finished_slot(video_buffer, &ctx);
+            video_wait_timeout_logged = false;
+            pts                          = ctx->pts;
+            pixels                       = (uint32_t*)ctx->target->data[0];
+
+            ensure_video_textures_allocated(media.width, media.height);
+            glBindTexture(GL_TEXTURE_2D, frames[1].tex);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+                  (GLsizei)media.width, (GLsizei)media.height,
+                  GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            video_buffer_open_slot(video_buffer, ctx);
+            video_upload_seq++;
+         }
+
+         if (pts != AV_NOPTS_VALUE)
+            frames[1].pts = av_q2d(fctx->streams[video_stream_index]->time_base) * pts;
+         else if (frames[0].valid)
+            frames[1].pts = frames[0].pts + (1.0 / media.interpolate_fps);
+         else
+            frames[1].pts = min_pts;
+         frames[1].valid = true;
+      }
+
+      mix_factor = 1.0f;
+      if (!video_native_timing && !trick_play_active &&
+            frames[0].valid && frames[1].valid && frames[1].pts > frames[0].pts)
+      {
+         double mix = (min_pts - frames[0].pts) / (frames[1].pts - frames[0].pts);
+         if (mix < 0.0)
+            mix = 0.0;
+         else if (mix > 1.0)
+            mix = 1.0;
+         mix_factor = 1.0f - (video_blend_strength * (1.0f - (float)mix));
+      }
+
+      /* Same textures, blend and quad as last time: a dupe, which is
+       * most presents of low frame rate video, and all while paused. */
+      get_video_quad(quad);
+      stats_presents++;
+      if (frontend_can_dupe && video_present_valid &&
+            video_presented_seq == video_upload_seq &&
+            video_presented_mix == mix_factor &&
+            !memcmp(quad, video_quad_vertices, sizeof(quad)))
+      {
+         stats_presents_elided++;
+         video_cb(NULL, media.width, media.height, media.width * sizeof(uint32_t));
+         goto video_presented;
+      }
+
+      glBindFramebuffer(GL_FRAMEBUFFER, hw_render.get_current_framebuffer());
+
+      glClearColor(0, 0, 0, 1);
+      glClear(GL_COLOR_BUFFER_BIT);
+      glViewport(0, 0, media.width, media.height);
+
+      glUseProgram(prog);
+
+      glUniform1f(mix_loc, mix_factor);
+      glActiveTexture(GL_TEXTURE1);
+      glBindTexture(GL_TEXTURE_2D, frames[1].tex);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, frames[0].tex);
+
+      if (!video_present_valid || memcmp(quad, video_quad_vertices, sizeof(quad)))
+         update_video_quad(quad);
+      glBindBuffer(GL_ARRAY_BUFFER, vbo);
+      glVertexAttribPointer(vertex_loc, 2, GL_FLOAT, GL_FALSE,
+            4 * sizeof(GLfloat), (const GLvoid*)(0 * sizeof(GLfloat)));
+      glVertexAttribPointer(tex_loc, 2, GL_FLOAT, GL_FALSE,
+            4 * sizeof(GLfloat), (const GLvoid*)(2 * sizeof(GLfloat)));
+      glEnableVertexAttribArray(vertex_loc);
+      glEnableVertexAttribArray(tex_loc);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+      glDisableVertexAttribArray(vertex_loc);
+      glDisableVertexAttribArray(tex_loc);
+
+      glUseProgram(0);
+      glActiveTexture(GL_TEXTURE1);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, 0);
+
+      /* Draw video using OGL*/
+      video_cb(RETRO_HW_FRAME_BUFFER_VALID,
+            media.width, media.height, media.width * sizeof(uint32_t));
+
+      memcpy(video_quad_vertices, quad, sizeof(quad));
+      video_presented_seq = video_upload_seq;
+      video_presented_mix = mix_factor;
+      video_present_valid = true;
+video_presented:
+      ;
+   }
+   else if (cover_art_frame)
+      cover_art_present();
+   else if (fft)
+   {
+      if (fft_enabled)
+      {
+         int64_t now = av_gettime_relative();
+
+         fft_set_resolution(fft, fft_scale_min, fft_scale_max,
+               1000.0 / media.interpolate_fps);
+         if (fft_last_frame_us && !paused)
+            fft_report_frame_time(fft, (double)(now - fft_last_frame_us) / 1000.0);
+         fft_last_frame_us = now;
+
+         fft_step_audio(audio_region[0], audio_region_frames[0]);
+         fft_step_audio(audio_region[1], audio_region_frames[1]);
+         fft_step_audio(NULL, audio_silence_frames);
+         fft_render(fft, hw_render.get_current_framebuffer(), fft_width, fft_height);
+      }
+      else
+      {
+         glBindFramebuffer(GL_FRAMEBUFFER, hw_render.get_current_framebuffer());
+         glViewport(0, 0, fft_width, fft_height);
+         glClearColor(0, 0, 0, 1);
+         glClear(GL_COLOR_BUFFER_BIT);
+      }
+
+      /* Draw music FFT using OGL*/
+      video_cb(RETRO_HW_FRAME_BUFFER_VALID,
+            fft_width, fft_height, fft_width * sizeof(uint32_t));
+   }
+   else if (cpu_fft && cpu_fft_frame_prepare())
+   {
+      if (fft_enabled)
+      {
+         fft_step_audio(audio_region[0], audio_region_frames[0]);
+         fft_step_audio(audio_region[1], audio_region_frames[1]);
+         fft_step_audio(NULL, audio_silence_frames);
+         cpu_fft_render(cpu_fft, cpu_fft_frame, fft_width, fft_height,
+               fft_width * sizeof(uint32_t));
+      }
+      else
+         memset(cpu_fft_frame, 0, cpu_fft_frame_size);
+
+      /* Draw music FFT using the CPU */
+      if (hw_render_enabled)
+      {
+         cpu_fft_present_gl();
+         video_cb(RETRO_HW_FRAME_BUFFER_VALID,
+               fft_width, fft_height, fft_width * sizeof(uint32_t));
+      }
+      else
+         video_cb(cpu_fft_frame, fft_width, fft_height,
+               fft_width * sizeof(uint32_t));
+   }
+   else
+   {
+      /* Draw music not using FFT and not using OGL */
+      video_cb(NULL, 1, 1, sizeof(uint32_t));
+   }
+   audio_submit_run(audio_region, audio_region_frames, audio_silence_frames);
+   if (audio_queue)
+   {
+      spsc_ring_consume(audio_queue->ring,
+            (audio_region_frames[0] + audio_region_frames[1]) * sizeof(int16_t) * 2);
+      if (audio_region_frames[0] + audio_region_frames[1])
+         audio_ring_wake_producer();
+   }
+   if (audio_queue)
+      audio_standby_trim((double)audio_frames / media.sample_rate + pts_bias);
+}
+
+static bool open_codec(AVCodecContext **ctx, enum AVMediaType type, unsigned index)
+{
+   int ret              = 0;
+   const AVCodec *codec = avcodec_find_decoder(fctx->streams[index]->codecpar->codec_id);
+   if (!codec)
+   {
+      log_cb(RETRO_LOG_ERROR, "[APLAYER] Couldn't find suitable decoder\n");
+      return false;
+   }
+
+   *ctx = avcodec_alloc_context3(codec);
+   avcodec_parameters_to_context((*ctx), fctx->streams[index]->codecpar);
+
+   if (type == AVMEDIA_TYPE_VIDEO)
+   {
+      video_stream_index = index;
+      (*ctx)->thread_type  = FF_THREAD_FRAME;
+      (*ctx)->thread_count = sw_decoder_threads;
+      log_cb(RETRO_LOG_INFO, "[APLAYER] Using SW decoding.\n");
+      log_cb(RETRO_LOG_INFO, "[APLAYER] Configured software decoding threads: %d\n", sw_decoder_threads);
+   }
+
+   if ((ret = avcodec_open2(*ctx, codec, NULL)) < 0)
+   {
+      log_cb(RETRO_LOG_ERROR, "[APLAYER] Could not open codec: %s\n", av_err2str(ret));
+      return false;
+   }
+
+   return true;
+}
+
+/* Decodes the attached picture of cover_art_stream and scales it,
+ * letterboxed, into a new fft_width x fft_height frame. */
+static bool cover_art_load(void)
+{
+   int ret;
+   AVStream *stream         = fctx->streams[cover_art_stream];
+   const AVCodec *codec     = avcodec_find_decoder(stream->codecpar->codec_id);
+   AVCodecContext *ctx      = NULL;
+   AVFrame *frame           = NULL;
+   struct SwsContext *sws   = NULL;
+   bool ok                  = false;
+   unsigned width;
+   unsigned height;
+   uint8_t *dst[4]          = {NULL};
+   int dst_linesize[4]      = {0};
+
+   if (!codec || !(ctx = avcodec_alloc_context3(codec)) ||
+         !(frame = av_frame_alloc()))
+      goto end;
+
+   avcodec_parameters_to_context(ctx, stream->codecpar);
+   if ((ret = avcodec_open2(ctx, codec, NULL)) < 0 ||
+         (ret = avcodec_send_packet(ctx, &stream->attached_pic)) < 0 ||
+         (ret = avcodec_receive_frame(ctx, frame)) < 0)
+   {
+      log_cb(RETRO_LOG_WARN, "[APLAYER] Could not decode cover art: %s\n",
+            av_err2str(ret));
+      goto end;
+   }
+
+   if (frame->width <= 0 || frame->height <= 0)
+      goto end;
+
+   /* Fit the output, keeping the aspect ratio. */
+   width  = fft_width;
+   height = (unsigned)((uint64_t)fft_width * frame->height / frame->width);
+   if (height > fft_height)
+   {
+      height = fft_height;
+      width  = (unsigned)((uint64_t)fft_height * frame->width / frame->height);
+   }
+   width  = MAX(width, 1);
+   height = MAX(height, 1);
+
+   sws = sws_getContext(frame->width, frame->height, (enum AVPixelFormat)frame->format,
+         width, height, AV_PIX_FMT_RGB32, SWS_BICUBIC, NULL, NULL, NULL);
+   cover_art_frame = (uint32_t*)calloc((size_t)fft_width * fft_height, sizeof(uint32_t));
+   if (!sws || !cover_art_frame)
+      goto end;
+
+   dst[0]          = (uint8_t*)(cover_art_frame +
+         (fft_height - height) / 2 * fft_width + (fft_width - width) / 2);
+   dst_linesize[0] = fft_width * sizeof(uint32_t);
+   sws_scale(sws, (const uint8_t* const*)frame->data, frame->linesize,
+         0, frame->height, dst, dst_linesize);
+
+   log_cb(RETRO_LOG_INFO, "[APLAYER] Cover art: %dx%d %s, shown at %ux%u.\n",
+         frame->width, frame->height, avcodec_get_name(stream->codecpar->codec_id),
+         width, height);
+   ok = true;
+
+end:
+   if (!ok)
+   {
+      free(cover_art_frame);
+      cover_art_frame = NULL;
+   }
+   sws_freeContext(sws);
+   av_frame_free(&frame);
+   avcodec_free_context(&ctx);
+   return ok;
+}
+
+static bool codec_is_image(enum AVCodecID id)
+{
+   switch (id)
+   {
+      case AV_CODEC_ID_MJPEG:
+      case AV_CODEC_ID_PNG:
+      case AV_CODEC_ID_GIF:
+      case AV_CODEC_ID_BMP:
+         return true;
+
+      default:
+         break;
+   }
+
+   return false;
+}
+
+static bool codec_id_is_ttf(enum AVCodecID id)
+{
+   switch (id)
+   {
+      case AV_CODEC_ID_TTF:
+         return true;
+
+      default:
+         break;
+   }
+
+   return false;
+}
+
+static bool codec_id_is_ass(enum AVCodecID id)
+{
+   switch (id)
+   {
+      case AV_CODEC_ID_ASS:
+      case AV_CODEC_ID_SSA:
+         return true;
+      default:
+         break;
+   }
+
+   return false;
+}
+
+static bool codec_id_is_text_subtitle(enum AVCodecID id)
+{
+#ifdef AV_CODEC_PROP_TEXT_SUBTITLE
+   const AVCodecDescriptor *desc = avcodec_descriptor_get(id);
+   if (desc && (desc->props & AV_CODEC_PROP_TEXT_SUBTITLE))
+      return true;
+#endif
+   switch (id)
+   {
+      case AV_CODEC_ID_SUBRIP:
+      case AV_CODEC_ID_TEXT:
+      case AV_CODEC_ID_WEBVTT:
+      case AV_CODEC_ID_MOV_TEXT:
+         return true;
+      default:
+         break;
+   }
+
+   return false;
+}
+
+static bool codec_name_is_text_subtitle(enum AVCodecID id)
+{
+   const char *name = avcodec_get_name(id);
+
+   if (!name)
+      return false;
+
+   if (strcmp(name, "subrip") == 0 ||
+         strcmp(name, "srt") == 0 ||
+         strcmp(name, "webvtt") == 0 ||
+         strcmp(name, "mov_text") == 0 ||
+         strcmp(name, "text") == 0)
+      return true;
+
+   return false;
+}
+
+static bool codec_id_is_bitmap_subtitle(enum AVCodecID id)
+{
+   switch (id)
+   {
+      case AV_CODEC_ID_DVD_SUBTITLE:
+      case AV_CODEC_ID_DVB_SUBTITLE:
+      case AV_CODEC_ID_HDMV_PGS_SUBTITLE:
+      case AV_CODEC_ID_XSUB:
+         return true;
+      default:
+         break;
+   }
+
+   return false;
+}
 
-   // If paused, simply display the last rendered video frame and skip further processing.
-   if (paused) {
-      video_cb(RETRO_HW_FRAME_BUFFER_VALID, media.width, media.height, media.width * sizeof(uint32_t));
-      // Do not process audio or advance frames.
+static void subtitle_store_codec_private(unsigned slot, AVCodecContext *ctx, bool is_text)
+{
+   const uint8_t *src = NULL;
+   size_t size = 0;
+   bool has_native_header = false;
+
+   if (slot >= MAX_STREAMS || !ctx)
       return;
+
+   av_freep(&ass_extra_data[slot]);
+   ass_extra_data_size[slot] = 0;
+   subtitle_uses_native_text_header[slot] = false;
+
+   if (is_text && ctx->subtitle_header && ctx->subtitle_header_size > 0)
+   {
+      src = (const uint8_t*)ctx->subtitle_header;
+      size = (size_t)ctx->subtitle_header_size;
+      has_native_header = true;
+   }
+   else if (ctx->extradata && ctx->extradata_size > 0)
+   {
+      src = ctx->extradata;
+      size = (size_t)ctx->extradata_size;
    }
 
-   aplayer_consume_playback_restart_pending();
+   if (!src || size == 0)
+      return;
 
-   /* M3U */
-   if (do_seek && seek_time == 0.0 && playlist_count > 0)
+   ass_extra_data[slot] = (uint8_t*)av_malloc(size);
+   if (!ass_extra_data[slot])
+      return;
+
+   memcpy(ass_extra_data[slot], src, size);
+   ass_extra_data_size[slot] = size;
+   subtitle_uses_native_text_header[slot] = has_native_header;
+}
+
+/* Opens a decoder for @par, which belongs to the caller's own format
+ * context: the backfill thread must not touch fctx. */
+static bool open_subtitle_codec(AVCodecContext **ctx,
+      const AVCodecParameters *par, bool is_text)
+{
+   bool use_text_opts = is_text;
+   const AVCodec *codec = avcodec_find_decoder(par->codec_id);
+
+   if (!codec)
    {
-      internal_playlist_reload_pending = true;
-      retro_unload_game();
-      struct retro_game_info next_info = {0};
-      next_info.path = playlist[playlist_index];
-      unsigned  tries = 0;
-      while (tries < playlist_count &&
-             !retro_load_game(&next_info))
+      log_cb(RETRO_LOG_ERROR, "[APLAYER] Couldn't find suitable subtitle decoder\n");
+      return false;
+   }
+
+   do
+   {
+      int ret = 0;
+      AVDictionary *opts = NULL;
+
+      *ctx = avcodec_alloc_context3(codec);
+      if (!*ctx)
+         return false;
+
+      ret = avcodec_parameters_to_context(*ctx, par);
+      if (ret < 0)
       {
-         /* Advance and try the next entry                       */
-         playlist_index = (playlist_index + 1) % playlist_count;
-         next_info.path = playlist[playlist_index];
-         tries++;
+         avcodec_free_context(ctx);
+         return false;
       }
 
-      if (tries == playlist_count)
+      if (use_text_opts)
       {
-         internal_playlist_reload_pending = false;
-         struct retro_message_ext m = {
-            .msg = "Playlist finished - no playable entries.",
-            .duration = 5000,
-            .priority = 3,
-            .level = RETRO_LOG_ERROR,
-            .target = RETRO_MESSAGE_TARGET_ALL,
-            .type = RETRO_MESSAGE_TYPE_NOTIFICATION,
-            .progress = -1
-         };
-         environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE_EXT, &m);
-         return;   /* stop running gracefully */
+         av_dict_set(&opts, "sub_text_format", "ass", 0);
+         av_dict_set(&opts, "flags2", "+ass_ro_flush_noop", 0);
+#ifdef FF_SUB_CHARENC_MODE_IGNORE
+         (*ctx)->sub_charenc_mode = FF_SUB_CHARENC_MODE_IGNORE;
+#endif
       }
-      do_seek = false;
-      internal_playlist_reload_pending = false;
 
-      struct retro_system_av_info info;
-      retro_get_system_av_info(&info);
-      environ_cb(RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO, &info);
-   }
+      ret = avcodec_open2(*ctx, codec, &opts);
+      av_dict_free(&opts);
 
-   if (reset_triggered)
-   {
-      bool reset_handled = true;
+      if (ret >= 0)
+         return true;
 
-      if (decode_thread_dead)
-         reset_handled = aplayer_reload_current_from_start();
-      else
+      avcodec_free_context(ctx);
+      if (!use_text_opts)
       {
-         seek_frames = -1;
-         seek_frame(seek_frames);
-         if (decode_thread_dead)
-            reset_handled = aplayer_reload_current_from_start();
+         log_cb(RETRO_LOG_ERROR, "[APLAYER] Could not open subtitle codec: %s\n",
+               av_err2str(ret));
+         return false;
       }
 
-      if (!reset_handled)
-         log_cb(RETRO_LOG_ERROR, "[APLAYER] Failed to reload media for reset.\n");
+      log_cb(RETRO_LOG_WARN,
+            "[APLAYER] Retrying text subtitle decoder without ASS conversion options: %s\n",
+            av_err2str(ret));
+      use_text_opts = false;
+   } while (true);
 
-      reset_triggered = false;
+   return false;
+}
+
+static void ass_init_default_track(ASS_Track *track)
+{
+   unsigned play_res_x = subtitle_text_playres_x;
+   unsigned play_res_y = subtitle_text_playres_y;
+   const char *font_name = subtitle_font_name ? subtitle_font_name : "sans-serif";
+   int font_bold = 0;
+   unsigned font_size = 16;
+   char header[1024];
+   int len = snprintf(header, sizeof(header),
+         "[Script Info]\n"
+         "ScriptType: v4.00+\n"
+         "PlayResX: %u\n"
+         "PlayResY: %u\n"
+         "\n"
+         "[V4+ Styles]\n"
+         "Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, OutlineColour, BackColour, Bold, Italic, Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, BorderStyle, Outline, Shadow, Alignment, MarginL, MarginR, MarginV, Encoding\n"
+         "Style: Default,%s,%u,&H00FFFFFF,&H000000FF,&H00000000,&H64000000,%d,0,0,0,100,100,0,0,1,2,0,2,20,20,20,1\n"
+         "\n"
+         "[Events]\n"
+         "Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text\n",
+         play_res_x, play_res_y, font_name, font_size, font_bold);
+
+   if (len <= 0)
+      return;
+   if ((size_t)len >= sizeof(header))
+      len = (int)sizeof(header) - 1;
+
+   ass_process_codec_private(track, header, len);
+}
+
+static void ass_init_subtitle_track(ASS_Track *track, unsigned slot)
+{
+   if (!track || slot >= MAX_STREAMS)
+      return;
+
+   if (ass_extra_data_size[slot] > 0)
+      ass_process_codec_private(track, (char*)ass_extra_data[slot], ass_extra_data_size[slot]);
+
+   if (track->n_styles == 0)
+      ass_init_default_track(track);
+
+   if (subtitle_track_is_text(slot))
+      ass_update_text_track_styles(track);
+
+#ifdef LIBASS_VERSION
+#if LIBASS_VERSION >= 0x01302000
+   ass_set_check_readorder(track, 1);
+#endif
+#endif
+}
+
+static int subtitle_slot_for_stream(int stream_index)
+{
+   for (int i = 0; i < subtitle_streams_num; i++)
+   {
+      if (subtitle_streams[i] == stream_index)
+         return i;
    }
 
-   /* Push seek request to thread,
-    * wait for seek to complete. */
-   if (seek_frames)
-      seek_frame(seek_frames);
+   return -1;
+}
+
+static int audio_slot_for_stream(int stream_index)
+{
+   for (int i = 0; i < audio_streams_num; i++)
+   {
+      if (audio_streams[i] == stream_index)
+         return i;
+   }
+
+   return -1;
+}
+
+static void audio_packet_buffer_drop_stale(packet_buffer_t *buffer,
+      double timebase, double target_time)
+{
+   if (!buffer || timebase <= 0.0)
+      return;
+
+   while (!packet_buffer_empty(buffer))
+   {
+      int64_t end_pts = packet_buffer_peek_end_pts(buffer);
+      if (end_pts == AV_NOPTS_VALUE || end_pts < 0)
+         break;
+      if ((double)end_pts * timebase >= target_time)
+         break;
+      packet_buffer_drop_packet(buffer);
+   }
+}
 
-   if (decode_thread_dead)
+static void subtitle_text_timing_reset(void)
+{
+   unsigned i;
+
+   for (i = 0; i < MAX_STREAMS; i++)
    {
-      video_cb(NULL, 1, 1, sizeof(uint32_t));
-      return;
+      subtitle_text_pending_ms[i] = INT64_MIN;
+      subtitle_text_latest_ms[i]  = INT64_MIN;
    }
+}
 
-   frame_cnt++;
+static bool open_codecs(void)
+{
+   unsigned i;
+   decode_thread_lock   = slock_new();
 
-   /* Have to decode audio before video
-    * incase there are PTS fuckups due
-    * to seeking. */
-   if (audio_streams_num > 0)
-   {
-      /* Audio */
-      double reading_pts;
-      double expected_pts;
-      double old_pts_bias;
-      size_t to_read_bytes;
-      size_t bytes_per_frame = sizeof(int16_t) * 2;
-      uint64_t expected_audio_frames = frame_cnt * media.sample_rate / media.interpolate_fps;
+   video_stream_index   = -1;
+   audio_streams_num    = 0;
+   subtitle_streams_num = 0;
 
-      to_read_frames = expected_audio_frames - audio_frames;
-      to_read_bytes = to_read_frames * bytes_per_frame;
+   slock_lock(decode_thread_lock);
+   audio_streams_ptr    = 0;
+   subtitle_streams_ptr = SUBTITLE_STREAM_DISABLED;
+   slock_unlock(decode_thread_lock);
 
-      slock_lock(fifo_lock);
-      while (!decode_thread_dead && FIFO_READ_AVAIL(audio_decode_fifo) < to_read_bytes)
+   memset(audio_streams,    0, sizeof(audio_streams));
+   memset(subtitle_streams, 0, sizeof(subtitle_streams));
+   memset(subtitle_is_ass,  0, sizeof(subtitle_is_ass));
+   memset(subtitle_is_bitmap, 0, sizeof(subtitle_is_bitmap));
+   memset(subtitle_is_external, 0, sizeof(subtitle_is_external));
+   memset(subtitle_uses_native_text_header, 0, sizeof(subtitle_uses_native_text_header));
+   first_subtitle_event_logged = false;
+   first_ass_render_logged = false;
+   memset(first_ass_image_logged, 0, sizeof(first_ass_image_logged));
+   memset(first_ass_after_sub_logged, 0, sizeof(first_ass_after_sub_logged));
+   for (i = 0; i < MAX_STREAMS; i++)
+      first_subtitle_start_ms[i] = -1;
+   subtitle_text_timing_reset();
+
+   for (i = 0; i < fctx->nb_streams; i++)
+   {
+      enum AVMediaType type = fctx->streams[i]->codecpar->codec_type;
+      switch (type)
       {
-         main_sleeping = true;
-         scond_signal(fifo_decode_cond);
-         if (!scond_wait_timeout(fifo_cond, fifo_lock, 2000))
-         {
-            main_sleeping = false;
-            if (!audio_wait_timeout_logged)
+         case AVMEDIA_TYPE_AUDIO:
+            if (audio_streams_num < MAX_STREAMS)
             {
-               log_cb(RETRO_LOG_WARN,
-                     "[APLAYER] Audio decode wait timed out, padding silence.\n");
-               audio_wait_timeout_logged = true;
+               if (!open_codec(&actx[audio_streams_num], type, i))
+                  return false;
+               audio_streams[audio_streams_num] = i;
+               audio_streams_num++;
             }
             break;
-         }
-         main_sleeping = false;
-      }
-      if (FIFO_READ_AVAIL(audio_decode_fifo) >= to_read_bytes)
-         audio_wait_timeout_logged = false;
-      reading_pts  = decode_last_audio_time -
-         (double)FIFO_READ_AVAIL(audio_decode_fifo) / (media.sample_rate * bytes_per_frame);
-      expected_pts = (double)audio_frames / media.sample_rate;
-      old_pts_bias = pts_bias;
-      pts_bias     = reading_pts - expected_pts;
-
-      if (pts_bias < old_pts_bias - 1.0)
-      {
-         log_cb(RETRO_LOG_INFO, "[APLAYER] Resetting PTS (bias).\n");
-         frames[0].pts = 0.0;
-         frames[1].pts = 0.0;
-      }
-
-      if (!decode_thread_dead)
-      {
-         size_t avail_bytes = FIFO_READ_AVAIL(audio_decode_fifo);
-         size_t read_bytes = avail_bytes < to_read_bytes ? avail_bytes : to_read_bytes;
-         size_t read_frames = read_bytes / bytes_per_frame;
 
-         if (read_bytes)
-            fifo_read(audio_decode_fifo, audio_buffer, read_bytes);
-         if (read_frames < to_read_frames)
-         {
-            memset(audio_buffer + (read_frames * 2), 0,
-                  (to_read_frames - read_frames) * bytes_per_frame);
-         }
-      }
-      scond_signal(fifo_decode_cond);
+         case AVMEDIA_TYPE_VIDEO:
+            if (fctx->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC)
+            {
+               if (cover_art_stream < 0 && fctx->streams[i]->attached_pic.size > 0)
+                  cover_art_stream = i;
+            }
+            else if (!vctx
+                  && !codec_is_image(fctx->streams[i]->codecpar->codec_id))
+            {
+               if (!open_codec(&vctx, type, i))
+                  return false;
+            }
+            break;
 
-      slock_unlock(fifo_lock);
-      audio_frames += to_read_frames;
-   }
+         case AVMEDIA_TYPE_SUBTITLE:
+            if (subtitle_streams_num < MAX_STREAMS)
+            {
+               unsigned slot = subtitle_streams_num;
+               AVCodecContext **s = &sctx[slot];
+               const enum AVCodecID sub_id = fctx->streams[i]->codecpar->codec_id;
+               const char *codec_name = avcodec_get_name(sub_id);
+               bool is_ass = codec_id_is_ass(sub_id);
+               bool is_text = codec_id_is_text_subtitle(sub_id) ||
+                     codec_name_is_text_subtitle(sub_id);
+               bool is_bitmap = codec_id_is_bitmap_subtitle(sub_id);
 
-   min_pts = frame_cnt / media.interpolate_fps + pts_bias;
+               log_cb(RETRO_LOG_INFO, "[APLAYER] Found subtitle stream %u: %s\n",
+                     i, codec_name ? codec_name : "unknown");
 
-   if (video_stream_index >= 0)
-   {
-      /* Video */
-      float mix_factor;
+               if (!is_ass && !is_text && !is_bitmap)
+               {
+                  log_cb(RETRO_LOG_WARN, "[APLAYER] Subtitle codec not supported: %s\n",
+                        codec_name ? codec_name : "unknown");
+                  break;
+               }
 
-      while (!decode_thread_dead && (!frames[1].valid || min_pts > frames[1].pts))
-      {
-         int64_t pts = 0;
+               subtitle_streams[slot] = i;
+               subtitle_is_ass[slot] = is_ass;
+               subtitle_is_bitmap[slot] = is_bitmap;
+               if (!open_subtitle_codec(s, fctx->streams[i]->codecpar, is_text))
+                  return false;
 
-         if (frames[1].valid)
-         {
-            struct frame tmp = frames[1];
-            frames[1] = frames[0];
-            frames[0] = tmp;
-         }
+               if (!is_bitmap)
+                  subtitle_store_codec_private(slot, *s, is_text);
 
-         if (!decode_thread_dead)
-         {
-            video_decoder_context_t *ctx = NULL;
-            uint32_t               *pixels = NULL;
+               subtitle_streams_num++;
+               log_cb(RETRO_LOG_INFO, "[APLAYER] Subtitle stream %u registered: %s (%s)\n",
+                     i, codec_name ? codec_name : "unknown",
+                     is_ass ? "ass" : (is_bitmap ? "bitmap" : "text"));
+            }
+            break;
 
-            if (!video_buffer_wait_for_finished_slot(video_buffer))
+         case AVMEDIA_TYPE_ATTACHMENT:
             {
-               if (aplayer_consume_playback_restart_pending())
-               {
-                  min_pts = frame_cnt / media.interpolate_fps + pts_bias;
-                  continue;
-               }
-               if (!video_wait_timeout_logged)
-               {
-                  log_cb(RETRO_LOG_WARN,
-                        "[APLAYER] Video frame wait timed out, reusing last frame.\n");
-                  video_wait_timeout_logged = true;
-               }
-               break;
+               AVCodecParameters *params = fctx->streams[i]->codecpar;
+               if (codec_id_is_ttf(params->codec_id))
+                  append_attachment(params->extradata, params->extradata_size);
             }
+            break;
 
-            if (aplayer_consume_playback_restart_pending())
-               min_pts = frame_cnt / media.interpolate_fps + pts_bias;
-
-            video_buffer_get_finished_slot(video_buffer, &ctx);
-            video_wait_timeout_logged = false;
-            pts                          = ctx->pts;
-            pixels                       = (uint32_t*)ctx->target->data[0];
+         default:
+            break;
+      }
+   }
 
-            double render_time = min_pts;
-            if (pts != AV_NOPTS_VALUE)
-               render_time = av_q2d(fctx->streams[video_stream_index]->time_base) * pts;
-            render_subtitles_on_buffer(pixels, media.width,
-                  media.height, render_time);
+   if (audio_streams_num > 0)
+      audio_streams_ptr = audio_select_initial_stream_ptr();
 
-            ensure_video_textures_allocated(media.width, media.height);
-            glBindTexture(GL_TEXTURE_2D, frames[1].tex);
-            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
-                  (GLsizei)media.width, (GLsizei)media.height,
-                  GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-            glBindTexture(GL_TEXTURE_2D, 0);
-            video_buffer_open_slot(video_buffer, ctx);
-         }
+   return actx[0] || vctx;
+}
 
-         if (pts != AV_NOPTS_VALUE)
-            frames[1].pts = av_q2d(fctx->streams[video_stream_index]->time_base) * pts;
-         else if (frames[0].valid)
-            frames[1].pts = frames[0].pts + (1.0 / media.interpolate_fps);
-         else
-            frames[1].pts = min_pts;
-         frames[1].valid = true;
-      }
+static bool init_media_info(void)
+{
+   AVCodecContext *audio_ctx = actx[0];
+   unsigned target_rate      = 0;
 
-      mix_factor = 1.0f;
-      if (frames[0].valid && frames[1].valid && frames[1].pts > frames[0].pts)
-      {
-         double mix = (min_pts - frames[0].pts) / (frames[1].pts - frames[0].pts);
-         if (mix < 0.0)
-            mix = 0.0;
-         else if (mix > 1.0)
-            mix = 1.0;
-         mix_factor = 1.0f - (video_blend_strength * (1.0f - (float)mix));
-      }
+   if (audio_streams_num > 0 && actx[audio_streams_ptr])
+      audio_ctx = actx[audio_streams_ptr];
 
-      glBindFramebuffer(GL_FRAMEBUFFER, hw_render.get_current_framebuffer());
+   /* Resample once, straight to the rate the frontend outputs at, so it
+    * does not convert a second time. Every track is converted to this
+    * rate, whatever its own. */
+   if (audio_ctx && environ_cb(RETRO_ENVIRONMENT_GET_TARGET_SAMPLE_RATE, &target_rate) &&
+         target_rate > 0)
+   {
+      media.sample_rate = target_rate;
+      log_cb(RETRO_LOG_INFO, "[APLAYER] Audio output rate: %u Hz (frontend).\n",
+            target_rate);
+   }
+   else if (audio_ctx && audio_ctx->sample_rate > 0)
+      media.sample_rate = audio_ctx->sample_rate;
+   else if (audio_ctx)
+      log_cb(RETRO_LOG_WARN,
+            "[APLAYER] Invalid audio sample rate (%d), using default %u.\n",
+            audio_ctx->sample_rate, media.sample_rate);
 
-      glClearColor(0, 0, 0, 1);
-      glClear(GL_COLOR_BUFFER_BIT);
-      glViewport(0, 0, media.width, media.height);
+   if (vctx)
+   {
+      media.width  = vctx->width;
+      media.height = vctx->height;
+      init_aspect_ratio();
+   }
 
-      glUseProgram(prog);
+   media.interpolate_fps = aplayer_get_content_refresh_rate();
 
-      glUniform1f(mix_loc, mix_factor);
-      glActiveTexture(GL_TEXTURE1);
-      glBindTexture(GL_TEXTURE_2D, frames[1].tex);
-      glActiveTexture(GL_TEXTURE0);
-      glBindTexture(GL_TEXTURE_2D, frames[0].tex);
+   if (fctx)
+   {
+      double duration_sec = 0.0;
 
-      update_video_quad();
-      glBindBuffer(GL_ARRAY_BUFFER, vbo);
-      glVertexAttribPointer(vertex_loc, 2, GL_FLOAT, GL_FALSE,
-            4 * sizeof(GLfloat), (const GLvoid*)(0 * sizeof(GLfloat)));
-      glVertexAttribPointer(tex_loc, 2, GL_FLOAT, GL_FALSE,
-            4 * sizeof(GLfloat), (const GLvoid*)(2 * sizeof(GLfloat)));
-      glEnableVertexAttribArray(vertex_loc);
-      glEnableVertexAttribArray(tex_loc);
-      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      if (fctx->duration != AV_NOPTS_VALUE && fctx->duration > 0)
+      {
+         int64_t duration = fctx->duration + (fctx->duration <= INT64_MAX - 5000 ? 5000 : 0);
+         duration_sec = (double)(duration / AV_TIME_BASE);
+      }
 
-      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-      glDisableVertexAttribArray(vertex_loc);
-      glDisableVertexAttribArray(tex_loc);
+      if (!duration_is_valid(duration_sec) && audio_streams_num > 0)
+         duration_sec = stream_duration_seconds(audio_streams[0]);
 
-      glUseProgram(0);
-      glActiveTexture(GL_TEXTURE1);
-      glBindTexture(GL_TEXTURE_2D, 0);
-      glActiveTexture(GL_TEXTURE0);
-      glBindTexture(GL_TEXTURE_2D, 0);
+      if (!duration_is_valid(duration_sec) && video_stream_index >= 0)
+         duration_sec = stream_duration_seconds(video_stream_index);
 
-      /* Draw video using OGL*/
-      video_cb(RETRO_HW_FRAME_BUFFER_VALID,
-            media.width, media.height, media.width * sizeof(uint32_t));
+      if (duration_is_valid(duration_sec))
+      {
+         media.duration.time     = duration_sec;
+         media.duration.seconds  = (unsigned)media.duration.time;
+         media.duration.minutes  = media.duration.seconds / 60;
+         media.duration.seconds %= 60;
+         media.duration.hours    = media.duration.minutes / 60;
+         media.duration.minutes %= 60;
+      }
+      else
+      {
+         media.duration.time    = 0.0;
+         media.duration.hours   = 0;
+         media.duration.minutes = 0;
+         media.duration.seconds = 0;
+         log_cb(RETRO_LOG_WARN, "[APLAYER] Could not determine media duration\n");
+      }
    }
-   else if (fft)
+
+   int type = get_media_type();
+
+   switch (type)
    {
-      if (fft_enabled)
+      case MEDIA_TYPE_AUDIO:
       {
-         unsigned       frames = to_read_frames;
-         const int16_t *buffer = audio_buffer;
-
-         while (frames)
+         for (int i = 0; i < fctx->nb_streams; i++)
          {
-            unsigned to_read = frames;
-
-            /* FFT size we use (1 << 11). Really shouldn't happen,
-             * unless we use a crazy high sample rate. */
-            if (to_read > (1 << 11))
-               to_read = 1 << 11;
-
-            fft_step_fft(fft, buffer, to_read);
-            buffer += to_read * 2;
-            frames -= to_read;
+            if (fctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+            {
+               media.title = av_dict_get(fctx->streams[i]->metadata, "title", NULL, 0);
+            }
          }
-         fft_render(fft, hw_render.get_current_framebuffer(), fft_width, fft_height);
+         break;
       }
-      else
+      case MEDIA_TYPE_VIDEO:
+         media.title = av_dict_get(fctx->metadata, "title", media.title, 0);
+         break;
+      default:
+         break;
+   }
+
+   display_media_title();
+
+   if (sctx[0])
+   {
+      unsigned i;
+      bool need_ass_context = false;
+
+      for (i = 0; i < (unsigned)subtitle_streams_num; i++)
       {
-         glBindFramebuffer(GL_FRAMEBUFFER, hw_render.get_current_framebuffer());
-         glViewport(0, 0, fft_width, fft_height);
-         glClearColor(0, 0, 0, 1);
-         glClear(GL_COLOR_BUFFER_BIT);
+         if (!subtitle_track_is_bitmap(i))
+         {
+            need_ass_context = true;
+            break;
+         }
       }
 
-      /* Draw music FFT using OGL*/
-      video_cb(RETRO_HW_FRAME_BUFFER_VALID,
-            fft_width, fft_height, fft_width * sizeof(uint32_t));
-   }
-   else
-   {
-      /* Draw music not using FFT and not using OGL */
-      video_cb(NULL, 1, 1, sizeof(uint32_t));
-   }
-   if (to_read_frames)
-      audio_batch_cb(audio_buffer, to_read_frames);
-}
+      if (!need_ass_context)
+         return true;
 
-static bool open_codec(AVCodecContext **ctx, enum AVMediaType type, unsigned index)
-{
-   int ret              = 0;
-   const AVCodec *codec = avcodec_find_decoder(fctx->streams[index]->codecpar->codec_id);
-   if (!codec)
-   {
-      log_cb(RETRO_LOG_ERROR, "[APLAYER] Couldn't find suitable decoder\n");
-      return false;
-   }
+      ass = ass_library_init();
+      ass_set_message_cb(ass, ass_msg_cb, NULL);
 
-   *ctx = avcodec_alloc_context3(codec);
-   avcodec_parameters_to_context((*ctx), fctx->streams[index]->codecpar);
+      for (i = 0; i < attachments_size; i++)
+         ass_add_font(ass, (char*)"",
+               (char*)attachments[i].data, attachments[i].size);
 
-   if (type == AVMEDIA_TYPE_VIDEO)
-   {
-      video_stream_index = index;
-      (*ctx)->thread_type  = FF_THREAD_FRAME;
-      (*ctx)->thread_count = sw_decoder_threads;
-      log_cb(RETRO_LOG_INFO, "[APLAYER] Using SW decoding.\n");
-      log_cb(RETRO_LOG_INFO, "[APLAYER] Configured software decoding threads: %d\n", sw_decoder_threads);
-   }
+      ass_set_extract_fonts(ass, true);
+      update_subtitle_font_settings();
 
-   if ((ret = avcodec_open2(*ctx, codec, NULL)) < 0)
-   {
-      log_cb(RETRO_LOG_ERROR, "[APLAYER] Could not open codec: %s\n", av_err2str(ret));
-      return false;
+      for (i = 0; i < (unsigned)subtitle_streams_num; i++)
+      {
+         if (subtitle_track_is_bitmap(i))
+            continue;
+
+         ass_track[i] = ass_new_track(ass);
+         if (ass_track[i])
+            ass_init_subtitle_track(ass_track[i], i);
+      }
    }
 
    return true;
 }
 
-static bool codec_is_image(enum AVCodecID id)
+static void set_colorspace(struct SwsContext *sws,
+      unsigned width, unsigned height,
+      enum AVColorSpace default_color, int in_range)
 {
-   switch (id)
-   {
-      case AV_CODEC_ID_MJPEG:
-      case AV_CODEC_ID_PNG:
-      case AV_CODEC_ID_GIF:
-      case AV_CODEC_ID_BMP:
-         return true;
+   const int *coeffs = NULL;
+   const int *fallback_coeffs = sws_getCoefficients(SWS_CS_DEFAULT);
+   int in_full = 0;
+   int out_full = 0;
+   int brightness = 0;
+   int contrast = 1 << 16;
+   int saturation = 1 << 16;
+   const int *inv_table = fallback_coeffs;
+   const int *table = fallback_coeffs;
+   int ret;
 
-      default:
-         break;
-   }
+   if (!sws || !fallback_coeffs)
+      return;
 
-   return false;
-}
+   if (default_color != AVCOL_SPC_UNSPECIFIED)
+      coeffs = sws_getCoefficients(default_color);
+   else if (width >= 1280 || height > 576)
+      coeffs = sws_getCoefficients(AVCOL_SPC_BT709);
+   else
+      coeffs = sws_getCoefficients(AVCOL_SPC_BT470BG);
 
-static bool codec_id_is_ttf(enum AVCodecID id)
-{
-   switch (id)
-   {
-      case AV_CODEC_ID_TTF:
-         return true;
+   if (!coeffs)
+      coeffs = fallback_coeffs;
 
-      default:
-         break;
+   ret = sws_getColorspaceDetails(sws, (int**)&inv_table, &in_full,
+         (int**)&table, &out_full,
+         &brightness, &contrast, &saturation);
+   if (ret < 0)
+   {
+      inv_table = coeffs;
+      table = fallback_coeffs;
+      in_full = 0;
+      out_full = 0;
+      brightness = 0;
+      contrast = 1 << 16;
+      saturation = 1 << 16;
    }
+   else
+      inv_table = coeffs;
 
-   return false;
-}
+   if (in_range != AVCOL_RANGE_UNSPECIFIED)
+      in_full = in_range == AVCOL_RANGE_JPEG;
 
-static bool codec_id_is_ass(enum AVCodecID id)
-{
-   switch (id)
+   if (sws_setColorspaceDetails(sws, inv_table, in_full,
+         table ? table : fallback_coeffs, out_full,
+         brightness, contrast, saturation) < 0)
    {
-      case AV_CODEC_ID_ASS:
-      case AV_CODEC_ID_SSA:
-         return true;
-      default:
-         break;
+      log_cb(RETRO_LOG_WARN,
+            "[APLAYER] Failed to apply video colorspace details; using swscale defaults.\n");
    }
-
-   return false;
 }
 
-static bool codec_id_is_text_subtitle(enum AVCodecID id)
+/* Straight CPU alpha blending.
+ * Should probably do in GL. */
+static void render_ass_img(AVFrame *conv_frame, ASS_Image *img)
 {
-#ifdef AV_CODEC_PROP_TEXT_SUBTITLE
-   const AVCodecDescriptor *desc = avcodec_descriptor_get(id);
-   if (desc && (desc->props & AV_CODEC_PROP_TEXT_SUBTITLE))
-      return true;
-#endif
-   switch (id)
+   uint32_t *frame = (uint32_t*)conv_frame->data[0];
+   int      stride = conv_frame->linesize[0] / sizeof(uint32_t);
+
+   for (; img; img = img->next)
    {
-      case AV_CODEC_ID_SUBRIP:
-      case AV_CODEC_ID_TEXT:
-      case AV_CODEC_ID_WEBVTT:
-      case AV_CODEC_ID_MOV_TEXT:
-         return true;
-      default:
-         break;
-   }
+      int x, y;
+      unsigned r, g, b, a;
+      uint32_t *dst         = NULL;
+      const uint8_t *bitmap = NULL;
 
-   return false;
-}
+      if (img->w == 0 && img->h == 0)
+         continue;
 
-static bool codec_name_is_text_subtitle(enum AVCodecID id)
-{
-   const char *name = avcodec_get_name(id);
+      bitmap = img->bitmap;
+      dst    = frame + img->dst_x + img->dst_y * stride;
 
-   if (!name)
-      return false;
+      r      = (img->color >> 24) & 0xff;
+      g      = (img->color >> 16) & 0xff;
+      b      = (img->color >>  8) & 0xff;
+      a      = 255 - (img->color & 0xff);
 
-   if (strcmp(name, "subrip") == 0 ||
-         strcmp(name, "srt") == 0 ||
-         strcmp(name, "webvtt") == 0 ||
-         strcmp(name, "mov_text") == 0 ||
-         strcmp(name, "text") == 0)
-      return true;
+      for (y = 0; y < img->h; y++,
+            bitmap += img->stride, dst += stride)
+      {
+         for (x = 0; x < img->w; x++)
+         {
+            unsigned src_alpha = ((bitmap[x] * (a + 1)) >> 8) + 1;
+            unsigned dst_alpha = 256 - src_alpha;
 
-   return false;
-}
+            uint32_t dst_color = dst[x];
+            unsigned dst_r     = (dst_color >> 16) & 0xff;
+            unsigned dst_g     = (dst_color >>  8) & 0xff;
+            unsigned dst_b     = (dst_color >>  0) & 0xff;
 
-static bool codec_id_is_bitmap_subtitle(enum AVCodecID id)
-{
-   switch (id)
-   {
-      case AV_CODEC_ID_DVD_SUBTITLE:
-      case AV_CODEC_ID_DVB_SUBTITLE:
-      case AV_CODEC_ID_HDMV_PGS_SUBTITLE:
-      case AV_CODEC_ID_XSUB:
-         return true;
-      default:
-         break;
+            dst_r = (r * src_alpha + dst_r * dst_alpha) >> 8;
+            dst_g = (g * src_alpha + dst_g * dst_alpha) >> 8;
+            dst_b = (b * src_alpha + dst_b * dst_alpha) >> 8;
+
+            dst[x] = (0xffu << 24) | (dst_r << 16) |
+               (dst_g << 8) | (dst_b << 0);
+         }
+      }
    }
+}
+
+static int bitmap_subtitle_scale_coord(int value, int src_size, int dst_size)
+{
+   if (src_size <= 0)
+      return value;
 
-   return false;
+   return (int)(((int64_t)value * dst_size + src_size / 2) / src_size);
 }
 
-static void subtitle_store_codec_private(unsigned slot, AVCodecContext *ctx, bool is_text)
+static void blend_bitmap_subtitle_pixel(uint32_t *dst, uint32_t src)
 {
-   const uint8_t *src = NULL;
-   size_t size = 0;
-   bool has_native_header = false;
+   unsigned src_a = (src >> 24) & 0xff;
+   unsigned src_r = (src >> 16) & 0xff;
+   unsigned src_g = (src >>  8) & 0xff;
+   unsigned src_b = (src >>  0) & 0xff;
+   unsigned inv_a = 255 - src_a;
+   uint32_t dst_color = *dst;
+   unsigned dst_r = (dst_color >> 16) & 0xff;
+   unsigned dst_g = (dst_color >>  8) & 0xff;
+   unsigned dst_b = (dst_color >>  0) & 0xff;
 
-   if (slot >= MAX_STREAMS || !ctx)
+   if (src_a == 0)
       return;
 
-   av_freep(&ass_extra_data[slot]);
-   ass_extra_data_size[slot] = 0;
-   subtitle_uses_native_text_header[slot] = false;
-
-   if (is_text && ctx->subtitle_header && ctx->subtitle_header_size > 0)
-   {
-      src = (const uint8_t*)ctx->subtitle_header;
-      size = (size_t)ctx->subtitle_header_size;
-      has_native_header = true;
-   }
-   else if (ctx->extradata && ctx->extradata_size > 0)
+   if (src_a == 255)
    {
-      src = ctx->extradata;
-      size = (size_t)ctx->extradata_size;
+      *dst = src;
+      return;
    }
 
-   if (!src || size == 0)
-      return;
+   dst_r = src_r + ((dst_r * inv_a + 127) / 255);
+   dst_g = src_g + ((dst_g * inv_a + 127) / 255);
+   dst_b = src_b + ((dst_b * inv_a + 127) / 255);
 
-   ass_extra_data[slot] = (uint8_t*)av_malloc(size);
-   if (!ass_extra_data[slot])
+   *dst = (0xffu << 24) | (dst_r << 16) | (dst_g << 8) | dst_b;
+}
+
+static void bitmap_subtitle_scale_rect(struct bitmap_subtitle_rect *rect,
+      int canvas_w, int canvas_h, unsigned width, unsigned height)
+{
+   int full_x0 = 0;
+   int full_y0 = 0;
+   int full_x1 = 0;
+   int full_y1 = 0;
+   int dst_x0 = 0;
+   int dst_y0 = 0;
+   int dst_x1 = 0;
+   int dst_y1 = 0;
+   int dst_w = 0;
+   int dst_h = 0;
+   int full_w = 0;
+   int full_h = 0;
+   int *src_x_map = NULL;
+   struct bitmap_subtitle_surface *surface = NULL;
+
+   bitmap_subtitle_surface_unref(rect->scaled);
+   rect->scaled = NULL;
+
+   if (!rect->indices || rect->w <= 0 || rect->h <= 0)
       return;
 
-   memcpy(ass_extra_data[slot], src, size);
-   ass_extra_data_size[slot] = size;
-   subtitle_uses_native_text_header[slot] = has_native_header;
-}
+   full_x0 = bitmap_subtitle_scale_coord(rect->x, canvas_w, (int)width);
+   full_y0 = bitmap_subtitle_scale_coord(rect->y, canvas_h, (int)height);
+   full_x1 = bitmap_subtitle_scale_coord(rect->x + rect->w, canvas_w, (int)width);
+   full_y1 = bitmap_subtitle_scale_coord(rect->y + rect->h, canvas_h, (int)height);
+
+   dst_x0 = full_x0;
+   dst_y0 = full_y0;
+   dst_x1 = full_x1;
+   dst_y1 = full_y1;
+
+   if (dst_x1 <= dst_x0)
+      dst_x1 = dst_x0 + 1;
+   if (dst_y1 <= dst_y0)
+      dst_y1 = dst_y0 + 1;
+
+   full_w = full_x1 - full_x0;
+   full_h = full_y1 - full_y0;
+   if (full_w <= 0)
+      full_w = 1;
+   if (full_h <= 0)
+      full_h = 1;
+
+   if (dst_x0 >= (int)width || dst_y0 >= (int)height || dst_x1 <= 0 || dst_y1 <= 0)
+      return;
 
-static bool open_subtitle_codec(AVCodecContext **ctx, unsigned index, bool is_text)
-{
-   bool use_text_opts = is_text;
-   const AVCodec *codec = avcodec_find_decoder(fctx->streams[index]->codecpar->codec_id);
+   if (dst_x0 < 0)
+      dst_x0 = 0;
+   if (dst_y0 < 0)
+      dst_y0 = 0;
+   if (dst_x1 > (int)width)
+      dst_x1 = (int)width;
+   if (dst_y1 > (int)height)
+      dst_y1 = (int)height;
+
+   dst_w = dst_x1 - dst_x0;
+   dst_h = dst_y1 - dst_y0;
+   if (dst_w <= 0 || dst_h <= 0)
+      return;
 
-   if (!codec)
+   surface   = (struct bitmap_subtitle_surface*)malloc(sizeof(*surface) +
+         (size_t)dst_w * (size_t)dst_h * sizeof(*surface->pixels));
+   src_x_map = (int*)malloc((size_t)dst_w * sizeof(*src_x_map));
+   if (!surface || !src_x_map)
    {
-      log_cb(RETRO_LOG_ERROR, "[APLAYER] Couldn't find suitable subtitle decoder\n");
-      return false;
+      free(surface);
+      free(src_x_map);
+      return;
    }
 
-   do
+   /* Nearest-neighbour column lookup, shared by every row. */
+   for (int dx = 0; dx < dst_w; dx++)
    {
-      int ret = 0;
-      AVDictionary *opts = NULL;
+      int full_dx = (dst_x0 - full_x0) + dx;
+      int src_x = (int)(((int64_t)full_dx * rect->w) / full_w);
 
-      *ctx = avcodec_alloc_context3(codec);
-      if (!*ctx)
-         return false;
-
-      ret = avcodec_parameters_to_context(*ctx, fctx->streams[index]->codecpar);
-      if (ret < 0)
-      {
-         avcodec_free_context(ctx);
-         return false;
-      }
-
-      if (use_text_opts)
-      {
-         av_dict_set(&opts, "sub_text_format", "ass", 0);
-         av_dict_set(&opts, "flags2", "+ass_ro_flush_noop", 0);
-#ifdef FF_SUB_CHARENC_MODE_IGNORE
-         (*ctx)->sub_charenc_mode = FF_SUB_CHARENC_MODE_IGNORE;
-#endif
-      }
+      if (src_x >= rect->w)
+         src_x = rect->w - 1;
+      if (src_x < 0)
+         src_x = 0;
+      src_x_map[dx] = src_x;
+   }
 
-      ret = avcodec_open2(*ctx, codec, &opts);
-      av_dict_free(&opts);
+   for (int dy = 0; dy < dst_h; dy++)
+   {
+      uint32_t *dst_row = surface->pixels + (size_t)dy * (size_t)dst_w;
+      const uint8_t *src_row = NULL;
+      int full_dy = (dst_y0 - full_y0) + dy;
+      int src_y = (int)(((int64_t)full_dy * rect->h) / full_h);
 
-      if (ret >= 0)
-         return true;
+      if (src_y >= rect->h)
+         src_y = rect->h - 1;
+      if (src_y < 0)
+         src_y = 0;
 
-      avcodec_free_context(ctx);
-      if (!use_text_opts)
-      {
-         log_cb(RETRO_LOG_ERROR, "[APLAYER] Could not open subtitle codec: %s\n",
-               av_err2str(ret));
-         return false;
-      }
+      src_row = rect->indices + (size_t)src_y * (size_t)rect->w;
+      for (int dx = 0; dx < dst_w; dx++)
+         dst_row[dx] = rect->palette[src_row[src_x_map[dx]]];
+   }
 
-      log_cb(RETRO_LOG_WARN,
-            "[APLAYER] Retrying text subtitle decoder without ASS conversion options: %s\n",
-            av_err2str(ret));
-      use_text_opts = false;
-   } while (true);
+   free(src_x_map);
 
-   return false;
+   surface->refs = 1;
+   surface->x    = dst_x0;
+   surface->y    = dst_y0;
+   surface->w    = dst_w;
+   surface->h    = dst_h;
+   rect->scaled  = surface;
 }
 
-static AVCodecContext *open_text_subtitle_converter(enum AVCodecID codec_id)
+/* Expands and scales every rect of the event once per output size.
+ * Only events that actually get shown pay for 32-bit surfaces; the
+ * cached copies live as long as the event, so later frames only blend. */
+static void bitmap_subtitle_scale_event(struct bitmap_subtitle_event *event,
+      unsigned width, unsigned height)
 {
-   const AVCodec *codec = avcodec_find_decoder(codec_id);
-   bool use_text_opts = true;
-
-   if (!codec)
-      return NULL;
+   unsigned rect_index = 0;
+   int canvas_w = event->canvas_w > 0 ? event->canvas_w : (int)width;
+   int canvas_h = event->canvas_h > 0 ? event->canvas_h : (int)height;
 
-   do
+   for (rect_index = 0; rect_index < event->rect_count; rect_index++)
    {
-      int ret = 0;
-      AVDictionary *opts = NULL;
-      AVCodecContext *ctx = avcodec_alloc_context3(codec);
-
-      if (!ctx)
-         return NULL;
+      struct bitmap_subtitle_rect *rect = &event->rects[rect_index];
 
-      if (use_text_opts)
-      {
-         av_dict_set(&opts, "sub_text_format", "ass", 0);
-         av_dict_set(&opts, "flags2", "+ass_ro_flush_noop", 0);
-#ifdef FF_SUB_CHARENC_MODE_IGNORE
-         ctx->sub_charenc_mode = FF_SUB_CHARENC_MODE_IGNORE;
-#endif
-      }
+      event->bytes -= bitmap_subtitle_surface_bytes(rect->scaled);
+      bitmap_subtitle_scale_rect(rect, canvas_w, canvas_h, width, height);
+      event->bytes += bitmap_subtitle_surface_bytes(rect->scaled);
+   }
 
-      ret = avcodec_open2(ctx, codec, &opts);
-      av_dict_free(&opts);
+   event->scaled_width  = width;
+   event->scaled_height = height;
+}
 
-      if (ret >= 0)
-         return ctx;
+/* Scales the event for the output size if needed and takes a reference
+ * on each of its surfaces, so they can be blended without ass_lock.
+ * Returns the number of surfaces stored in @surfaces, which the caller
+ * frees along with the references. */
+static unsigned bitmap_subtitle_ref_surfaces_locked(
+      struct bitmap_subtitle_event *event, unsigned width, unsigned height,
+      struct bitmap_subtitle_surface ***surfaces)
+{
+   unsigned rect_index = 0;
+   unsigned count = 0;
 
-      avcodec_free_context(&ctx);
-      if (!use_text_opts)
-         return NULL;
+   *surfaces = NULL;
+   if (width == 0 || height == 0 || !event || !event->rect_count)
+      return 0;
 
-      use_text_opts = false;
-   } while (true);
+   if (event->scaled_width != width || event->scaled_height != height)
+      bitmap_subtitle_scale_event(event, width, height);
 
-   return NULL;
-}
+   *surfaces = (struct bitmap_subtitle_surface**)malloc(
+         event->rect_count * sizeof(**surfaces));
+   if (!*surfaces)
+      return 0;
 
-static void ass_init_default_track(ASS_Track *track)
-{
-   unsigned play_res_x = subtitle_text_playres_x;
-   unsigned play_res_y = subtitle_text_playres_y;
-   const char *font_name = subtitle_font_name ? subtitle_font_name : "sans-serif";
-   int font_bold = 0;
-   unsigned font_size = 16;
-   char header[1024];
-   int len = snprintf(header, sizeof(header),
-         "[Script Info]\n"
-         "ScriptType: v4.00+\n"
-         "PlayResX: %u\n"
-         "PlayResY: %u\n"
-         "\n"
-         "[V4+ Styles]\n"
-         "Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, OutlineColour, BackColour, Bold, Italic, Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, BorderStyle, Outline, Shadow, Alignment, MarginL, MarginR, MarginV, Encoding\n"
-         "Style: Default,%s,%u,&H00FFFFFF,&H000000FF,&H00000000,&H64000000,%d,0,0,0,100,100,0,0,1,2,0,2,20,20,20,1\n"
-         "\n"
-         "[Events]\n"
-         "Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text\n",
-         play_res_x, play_res_y, font_name, font_size, font_bold);
+   for (rect_index = 0; rect_index < event->rect_count; rect_index++)
+   {
+      struct bitmap_subtitle_surface *surface = event->rects[rect_index].scaled;
 
-   if (len <= 0)
-      return;
-   if ((size_t)len >= sizeof(header))
-      len = (int)sizeof(header) - 1;
+      if (!surface)
+         continue;
+      __atomic_add_fetch(&surface->refs, 1, __ATOMIC_RELAXED);
+      (*surfaces)[count++] = surface;
+   }
 
-   ass_process_codec_private(track, header, len);
+   return count;
 }
 
-static void ass_init_subtitle_track(ASS_Track *track, unsigned slot)
+/* Blends the surfaces taken by bitmap_subtitle_ref_surfaces_locked()
+ * and drops the references. */
+static void render_bitmap_subtitle_surfaces(uint32_t *buffer, unsigned width,
+      struct bitmap_subtitle_surface **surfaces, unsigned count)
 {
-   if (!track || slot >= MAX_STREAMS)
-      return;
+   unsigned i = 0;
 
-   if (ass_extra_data_size[slot] > 0)
-      ass_process_codec_private(track, (char*)ass_extra_data[slot], ass_extra_data_size[slot]);
+   for (i = 0; i < count; i++)
+   {
+      const struct bitmap_subtitle_surface *surface = surfaces[i];
 
-   if (track->n_styles == 0)
-      ass_init_default_track(track);
+      for (int dy = 0; dy < surface->h; dy++)
+      {
+         uint32_t *dst_row = buffer + (size_t)(surface->y + dy) * width + surface->x;
+         const uint32_t *src_row = surface->pixels + (size_t)dy * (size_t)surface->w;
 
-   if (subtitle_track_is_text(slot))
-      ass_update_text_track_styles(track);
+         for (int dx = 0; dx < surface->w; dx++)
+            blend_bitmap_subtitle_pixel(&dst_row[dx], src_row[dx]);
+      }
+      bitmap_subtitle_surface_unref(surfaces[i]);
+   }
 
-#ifdef LIBASS_VERSION
-#if LIBASS_VERSION >= 0x01302000
-   ass_set_check_readorder(track, 1);
-#endif
-#endif
+   free(surfaces);
 }
 
-static int subtitle_slot_for_stream(int stream_index)
+static ASS_Renderer *subtitle_renderer_new(void)
 {
-   for (int i = 0; i < subtitle_streams_num; i++)
-   {
-      if (subtitle_streams[i] == stream_index)
-         return i;
-   }
+   ASS_Renderer *renderer = NULL;
 
-   return -1;
-}
+   if (!ass)
+      return NULL;
 
-static int audio_slot_for_stream(int stream_index)
-{
-   for (int i = 0; i < audio_streams_num; i++)
-   {
-      if (audio_streams[i] == stream_index)
-         return i;
-   }
+   renderer = ass_renderer_init(ass);
+   if (!renderer)
+      return NULL;
 
-   return -1;
+   ass_set_frame_size(renderer, media.width, media.height);
+   ass_set_fonts(renderer, NULL, NULL, 1, NULL, 1);
+   ass_set_hinting(renderer, ASS_HINTING_LIGHT);
+
+   return renderer;
 }
 
-static void audio_packet_buffer_drop_stale(packet_buffer_t *buffer,
-      double timebase, double target_time)
+static size_t subtitle_event_bytes(const ASS_Event *event)
 {
-   if (!buffer || timebase <= 0.0)
-      return;
+   size_t bytes = 0;
 
-   while (!packet_buffer_empty(buffer))
-   {
-      int64_t end_pts = packet_buffer_peek_end_pts(buffer);
-      if (end_pts == AV_NOPTS_VALUE || end_pts < 0)
-         break;
-      if ((double)end_pts * timebase >= target_time)
-         break;
-      packet_buffer_drop_packet(buffer);
-   }
+   if (event->Text)
+      bytes += strlen(event->Text) + 1;
+   if (event->Name)
+      bytes += strlen(event->Name) + 1;
+   if (event->Effect)
+      bytes += strlen(event->Effect) + 1;
+   return bytes;
 }
 
-static bool open_codecs(void)
+/* Accounts the events appended to @track, the slot's track, from
+ * index @first on. */
+static void subtitle_text_account_locked(unsigned slot, ASS_Track *track,
+      int first)
 {
-   unsigned i;
-   decode_thread_lock   = slock_new();
-
-   video_stream_index   = -1;
-   audio_streams_num    = 0;
-   subtitle_streams_num = 0;
-
-   slock_lock(decode_thread_lock);
-   audio_streams_ptr    = 0;
-   subtitle_streams_ptr = SUBTITLE_STREAM_DISABLED;
-   slock_unlock(decode_thread_lock);
-
-   memset(audio_streams,    0, sizeof(audio_streams));
-   memset(subtitle_streams, 0, sizeof(subtitle_streams));
-   memset(subtitle_is_ass,  0, sizeof(subtitle_is_ass));
-   memset(subtitle_is_bitmap, 0, sizeof(subtitle_is_bitmap));
-   memset(subtitle_is_external, 0, sizeof(subtitle_is_external));
-   memset(subtitle_uses_native_text_header, 0, sizeof(subtitle_uses_native_text_header));
-   first_subtitle_event_logged = false;
-   first_ass_render_logged = false;
-   memset(first_ass_image_logged, 0, sizeof(first_ass_image_logged));
-   memset(first_ass_after_sub_logged, 0, sizeof(first_ass_after_sub_logged));
-   for (i = 0; i < MAX_STREAMS; i++)
-      first_subtitle_start_ms[i] = -1;
+   int i;
 
-   for (i = 0; i < fctx->nb_streams; i++)
-   {
-      enum AVMediaType type = fctx->streams[i]->codecpar->codec_type;
-      switch (type)
-      {
-         case AVMEDIA_TYPE_AUDIO:
-            if (audio_streams_num < MAX_STREAMS)
-            {
-               if (!open_codec(&actx[audio_streams_num], type, i))
-                  return false;
-               audio_streams[audio_streams_num] = i;
-               audio_streams_num++;
-            }
-            break;
+   for (i = first; i < track->n_events; i++)
+      subtitle_text_bytes[slot] += subtitle_event_bytes(&track->events[i]);
+}
 
-         case AVMEDIA_TYPE_VIDEO:
-            if (!vctx
-                  && !codec_is_image(fctx->streams[i]->codecpar->codec_id))
-            {
-               if (!open_codec(&vctx, type, i))
-                  return false;
-            }
-            break;
+/* Embedded text tracks would otherwise keep every event of the file.
+ * Events that ended well before @now_ms are dropped, events still
+ * waiting for their end are kept; a backward seek flushes the track
+ * and demuxes them again. External tracks are parsed only once, so
+ * they are kept whole. */
+static void subtitle_prune_text_events_locked(unsigned slot, int64_t now_ms)
+{
+   ASS_Track *track = ass_track[slot];
+   int64_t deadline = now_ms - SUBTITLE_TEXT_PRUNE_BEHIND_MS;
+#if !defined(LIBASS_VERSION) || LIBASS_VERSION < 0x01700000
+   int kept = 0;
+#endif
+   int i;
 
-         case AVMEDIA_TYPE_SUBTITLE:
-            if (subtitle_streams_num < MAX_STREAMS)
-            {
-               unsigned slot = subtitle_streams_num;
-               AVCodecContext **s = &sctx[slot];
-               const enum AVCodecID sub_id = fctx->streams[i]->codecpar->codec_id;
-               const char *codec_name = avcodec_get_name(sub_id);
-               bool is_ass = codec_id_is_ass(sub_id);
-               bool is_text = codec_id_is_text_subtitle(sub_id) ||
-                     codec_name_is_text_subtitle(sub_id);
-               bool is_bitmap = codec_id_is_bitmap_subtitle(sub_id);
+   if (!track || subtitle_is_external[slot] ||
+         track->n_events < SUBTITLE_TEXT_PRUNE_MIN_EVENTS)
+      return;
 
-               log_cb(RETRO_LOG_INFO, "[APLAYER] Found subtitle stream %u: %s\n",
-                     i, codec_name ? codec_name : "unknown");
+#if defined(LIBASS_VERSION) && LIBASS_VERSION >= 0x01700000
+   /* Same test as libass, for the byte count. */
+   for (i = 0; i < track->n_events; i++)
+      if (track->events[i].Start + track->events[i].Duration < deadline)
+         subtitle_text_bytes[slot] -= subtitle_event_bytes(&track->events[i]);
+   ass_prune_events(track, deadline);
+#else
+   for (i = 0; i < track->n_events; i++)
+   {
+      ASS_Event *event = &track->events[i];
 
-               if (!is_ass && !is_text && !is_bitmap)
-               {
-                  log_cb(RETRO_LOG_WARN, "[APLAYER] Subtitle codec not supported: %s\n",
-                        codec_name ? codec_name : "unknown");
-                  break;
-               }
+      if (event->Duration != SUBTITLE_UNKNOWN_DURATION_MS &&
+            event->Start + event->Duration < deadline)
+      {
+         subtitle_text_bytes[slot] -= subtitle_event_bytes(event);
+         ass_free_event(track, i);
+         continue;
+      }
 
-               subtitle_streams[slot] = i;
-               subtitle_is_ass[slot] = is_ass;
-               subtitle_is_bitmap[slot] = is_bitmap;
-               if (!open_subtitle_codec(s, i, is_text))
-                  return false;
+      if (kept != i)
+         track->events[kept] = *event;
+      kept++;
+   }
 
-               if (!is_bitmap)
-                  subtitle_store_codec_private(slot, *s, is_text);
+   track->n_events = kept;
+#endif
+}
 
-               subtitle_streams_num++;
-               log_cb(RETRO_LOG_INFO, "[APLAYER] Subtitle stream %u registered: %s (%s)\n",
-                     i, codec_name ? codec_name : "unknown",
-                     is_ass ? "ass" : (is_bitmap ? "bitmap" : "text"));
-            }
-            break;
+/* Event count and approximate heap usage of a subtitle slot. */
+static void subtitle_track_usage_locked(unsigned slot, size_t *events, size_t *bytes)
+{
+   ASS_Track *track = ass_track[slot];
 
-         case AVMEDIA_TYPE_ATTACHMENT:
-            {
-               AVCodecParameters *params = fctx->streams[i]->codecpar;
-               if (codec_id_is_ttf(params->codec_id))
-                  append_attachment(params->extradata, params->extradata_size);
-            }
-            break;
+   *events = 0;
+   *bytes  = 0;
 
-         default:
-            break;
-      }
+   if (subtitle_track_is_bitmap(slot))
+   {
+      *events = bitmap_subtitle_event_count[slot];
+      *bytes  = bitmap_subtitle_bytes[slot] +
+            bitmap_subtitle_event_cap[slot] * sizeof(struct bitmap_subtitle_event);
+      return;
    }
 
-   if (audio_streams_num > 0)
-      audio_streams_ptr = audio_select_initial_stream_ptr();
+   if (!track)
+      return;
 
-   return actx[0] || vctx;
+   *events = (size_t)track->n_events;
+   *bytes  = (size_t)track->max_events * sizeof(ASS_Event) +
+         subtitle_text_bytes[slot];
 }
 
-static bool init_media_info(void)
+/* Playback statistics, logged at debug level while playing and once
+ * more when the content is unloaded. */
+static void aplayer_stats_log(enum retro_log_level level)
 {
-   if (actx[0] && actx[0]->sample_rate > 0)
-      media.sample_rate = actx[0]->sample_rate;
-   else if (actx[0])
-      log_cb(RETRO_LOG_WARN,
-            "[APLAYER] Invalid audio sample rate (%d), using default %u.\n",
-            actx[0]->sample_rate, media.sample_rate);
+   unsigned i;
+   int64_t now      = av_gettime_relative();
+   unsigned wakeups = decode_wakeups;
+
+   if (stats_wakeups_since_us && now > stats_wakeups_since_us)
+      log_cb(level, "[APLAYER] Stats: decode thread %.1f wakeups/s%s\n",
+            (double)(wakeups - stats_wakeups_count) * AV_TIME_BASE /
+            (double)(now - stats_wakeups_since_us),
+            audio_low_power ? " (low-power audio)" : "");
+   stats_wakeups_since_us = now;
+   stats_wakeups_count    = wakeups;
+
+   if (stats_presents)
+      log_cb(level, "[APLAYER] Stats: %u video presents, %u elided as dupes (%.0f%%)\n",
+            stats_presents, stats_presents_elided,
+            100.0 * stats_presents_elided / stats_presents);
+   stats_presents        = 0;
+   stats_presents_elided = 0;
+
+   if (stats_late_video || stats_late_audio)
+      log_cb(level, "[APLAYER] Stats: late runs: %u video, %u audio%s\n",
+            stats_late_video, stats_late_audio,
+            present_never_block ? " (never-block)" : "");
+   stats_late_video = 0;
+   stats_late_audio = 0;
+
+   if (stats_frame_times)
+      log_cb(level, "[APLAYER] Stats: frame time %.3f ms, jitter %.3f ms avg / %.3f ms max, %u hiccups\n",
+            frame_clock_period * 1000.0 / media.interpolate_fps,
+            stats_frame_jitter_sum / stats_frame_times,
+            stats_frame_jitter_max, stats_frame_hiccups);
+   stats_frame_times      = 0;
+   stats_frame_hiccups    = 0;
+   stats_frame_jitter_sum = 0.0;
+   stats_frame_jitter_max = 0.0;
+
+   if (stats_seeks_cached || stats_seeks_demuxed)
+      log_cb(level, "[APLAYER] Stats: %u of %u seeks served by the seek cache (%.1f MB, %.1f s kept)\n",
+            stats_seeks_cached, stats_seeks_cached + stats_seeks_demuxed,
+            stats_history_bytes / (1024.0 * 1024.0), stats_history_span);
+   stats_seeks_cached  = 0;
+   stats_seeks_demuxed = 0;
+
+   if (io_cache)
+   {
+      struct avio_cache_stats io_stats;
+
+      avio_cache_get_stats(io_cache, &io_stats, true);
+      log_cb(level, "[APLAYER] Stats: network read-ahead %.1f MB ahead, %.2f MB/s, %u stalls (%.1f ms), %u of %u seeks reused, %u retries\n",
+            io_stats.ahead / (1024.0 * 1024.0),
+            io_stats.fetch_us ? io_stats.bytes_fetched / (double)io_stats.fetch_us : 0.0,
+            io_stats.stalls, io_stats.stall_us / 1000.0, io_stats.seeks_reused,
+            io_stats.seeks_reused + io_stats.seeks_source, io_stats.retries);
+   }
+
+   if (io_file)
+   {
+      struct avio_file_stats io_stats;
+
+      avio_file_get_stats(io_file, &io_stats, true);
+      if (io_stats.blocks)
+         log_cb(level, "[APLAYER] Stats: file read-ahead %u blocks, %.1f MB at %.2f MB/s, slowest %.1f ms\n",
+               io_stats.blocks, io_stats.bytes_read / (1024.0 * 1024.0),
+               io_stats.read_us ? io_stats.bytes_read / (double)io_stats.read_us : 0.0,
+               io_stats.read_max_us / 1000.0);
+   }
+
+   if (stats_loops)
+      log_cb(level, "[APLAYER] Stats: %u loops played from the cached start of the track\n",
+            stats_loops);
+   stats_loops = 0;
+
+   if (audio_status_enabled)
+      log_cb(level, "[APLAYER] Stats: frontend audio buffer %u%% min, %u runs about to starve\n",
+            audio_device_occupancy_min, stats_audio_starving);
+   audio_device_occupancy_min = 100;
+   stats_audio_starving       = 0;
 
-   if (vctx)
+   if (fft)
    {
-      media.width  = vctx->width;
-      media.height = vctx->height;
-      init_aspect_ratio();
+      double gpu_avg_ms = 0.0;
+      double gpu_max_ms = 0.0;
+
+      if (fft_get_gpu_time(fft, &gpu_avg_ms, &gpu_max_ms))
+         log_cb(level, "[APLAYER] Stats: visualizer GPU time %.2f ms/frame avg, %.2f ms max, %.0f%% resolution\n",
+               gpu_avg_ms, gpu_max_ms, fft_get_scale(fft) * 100.0f);
    }
 
-   media.interpolate_fps = aplayer_get_content_refresh_rate();
+   if (!ass_lock)
+      return;
 
-   if (fctx)
+   slock_lock(ass_lock);
+   for (i = 0; (int)i < subtitle_streams_num && i < MAX_STREAMS; i++)
    {
-      double duration_sec = 0.0;
+      size_t events = 0;
+      size_t bytes  = 0;
 
-      if (fctx->duration != AV_NOPTS_VALUE && fctx->duration > 0)
+      subtitle_track_usage_locked(i, &events, &bytes);
+      log_cb(level,
+            "[APLAYER] Stats: subtitle slot %u (%s): %u events, %u KB, %u packets indexed\n",
+            i,
+            subtitle_track_is_bitmap(i) ? "bitmap" :
+               (subtitle_is_external[i] ? "external" : "text"),
+            (unsigned)events, (unsigned)((bytes + 1023) / 1024),
+            (unsigned)subtitle_packet_index[i].count);
+   }
+   slock_unlock(ass_lock);
+}
+
+/* Runs on the sws workers. Every video buffer slot owns its own
+ * ASS_Renderer, so only track access is serialized via ass_lock
+ * while the blending of the resulting images overlaps across cores. */
+static void render_subtitles_on_frame(video_decoder_context_t *ctx,
+      double time_sec)
+{
+   ASS_Track *render_track = NULL;
+   ASS_Image *img = NULL;
+   struct bitmap_subtitle_event *bitmap_event = NULL;
+   struct bitmap_subtitle_surface **surfaces = NULL;
+   unsigned surface_count = 0;
+   uint32_t *buffer = NULL;
+   unsigned width = media.width;
+   unsigned height = media.height;
+   int subtitle_ptr = -1;
+   int64_t track_start_ms = -1;
+   long long now_ms = 0;
+   AVFrame tmp_frame;
+
+   if (!ctx || !ctx->target || !ctx->target->data[0] ||
+         width == 0 || height == 0)
+      return;
+
+   /* Apply whatever the decode thread staged since the last frame,
+    * even while subtitles are hidden, so the queue never backs up. */
+   if (spsc_ring_read_avail(subtitle_stage) > 0)
+   {
+      slock_lock(ass_lock);
+      subtitle_stage_drain_locked(true);
+      slock_unlock(ass_lock);
+   }
+
+   subtitle_ptr = ctx->subtitle_ptr;
+   if (!subtitle_selection_is_valid(subtitle_ptr) || subtitle_ptr >= MAX_STREAMS)
+      return;
+
+   buffer         = (uint32_t*)ctx->target->data[0];
+   render_track   = ctx->ass_track_active;
+   track_start_ms = first_subtitle_start_ms[subtitle_ptr];
+
+   slock_lock(ass_lock);
+   if (subtitle_track_is_bitmap((unsigned)subtitle_ptr))
+   {
+      now_ms = subtitle_adjust_render_time_ms(render_track,
+            subtitle_ptr, (long long)(time_sec * 1000.0));
+      /* Workers may finish slightly out of order, keep recent events
+       * around for frames that are still in flight. */
+      bitmap_subtitle_prune_locked((unsigned)subtitle_ptr,
+            now_ms - BITMAP_SUBTITLE_PRUNE_SLACK_MS);
+      bitmap_event = bitmap_subtitle_current_locked((unsigned)subtitle_ptr, now_ms);
+      if (bitmap_event && buffer)
       {
-         int64_t duration = fctx->duration + (fctx->duration <= INT64_MAX - 5000 ? 5000 : 0);
-         duration_sec = (double)(duration / AV_TIME_BASE);
+         size_t bytes = bitmap_event->bytes;
+         surface_count = bitmap_subtitle_ref_surfaces_locked(bitmap_event,
+               width, height, &surfaces);
+         bitmap_subtitle_bytes[subtitle_ptr] += bitmap_event->bytes - bytes;
+         /* Scaled surfaces count towards the cap as well. */
+         bitmap_subtitle_enforce_cap_locked((unsigned)subtitle_ptr,
+               (size_t)(bitmap_event - bitmap_subtitle_events[subtitle_ptr]));
       }
+      slock_unlock(ass_lock);
+      /* Blend outside the lock, the references keep the surfaces alive. */
+      render_bitmap_subtitle_surfaces(buffer, width, surfaces, surface_count);
+      return;
+   }
 
-      if (!duration_is_valid(duration_sec) && audio_streams_num > 0)
-         duration_sec = stream_duration_seconds(audio_streams[0]);
+   if (render_track && !ctx->ass_render)
+      ctx->ass_render = subtitle_renderer_new();
 
-      if (!duration_is_valid(duration_sec) && video_stream_index >= 0)
-         duration_sec = stream_duration_seconds(video_stream_index);
+   if (render_track && ctx->ass_render)
+   {
+      int change = 0;
+      now_ms = subtitle_adjust_render_time_ms(render_track,
+            subtitle_ptr, (long long)(time_sec * 1000.0));
+      img = ass_render_frame(ctx->ass_render, render_track, now_ms, &change);
 
-      if (duration_is_valid(duration_sec))
+      if (!first_ass_render_logged)
       {
-         media.duration.time     = duration_sec;
-         media.duration.seconds  = (unsigned)media.duration.time;
-         media.duration.minutes  = media.duration.seconds / 60;
-         media.duration.seconds %= 60;
-         media.duration.hours    = media.duration.minutes / 60;
-         media.duration.minutes %= 60;
+         log_cb(RETRO_LOG_INFO,
+               "[APLAYER] ass_render_frame first call: images=%s change=%d time_ms=%lld\n",
+               img ? "yes" : "no", change, now_ms);
+         first_ass_render_logged = true;
       }
-      else
+
+      if (img && !first_ass_image_logged[subtitle_ptr])
       {
-         media.duration.time    = 0.0;
-         media.duration.hours   = 0;
-         media.duration.minutes = 0;
-         media.duration.seconds = 0;
-         log_cb(RETRO_LOG_WARN, "[APLAYER] Could not determine media duration\n");
+         log_cb(RETRO_LOG_INFO,
+               "[APLAYER] ass_render_frame first non-null image: change=%d time_ms=%lld track=%d first_sub_start_ms=%lld\n",
+               change, now_ms, subtitle_ptr, (long long)track_start_ms);
+         first_ass_image_logged[subtitle_ptr] = true;
+      }
+      else if (!img && !first_ass_after_sub_logged[subtitle_ptr] &&
+            track_start_ms >= 0 &&
+            now_ms >= track_start_ms)
+      {
+         log_cb(RETRO_LOG_INFO,
+               "[APLAYER] ass_render_frame no image at/after first subtitle start: change=%d time_ms=%lld track=%d first_sub_start_ms=%lld\n",
+               change, now_ms, subtitle_ptr, (long long)track_start_ms);
+         first_ass_after_sub_logged[subtitle_ptr] = true;
       }
    }
+   slock_unlock(ass_lock);
 
-   int type = get_media_type();
+   /* The image list stays owned by this slot's renderer until its
+    * next ass_render_frame() call. */
+   if (!img)
+      return;
 
-   switch (type)
+   memset(&tmp_frame, 0, sizeof(tmp_frame));
+   tmp_frame.data[0]     = (uint8_t*)buffer;
+   tmp_frame.linesize[0] = (int)width * (int)sizeof(uint32_t);
+   render_ass_img(&tmp_frame, img);
+}
+
+static void bitmap_subtitle_convert_palette(uint32_t *colors, size_t count)
+{
+   size_t i = 0;
+
+   if (!colors)
+      return;
+
+   for (i = 0; i < count; i++)
    {
-      case MEDIA_TYPE_AUDIO:
-      {
-         for (int i = 0; i < fctx->nb_streams; i++)
-         {
-            if (fctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-            {
-               media.title = av_dict_get(fctx->streams[i]->metadata, "title", NULL, 0);
-            }
-         }
-         break;
-      }
-      case MEDIA_TYPE_VIDEO:
-         media.title = av_dict_get(fctx->metadata, "title", media.title, 0);
-         break;
-      default:
-         break;
+      uint32_t c = colors[i];
+      uint32_t b = c & 0xff;
+      uint32_t g = (c >> 8) & 0xff;
+      uint32_t r = (c >> 16) & 0xff;
+      uint32_t a = (c >> 24) & 0xff;
+
+      b = b * a / 255;
+      g = g * a / 255;
+      r = r * a / 255;
+
+      colors[i] = b | (g << 8) | (r << 16) | (a << 24);
    }
+}
 
-   display_media_title();
+static bool bitmap_subtitle_build_event(AVCodecContext *ctx, const AVSubtitle *sub,
+      int64_t start_ms, int64_t end_ms, bool end_known,
+      struct bitmap_subtitle_event *event)
+{
+   int canvas_w = 0;
+   int canvas_h = 0;
+   unsigned rect_count = 0;
 
-   if (sctx[0])
+   if (!sub || !event || sub->num_rects <= 0)
+      return false;
+
+   memset(event, 0, sizeof(*event));
+   event->start_ms = start_ms;
+   event->end_ms = end_ms;
+   event->end_known = end_known;
+
+   if (ctx)
    {
-      unsigned i;
-      bool need_ass_context = false;
+      canvas_w = ctx->width;
+      canvas_h = ctx->height;
+   }
 
-      for (i = 0; i < (unsigned)subtitle_streams_num; i++)
+   event->rects = (struct bitmap_subtitle_rect*)calloc((size_t)sub->num_rects,
+         sizeof(*event->rects));
+   if (!event->rects)
+      return false;
+   event->bytes = (size_t)sub->num_rects * sizeof(*event->rects);
+
+   for (int i = 0; i < sub->num_rects; i++)
+   {
+      const AVSubtitleRect *rect = sub->rects[i];
+      struct bitmap_subtitle_rect *dst = NULL;
+      uint8_t *indices = NULL;
+      int palette_size = 0;
+
+      if (!rect || rect->type != SUBTITLE_BITMAP ||
+            rect->w <= 0 || rect->h <= 0 ||
+            !rect->data[0] || !rect->data[1] || rect->linesize[0] <= 0)
       {
-         if (!subtitle_track_is_bitmap(i))
-         {
-            need_ass_context = true;
-            break;
-         }
+         continue;
       }
 
-      if (!need_ass_context)
-         return true;
+      palette_size = rect->nb_colors;
+      if (palette_size <= 0 || palette_size > 256)
+         continue;
 
-      ass = ass_library_init();
-      ass_set_message_cb(ass, ass_msg_cb, NULL);
+      indices = (uint8_t*)malloc((size_t)rect->w * (size_t)rect->h);
+      if (!indices)
+         continue;
 
-      for (i = 0; i < attachments_size; i++)
-         ass_add_font(ass, (char*)"",
-               (char*)attachments[i].data, attachments[i].size);
+      for (int y = 0; y < rect->h; y++)
+         memcpy(indices + (size_t)y * (size_t)rect->w,
+               rect->data[0] + y * rect->linesize[0], (size_t)rect->w);
 
-      ass_render = ass_renderer_init(ass);
-      ass_set_frame_size(ass_render, media.width, media.height);
-      ass_set_extract_fonts(ass, true);
-      ass_set_fonts(ass_render, NULL, NULL, 1, NULL, 1);
-      ass_set_hinting(ass_render, ASS_HINTING_LIGHT);
-      update_subtitle_font_settings();
+      dst = &event->rects[rect_count++];
+      dst->x = rect->x;
+      dst->y = rect->y;
+      dst->w = rect->w;
+      dst->h = rect->h;
+      dst->indices = indices;
+      /* Unused entries stay zero, i.e. fully transparent. */
+      memcpy(dst->palette, rect->data[1], (size_t)palette_size * sizeof(dst->palette[0]));
+      bitmap_subtitle_convert_palette(dst->palette, (size_t)palette_size);
+      event->bytes += (size_t)rect->w * (size_t)rect->h;
 
-      for (i = 0; i < (unsigned)subtitle_streams_num; i++)
-      {
-         if (subtitle_track_is_bitmap(i))
-            continue;
+      if (dst->x + dst->w > canvas_w)
+         canvas_w = dst->x + dst->w;
+      if (dst->y + dst->h > canvas_h)
+         canvas_h = dst->y + dst->h;
+   }
 
-         ass_track[i] = ass_new_track(ass);
-         if (ass_track[i])
-            ass_init_subtitle_track(ass_track[i], i);
-      }
+   if (rect_count == 0)
+   {
+      bitmap_subtitle_clear_event(event);
+      return false;
    }
 
+   event->rect_count = rect_count;
+   event->canvas_w = canvas_w > 0 ? canvas_w : media.width;
+   event->canvas_h = canvas_h > 0 ? canvas_h : media.height;
    return true;
 }
 
-static void set_colorspace(struct SwsContext *sws,
-      unsigned width, unsigned height,
-      enum AVColorSpace default_color, int in_range)
+static char *ass_escape_text(const char *text)
 {
-   const int *coeffs = NULL;
-   const int *fallback_coeffs = sws_getCoefficients(SWS_CS_DEFAULT);
-   int in_full = 0;
-   int out_full = 0;
-   int brightness = 0;
-   int contrast = 1 << 16;
-   int saturation = 1 << 16;
-   const int *inv_table = fallback_coeffs;
-   const int *table = fallback_coeffs;
-   int ret;
-
-   if (!sws || !fallback_coeffs)
-      return;
-
-   if (default_color != AVCOL_SPC_UNSPECIFIED)
-      coeffs = sws_getCoefficients(default_color);
-   else if (width >= 1280 || height > 576)
-      coeffs = sws_getCoefficients(AVCOL_SPC_BT709);
-   else
-      coeffs = sws_getCoefficients(AVCOL_SPC_BT470BG);
+   size_t len = strlen(text);
+   char *out = (char*)malloc(len * 2 + 1);
+   char *dst = out;
 
-   if (!coeffs)
-      coeffs = fallback_coeffs;
+   if (!out)
+      return NULL;
 
-   ret = sws_getColorspaceDetails(sws, (int**)&inv_table, &in_full,
-         (int**)&table, &out_full,
-         &brightness, &contrast, &saturation);
-   if (ret < 0)
+   for (const char *src = text; *src; src++)
    {
-      inv_table = coeffs;
-      table = fallback_coeffs;
-      in_full = 0;
-      out_full = 0;
-      brightness = 0;
-      contrast = 1 << 16;
-      saturation = 1 << 16;
-   }
-   else
-      inv_table = coeffs;
+      if (*src == '\r')
+         continue;
+      if (*src == '\n')
+      {
+         *dst++ = '\\';
+         *dst++ = 'N';
+         continue;
+      }
 
-   if (in_range != AVCOL_RANGE_UNSPECIFIED)
-      in_full = in_range == AVCOL_RANGE_JPEG;
+      if (*src == '{' || *src == '}' || *src == '\\')
+         *dst++ = '\\';
 
-   if (sws_setColorspaceDetails(sws, inv_table, in_full,
-         table ? table : fallback_coeffs, out_full,
-         brightness, contrast, saturation) < 0)
-   {
-      log_cb(RETRO_LOG_WARN,
-            "[APLAYER] Failed to apply video colorspace details; using swscale defaults.\n");
+      *dst++ = *src;
    }
+
+   *dst = '\0';
+   return out;
 }
 
-/* Straight CPU alpha blending.
- * Should probably do in GL. */
-static void render_ass_img(AVFrame *conv_frame, ASS_Image *img)
+static void ass_process_line(ASS_Track *track, const char *line)
 {
-   uint32_t *frame = (uint32_t*)conv_frame->data[0];
-   int      stride = conv_frame->linesize[0] / sizeof(uint32_t);
+   if (!line || !*line)
+      return;
 
-   for (; img; img = img->next)
-   {
-      int x, y;
-      unsigned r, g, b, a;
-      uint32_t *dst         = NULL;
-      const uint8_t *bitmap = NULL;
+   const char *prefix = "";
+   if (strncmp(line, "Dialogue:", 9) != 0 &&
+         strncmp(line, "Comment:", 8) != 0 &&
+         strncmp(line, "Style:", 6) != 0 &&
+         strncmp(line, "Format:", 7) != 0 &&
+         line[0] != '[')
+      prefix = "Dialogue: ";
 
-      if (img->w == 0 && img->h == 0)
-         continue;
+   size_t prefix_len = strlen(prefix);
+   size_t len = strlen(line);
+   bool has_newline = len > 0 && line[len - 1] == '\n';
+   size_t total_len = prefix_len + len + (has_newline ? 0 : 1);
 
-      bitmap = img->bitmap;
-      dst    = frame + img->dst_x + img->dst_y * stride;
+   char *buf = (char*)malloc(total_len + 1);
+   if (!buf)
+      return;
 
-      r      = (img->color >> 24) & 0xff;
-      g      = (img->color >> 16) & 0xff;
-      b      = (img->color >>  8) & 0xff;
-      a      = 255 - (img->color & 0xff);
+   memcpy(buf, prefix, prefix_len);
+   memcpy(buf + prefix_len, line, len);
+   if (!has_newline)
+      buf[prefix_len + len] = '\n';
+   buf[total_len] = '\0';
 
-      for (y = 0; y < img->h; y++,
-            bitmap += img->stride, dst += stride)
-      {
-         for (x = 0; x < img->w; x++)
-         {
-            unsigned src_alpha = ((bitmap[x] * (a + 1)) >> 8) + 1;
-            unsigned dst_alpha = 256 - src_alpha;
+   ass_process_data(track, buf, total_len);
+   free(buf);
+}
 
-            uint32_t dst_color = dst[x];
-            unsigned dst_r     = (dst_color >> 16) & 0xff;
-            unsigned dst_g     = (dst_color >>  8) & 0xff;
-            unsigned dst_b     = (dst_color >>  0) & 0xff;
+static void ass_format_time(int64_t ms, char *buf, size_t buf_len)
+{
+   if (!buf || buf_len == 0)
+      return;
 
-            dst_r = (r * src_alpha + dst_r * dst_alpha) >> 8;
-            dst_g = (g * src_alpha + dst_g * dst_alpha) >> 8;
-            dst_b = (b * src_alpha + dst_b * dst_alpha) >> 8;
+   if (ms < 0)
+      ms = 0;
 
-            dst[x] = (0xffu << 24) | (dst_r << 16) |
-               (dst_g << 8) | (dst_b << 0);
-         }
-      }
-   }
+   int centiseconds = (int)((ms / 10) % 100);
+   int seconds = (int)((ms / 1000) % 60);
+   int minutes = (int)((ms / 60000) % 60);
+   int hours = (int)(ms / 3600000);
+
+   snprintf(buf, buf_len, "%d:%02d:%02d.%02d", hours, minutes, seconds, centiseconds);
 }
 
-static int bitmap_subtitle_scale_coord(int value, int src_size, int dst_size)
+static void ass_add_text_event_raw(ASS_Track *track, int64_t start_ms, int64_t end_ms, const char *text)
 {
-   if (src_size <= 0)
-      return value;
+   if (!text)
+      return;
 
-   return (int)(((int64_t)value * dst_size + src_size / 2) / src_size);
+   if (end_ms <= start_ms)
+      end_ms = start_ms + 2000;
+
+   char start_buf[32];
+   char end_buf[32];
+   ass_format_time(start_ms, start_buf, sizeof(start_buf));
+   ass_format_time(end_ms, end_buf, sizeof(end_buf));
+
+   size_t text_len = strlen(text);
+   size_t line_cap = text_len + 96;
+   char *line = (char*)malloc(line_cap);
+   if (!line)
+      return;
+
+   snprintf(line, line_cap, "Dialogue: 0,%s,%s,Default,,0,0,0,,%s",
+         start_buf, end_buf, text);
+   ass_process_line(track, line);
+   free(line);
 }
 
-static void blend_bitmap_subtitle_pixel(uint32_t *dst, uint32_t src)
+static void ass_add_text_event(ASS_Track *track, int64_t start_ms, int64_t end_ms, const char *text)
 {
-   unsigned src_a = (src >> 24) & 0xff;
-   unsigned src_r = (src >> 16) & 0xff;
-   unsigned src_g = (src >>  8) & 0xff;
-   unsigned src_b = (src >>  0) & 0xff;
-   unsigned inv_a = 255 - src_a;
-   uint32_t dst_color = *dst;
-   unsigned dst_r = (dst_color >> 16) & 0xff;
-   unsigned dst_g = (dst_color >>  8) & 0xff;
-   unsigned dst_b = (dst_color >>  0) & 0xff;
+   char *escaped = ass_escape_text(text);
 
-   if (src_a == 0)
+   if (!escaped)
       return;
 
-   if (src_a == 255)
-   {
-      *dst = src;
-      return;
-   }
+   if (end_ms <= start_ms)
+      end_ms = start_ms + 2000;
 
-   dst_r = src_r + ((dst_r * inv_a + 127) / 255);
-   dst_g = src_g + ((dst_g * inv_a + 127) / 255);
-   dst_b = src_b + ((dst_b * inv_a + 127) / 255);
+   ass_add_text_event_raw(track, start_ms, end_ms, escaped);
 
-   *dst = (0xffu << 24) | (dst_r << 16) | (dst_g << 8) | dst_b;
+   free(escaped);
 }
 
-static void render_bitmap_subtitle_event(uint32_t *buffer, unsigned width,
-      unsigned height, const struct bitmap_subtitle_event *event)
+static void ass_add_embedded_event(ASS_Track *track, int64_t start_ms,
+      int64_t end_ms, const char *ass_line)
 {
-   unsigned rect_index = 0;
-   int canvas_w = 0;
-   int canvas_h = 0;
+   const char *chunk = ass_line;
+   int64_t duration_ms = 0;
 
-   if (!buffer || width == 0 || height == 0 || !event)
+   if (!track || !ass_line || !*ass_line)
       return;
 
-   canvas_w = event->canvas_w > 0 ? event->canvas_w : (int)width;
-   canvas_h = event->canvas_h > 0 ? event->canvas_h : (int)height;
+   while (*chunk && isspace((unsigned char)*chunk))
+      chunk++;
 
-   for (rect_index = 0; rect_index < event->rect_count; rect_index++)
+   if (strncmp(chunk, "Dialogue:", 9) == 0)
    {
-      const struct bitmap_subtitle_rect *rect = &event->rects[rect_index];
-      int full_x0 = 0;
-      int full_y0 = 0;
-      int full_x1 = 0;
-      int full_y1 = 0;
-      int dst_x0 = 0;
-      int dst_y0 = 0;
-      int dst_x1 = 0;
-      int dst_y1 = 0;
-      int dst_w = 0;
-      int dst_h = 0;
-      int full_w = 0;
-      int full_h = 0;
-      int src_y = 0;
-
-      if (!rect->pixels || rect->w <= 0 || rect->h <= 0)
-         continue;
+      chunk += 9;
+      while (*chunk && isspace((unsigned char)*chunk))
+         chunk++;
+   }
+   else if (strncmp(chunk, "Comment:", 8) == 0)
+   {
+      return;
+   }
 
-      full_x0 = bitmap_subtitle_scale_coord(rect->x, canvas_w, (int)width);
-      full_y0 = bitmap_subtitle_scale_coord(rect->y, canvas_h, (int)height);
-      full_x1 = bitmap_subtitle_scale_coord(rect->x + rect->w, canvas_w, (int)width);
-      full_y1 = bitmap_subtitle_scale_coord(rect->y + rect->h, canvas_h, (int)height);
-
-      dst_x0 = full_x0;
-      dst_y0 = full_y0;
-      dst_x1 = full_x1;
-      dst_y1 = full_y1;
-
-      if (dst_x1 <= dst_x0)
-         dst_x1 = dst_x0 + 1;
-      if (dst_y1 <= dst_y0)
-         dst_y1 = dst_y0 + 1;
-
-      full_w = full_x1 - full_x0;
-      full_h = full_y1 - full_y0;
-      if (full_w <= 0)
-         full_w = 1;
-      if (full_h <= 0)
-         full_h = 1;
-
-      if (dst_x0 >= (int)width || dst_y0 >= (int)height || dst_x1 <= 0 || dst_y1 <= 0)
-         continue;
+   if (!*chunk)
+      return;
 
-      if (dst_x0 < 0)
-         dst_x0 = 0;
-      if (dst_y0 < 0)
-         dst_y0 = 0;
-      if (dst_x1 > (int)width)
-         dst_x1 = (int)width;
-      if (dst_y1 > (int)height)
-         dst_y1 = (int)height;
-
-      dst_w = dst_x1 - dst_x0;
-      dst_h = dst_y1 - dst_y0;
-      if (dst_w <= 0 || dst_h <= 0)
-         continue;
+   if (start_ms < 0)
+      start_ms = 0;
 
-      for (int dy = 0; dy < dst_h; dy++)
-      {
-         uint32_t *dst_row = buffer + (dst_y0 + dy) * width + dst_x0;
-         int full_dy = (dst_y0 - full_y0) + dy;
-         src_y = ((int64_t)full_dy * rect->h) / full_h;
-         if (src_y >= rect->h)
-            src_y = rect->h - 1;
-         if (src_y < 0)
-            src_y = 0;
+   duration_ms = end_ms - start_ms;
+   if (duration_ms <= 0)
+      duration_ms = 2000;
 
-         for (int dx = 0; dx < dst_w; dx++)
-         {
-            int full_dx = (dst_x0 - full_x0) + dx;
-            int src_x = ((int64_t)full_dx * rect->w) / full_w;
-            uint32_t src = 0;
+   ass_process_chunk(track, (char*)chunk, (int)strlen(chunk), start_ms, duration_ms);
+}
+
+/* Returns the number of the first @count events starting at or before
+ * start_ms. Text tracks of the media are kept sorted by start. */
+static int subtitle_text_upper_bound(const ASS_Event *events, int count,
+      long long start_ms)
+{
+   int lo = 0;
+   int hi = count;
 
-            if (src_x >= rect->w)
-               src_x = rect->w - 1;
-            if (src_x < 0)
-               src_x = 0;
+   while (lo < hi)
+   {
+      int mid = lo + (hi - lo) / 2;
 
-            src = rect->pixels[src_y * rect->w + src_x];
-            blend_bitmap_subtitle_pixel(&dst_row[dx], src);
-         }
-      }
+      if (events[mid].Start <= start_ms)
+         lo = mid + 1;
+      else
+         hi = mid;
    }
+
+   return lo;
 }
 
-static void render_subtitles_on_buffer(uint32_t *buffer, unsigned width,
-      unsigned height, double time_sec)
+/* Moves the event just appended to @track to its place by start, as
+ * backfilled events arrive out of order. */
+static void subtitle_text_sort_last_locked(ASS_Track *track)
 {
-   ASS_Track *render_track = NULL;
-   struct bitmap_subtitle_event *bitmap_event = NULL;
-   int subtitle_ptr = -1;
-   int64_t track_start_ms = -1;
+   int last = track->n_events - 1;
+   ASS_Event event;
+   int pos;
 
-   if (!buffer || width == 0 || height == 0)
+   if (last <= 0 || track->events[last - 1].Start <= track->events[last].Start)
       return;
 
-   if (subtitle_streams_num <= 0)
+   event = track->events[last];
+   pos   = subtitle_text_upper_bound(track->events, last, event.Start);
+   memmove(track->events + pos + 1, track->events + pos,
+         (size_t)(last - pos) * sizeof(*track->events));
+   track->events[pos] = event;
+}
+
+/* Called after an event starting at @start_ms was appended to the slot's
+ * track. Only the previous pending group is touched, so the cost does not
+ * grow with the track. */
+static void subtitle_text_resolve_durations_locked(unsigned slot,
+      ASS_Track *track, int64_t start_ms, bool unknown)
+{
+   int64_t pending = subtitle_text_pending_ms[slot];
+   int i;
+
+   if (start_ms < subtitle_text_latest_ms[slot])
+   {
+      /* Backfilled out of order, end it where the next event starts. */
+      if (!unknown)
+         return;
+      i = subtitle_text_upper_bound(track->events, track->n_events - 1, start_ms);
+      if (i < track->n_events - 1)
+         track->events[track->n_events - 1].Duration =
+            track->events[i].Start - start_ms;
       return;
+   }
 
-   if (decode_thread_lock)
+   subtitle_text_latest_ms[slot] = start_ms;
+
+   if (pending != INT64_MIN && start_ms > pending)
    {
-      slock_lock(decode_thread_lock);
-      if (subtitle_selection_is_valid(subtitle_streams_ptr))
+      /* The pending group sits right before this event. */
+      for (i = track->n_events - 2; i >= 0 && track->events[i].Start >= pending; i--)
       {
-         subtitle_ptr = subtitle_streams_ptr;
-         render_track = ass_track[subtitle_ptr];
+         ASS_Event *event = &track->events[i];
+         if (event->Start == pending &&
+               event->Duration == SUBTITLE_UNKNOWN_DURATION_MS)
+            event->Duration = start_ms - pending;
       }
-      slock_unlock(decode_thread_lock);
+      subtitle_text_pending_ms[slot] = INT64_MIN;
    }
 
-   if (subtitle_ptr < 0 || subtitle_ptr >= MAX_STREAMS)
+   if (unknown)
+      subtitle_text_pending_ms[slot] = start_ms;
+}
+
+static void subtitle_staged_event_free(struct subtitle_staged_event *staged)
+{
+   if (!staged)
       return;
 
-   if (subtitle_ptr >= 0 && subtitle_ptr < MAX_STREAMS)
-      track_start_ms = first_subtitle_start_ms[subtitle_ptr];
+   free(staged->ass);
+   free(staged->text);
+   bitmap_subtitle_clear_event(&staged->bitmap);
+   free(staged);
+}
 
-   AVFrame tmp_frame;
-   memset(&tmp_frame, 0, sizeof(tmp_frame));
-   tmp_frame.data[0] = (uint8_t*)buffer;
-   tmp_frame.linesize[0] = (int)width * (int)sizeof(uint32_t);
+static void subtitle_staged_event_apply_locked(struct subtitle_staged_event *staged)
+{
+   ASS_Track *track = NULL;
+   int n_events = 0;
 
-   slock_lock(ass_lock);
-   if (subtitle_track_is_bitmap((unsigned)subtitle_ptr))
+   if (staged->is_bitmap)
    {
-      long long now_ms = subtitle_adjust_render_time_ms(render_track,
-            subtitle_ptr, (long long)(time_sec * 1000.0));
-      bitmap_subtitle_prune_locked((unsigned)subtitle_ptr, now_ms);
-      bitmap_event = bitmap_subtitle_current_locked((unsigned)subtitle_ptr, now_ms);
-      if (bitmap_event)
-         render_bitmap_subtitle_event(buffer, width, height, bitmap_event);
+      bitmap_subtitle_end_previous_locked(staged->slot, staged->start_ms);
+      /* On success the slot takes ownership of the rects. */
+      if (staged->bitmap.rect_count > 0 &&
+            bitmap_subtitle_append_locked(staged->slot, &staged->bitmap))
+         memset(&staged->bitmap, 0, sizeof(staged->bitmap));
+      return;
    }
-   else if (render_track && ass_render)
-   {
-      int change = 0;
-      long long now_ms = subtitle_adjust_render_time_ms(render_track,
-            subtitle_ptr, (long long)(time_sec * 1000.0));
-      ASS_Image *img = ass_render_frame(ass_render, render_track, now_ms, &change);
 
-      if (!first_ass_render_logged)
-      {
-         log_cb(RETRO_LOG_INFO,
-               "[APLAYER] ass_render_frame first call: images=%s change=%d time_ms=%lld\n",
-               img ? "yes" : "no", change, now_ms);
-         first_ass_render_logged = true;
-      }
+   track = staged->slot < MAX_STREAMS ? ass_track[staged->slot] : NULL;
+   if (!track)
+      return;
 
-      if (subtitle_ptr >= 0 && subtitle_ptr < MAX_STREAMS &&
-            img && !first_ass_image_logged[subtitle_ptr])
-      {
-         log_cb(RETRO_LOG_INFO,
-               "[APLAYER] ass_render_frame first non-null image: change=%d time_ms=%lld track=%d first_sub_start_ms=%lld\n",
-               change, now_ms, subtitle_ptr, (long long)track_start_ms);
-         first_ass_image_logged[subtitle_ptr] = true;
-      }
-      else if (subtitle_ptr >= 0 && subtitle_ptr < MAX_STREAMS &&
-            !img && !first_ass_after_sub_logged[subtitle_ptr] &&
-            track_start_ms >= 0 &&
-            now_ms >= track_start_ms)
-      {
-         log_cb(RETRO_LOG_INFO,
-               "[APLAYER] ass_render_frame no image at/after first subtitle start: change=%d time_ms=%lld track=%d first_sub_start_ms=%lld\n",
-               change, now_ms, subtitle_ptr, (long long)track_start_ms);
-         first_ass_after_sub_logged[subtitle_ptr] = true;
-      }
+   n_events = track->n_events;
+   if (staged->ass)
+      ass_add_embedded_event(track, staged->start_ms, staged->end_ms, staged->ass);
+   else if (staged->text)
+      ass_add_text_event(track, staged->start_ms, staged->end_ms, staged->text);
 
-      if (img)
-         render_ass_img(&tmp_frame, img);
-   }
-   slock_unlock(ass_lock);
+   /* Duplicates are dropped by libass, only new events need timing. */
+   if (track->n_events <= n_events)
+      return;
+   subtitle_text_account_locked(staged->slot, track, n_events);
+   if (!subtitle_is_ass[staged->slot])
+      subtitle_text_resolve_durations_locked(staged->slot, track, staged->start_ms,
+            staged->end_ms - staged->start_ms == SUBTITLE_UNKNOWN_DURATION_MS);
+   subtitle_text_sort_last_locked(track);
 }
 
-static void bitmap_subtitle_convert_palette(uint32_t *colors, size_t count)
+/* Consumer side of subtitle_stage, callers hold ass_lock. */
+static void subtitle_stage_drain_locked(bool apply)
 {
-   size_t i = 0;
+   struct subtitle_staged_event *staged = NULL;
 
-   if (!colors)
-      return;
+   while (spsc_ring_read(subtitle_stage, &staged, sizeof(staged)) == sizeof(staged))
+   {
+      if (apply)
+         subtitle_staged_event_apply_locked(staged);
+      subtitle_staged_event_free(staged);
+   }
+}
 
-   for (i = 0; i < count; i++)
+/* Producer side, decode thread only. */
+static void subtitle_stage_push(struct subtitle_staged_event *staged)
+{
+   unsigned slot    = staged->slot;
+   int64_t start_ms = staged->start_ms;
+   bool prune       = !staged->is_bitmap && slot < MAX_STREAMS &&
+         ++subtitle_text_staged[slot] >= SUBTITLE_TEXT_PRUNE_MIN_EVENTS;
+
+   if (spsc_ring_write_avail(subtitle_stage) >= sizeof(staged))
    {
-      uint32_t c = colors[i];
-      uint32_t b = c & 0xff;
-      uint32_t g = (c >> 8) & 0xff;
-      uint32_t r = (c >> 16) & 0xff;
-      uint32_t a = (c >> 24) & 0xff;
+      spsc_ring_write(subtitle_stage, &staged, sizeof(staged));
+      staged = NULL;
+   }
 
-      b = b * a / 255;
-      g = g * a / 255;
-      r = r * a / 255;
+   if (!staged && !prune)
+      return;
 
-      colors[i] = b | (g << 8) | (r << 16) | (a << 24);
+   slock_lock(ass_lock);
+   if (staged)
+   {
+      /* Nobody rendered for a while (or the queue is missing), so apply
+       * the backlog here rather than waiting for a consumer. */
+      subtitle_stage_drain_locked(true);
+      subtitle_staged_event_apply_locked(staged);
    }
+   /* Pruned here every so many events rather than by the renderers.
+    * The decode position runs ahead of playback by far less than the
+    * prune distance. */
+   if (prune)
+   {
+      subtitle_text_staged[slot] = 0;
+      subtitle_prune_text_events_locked(slot, start_ms);
+   }
+   slock_unlock(ass_lock);
+   subtitle_staged_event_free(staged);
 }
 
-static bool bitmap_subtitle_build_event(AVCodecContext *ctx, const AVSubtitle *sub,
-      int64_t start_ms, int64_t end_ms, bool end_known,
-      struct bitmap_subtitle_event *event)
+/* Decodes one embedded subtitle packet and hands the resulting events
+ * to @emit, which takes ownership of them. Only the decode thread sets
+ * @record_first, to log and record the first event of the media. */
+static void subtitle_decode_packet(AVCodecContext *sctx_sub, unsigned slot,
+      AVRational time_base, AVPacket *pkt, bool record_first,
+      void (*emit)(struct subtitle_staged_event *staged))
 {
-   int canvas_w = 0;
-   int canvas_h = 0;
-   unsigned rect_count = 0;
+   AVSubtitle sub;
+   unsigned i;
+   int finished = 0;
+   int64_t base_time_ms = 0;
+   int64_t start_ms = 0;
+   int64_t end_ms = 0;
+   int64_t duration_ms = 0;
+   bool end_known = false;
 
-   if (!sub || !event || sub->num_rects <= 0)
-      return false;
+   memset(&sub, 0, sizeof(sub));
 
-   memset(event, 0, sizeof(*event));
-   event->start_ms = start_ms;
-   event->end_ms = end_ms;
-   event->end_known = end_known;
+   /* Subtitle decoders consume one packet at a time; some packets
+    * validly produce no completed subtitle. Do not retry them. */
+   if (avcodec_decode_subtitle2(sctx_sub, &sub, &finished, pkt) < 0)
+   {
+      log_cb(RETRO_LOG_ERROR, "[APLAYER] Decode subtitles failed.\n");
+      avsubtitle_free(&sub);
+      return;
+   }
 
-   if (ctx)
+   if (!finished)
    {
-      canvas_w = ctx->width;
-      canvas_h = ctx->height;
+      avsubtitle_free(&sub);
+      return;
    }
 
-   event->rects = (struct bitmap_subtitle_rect*)calloc((size_t)sub->num_rects,
-         sizeof(*event->rects));
-   if (!event->rects)
-      return false;
+   if (pkt->pts != AV_NOPTS_VALUE)
+      base_time_ms = (int64_t)(pkt->pts * av_q2d(time_base) * 1000.0);
+   else if (sub.pts != AV_NOPTS_VALUE)
+      base_time_ms = sub.pts / 1000;
 
-   for (int i = 0; i < sub->num_rects; i++)
+   start_ms = base_time_ms + (int64_t)sub.start_display_time;
+   if (sub.end_display_time != UINT32_MAX &&
+         sub.end_display_time > sub.start_display_time)
    {
-      const AVSubtitleRect *rect = sub->rects[i];
-      struct bitmap_subtitle_rect *dst = NULL;
-      uint32_t palette[256] = {0};
-      uint32_t *pixels = NULL;
-      int palette_size = 0;
+      duration_ms = (int64_t)sub.end_display_time - (int64_t)sub.start_display_time;
+      end_known = true;
+   }
 
-      if (!rect || rect->type != SUBTITLE_BITMAP ||
-            rect->w <= 0 || rect->h <= 0 ||
-            !rect->data[0] || !rect->data[1] || rect->linesize[0] <= 0)
+   if (duration_ms <= 0 && pkt->duration > 0)
+   {
+      double packet_duration_ms = pkt->duration * av_q2d(time_base) * 1000.0;
+      if (packet_duration_ms > 0.0)
       {
-         continue;
+         duration_ms = (int64_t)(packet_duration_ms + 0.5);
+         end_known = true;
       }
+   }
 
-      palette_size = rect->nb_colors;
-      if (palette_size <= 0 || palette_size > 256)
-         continue;
-
-      pixels = (uint32_t*)malloc((size_t)rect->w * (size_t)rect->h * sizeof(*pixels));
-      if (!pixels)
-         continue;
+   if (end_known)
+      end_ms = start_ms + duration_ms;
+   else
+      end_ms = start_ms;
 
-      memcpy(palette, rect->data[1], (size_t)palette_size * sizeof(palette[0]));
-      bitmap_subtitle_convert_palette(palette, 256);
+   if (subtitle_track_is_bitmap(slot))
+   {
+      struct subtitle_staged_event *staged = (struct subtitle_staged_event*)
+         calloc(1, sizeof(*staged));
 
-      for (int y = 0; y < rect->h; y++)
+      if (staged)
       {
-         const uint8_t *src_row = rect->data[0] + y * rect->linesize[0];
-         uint32_t *dst_row = pixels + (size_t)y * (size_t)rect->w;
+         staged->slot      = slot;
+         staged->start_ms  = start_ms;
+         staged->end_ms    = end_ms;
+         staged->is_bitmap = true;
+
+         /* An empty packet only ends the previous event. */
+         if (sub.num_rects > 0 &&
+               bitmap_subtitle_build_event(sctx_sub, &sub, start_ms, end_ms,
+                  end_known, &staged->bitmap))
+         {
+            if (record_first && !first_subtitle_event_logged)
+            {
+               if (first_subtitle_start_ms[slot] < 0)
+                  first_subtitle_start_ms[slot] = start_ms;
+               log_cb(RETRO_LOG_INFO,
+                     "[APLAYER] First subtitle event (bitmap): stream=%d slot=%u start_ms=%lld end_ms=%s%lld rects=%u\n",
+                     pkt->stream_index, slot,
+                     (long long)start_ms,
+                     end_known ? "" : "unknown/",
+                     (long long)end_ms,
+                     staged->bitmap.rect_count);
+               first_subtitle_event_logged = true;
+            }
+         }
 
-         for (int x = 0; x < rect->w; x++)
-            dst_row[x] = palette[src_row[x]];
+         emit(staged);
       }
 
-      dst = &event->rects[rect_count++];
-      dst->x = rect->x;
-      dst->y = rect->y;
-      dst->w = rect->w;
-      dst->h = rect->h;
-      dst->pixels = pixels;
-
-      if (dst->x + dst->w > canvas_w)
-         canvas_w = dst->x + dst->w;
-      if (dst->y + dst->h > canvas_h)
-         canvas_h = dst->y + dst->h;
+      avsubtitle_free(&sub);
+      return;
    }
 
-   if (rect_count == 0)
+   if (duration_ms <= 0)
+      duration_ms = SUBTITLE_UNKNOWN_DURATION_MS;
+
+   end_ms = start_ms + duration_ms;
+
+   for (i = 0; ass_track[slot] && i < sub.num_rects; i++)
    {
-      bitmap_subtitle_clear_event(event);
-      return false;
+      struct subtitle_staged_event *staged = NULL;
+      const char *raw_text = NULL;
+      const char *ass_payload = NULL;
+
+      if (!sub.rects[i])
+         continue;
+
+      raw_text    = sub.rects[i]->text;
+      ass_payload = sub.rects[i]->ass;
+      if (!raw_text && !ass_payload)
+         continue;
+
+      if (record_first && !first_subtitle_event_logged)
+      {
+         const char *payload = ass_payload ? ass_payload : raw_text;
+         if (first_subtitle_start_ms[slot] < 0)
+            first_subtitle_start_ms[slot] = start_ms;
+         log_cb(RETRO_LOG_INFO,
+               "[APLAYER] First subtitle event (%s): stream=%d slot=%u start_ms=%lld end_ms=%lld text=\"%.200s\"\n",
+               ass_payload && subtitle_is_ass[slot] ? "ass" : "text",
+               pkt->stream_index, slot,
+               (long long)start_ms, (long long)end_ms,
+               payload);
+         first_subtitle_event_logged = true;
+      }
+
+      staged = (struct subtitle_staged_event*)calloc(1, sizeof(*staged));
+      if (!staged)
+         continue;
+
+      staged->slot     = slot;
+      staged->start_ms = start_ms;
+      staged->end_ms   = end_ms;
+      staged->ass      = ass_payload ? strdup(ass_payload) : NULL;
+      staged->text     = !ass_payload ? strdup(raw_text) : NULL;
+      emit(staged);
    }
 
-   event->rect_count = rect_count;
-   event->canvas_w = canvas_w > 0 ? canvas_w : media.width;
-   event->canvas_h = canvas_h > 0 ? canvas_h : media.height;
-   return true;
+   avsubtitle_free(&sub);
 }
 
-static char *ass_escape_text(const char *text)
+static int64_t subtitle_packet_time_ms(const AVPacket *pkt, AVRational time_base)
 {
-   size_t len = strlen(text);
-   char *out = (char*)malloc(len * 2 + 1);
-   char *dst = out;
+   int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
 
-   if (!out)
-      return NULL;
+   if (ts == AV_NOPTS_VALUE)
+      return AV_NOPTS_VALUE;
 
-   for (const char *src = text; *src; src++)
-   {
-      if (*src == '\r')
-         continue;
-      if (*src == '\n')
-      {
-         *dst++ = '\\';
-         *dst++ = 'N';
-         continue;
-      }
+   return av_rescale_q(ts, time_base, (AVRational){1, 1000});
+}
 
-      if (*src == '{' || *src == '}' || *src == '\\')
-         *dst++ = '\\';
+/* First entry at or after @time_ms. */
+static size_t subtitle_packet_index_lower_bound(
+      const struct subtitle_packet_index *index, int64_t time_ms)
+{
+   size_t lo = 0;
+   size_t hi = index->count;
 
-      *dst++ = *src;
+   while (lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+      if (index->entries[mid].pts_ms < time_ms)
+         lo = mid + 1;
+      else
+         hi = mid;
    }
 
-   *dst = '\0';
-   return out;
+   return lo;
 }
 
-static void ass_process_line(ASS_Track *track, const char *line)
+static void subtitle_packet_index_add(unsigned slot, const AVPacket *pkt,
+      AVRational time_base)
 {
-   if (!line || !*line)
-      return;
+   struct subtitle_packet_index *index = NULL;
+   int64_t pts_ms = 0;
+   size_t pos = 0;
 
-   const char *prefix = "";
-   if (strncmp(line, "Dialogue:", 9) != 0 &&
-         strncmp(line, "Comment:", 8) != 0 &&
-         strncmp(line, "Style:", 6) != 0 &&
-         strncmp(line, "Format:", 7) != 0 &&
-         line[0] != '[')
-      prefix = "Dialogue: ";
+   if (slot >= MAX_STREAMS)
+      return;
 
-   size_t prefix_len = strlen(prefix);
-   size_t len = strlen(line);
-   bool has_newline = len > 0 && line[len - 1] == '\n';
-   size_t total_len = prefix_len + len + (has_newline ? 0 : 1);
+   pts_ms = subtitle_packet_time_ms(pkt, time_base);
+   if (pts_ms == AV_NOPTS_VALUE)
+      return;
 
-   char *buf = (char*)malloc(total_len + 1);
-   if (!buf)
+   /* Packets arrive in order, except after a backward seek where
+    * already indexed ones are read again. */
+   index = &subtitle_packet_index[slot];
+   pos = subtitle_packet_index_lower_bound(index, pts_ms);
+   if (pos < index->count && index->entries[pos].pts_ms == pts_ms)
       return;
 
-   memcpy(buf, prefix, prefix_len);
-   memcpy(buf + prefix_len, line, len);
-   if (!has_newline)
-      buf[prefix_len + len] = '\n';
-   buf[total_len] = '\0';
+   if (index->count >= index->cap)
+   {
+      size_t new_cap = index->cap ? index->cap * 2 : 256;
+      struct subtitle_packet_entry *entries = (struct subtitle_packet_entry*)
+         realloc(index->entries, new_cap * sizeof(*entries));
+      if (!entries)
+         return;
 
-   ass_process_data(track, buf, total_len);
-   free(buf);
+      index->entries = entries;
+      index->cap     = new_cap;
+   }
+
+   if (pos < index->count)
+      memmove(index->entries + pos + 1, index->entries + pos,
+            (index->count - pos) * sizeof(*index->entries));
+
+   index->entries[pos].pts_ms = pts_ms;
+   index->entries[pos].pos    = pkt->pos;
+   index->count++;
 }
 
-static void ass_format_time(int64_t ms, char *buf, size_t buf_len)
+static void subtitle_packet_index_free(void)
 {
-   if (!buf || buf_len == 0)
-      return;
+   unsigned i;
 
-   if (ms < 0)
-      ms = 0;
+   for (i = 0; i < MAX_STREAMS; i++)
+   {
+      free(subtitle_packet_index[i].entries);
+      memset(&subtitle_packet_index[i], 0, sizeof(subtitle_packet_index[i]));
+   }
+}
 
-   int centiseconds = (int)((ms / 10) % 100);
-   int seconds = (int)((ms / 1000) % 60);
-   int minutes = (int)((ms / 60000) % 60);
-   int hours = (int)(ms / 3600000);
+static bool subtitle_slot_has_event_locked(unsigned slot, int64_t start_ms)
+{
+   ASS_Track *track = NULL;
+   int pos;
 
-   snprintf(buf, buf_len, "%d:%02d:%02d.%02d", hours, minutes, seconds, centiseconds);
+   if (subtitle_track_is_bitmap(slot))
+   {
+      size_t index = bitmap_subtitle_upper_bound_locked(slot, start_ms);
+      return index > 0 &&
+            bitmap_subtitle_events[slot][index - 1].start_ms == start_ms;
+   }
+
+   track = ass_track[slot];
+   if (!track)
+      return false;
+
+   pos = subtitle_text_upper_bound(track->events, track->n_events, start_ms);
+   return pos > 0 && track->events[pos - 1].Start == start_ms;
+}
+
+static void subtitle_backfill_emit(struct subtitle_staged_event *staged)
+{
+   slock_lock(ass_lock);
+   subtitle_staged_event_apply_locked(staged);
+   slock_unlock(ass_lock);
+   subtitle_staged_event_free(staged);
+}
+
+static int subtitle_backfill_interrupt(void *opaque)
+{
+   struct subtitle_backfill *job = (struct subtitle_backfill*)opaque;
+   return job->cancel;
 }
 
-static void ass_add_text_event_raw(ASS_Track *track, int64_t start_ms, int64_t end_ms, const char *text)
+static void subtitle_backfill_thread(void *data)
 {
-   if (!text)
-      return;
+   struct subtitle_backfill *job = (struct subtitle_backfill*)data;
+   AVFormatContext *bctx = NULL;
+   AVCodecContext *bsctx = NULL;
+   AVPacket *pkt = NULL;
+   AVStream *st = NULL;
+   enum AVCodecID codec_id;
+   unsigned packets = 0;
+   unsigned i;
 
-   if (end_ms <= start_ms)
-      end_ms = start_ms + 2000;
+   bctx = avformat_alloc_context();
+   if (!bctx)
+      return;
 
-   char start_buf[32];
-   char end_buf[32];
-   ass_format_time(start_ms, start_buf, sizeof(start_buf));
-   ass_format_time(end_ms, end_buf, sizeof(end_buf));
+   bctx->interrupt_callback.callback = subtitle_backfill_interrupt;
+   bctx->interrupt_callback.opaque   = job;
 
-   size_t text_len = strlen(text);
-   size_t line_cap = text_len + 96;
-   char *line = (char*)malloc(line_cap);
-   if (!line)
+   if (avformat_open_input(&bctx, job->url, NULL, NULL) < 0)
       return;
 
-   snprintf(line, line_cap, "Dialogue: 0,%s,%s,Default,,0,0,0,,%s",
-         start_buf, end_buf, text);
-   ass_process_line(track, line);
-   free(line);
-}
-
-static void ass_add_text_event(ASS_Track *track, int64_t start_ms, int64_t end_ms, const char *text)
-{
-   char *escaped = ass_escape_text(text);
+   if (job->stream_index >= (int)bctx->nb_streams)
+      avformat_find_stream_info(bctx, NULL);
+   if (job->stream_index >= (int)bctx->nb_streams)
+      goto end;
 
-   if (!escaped)
-      return;
+   for (i = 0; i < bctx->nb_streams; i++)
+      bctx->streams[i]->discard = (int)i == job->stream_index ?
+            AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+   /* Seek on the default stream, subtitle streams are rarely indexed. */
+   if (avformat_seek_file(bctx, -1, INT64_MIN,
+            job->from_ms * (AV_TIME_BASE / 1000),
+            job->from_ms * (AV_TIME_BASE / 1000), 0) < 0 &&
+         (job->from_pos < 0 ||
+          avformat_seek_file(bctx, -1, INT64_MIN, job->from_pos,
+             job->from_pos, AVSEEK_FLAG_BYTE) < 0))
+      goto end;
 
-   if (end_ms <= start_ms)
-      end_ms = start_ms + 2000;
+   st       = bctx->streams[job->stream_index];
+   codec_id = st->codecpar->codec_id;
+   if (!open_subtitle_codec(&bsctx, st->codecpar,
+            codec_id_is_text_subtitle(codec_id) || codec_name_is_text_subtitle(codec_id)))
+      goto end;
 
-   ass_add_text_event_raw(track, start_ms, end_ms, escaped);
+   pkt = av_packet_alloc();
+   while (pkt && !job->cancel && av_read_frame(bctx, pkt) >= 0)
+   {
+      int64_t pts_ms = AV_NOPTS_VALUE;
+      bool have_event = false;
 
-   free(escaped);
-}
+      if (pkt->stream_index != job->stream_index)
+      {
+         av_packet_unref(pkt);
+         continue;
+      }
 
-static void ass_add_embedded_event(ASS_Track *track, int64_t start_ms,
-      int64_t end_ms, const char *ass_line)
-{
-   const char *chunk = ass_line;
-   int64_t duration_ms = 0;
+      pts_ms = subtitle_packet_time_ms(pkt, st->time_base);
+      /* The decode thread took over from here. */
+      if (pts_ms != AV_NOPTS_VALUE && pts_ms > job->to_ms)
+      {
+         av_packet_unref(pkt);
+         break;
+      }
 
-   if (!track || !ass_line || !*ass_line)
-      return;
+      if (pts_ms != AV_NOPTS_VALUE && pts_ms >= job->from_ms)
+      {
+         slock_lock(ass_lock);
+         have_event = subtitle_slot_has_event_locked(job->slot, pts_ms);
+         slock_unlock(ass_lock);
 
-   while (*chunk && isspace((unsigned char)*chunk))
-      chunk++;
+         if (!have_event)
+         {
+            subtitle_decode_packet(bsctx, job->slot, st->time_base, pkt,
+                  false, subtitle_backfill_emit);
+            packets++;
+         }
+      }
 
-   if (strncmp(chunk, "Dialogue:", 9) == 0)
-   {
-      chunk += 9;
-      while (*chunk && isspace((unsigned char)*chunk))
-         chunk++;
-   }
-   else if (strncmp(chunk, "Comment:", 8) == 0)
-   {
-      return;
+      av_packet_unref(pkt);
    }
 
-   if (!*chunk)
-      return;
+   log_cb(RETRO_LOG_INFO,
+         "[APLAYER] Subtitle slot %u backfilled %u packets (%lld-%lld ms)\n",
+         job->slot, packets, (long long)job->from_ms, (long long)job->to_ms);
 
-   if (start_ms < 0)
-      start_ms = 0;
+end:
+   av_packet_free(&pkt);
+   avcodec_free_context(&bsctx);
+   avformat_close_input(&bctx);
+}
 
-   duration_ms = end_ms - start_ms;
-   if (duration_ms <= 0)
-      duration_ms = 2000;
+static void subtitle_backfill_release(void)
+{
+   if (subtitle_backfill.thread)
+   {
+      subtitle_backfill.cancel = true;
+      sthread_join(subtitle_backfill.thread);
+   }
 
-   ass_process_chunk(track, (char*)chunk, (int)strlen(chunk), start_ms, duration_ms);
+   free(subtitle_backfill.url);
+   memset(&subtitle_backfill, 0, sizeof(subtitle_backfill));
 }
 
-static void ass_backfill_unknown_event_durations(ASS_Track *track)
+/* Called by the decode thread when @slot becomes the selected track. */
+static void subtitle_backfill_start(unsigned slot)
 {
-   int last = 0;
+   const struct subtitle_packet_index *index = &subtitle_packet_index[slot];
+   double playhead = 0.0;
+   int64_t playhead_ms = 0;
+   size_t first = 0;
 
-   if (!track || track->n_events <= 1)
+   subtitle_backfill_release();
+
+   if (!sctx[slot] || !fctx || !fctx->url)
       return;
 
-   last = track->n_events - 1;
-   for (int i = last - 1; i >= 0; i--)
-   {
-      ASS_Event *event = &track->events[i];
-      ASS_Event *next = &track->events[i + 1];
+   /* The decoder missed every packet since the track was last selected. */
+   avcodec_flush_buffers(sctx[slot]);
 
-      if (track->events[last].Start == event->Start)
-         continue;
+   playhead    = (double)frame_cnt / media.interpolate_fps + pts_bias;
+   playhead   -= aplayer_loop_offset_at(playhead);
+   playhead_ms = (int64_t)(playhead * 1000.0);
+   first = subtitle_packet_index_lower_bound(index,
+         playhead_ms - SUBTITLE_BACKFILL_LOOKBEHIND_MS);
+   if (first >= index->count)
+      return;
 
-      if (event->Duration == SUBTITLE_UNKNOWN_DURATION_MS)
-      {
-         if (event->Start < next->Start)
-            event->Duration = next->Start - event->Start;
-         else if (event->Start == next->Start)
-            event->Duration = next->Duration;
-      }
+   subtitle_backfill.url          = strdup(fctx->url);
+   subtitle_backfill.slot         = slot;
+   subtitle_backfill.stream_index = subtitle_streams[slot];
+   subtitle_backfill.from_ms      = index->entries[first].pts_ms;
+   subtitle_backfill.to_ms        = index->entries[index->count - 1].pts_ms;
+   subtitle_backfill.from_pos     = index->entries[first].pos;
+   subtitle_backfill.cancel       = false;
 
-      if (i > 0 && event->Start != track->events[i - 1].Start)
-         break;
-   }
+   if (subtitle_backfill.url)
+      subtitle_backfill.thread = sthread_create(subtitle_backfill_thread,
+            &subtitle_backfill);
+   if (!subtitle_backfill.thread)
+      subtitle_backfill_release();
 }
 
 static bool path_replace_extension(const char *path, const char *new_ext, char *out, size_t out_size)
@@ -5315,11 +7729,21 @@ static bool parse_srt_timestamp_ms(const char *s, int64_t *out_ms)
    if (!parse_uint_component(p, &hours, &p) || *p != ':')
       return false;
    p++;
-   if (!parse_uint_component(p, &minutes, &p) || *p != ':')
-      return false;
-   p++;
-   if (!parse_uint_component(p, &seconds, &p))
+   if (!parse_uint_component(p, &minutes, &p))
       return false;
+   if (*p == ':')
+   {
+      p++;
+      if (!parse_uint_component(p, &seconds, &p))
+         return false;
+   }
+   else
+   {
+      /* WebVTT allows the hours to be omitted (mm:ss.ttt). */
+      seconds = minutes;
+      minutes = hours;
+      hours   = 0;
+   }
 
    if (*p == ',' || *p == '.')
    {
@@ -5374,25 +7798,331 @@ static bool parse_srt_time_range_ms(const char *line, int64_t *start_ms, int64_t
    return true;
 }
 
-static bool srt_add_events_from_buffer(ASS_Track *track, char *buf, size_t buf_size,
-      int64_t *first_start_ms_out, AVCodecContext *converter)
+struct subtitle_text_buffer
+{
+   char *data;
+   size_t len;
+   size_t cap;
+};
+
+static bool subtitle_text_buffer_append(struct subtitle_text_buffer *b,
+      const char *s, size_t len)
+{
+   if (b->len + len + 1 > b->cap)
+   {
+      size_t new_cap = b->cap ? b->cap * 2 : 256;
+      char *new_data = NULL;
+
+      while (new_cap < b->len + len + 1)
+         new_cap *= 2;
+
+      new_data = (char*)realloc(b->data, new_cap);
+      if (!new_data)
+         return false;
+
+      b->data = new_data;
+      b->cap = new_cap;
+   }
+
+   memcpy(b->data + b->len, s, len);
+   b->len += len;
+   b->data[b->len] = '\0';
+   return true;
+}
+
+static bool subtitle_text_buffer_append_str(struct subtitle_text_buffer *b,
+      const char *s)
+{
+   return subtitle_text_buffer_append(b, s, strlen(s));
+}
+
+static bool srt_parse_font_color(const char *attrs, size_t len, uint32_t *rgb)
+{
+   static const struct { const char *name; uint32_t rgb; } named[] = {
+      { "white",   0xffffff }, { "black",   0x000000 },
+      { "red",     0xff0000 }, { "green",   0x00ff00 },
+      { "blue",    0x0000ff }, { "yellow",  0xffff00 },
+      { "cyan",    0x00ffff }, { "magenta", 0xff00ff },
+      { "gray",    0x808080 }, { "grey",    0x808080 },
+   };
+   char value[32];
+   size_t value_len = 0;
+   size_t i = 0;
+
+   for (i = 0; i + 5 <= len; i++)
+   {
+      if (strncasecmp(attrs + i, "color", 5) == 0)
+         break;
+   }
+   if (i + 5 > len)
+      return false;
+
+   i += 5;
+   while (i < len && (isspace((unsigned char)attrs[i]) || attrs[i] == '='))
+      i++;
+   if (i < len && (attrs[i] == '"' || attrs[i] == '\''))
+      i++;
+   if (i < len && attrs[i] == '#')
+      i++;
+
+   while (i < len && value_len + 1 < sizeof(value) &&
+         isalnum((unsigned char)attrs[i]))
+      value[value_len++] = attrs[i++];
+   value[value_len] = '\0';
+
+   if (value_len == 6)
+   {
+      char *end = NULL;
+      unsigned long v = strtoul(value, &end, 16);
+      if (end && *end == '\0')
+      {
+         *rgb = (uint32_t)v;
+         return true;
+      }
+   }
+
+   for (i = 0; i < sizeof(named) / sizeof(named[0]); i++)
+   {
+      if (strcasecmp(value, named[i].name) == 0)
+      {
+         *rgb = named[i].rgb;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+/* Maps a single SRT/WebVTT markup tag (without the angle brackets)
+ * to ASS override tags. Unknown tags such as <c.class> or <v Name>
+ * are dropped. */
+static bool srt_append_tag(struct subtitle_text_buffer *out,
+      const char *tag, size_t len)
+{
+   static const struct { const char *srt; const char *ass; } simple[] = {
+      { "i", "{\\i1}" }, { "/i", "{\\i0}" },
+      { "b", "{\\b1}" }, { "/b", "{\\b0}" },
+      { "u", "{\\u1}" }, { "/u", "{\\u0}" },
+      { "s", "{\\s1}" }, { "/s", "{\\s0}" },
+      { "/font", "{\\c}" },
+   };
+   size_t i = 0;
+
+   while (len > 0 && isspace((unsigned char)tag[len - 1]))
+      len--;
+
+   for (i = 0; i < sizeof(simple) / sizeof(simple[0]); i++)
+   {
+      if (strlen(simple[i].srt) == len &&
+            strncasecmp(tag, simple[i].srt, len) == 0)
+         return subtitle_text_buffer_append_str(out, simple[i].ass);
+   }
+
+   if (len > 5 && strncasecmp(tag, "font", 4) == 0 &&
+         isspace((unsigned char)tag[4]))
+   {
+      uint32_t rgb = 0;
+      char color[32];
+
+      if (!srt_parse_font_color(tag + 5, len - 5, &rgb))
+         return true;
+
+      snprintf(color, sizeof(color), "{\\c&H%02X%02X%02X&}",
+            (unsigned)(rgb & 0xff),
+            (unsigned)((rgb >> 8) & 0xff),
+            (unsigned)((rgb >> 16) & 0xff));
+      return subtitle_text_buffer_append_str(out, color);
+   }
+
+   return true;
+}
+
+/* Native replacement for the libavcodec SubRip decoder: converts cue
+ * text to an ASS dialogue text field. Handles <i>, <b>, <u>, <s>,
+ * <font color>, SRT {\anN}/{\pos} positioning blocks and the common
+ * HTML entities used by WebVTT. */
+static bool srt_text_to_ass(struct subtitle_text_buffer *out,
+      const char *text, size_t len)
+{
+   static const struct { const char *entity; const char *text; } entities[] = {
+      { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" },
+      { "&quot;", "\"" }, { "&apos;", "'" }, { "&nbsp;", "\\h" },
+   };
+   size_t i = 0;
+   bool ok = true;
+
+   while (ok && i < len)
+   {
+      const char *c = text + i;
+
+      if (*c == '\r')
+      {
+         i++;
+         continue;
+      }
+
+      if (*c == '\n')
+      {
+         ok = subtitle_text_buffer_append(out, "\\N", 2);
+         i++;
+         continue;
+      }
+
+      if (*c == '<')
+      {
+         const char *close = (const char*)memchr(c + 1, '>', len - i - 1);
+         const char *newline = (const char*)memchr(c + 1, '\n', len - i - 1);
+
+         if (close && (!newline || close < newline))
+         {
+            ok = srt_append_tag(out, c + 1, (size_t)(close - c - 1));
+            i += (size_t)(close - c) + 1;
+            continue;
+         }
+      }
+      else if (*c == '{')
+      {
+         const char *close = (const char*)memchr(c + 1, '}', len - i - 1);
+
+         /* SRT files commonly carry ASS positioning such as {\an8}. */
+         if (i + 1 < len && c[1] == '\\' && close)
+         {
+            ok = subtitle_text_buffer_append(out, c, (size_t)(close - c) + 1);
+            i += (size_t)(close - c) + 1;
+            continue;
+         }
+
+         ok = subtitle_text_buffer_append(out, "\\{", 2);
+         i++;
+         continue;
+      }
+      else if (*c == '}' || *c == '\\')
+      {
+         char escaped[2] = { '\\', *c };
+         ok = subtitle_text_buffer_append(out, escaped, 2);
+         i++;
+         continue;
+      }
+      else if (*c == '&')
+      {
+         size_t e = 0;
+
+         for (e = 0; e < sizeof(entities) / sizeof(entities[0]); e++)
+         {
+            size_t entity_len = strlen(entities[e].entity);
+            if (i + entity_len <= len &&
+                  strncmp(c, entities[e].entity, entity_len) == 0)
+               break;
+         }
+
+         if (e < sizeof(entities) / sizeof(entities[0]))
+         {
+            ok = subtitle_text_buffer_append_str(out, entities[e].text);
+            i += strlen(entities[e].entity);
+            continue;
+         }
+      }
+
+      ok = subtitle_text_buffer_append(out, c, 1);
+      i++;
+   }
+
+   return ok;
+}
+
+/* Lines assumed on screen when a WebVTT cue gives its line position as
+ * a line number. The real count depends on the video height and font
+ * size, which the converter does not know. */
+#define VTT_CUE_LINE_GRID 15
+
+/* WebVTT cue settings: a line position in the upper half moves the cue
+ * to the top of the screen. Percentages are taken as they are. A line
+ * number counts from the top when positive and from the bottom when
+ * negative, so only positive numbers in the upper half of a
+ * VTT_CUE_LINE_GRID grid count as top, which leaves cues placed a few
+ * lines above the bottom, e.g. line:12, at the bottom. */
+static bool vtt_cue_is_top_aligned(const char *timing_line)
 {
-   char *cursor = buf;
-   char *end = buf + buf_size;
-   int64_t first_start_ms = -1;
-   bool any = false;
+   const char *line = strstr(timing_line, "line:");
+   char *end = NULL;
+   double value;
 
-   if (first_start_ms_out)
-      *first_start_ms_out = -1;
+   if (!line)
+      return false;
 
-   if (!track || !buf || buf_size == 0)
+   value = strtod(line + 5, &end);
+   if (end == line + 5)
       return false;
 
-   while (true)
+   if (*end == '%')
+      return value < 50.0;
+
+   return value >= 0.0 && value < VTT_CUE_LINE_GRID / 2.0;
+}
+
+static void external_subtitle_flush_batch(struct external_subtitle_ingest *job,
+      struct subtitle_text_buffer *batch)
+{
+   int n_events;
+
+   if (!batch->len)
+      return;
+
+   slock_lock(ass_lock);
+   n_events = job->track->n_events;
+   ass_process_data(job->track, batch->data, (int)batch->len);
+   subtitle_text_account_locked(job->slot, job->track, n_events);
+   slock_unlock(ass_lock);
+   batch->len = 0;
+}
+
+static void external_subtitle_add_cue(struct external_subtitle_ingest *job,
+      struct subtitle_text_buffer *batch, int64_t start_ms, int64_t end_ms,
+      const char *text, size_t text_len, bool top_aligned)
+{
+   char start_buf[32];
+   char end_buf[32];
+   char prefix[128];
+
+   if (end_ms <= start_ms)
+      end_ms = start_ms + 2000;
+
+   ass_format_time(start_ms, start_buf, sizeof(start_buf));
+   ass_format_time(end_ms, end_buf, sizeof(end_buf));
+   snprintf(prefix, sizeof(prefix), "Dialogue: 0,%s,%s,Default,,0,0,0,,%s",
+         start_buf, end_buf, top_aligned ? "{\\an8}" : "");
+
+   if (!subtitle_text_buffer_append_str(batch, prefix) ||
+         !srt_text_to_ass(batch, text, text_len) ||
+         !subtitle_text_buffer_append(batch, "\n", 1))
+      return;
+
+   if (first_subtitle_start_ms[job->slot] < 0)
+   {
+      slock_lock(ass_lock);
+      first_subtitle_start_ms[job->slot] = start_ms;
+      slock_unlock(ass_lock);
+   }
+
+   if (batch->len >= 64 * 1024)
+      external_subtitle_flush_batch(job, batch);
+}
+
+static void external_subtitle_ingest_text(struct external_subtitle_ingest *job)
+{
+   struct subtitle_text_buffer batch = {0};
+   char *cursor = job->buf;
+   char *end = job->buf + job->size;
+   size_t cues = 0;
+
+   while (!job->cancel)
    {
       char *line = next_line_inplace(&cursor, end);
       char *trimmed = NULL;
+      char *text = NULL;
+      char *text_end = NULL;
       bool is_index = true;
+      bool top_aligned = false;
       int64_t start_ms = 0;
       int64_t end_ms = 0;
 
@@ -5418,132 +8148,201 @@ static bool srt_add_events_from_buffer(ASS_Track *track, char *buf, size_t buf_s
          line = next_line_inplace(&cursor, end);
          if (!line)
             break;
-         trimmed = trim_srt_line(line);
-         if (!trimmed || *trimmed == '\0')
-            continue;
+         trimmed = trim_srt_line(line);
+         if (!trimmed || *trimmed == '\0')
+            continue;
+      }
+
+      if (!parse_srt_time_range_ms(trimmed, &start_ms, &end_ms))
+         continue;
+
+      if (job->format == EXTERNAL_SUBTITLE_VTT)
+         top_aligned = vtt_cue_is_top_aligned(trimmed);
+
+      /* The cue text is the run of lines up to the next empty one.
+       * next_line_inplace() terminates each line, so turn the
+       * terminators back into newlines to keep it contiguous. */
+      while (true)
+      {
+         char *tline = next_line_inplace(&cursor, end);
+         char *ws = NULL;
+
+         if (!tline)
+            break;
+
+         ws = tline;
+         while (*ws && isspace((unsigned char)*ws))
+            ws++;
+
+         if (*ws == '\0')
+            break;
+
+         if (!text)
+            text = tline;
+         else
+            for (char *p = text_end; p < tline; p++)
+               *p = (p + 1 == tline) ? '\n' : '\r';
+         text_end = tline + strlen(tline);
       }
 
-      if (!parse_srt_time_range_ms(trimmed, &start_ms, &end_ms))
+      if (!text)
          continue;
 
-      /* Collect text lines until an empty separator line. */
+      external_subtitle_add_cue(job, &batch, start_ms, end_ms,
+            text, (size_t)(text_end - text), top_aligned);
+      cues++;
+   }
+
+   external_subtitle_flush_batch(job, &batch);
+   free(batch.data);
+
+   log_cb(RETRO_LOG_INFO, "[APLAYER] External subtitles ingested: %u cues\n",
+         (unsigned)cues);
+}
+
+static void external_subtitle_ingest_ass(struct external_subtitle_ingest *job)
+{
+   size_t offset = 0;
+
+   /* Hand the script to libass in line-aligned chunks so the renderers
+    * never wait long on ass_lock. */
+   while (!job->cancel && offset < job->size)
+   {
+      size_t chunk = job->size - offset;
+      int n_events;
+
+      if (chunk > 64 * 1024)
       {
-         char *text = NULL;
-         size_t text_len = 0;
-         size_t text_cap = 0;
+         const char *nl = NULL;
 
-         while (true)
-         {
-            char *tline = next_line_inplace(&cursor, end);
-            char *ws = NULL;
-            size_t add_len = 0;
-            size_t need = 0;
+         chunk = 64 * 1024;
+         nl = (const char*)memchr(job->buf + offset + chunk, '\n',
+               job->size - offset - chunk);
+         chunk = nl ? (size_t)(nl - (job->buf + offset)) + 1 :
+               job->size - offset;
+      }
 
-            if (!tline)
-               break;
+      slock_lock(ass_lock);
+      n_events = job->track->n_events;
+      ass_process_data(job->track, job->buf + offset, (int)chunk);
+      subtitle_text_account_locked(job->slot, job->track, n_events);
+      slock_unlock(ass_lock);
+      offset += chunk;
+   }
+}
 
-            ws = tline;
-            while (*ws && isspace((unsigned char)*ws))
-               ws++;
+static void external_subtitle_free_buffer(struct external_subtitle_ingest *job)
+{
+#ifdef HAVE_MMAN
+   if (job->buf && job->map_size)
+      munmap(job->buf, job->map_size);
+   else
+#endif
+      free(job->buf);
 
-            if (*ws == '\0')
-               break;
+   job->buf      = NULL;
+   job->size     = 0;
+   job->map_size = 0;
+}
 
-            add_len = strlen(tline);
-            need = text_len + add_len + (text_len ? 1 : 0) + 1;
+static void external_subtitle_ingest_thread(void *arg)
+{
+   struct external_subtitle_ingest *job = (struct external_subtitle_ingest*)arg;
 
-            if (need > text_cap)
-            {
-               size_t new_cap = text_cap ? text_cap * 2 : 256;
-               char *new_text = NULL;
-               while (new_cap < need)
-                  new_cap *= 2;
-               new_text = (char*)realloc(text, new_cap);
-               if (!new_text)
-               {
-                  free(text);
-                  text = NULL;
-                  text_cap = 0;
-                  text_len = 0;
-                  break;
-               }
-               text = new_text;
-               text_cap = new_cap;
-            }
+   if (job->format == EXTERNAL_SUBTITLE_ASS)
+      external_subtitle_ingest_ass(job);
+   else
+      external_subtitle_ingest_text(job);
 
-            if (text_len)
-               text[text_len++] = '\n';
-            memcpy(text + text_len, tline, add_len);
-            text_len += add_len;
-            text[text_len] = '\0';
-         }
+   /* libass keeps its own copy of every event. */
+   external_subtitle_free_buffer(job);
+}
 
-         if (text && text_len > 0)
-         {
-            bool added = false;
+/* Maps a sidecar file read/write-private so the in-place line splitter
+ * can terminate lines without copying the file up front. Returns NULL
+ * when the file can't be mapped with a guaranteed NUL after its end,
+ * in which case the caller falls back to read_entire_file(). */
+static char *map_subtitle_file(const char *path, size_t *out_size,
+      size_t *out_map_size)
+{
+#ifdef HAVE_MMAN
+   static const size_t max_size = 64u * 1024u * 1024u;
+   struct stat st;
+   long page_size = sysconf(_SC_PAGESIZE);
+   void *map = NULL;
+   int fd = -1;
 
-            if (converter)
-            {
-               AVPacket pkt;
-               AVSubtitle sub;
-               int got_sub = 0;
+   *out_size = 0;
+   *out_map_size = 0;
 
-               memset(&pkt, 0, sizeof(pkt));
-               memset(&sub, 0, sizeof(sub));
-               pkt.data = (uint8_t*)text;
-               pkt.size = (int)text_len;
+   fd = open(path, O_RDONLY);
+   if (fd < 0)
+      return NULL;
 
-               if (avcodec_decode_subtitle2(converter, &sub, &got_sub, &pkt) >= 0 &&
-                     got_sub)
-               {
-                  for (int i = 0; i < sub.num_rects; i++)
-                  {
-                     if (!sub.rects[i])
-                        continue;
-
-                     if (sub.rects[i]->ass)
-                     {
-                        ass_add_embedded_event(track, start_ms, end_ms, sub.rects[i]->ass);
-                        added = true;
-                     }
-                     else if (sub.rects[i]->text)
-                     {
-                        ass_add_text_event(track, start_ms, end_ms, sub.rects[i]->text);
-                        added = true;
-                     }
-                  }
-               }
+   if (fstat(fd, &st) != 0 || st.st_size <= 0 ||
+         (size_t)st.st_size > max_size ||
+         page_size <= 0 || st.st_size % page_size == 0)
+   {
+      close(fd);
+      return NULL;
+   }
 
-               avsubtitle_free(&sub);
-            }
+   /* The tail of the last page is zero-filled, which terminates the
+    * buffer for the string helpers. */
+   map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return NULL;
 
-            if (!added)
-            {
-               ass_add_text_event(track, start_ms, end_ms, text);
-               added = true;
-            }
+#ifdef MADV_SEQUENTIAL
+   madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
 
-            if (added)
-            {
-               any = true;
-               if (first_start_ms < 0)
-                  first_start_ms = start_ms;
-            }
-         }
+   *out_size = (size_t)st.st_size;
+   *out_map_size = (size_t)st.st_size;
+   return (char*)map;
+#else
+   *out_size = 0;
+   *out_map_size = 0;
+   return NULL;
+#endif
+}
 
-         free(text);
-      }
+static void external_subtitle_ingest_release(void)
+{
+   struct external_subtitle_ingest *job = &external_subtitle_ingest;
+
+   if (job->thread)
+   {
+      job->cancel = true;
+      sthread_join(job->thread);
    }
 
-   if (first_start_ms_out)
-      *first_start_ms_out = first_start_ms;
+   external_subtitle_free_buffer(job);
+   memset(job, 0, sizeof(*job));
+}
+
+static void external_subtitle_ingest_start(void)
+{
+   struct external_subtitle_ingest *job = &external_subtitle_ingest;
+
+   if (!job->track || !job->buf || job->thread)
+      return;
 
-   return any;
+   job->cancel = false;
+   job->thread = sthread_create(external_subtitle_ingest_thread, job);
+   if (!job->thread)
+   {
+      log_cb(RETRO_LOG_WARN,
+            "[APLAYER] Failed to start subtitle ingest thread, parsing inline.\n");
+      external_subtitle_ingest_thread(job);
+   }
 }
 
 static bool ensure_ass_context(void)
 {
-   if (ass && ass_render)
+   if (ass)
       return true;
 
    ass = ass_library_init();
@@ -5555,28 +8354,29 @@ static bool ensure_ass_context(void)
    for (unsigned i = 0; i < attachments_size; i++)
       ass_add_font(ass, (char*)"", (char*)attachments[i].data, attachments[i].size);
 
-   ass_render = ass_renderer_init(ass);
-   if (!ass_render)
-   {
-      ass_library_done(ass);
-      ass = NULL;
-      return false;
-   }
-
-   ass_set_frame_size(ass_render, media.width, media.height);
    ass_set_extract_fonts(ass, true);
-   ass_set_fonts(ass_render, NULL, NULL, 1, NULL, 1);
-   ass_set_hinting(ass_render, ASS_HINTING_LIGHT);
 
    update_subtitle_font_settings();
 
    return true;
 }
 
+static bool buffer_looks_like_vtt(const char *buf, size_t buf_size)
+{
+   const unsigned char *u = (const unsigned char*)buf;
+   size_t i = 0;
+
+   if (buf_size >= 3 && u[0] == 0xEF && u[1] == 0xBB && u[2] == 0xBF)
+      i = 3;
+
+   return i + 6 <= buf_size && strncmp(buf + i, "WEBVTT", 6) == 0;
+}
+
 static void maybe_load_external_subtitles(const char *media_path)
 {
-   static const char *exts[] = { ".srt" };
+   static const char *exts[] = { ".srt", ".ass", ".ssa", ".vtt" };
    char sub_path[PATH_MAX];
+   struct external_subtitle_ingest *job = &external_subtitle_ingest;
 
    if (!media_path)
       return;
@@ -5590,12 +8390,10 @@ static void maybe_load_external_subtitles(const char *media_path)
    for (unsigned i = 0; i < (unsigned)(sizeof(exts) / sizeof(exts[0])); i++)
    {
       size_t buf_size = 0;
+      size_t map_size = 0;
       char *buf = NULL;
       ASS_Track *track = NULL;
-      AVCodecContext *converter = NULL;
-      bool is_ass = false;
-      bool any_events = false;
-      int64_t first_start_ms = -1;
+      enum external_subtitle_format format = EXTERNAL_SUBTITLE_SRT;
       int slot = subtitle_streams_num;
 
       if (!path_replace_extension(media_path, exts[i], sub_path, sizeof(sub_path)))
@@ -5607,53 +8405,45 @@ static void maybe_load_external_subtitles(const char *media_path)
       if (access(sub_path, R_OK) != 0)
          continue;
 
-      buf = read_entire_file(sub_path, &buf_size);
+      buf = map_subtitle_file(sub_path, &buf_size, &map_size);
+      if (!buf)
+         buf = read_entire_file(sub_path, &buf_size);
       if (!buf || buf_size == 0)
       {
          free(buf);
          continue;
       }
 
+      job->buf      = buf;
+      job->size     = buf_size;
+      job->map_size = map_size;
+
+      if (buffer_looks_like_ass(buf, buf_size))
+         format = EXTERNAL_SUBTITLE_ASS;
+      else if (buffer_looks_like_vtt(buf, buf_size))
+         format = EXTERNAL_SUBTITLE_VTT;
+      else if (!strstr(buf, "-->"))
+      {
+         /* Not a cue based file either, try the next candidate. */
+         external_subtitle_ingest_release();
+         continue;
+      }
+
       if (!ensure_ass_context())
       {
-         free(buf);
+         external_subtitle_ingest_release();
          return;
       }
 
-      is_ass = buffer_looks_like_ass(buf, buf_size);
       track = ass_new_track(ass);
       if (!track)
       {
-         free(buf);
+         external_subtitle_ingest_release();
          return;
       }
 
-      if (is_ass)
-      {
-         ass_process_data(track, buf, (int)buf_size);
-      }
-      else
-      {
-#ifdef AV_CODEC_ID_SUBRIP
-         converter = open_text_subtitle_converter(AV_CODEC_ID_SUBRIP);
-#endif
-         if (converter)
-            subtitle_store_codec_private(slot, converter, true);
-
+      if (format != EXTERNAL_SUBTITLE_ASS)
          ass_init_subtitle_track(track, slot);
-         any_events = srt_add_events_from_buffer(track, buf, buf_size,
-               &first_start_ms, converter);
-         if (!any_events)
-         {
-            ass_free_track(track);
-            av_freep(&ass_extra_data[slot]);
-            ass_extra_data_size[slot] = 0;
-            subtitle_uses_native_text_header[slot] = false;
-            avcodec_free_context(&converter);
-            free(buf);
-            continue;
-         }
-      }
 
 #ifdef LIBASS_VERSION
 #if LIBASS_VERSION >= 0x01302000
@@ -5664,19 +8454,23 @@ static void maybe_load_external_subtitles(const char *media_path)
       sctx[slot] = NULL;
       ass_track[slot] = track;
       subtitle_streams[slot] = -1;
-      subtitle_is_ass[slot] = is_ass;
+      subtitle_is_ass[slot] = format == EXTERNAL_SUBTITLE_ASS;
       subtitle_is_bitmap[slot] = false;
       subtitle_is_external[slot] = true;
-      first_subtitle_start_ms[slot] = first_start_ms;
+      first_subtitle_start_ms[slot] = -1;
       subtitle_streams_num++;
 
+      job->track  = track;
+      job->slot   = (unsigned)slot;
+      job->format = format;
+
       update_subtitle_font_settings();
 
+      /* Events are ingested once ass_lock exists, see
+       * external_subtitle_ingest_start(). */
       log_cb(RETRO_LOG_INFO, "[APLAYER] Loaded external subtitles: %s (%s)\n",
-            sub_path, is_ass ? "ass" : "text");
-
-      avcodec_free_context(&converter);
-      free(buf);
+            sub_path, format == EXTERNAL_SUBTITLE_ASS ? "ass" :
+            format == EXTERNAL_SUBTITLE_VTT ? "vtt" : "text");
       break;
    }
 }
@@ -5740,18 +8534,28 @@ static void sws_worker_thread(void *arg)
    ctx->pts = tmp_frame->best_effort_timestamp != AV_NOPTS_VALUE ?
          tmp_frame->best_effort_timestamp : tmp_frame->pts;
 
+   if (ret >= 0)
+   {
+      double render_time = ctx->fallback_time;
+      if (ctx->pts != AV_NOPTS_VALUE)
+         render_time = av_q2d(fctx->streams[video_stream_index]->time_base) * ctx->pts;
+      /* Subtitle packets are not shifted by loops. */
+      render_time -= aplayer_loop_offset_at(render_time);
+      render_subtitles_on_frame(ctx, render_time);
+   }
+
 done:
    av_frame_unref(ctx->source);
    av_frame_unref(ctx->filtered);
    video_buffer_finish_slot(video_buffer, ctx);
 }
 
-static void decode_video(AVCodecContext *ctx, AVPacket *pkt, ASS_Track *ass_track_active)
+static void decode_video(AVCodecContext *ctx, AVPacket *pkt, int subtitle_ptr)
 {
    int ret = 0;
    video_decoder_context_t *decoder_ctx = NULL;
 
-   video_filter_drain_to_buffer(ass_track_active);
+   video_filter_drain_to_buffer(subtitle_ptr);
 
    /* Stop decoding thread until video_buffer is not full again */
    while (!decode_thread_dead && !video_buffer_has_open_slot(video_buffer))
@@ -5830,25 +8634,139 @@ static void decode_video(AVCodecContext *ctx, AVPacket *pkt, ASS_Track *ass_trac
       }
 
       update_video_presentation_from_frame(decoder_ctx->source);
-      if (video_filter_queue_frame(decoder_ctx, ass_track_active))
+      if (video_filter_queue_frame(decoder_ctx, subtitle_ptr))
          continue;
 
-      video_submit_frame_to_worker(decoder_ctx, ass_track_active);
+      video_submit_frame_to_worker(decoder_ctx, subtitle_ptr);
+   }
+
+   video_filter_drain_to_buffer(subtitle_ptr);
+}
+
+/* One resampler per audio track. The input side is taken from the
+ * decoded frames rather than the codec parameters, which can be wrong
+ * (implicit SBR doubles the AAC rate) or change mid-stream. */
+struct audio_resampler
+{
+   SwrContext *swr;
+   AVChannelLayout in_layout;
+   int in_rate;
+   int in_format;
+};
+
+static bool audio_resampler_setup(struct audio_resampler *res,
+      const AVFrame *frame)
+{
+   AVChannelLayout in_default_layout = {0};
+   AVChannelLayout out_layout        = {0};
+   const AVChannelLayout *in_layout  = &frame->ch_layout;
+   int in_channels                   = in_layout->nb_channels;
+   int ret;
+
+   if (res->swr && res->in_rate == frame->sample_rate &&
+         res->in_format == frame->format &&
+         !av_channel_layout_compare(&res->in_layout, &frame->ch_layout))
+      return true;
+
+   if (frame->sample_rate <= 0 || media.sample_rate <= 0)
+      return false;
+
+   /* A matrix set for the old layout survives swr_close(), so a new
+    * layout gets a new context. */
+   if (res->swr && av_channel_layout_compare(&res->in_layout, &frame->ch_layout))
+      swr_free(&res->swr);
+
+   if (!res->swr)
+      res->swr = swr_alloc();
+   else
+      swr_close(res->swr);
+   if (!res->swr)
+      return false;
+
+   if (in_channels <= 0)
+      in_channels = 2;
+
+   /* Swr expects a concrete channel map; normalize unknown/custom layouts. */
+   if (in_layout->order != AV_CHANNEL_ORDER_NATIVE || in_layout->u.mask == 0)
+   {
+      av_channel_layout_default(&in_default_layout, in_channels);
+      in_layout = &in_default_layout;
+   }
+
+   av_channel_layout_default(&out_layout, 2);
+
+   av_opt_set_chlayout(res->swr, "in_chlayout", in_layout, 0);
+   av_opt_set_chlayout(res->swr, "out_chlayout", &out_layout, 0);
+   av_opt_set_int(res->swr, "in_sample_rate",     frame->sample_rate, 0);
+   av_opt_set_int(res->swr, "out_sample_rate",    (int)media.sample_rate, 0);
+   av_opt_set_sample_fmt(res->swr, "in_sample_fmt",  (enum AVSampleFormat)frame->format, 0);
+   av_opt_set_sample_fmt(res->swr, "out_sample_fmt", AV_SAMPLE_FMT_S16,  0);
+   /* This is the only rate conversion on the way to the speakers, so
+    * use a longer polyphase filter than the swr default. */
+   av_opt_set_int(res->swr, "filter_size",   64, 0);
+   av_opt_set_int(res->swr, "phase_shift",   10, 0);
+   av_opt_set_int(res->swr, "linear_interp",  1, 0);
+
+   /* matriz solo si hay 6 canales */
+   if (in_layout->nb_channels == 6) {
+      double m[12] = {
+         1.0, 0.0, 1.2, 0.0, 0.5, 0.5,
+         0.0, 1.0, 1.2, 0.0, 0.5, 0.5
+      };
+      for (int j=0;j<12;j++) m[j]*=2.0;          /* +6 dB */
+      swr_set_matrix(res->swr, m, 0);
+   }
+
+   ret = swr_init(res->swr);
+   av_channel_layout_uninit(&out_layout);
+   av_channel_layout_uninit(&in_default_layout);
+
+   av_channel_layout_uninit(&res->in_layout);
+   if (ret < 0)
+   {
+      log_cb(RETRO_LOG_ERROR, "[APLAYER] Failed to set up audio resampler: %s\n",
+            av_err2str(ret));
+      res->in_rate = 0;
+      return false;
    }
 
-   video_filter_drain_to_buffer(ass_track_active);
+   av_channel_layout_copy(&res->in_layout, &frame->ch_layout);
+   res->in_rate   = frame->sample_rate;
+   res->in_format = frame->format;
+
+   log_cb(RETRO_LOG_INFO, "[APLAYER] Audio resampler: %d Hz, %d ch -> %u Hz, 2 ch.\n",
+         frame->sample_rate, in_channels, (unsigned)media.sample_rate);
+   return true;
+}
+
+/* Drops resampler state; the next frame configures it again. */
+static void audio_resampler_reset(struct audio_resampler *res)
+{
+   if (res->swr)
+      swr_close(res->swr);
+   res->in_rate = 0;
+}
+
+static void audio_resampler_free(struct audio_resampler *res)
+{
+   swr_free(&res->swr);
+   av_channel_layout_uninit(&res->in_layout);
+   res->in_rate = 0;
 }
 
 static int16_t *decode_audio(AVCodecContext *ctx, AVPacket *pkt,
       AVFrame *frame, int16_t *buffer, size_t *buffer_cap,
-      SwrContext *swr, bool *clock_rebase_pending)
+      struct audio_resampler *resampler, struct audio_queue *queue,
+      bool standby, bool *clock_rebase_pending)
 {
    int ret = 0;
-   int64_t pts = 0;
+   int64_t pts = AV_NOPTS_VALUE;
    size_t required_buffer = 0;
+   size_t batch_bytes = 0;
    int out_samples = 0;
    int max_out_samples = 0;
    size_t bytes_per_frame = sizeof(int16_t) * 2;
+   double end_time = 0.0;
    static bool warned_fifo_small = false;
 
    if ((ret = avcodec_send_packet(ctx, pkt)) < 0)
@@ -5857,6 +8775,8 @@ static int16_t *decode_audio(AVCodecContext *ctx, AVPacket *pkt,
       return buffer;
    }
 
+   /* Resample every frame of the packet into one batch, so the ring is
+    * written and the frontend woken once per packet. */
    for (;;)
    {
       ret = avcodec_receive_frame(ctx, frame);
@@ -5868,121 +8788,328 @@ static int16_t *decode_audio(AVCodecContext *ctx, AVPacket *pkt,
          break;
       }
 
-      max_out_samples = swr_get_out_samples(swr, frame->nb_samples);
-      if (max_out_samples < frame->nb_samples)
-         max_out_samples = frame->nb_samples;
+      if (!audio_resampler_setup(resampler, frame))
+         continue;
+
+      max_out_samples = swr_get_out_samples(resampler->swr, frame->nb_samples);
+      if (max_out_samples < frame->nb_samples)
+         max_out_samples = frame->nb_samples;
+
+      required_buffer = batch_bytes + (size_t)max_out_samples * bytes_per_frame;
+      if (required_buffer > *buffer_cap)
+      {
+         buffer      = (int16_t*)av_realloc(buffer, required_buffer);
+         *buffer_cap = required_buffer;
+      }
+
+      {
+         uint8_t *out = (uint8_t*)buffer + batch_bytes;
+         out_samples = swr_convert(resampler->swr,
+               &out,
+               max_out_samples,
+               (const uint8_t**)frame->data,
+               frame->nb_samples);
+      }
+      if (out_samples < 0)
+      {
+         log_cb(RETRO_LOG_ERROR, "[APLAYER] Error while resampling audio: %s\n",
+               av_err2str(out_samples));
+         break;
+      }
+      if (out_samples == 0)
+         continue;
+
+      batch_bytes += (size_t)out_samples * bytes_per_frame;
+      pts = frame->best_effort_timestamp;
+   }
+
+   if (batch_bytes == 0 || !queue || audio_ring_depth == 0)
+      return buffer;
+
+   required_buffer = batch_bytes;
+   if (required_buffer > audio_ring_depth)
+   {
+      if (!warned_fifo_small)
+      {
+         log_cb(RETRO_LOG_WARN,
+               "[APLAYER] Audio batch larger than FIFO (%zu > %zu), truncating.\n",
+               required_buffer, audio_ring_depth);
+         warned_fifo_small = true;
+      }
+      required_buffer = audio_ring_depth - audio_ring_depth % bytes_per_frame;
+   }
+
+   /* The standby track never waits, it is only decoded when there is
+    * room for it. */
+   while (!standby && !decode_thread_dead && audio_queue_space(queue) < required_buffer)
+   {
+      bool timed_out = false;
+
+      if (audio_switch_requested)
+         return buffer;
+      if (do_seek)
+      {
+         slock_lock(fifo_lock);
+         scond_signal(fifo_cond);
+         slock_unlock(fifo_lock);
+         return buffer;
+      }
+      if (main_sleeping && video_stream_index >= 0)
+      {
+         log_cb(RETRO_LOG_ERROR, "[APLAYER] Thread: Audio deadlock detected.\n");
+         spsc_ring_flush(queue->ring);
+         audio_queue_publish(queue, queue->end_time, NULL, 0);
+         break;
+      }
+
+      slock_lock(fifo_lock);
+      /* In low-power mode, sleep until half the queue has drained and
+       * then refill it in one go. */
+      audio_ring_producer_need = required_buffer;
+      if (audio_low_power && audio_ring_producer_need < audio_ring_depth / 2)
+         audio_ring_producer_need = audio_ring_depth / 2;
+      audio_ring_producer_waiting = true;
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (!decode_thread_dead && !do_seek && !audio_switch_requested &&
+            audio_queue_space(queue) < required_buffer)
+      {
+         if (!main_sleeping)
+            scond_wait(fifo_decode_cond, fifo_lock);
+         else
+            timed_out = !scond_wait_timeout(fifo_decode_cond, fifo_lock, 2000);
+         decode_wakeups++;
+      }
+      audio_ring_producer_waiting = false;
+      slock_unlock(fifo_lock);
+
+      if (timed_out)
+         break;
+   }
+
+   if ((!standby && audio_switch_requested) || decode_thread_dead)
+      return buffer;
+
+   if (clock_rebase_pending && *clock_rebase_pending)
+   {
+      double queued_seconds = (double)(spsc_ring_fill(queue->ring) +
+            required_buffer) / (media.sample_rate * bytes_per_frame);
+      end_time = (double)audio_frames / media.sample_rate +
+            pts_bias + queued_seconds;
+      *clock_rebase_pending = false;
+   }
+   else
+      end_time = pts * av_q2d(
+            fctx->streams[audio_streams[queue->track]]->time_base);
+
+   if (audio_queue_space(queue) < required_buffer)
+      required_buffer = audio_queue_space(queue) - audio_queue_space(queue) % bytes_per_frame;
+   audio_queue_publish(queue, end_time, buffer, required_buffer);
+
+   return buffer;
+}
+
+
+/* Start of a packet in seconds, NAN if unknown. */
+static double packet_time(const AVPacket *pkt)
+{
+   int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+   if (ts == AV_NOPTS_VALUE)
+      return NAN;
+   return ts * av_q2d(fctx->streams[pkt->stream_index]->time_base);
+}
+
+/* Decoding can start at video keyframes, or at any audio packet
+ * without video. */
+static bool packet_is_sync_point(const AVPacket *pkt)
+{
+   if (video_stream_index >= 0)
+      return pkt->stream_index == video_stream_index &&
+            (pkt->flags & AV_PKT_FLAG_KEY);
+   return audio_slot_for_stream(pkt->stream_index) >= 0;
+}
+
+/* Adds a packet just read from the demuxer to the seek cache. */
+static void packet_history_remember(const AVPacket *pkt)
+{
+   if (!packet_history)
+      return;
+
+   packet_history_add(packet_history, pkt, packet_time(pkt), packet_is_sync_point(pkt));
+   stats_history_bytes = packet_history_bytes(packet_history);
+   stats_history_span  = packet_history_span(packet_history);
+}
+
+/* Single tracks loop, and so do LOOP_ALL and SHUFFLE_ALL without a
+ * playlist. */
+static bool loop_track_enabled(void)
+{
+   return loopcontent == LOOP_TRACK ||
+         ((loopcontent == LOOP_ALL || loopcontent == SHUFFLE_ALL) && !playlist_count);
+}
+
+/* Drops the cached head, and caches it again from the next packet
+ * when the demuxer is @at_start of the track. */
+static void loop_head_reset(bool at_start)
+{
+   unsigned i;
+
+   packet_history_clear(loop_head);
+   loop_head_filling  = loop_head && at_start && loop_track_enabled();
+   loop_head_started  = false;
+   loop_head_complete = false;
+   loop_head_end      = NAN;
+   for (i = 0; i < loop_head_streams; i++)
+      loop_head_last_ts[i] = INT64_MIN;
+}
+
+/* Adds a packet just read from the demuxer to the head, which ends at
+ * the first sync point APLAYER_LOOP_HEAD_SECONDS in. */
+static void loop_head_remember(const AVPacket *pkt)
+{
+   int64_t ts      = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+   double time     = packet_time(pkt);
+   bool sync_point = packet_is_sync_point(pkt);
+
+   if (!loop_head_started)
+   {
+      if (!sync_point || isnan(time))
+         return;
+      loop_head_started = true;
+      loop_head_start   = time;
+   }
+   else if (sync_point && !isnan(time) &&
+         time >= loop_head_start + APLAYER_LOOP_HEAD_SECONDS)
+   {
+      /* Loops go back to the demuxer at this packet. */
+      loop_head_filling  = false;
+      loop_head_complete = true;
+      loop_head_end      = time;
+      return;
+   }
+
+   if (packet_history_bytes(loop_head) + pkt->size > APLAYER_LOOP_HEAD_BYTES)
+   {
+      log_cb(RETRO_LOG_DEBUG, "[APLAYER] Start of track too large to cache, loops will seek.\n");
+      loop_head_reset(false);
+      return;
+   }
+
+   packet_history_add(loop_head, pkt, time, sync_point);
+   if (ts != AV_NOPTS_VALUE && (unsigned)pkt->stream_index < loop_head_streams &&
+         ts > loop_head_last_ts[pkt->stream_index])
+      loop_head_last_ts[pkt->stream_index] = ts;
+}
+
+/* Back at the end of the head the demuxer may return packets the head
+ * already had, up to the first new one of each stream. */
+static bool loop_head_stale(const AVPacket *pkt)
+{
+   int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+
+   if (ts == AV_NOPTS_VALUE || (unsigned)pkt->stream_index >= loop_head_streams)
+      return false;
+   if (ts <= loop_resync_ts[pkt->stream_index])
+      return true;
+
+   loop_resync_ts[pkt->stream_index] = INT64_MIN;
+   return false;
+}
 
-      required_buffer = (size_t)max_out_samples * bytes_per_frame;
-      if (required_buffer > *buffer_cap)
-      {
-         buffer      = (int16_t*)av_realloc(buffer, required_buffer);
-         *buffer_cap = required_buffer;
-      }
+/* Shifts audio and video packets past the loops played so far, so
+ * that timestamps keep rising across the loop point and nothing
+ * downstream is flushed. Subtitles keep their own times. */
+static void loop_packet_shift(AVPacket *pkt)
+{
+   double tb  = av_q2d(fctx->streams[pkt->stream_index]->time_base);
+   double end = packet_time(pkt);
+   int64_t shift;
 
-      out_samples = swr_convert(swr,
-            (uint8_t**)&buffer,
-            max_out_samples,
-            (const uint8_t**)frame->data,
-            frame->nb_samples);
-      if (out_samples < 0)
-      {
-         log_cb(RETRO_LOG_ERROR, "[APLAYER] Error while resampling audio: %s\n",
-               av_err2str(out_samples));
-         break;
-      }
-      if (out_samples == 0)
-         continue;
+   if (!isnan(end))
+   {
+      end += pkt->duration * tb;
+      if (isnan(loop_iteration_end) || end > loop_iteration_end)
+         loop_iteration_end = end;
+   }
 
-      required_buffer = (size_t)out_samples * bytes_per_frame;
+   if (loop_offset == 0.0)
+      return;
 
-      pts = frame->best_effort_timestamp;
-      slock_lock(fifo_lock);
+   shift = llrint(loop_offset / tb);
+   if (pkt->pts != AV_NOPTS_VALUE)
+      pkt->pts += shift;
+   if (pkt->dts != AV_NOPTS_VALUE)
+      pkt->dts += shift;
+}
 
-      if (!audio_decode_fifo)
-      {
-         slock_unlock(fifo_lock);
-         continue;
-      }
+/* At the end of the track, plays the cached head again right behind
+ * the last packet instead of seeking back to the start. */
+static bool loop_start(void)
+{
+   double length;
 
-      size_t fifo_capacity = audio_decode_fifo->size ? audio_decode_fifo->size - 1 : 0;
-      if (fifo_capacity == 0)
-      {
-         slock_unlock(fifo_lock);
-         continue;
-      }
-      if (required_buffer > fifo_capacity)
-      {
-         if (!warned_fifo_small)
-         {
-            log_cb(RETRO_LOG_WARN,
-                  "[APLAYER] Audio frame larger than FIFO (%zu > %zu), truncating.\n",
-                  required_buffer, fifo_capacity);
-            warned_fifo_small = true;
-         }
-         required_buffer = fifo_capacity;
-      }
+   if (!loop_head || trick_play_active || !loop_track_enabled())
+      return false;
 
-      while (!decode_thread_dead &&
-            FIFO_WRITE_AVAIL(audio_decode_fifo) < required_buffer)
-      {
-         if (audio_switch_requested)
-         {
-            scond_signal(fifo_cond);
-            break;
-         }
-         if (do_seek)
-         {
-            scond_signal(fifo_cond);
-            slock_unlock(fifo_lock);
-            return buffer;
-         }
-         if (!main_sleeping)
-            scond_wait(fifo_decode_cond, fifo_lock);
-         else if (video_stream_index < 0)
-         {
-            if (!scond_wait_timeout(fifo_decode_cond, fifo_lock, 2000))
-               break;
-         }
-         else
-         {
-            log_cb(RETRO_LOG_ERROR, "[APLAYER] Thread: Audio deadlock detected.\n");
-            fifo_clear(audio_decode_fifo);
-            break;
-         }
-      }
+   /* The whole track fits, there is nothing to go back to. */
+   if (loop_head_filling && loop_head_started)
+   {
+      loop_head_filling  = false;
+      loop_head_complete = true;
+   }
 
-      if (audio_switch_requested)
-      {
-         scond_signal(fifo_cond);
-         slock_unlock(fifo_lock);
-         break;
-      }
+   if (!loop_head_complete || isnan(loop_iteration_end))
+      return false;
 
-      if (clock_rebase_pending && *clock_rebase_pending)
-      {
-         double queued_seconds = (double)(FIFO_READ_AVAIL(audio_decode_fifo) +
-               required_buffer) / (media.sample_rate * bytes_per_frame);
-         decode_last_audio_time = (double)audio_frames / media.sample_rate +
-               pts_bias + queued_seconds;
-         *clock_rebase_pending = false;
-      }
-      else
-         decode_last_audio_time = pts * av_q2d(
-               fctx->streams[audio_streams[audio_streams_ptr]]->time_base);
+   length = loop_iteration_end - loop_head_start;
+   if (length <= 0.0 || !packet_history_rewind(loop_head))
+      return false;
 
-      if (!decode_thread_dead &&
-            FIFO_WRITE_AVAIL(audio_decode_fifo) >= required_buffer)
-         fifo_write(audio_decode_fifo, buffer, required_buffer);
+   slock_lock(time_lock);
+   loop_offset_prev  = loop_offset;
+   loop_offset      += length;
+   loop_offset_from  = loop_head_start + loop_offset;
+   slock_unlock(time_lock);
 
-      scond_signal(fifo_cond);
-      slock_unlock(fifo_lock);
-   }
+   loop_iteration_end = NAN;
+   loop_replaying     = true;
+   loop_resync        = false;
+   /* The demuxer no longer follows on from the seek cache. */
+   packet_history_clear(packet_history);
+   stats_loops++;
 
-   return buffer;
+   log_cb(RETRO_LOG_INFO, "[APLAYER] Looping from the cached start of the track.\n");
+   return true;
 }
 
+/* Next packet of the head during a loop. Once it runs out the demuxer
+ * is moved to where the head ends. */
+static bool loop_head_read(AVPacket *pkt)
+{
+   unsigned i;
+   int64_t ts;
+
+   if (packet_history_read(loop_head, pkt))
+      return true;
+
+   loop_replaying = false;
+   if (isnan(loop_head_end))
+      return false;
+
+   ts = (int64_t)(loop_head_end * AV_TIME_BASE);
+   if (avformat_seek_file(fctx, -1, INT64_MIN, ts, ts, 0) < 0)
+      log_cb(RETRO_LOG_ERROR, "[APLAYER] av_seek_frame() failed.\n");
+
+   for (i = 0; i < loop_head_streams; i++)
+      loop_resync_ts[i] = loop_head_last_ts[i];
+   loop_resync = true;
+   return false;
+}
 
-static void decode_thread_seek(double time)
+/* @dir > 0 lands on the first keyframe at or after @time and @dir < 0
+ * on the last one at or before it, for trick-play hops that must not
+ * come back to the keyframe they left. 0 seeks to the nearest one. */
+static void decode_thread_seek(double time, int dir)
 {
    int64_t seek_to = time * AV_TIME_BASE;
    int i = 0;
@@ -5990,10 +9117,36 @@ static void decode_thread_seek(double time)
    if (seek_to < 0)
       seek_to = 0;
 
-   decode_last_audio_time = time;
+   for (i = 0; i < (int)ARRAY_SIZE(audio_queues); i++)
+      if (audio_queues[i].ring)
+         audio_queue_publish(&audio_queues[i], time, NULL, 0);
 
-   if (avformat_seek_file(fctx, -1, INT64_MIN, seek_to, INT64_MAX, 0) < 0)
-      log_cb(RETRO_LOG_ERROR, "[APLAYER] av_seek_frame() failed.\n");
+   /* Served from the seek cache, the demuxer stays where it is and
+    * carries on once the cached packets have been replayed. */
+   if (!dir && packet_history_seek(packet_history, time))
+      stats_seeks_cached++;
+   else
+   {
+      if (avformat_seek_file(fctx, -1, dir > 0 ? seek_to : INT64_MIN, seek_to,
+               dir < 0 ? seek_to : INT64_MAX, 0) < 0 &&
+            (!dir || avformat_seek_file(fctx, -1, INT64_MIN, seek_to, INT64_MAX, 0) < 0))
+         log_cb(RETRO_LOG_ERROR, "[APLAYER] av_seek_frame() failed.\n");
+      packet_history_clear(packet_history);
+      stats_seeks_demuxed++;
+
+      loop_resync = false;
+      if (!loop_head_complete)
+         loop_head_reset(!dir && seek_to == 0);
+   }
+
+   /* Playback goes on from the file time seeked to, unshifted. */
+   loop_replaying     = false;
+   loop_iteration_end = NAN;
+   slock_lock(time_lock);
+   loop_offset      = 0.0;
+   loop_offset_prev = 0.0;
+   loop_offset_from = 0.0;
+   slock_unlock(time_lock);
 
    if (video_stream_index >= 0)
    {
@@ -6008,17 +9161,38 @@ static void decode_thread_seek(double time)
 
    if (actx[audio_streams_ptr])
       avcodec_flush_buffers(actx[audio_streams_ptr]);
+   for (i = 0; i < (int)ARRAY_SIZE(audio_queues); i++)
+      if (audio_queues[i].ring && audio_queues[i].track >= 0 &&
+            audio_queues[i].track != audio_streams_ptr &&
+            actx[audio_queues[i].track])
+         avcodec_flush_buffers(actx[audio_queues[i].track]);
    if (vctx)
       avcodec_flush_buffers(vctx);
+
+   subtitle_backfill_release();
+
+   /* Events staged before the seek belong to the old position. */
+   slock_lock(ass_lock);
+   subtitle_stage_drain_locked(false);
+   slock_unlock(ass_lock);
+
    for (i = 0; i < subtitle_streams_num; i++)
    {
       if (sctx[i])
          avcodec_flush_buffers(sctx[i]);
       if (ass_track[i] && !subtitle_is_external[i])
+      {
          ass_flush_events(ass_track[i]);
+         subtitle_text_bytes[i] = 0;
+      }
       if (subtitle_track_is_bitmap((unsigned)i))
+      {
          bitmap_subtitle_clear_slot((unsigned)i);
+         bitmap_subtitle_playhead_ms[i] = (int64_t)(time * 1000.0);
+      }
    }
+
+   subtitle_text_timing_reset();
 }
 
 /**
@@ -6037,7 +9211,7 @@ static void decode_thread(void *data)
 {
    unsigned i;
    bool eof                = false;
-   struct SwrContext *swr[(audio_streams_num > 0) ? audio_streams_num : 1];
+   struct audio_resampler resamplers[(audio_streams_num > 0) ? audio_streams_num : 1];
    AVFrame *aud_frame      = NULL;
    size_t frame_size       = 0;
    int16_t *audio_buffer   = NULL;
@@ -6047,58 +9221,15 @@ static void decode_thread(void *data)
    packet_buffer_t *audio_packet_buffer = NULL;
    packet_buffer_t *video_packet_buffer;
    double last_audio_end  = 0;
+   int subtitle_decoding  = SUBTITLE_STREAM_DISABLED;
+   int64_t standby_window_start = 0;
+   int64_t standby_busy_us      = 0;
+   bool trick_decoding          = false;
 
    (void)data;
 
-   for (i = 0; (int)i < audio_streams_num; i++)
-   {
-      swr[i] = swr_alloc();
-
-      AVChannelLayout in_default_layout = {0};
-      const AVChannelLayout *in_layout = &actx[i]->ch_layout;
-      AVChannelLayout out_layout = {0};
-      int in_channels = in_layout->nb_channels;
-
-      if (in_channels <= 0)
-         in_channels = 2;
-
-      /* Swr expects a concrete channel map; normalize unknown/custom layouts. */
-      if (in_layout->order != AV_CHANNEL_ORDER_NATIVE || in_layout->u.mask == 0)
-      {
-         av_channel_layout_default(&in_default_layout, in_channels);
-         in_layout = &in_default_layout;
-      }
-
-      av_channel_layout_default(&out_layout, 2);
-
-      av_opt_set_chlayout(swr[i], "in_chlayout", in_layout, 0);
-      av_opt_set_chlayout(swr[i], "out_chlayout", &out_layout, 0);
-      av_opt_set_int(swr[i], "in_sample_rate",     actx[i]->sample_rate, 0);
-      av_opt_set_int(swr[i], "out_sample_rate",    media.sample_rate,    0);
-      av_opt_set_sample_fmt(swr[i], "in_sample_fmt",  actx[i]->sample_fmt, 0);
-      av_opt_set_sample_fmt(swr[i], "out_sample_fmt", AV_SAMPLE_FMT_S16,  0);
-
-      /* matriz solo si hay 6 canales */
-      if (in_layout->nb_channels == 6) {
-         double m[12] = {
-            1.0, 0.0, 1.2, 0.0, 0.5, 0.5, 
-            0.0, 1.0, 1.2, 0.0, 0.5, 0.5
-         };
-         for (int j=0;j<12;j++) m[j]*=2.0;          /* +6 dB */
-         swr_set_matrix(swr[i], m, 0);
-      }
-      
-      int ret;
-      if ((ret = swr_init(swr[i])) < 0) {
-         log_cb(RETRO_LOG_ERROR, "swr_init fallo: %s\n", av_err2str(ret));
-         av_channel_layout_uninit(&out_layout);
-         av_channel_layout_uninit(&in_default_layout);
-         continue;
-     }
-
-      av_channel_layout_uninit(&out_layout);
-      av_channel_layout_uninit(&in_default_layout);
-   }
+   /* Resamplers are configured lazily from the first decoded frame. */
+   memset(resamplers, 0, sizeof(resamplers));
 
    aud_frame = av_frame_alloc();
    for (i = 0; (int)i < audio_streams_num; i++)
@@ -6113,6 +9244,29 @@ static void decode_thread(void *data)
       log_cb(RETRO_LOG_INFO, "[APLAYER] Configured worker threads: %d\n", sw_sws_threads);
    }
 
+   if (packet_history_max_bytes)
+      packet_history = packet_history_create(packet_history_max_bytes,
+            APLAYER_PACKET_HISTORY_SECONDS);
+
+   loop_head_streams = fctx->nb_streams;
+   loop_head_last_ts = (int64_t*)malloc(2 * (loop_head_streams + 1) * sizeof(int64_t));
+   if (loop_head_last_ts)
+   {
+      loop_resync_ts = loop_head_last_ts + loop_head_streams + 1;
+      loop_head      = packet_history_create(APLAYER_LOOP_HEAD_BYTES, HUGE_VAL);
+   }
+   else
+      loop_head_streams = 0;
+   loop_replaying     = false;
+   loop_resync        = false;
+   loop_iteration_end = NAN;
+   slock_lock(time_lock);
+   loop_offset      = 0.0;
+   loop_offset_prev = 0.0;
+   loop_offset_from = 0.0;
+   slock_unlock(time_lock);
+   loop_head_reset(true);
+
    AVPacket *pkt_local = av_packet_alloc();
    if (!pkt_local)
       goto end;
@@ -6128,12 +9282,15 @@ static void decode_thread(void *data)
       slock_unlock(fifo_lock);
 
       if (paused && !pending_seek) {
-         usleep(10 * 1000);
+         usleep(audio_low_power ? 100 * 1000 : 10 * 1000);
+         decode_wakeups++;
          continue;
       }
 
       bool seek;
+      bool have_packet = false;
       double seek_time_thread;
+      int seek_dir_thread;
       int audio_stream_index, audio_stream_ptr;
 
       double audio_timebase   = 0.0;
@@ -6142,29 +9299,32 @@ static void decode_thread(void *data)
       double next_audio_start = 0.0;
 
       AVCodecContext *actx_active = NULL;
-      ASS_Track *ass_track_active = NULL;
+      int subtitle_active         = SUBTITLE_STREAM_DISABLED;
 
       slock_lock(fifo_lock);
       seek             = do_seek;
       seek_time_thread = seek_time;
+      seek_dir_thread  = trick_seek_dir;
       slock_unlock(fifo_lock);
 
       if (seek)
       {
          bool restart_request = playback_restart_request;
 
-         decode_thread_seek(seek_time_thread);
+         decode_thread_seek(seek_time_thread, seek_dir_thread);
 
          slock_lock(fifo_lock);
          do_seek          = false;
          eof              = false;
          seek_time        = 0.0;
+         trick_seek_dir   = 0;
          next_video_end   = 0.0;
          next_audio_start = 0.0;
          last_audio_end   = 0.0;
 
-         if (audio_decode_fifo)
-            fifo_clear(audio_decode_fifo);
+         for (i = 0; i < ARRAY_SIZE(audio_queues); i++)
+            if (audio_queues[i].ring)
+               spsc_ring_flush(audio_queues[i].ring);
 
          // Reset packet buffer states
          for (i = 0; (int)i < audio_streams_num; i++)
@@ -6184,58 +9344,93 @@ static void decode_thread(void *data)
       slock_lock(decode_thread_lock);
       if (audio_switch_requested)
       {
-         int ret;
          int switched_audio_stream_ptr = audio_streams_ptr;
-         for (i = 0; (int)i < audio_streams_num; i++)
+         struct audio_queue *playing   = &audio_queues[audio_queue_playing];
+         struct audio_queue *standby   = &audio_queues[!audio_queue_playing];
+         /* retro_run() already swapped to the standby queue. */
+         bool warm = playing->ring && playing->track == switched_audio_stream_ptr;
+
+         audio_switch_requested = false;
+         slock_unlock(decode_thread_lock);
+
+         if (warm)
+         {
+            last_audio_end             = playing->end_time;
+            audio_clock_rebase_pending = false;
+         }
+         else
+         {
+            if (actx[switched_audio_stream_ptr])
+               avcodec_flush_buffers(actx[switched_audio_stream_ptr]);
+            audio_resampler_reset(&resamplers[switched_audio_stream_ptr]);
+            if (aud_frame)
+               av_frame_unref(aud_frame);
+
+            /* The old track's audio is dropped on the frontend's next read. */
+            last_audio_end = (double)audio_frames / media.sample_rate + pts_bias;
+            if (playing->ring)
+               audio_queue_assign(playing, switched_audio_stream_ptr, last_audio_end);
+
+            slock_lock(fifo_lock);
+            audio_packet_buffer = audio_packet_buffers[switched_audio_stream_ptr];
+            audio_packet_buffer_drop_stale(audio_packet_buffer,
+                  av_q2d(fctx->streams[audio_streams[switched_audio_stream_ptr]]->time_base),
+                  last_audio_end - APLAYER_AUDIO_SWITCH_PREROLL_SECONDS);
+            audio_clock_rebase_pending = true;
+            scond_signal(fifo_cond);
+            scond_signal(fifo_decode_cond);
+            slock_unlock(fifo_lock);
+         }
+
+         /* The standby queue moves on to the track after the new one. */
+         if (standby->ring)
          {
-            if (actx[i])
-               avcodec_flush_buffers(actx[i]);
-            if (swr[i])
+            int next = (switched_audio_stream_ptr + 1) % audio_streams_num;
+
+            if (standby->track != next)
             {
-               swr_close(swr[i]);
-               ret = swr_init(swr[i]);
-               if (ret < 0)
-                  log_cb(RETRO_LOG_ERROR,
-                        "[APLAYER] Failed to reset audio resampler: %s\n",
-                        av_err2str(ret));
+               if (actx[next])
+                  avcodec_flush_buffers(actx[next]);
+               audio_resampler_reset(&resamplers[next]);
+               audio_queue_assign(standby, next,
+                     (double)audio_frames / media.sample_rate + pts_bias);
+               audio_packet_buffer_drop_stale(audio_packet_buffers[next],
+                     av_q2d(fctx->streams[audio_streams[next]]->time_base),
+                     standby->end_time);
             }
          }
-         audio_switch_requested = false;
-         if (aud_frame)
-            av_frame_unref(aud_frame);
-         slock_unlock(decode_thread_lock);
-
-         slock_lock(fifo_lock);
-         if (audio_decode_fifo)
-            fifo_clear(audio_decode_fifo);
-         audio_packet_buffer = audio_packet_buffers[switched_audio_stream_ptr];
-         audio_packet_buffer_drop_stale(audio_packet_buffer,
-               av_q2d(fctx->streams[audio_streams[switched_audio_stream_ptr]]->time_base),
-               (double)audio_frames / media.sample_rate + pts_bias -
-                  APLAYER_AUDIO_SWITCH_PREROLL_SECONDS);
-         decode_last_audio_time = (double)audio_frames / media.sample_rate + pts_bias;
-         last_audio_end = decode_last_audio_time;
-         audio_clock_rebase_pending = true;
-         scond_signal(fifo_cond);
-         scond_signal(fifo_decode_cond);
-         slock_unlock(fifo_lock);
       }
       else
          slock_unlock(decode_thread_lock);
 
+      /* Non-key packets are already dropped on read, this also skips
+       * keyframes that only decode with their predecessors. */
+      if (vctx && trick_decoding != trick_play_active)
+      {
+         trick_decoding  = trick_play_active;
+         vctx->skip_frame = trick_decoding ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+      }
+
       slock_lock(decode_thread_lock);
       audio_stream_index          = audio_streams[audio_streams_ptr];
       audio_stream_ptr            = audio_streams_ptr;
       actx_active                 = actx[audio_streams_ptr];
       if (subtitle_selection_is_valid(subtitle_streams_ptr))
-         ass_track_active         = ass_track[subtitle_streams_ptr];
+         subtitle_active          = subtitle_streams_ptr;
       audio_timebase = av_q2d(fctx->streams[audio_stream_index]->time_base);
       if (video_stream_index >= 0)
          video_timebase = av_q2d(fctx->streams[video_stream_index]->time_base);
       slock_unlock(decode_thread_lock);
+
+      if (subtitle_active != subtitle_decoding)
+      {
+         subtitle_decoding = subtitle_active;
+         if (subtitle_active >= 0 && !subtitle_is_external[subtitle_active])
+            subtitle_backfill_start((unsigned)subtitle_active);
+      }
       audio_packet_buffer = audio_packet_buffers[audio_stream_ptr];
 
-      video_filter_drain_to_buffer(ass_track_active);
+      video_filter_drain_to_buffer(subtitle_active);
 
       if (!packet_buffer_empty(audio_packet_buffer))
          next_audio_start = audio_timebase * packet_buffer_peek_start_pts(audio_packet_buffer);
@@ -6251,6 +9446,7 @@ static void decode_thread(void *data)
        *      (<= 500 ms tolerance),                              ahead < 0.5
        *   3. The decoder already hit EOF,                        eof == true
        *   4. The main thread is blocked waiting for audio data,  need_audio_now
+       *      or the frontend's audio buffer is about to starve
        *
        * Together these rules guarantee:
        *   – Audio never outruns video by more than half a second during normal
@@ -6262,24 +9458,68 @@ static void decode_thread(void *data)
 
       bool need_audio_now = false;
       slock_lock(fifo_lock);
-      need_audio_now = main_sleeping;   /* main thread is waiting for us */
+      need_audio_now = main_sleeping ||   /* main thread is waiting for us */
+            audio_device_starving;
       slock_unlock(fifo_lock);
 
       double ahead = next_audio_start - next_video_end;   /* may be < 0 */
       bool   okay  = (video_stream_index < 0) ||
                      (ahead < 0.5 /*s*/) || need_audio_now || eof;
 
-      if (okay && !packet_buffer_empty(audio_packet_buffer))
+      if (okay && !trick_play_active && !packet_buffer_empty(audio_packet_buffer))
       {
          packet_buffer_get_packet(audio_packet_buffer, pkt_local);
          last_audio_end = audio_timebase * (pkt_local->pts + pkt_local->duration);
          audio_buffer = decode_audio(actx_active, pkt_local, aud_frame,
                                     audio_buffer, &audio_buffer_cap,
-                                    swr[audio_stream_ptr],
-                                    &audio_clock_rebase_pending);
+                                    &resamplers[audio_stream_ptr],
+                                    audio_queue_for_track(audio_stream_ptr),
+                                    false, &audio_clock_rebase_pending);
          av_packet_unref(pkt_local);
       }
 
+      /* Keep the standby track level with the playing one, as long as
+       * it stays within its CPU budget. */
+      if (audio_standby_enabled && !audio_switch_requested && !trick_play_active)
+      {
+         struct audio_queue *active  = audio_queue_for_track(audio_stream_ptr);
+         struct audio_queue *standby = active ?
+               &audio_queues[!(active - audio_queues)] : NULL;
+         int64_t now = av_gettime_relative();
+
+         if (now - standby_window_start >= AV_TIME_BASE)
+         {
+            standby_window_start = now;
+            standby_busy_us      = 0;
+         }
+
+         if (standby && standby->ring && standby->track >= 0 &&
+               standby->track != audio_stream_ptr &&
+               !packet_buffer_empty(audio_packet_buffers[standby->track]) &&
+               standby->end_time <= active->end_time + APLAYER_AUDIO_STANDBY_MIN_SECONDS &&
+               audio_queue_space(standby) > audio_ring_depth / 4 &&
+               standby_busy_us < (int64_t)(AV_TIME_BASE * APLAYER_AUDIO_STANDBY_CPU_BUDGET))
+         {
+            int track         = standby->track;
+            double tb         = av_q2d(fctx->streams[audio_streams[track]]->time_base);
+            size_t queued     = spsc_ring_fill(standby->ring);
+
+            packet_buffer_get_packet(audio_packet_buffers[track], pkt_local);
+
+            /* A hole in the standby audio would put it out of step,
+             * start over from this packet instead. */
+            if (queued && pkt_local->pts != AV_NOPTS_VALUE &&
+                  pkt_local->pts * tb > standby->end_time + APLAYER_AUDIO_STANDBY_MIN_SECONDS)
+               spsc_ring_flush(standby->ring);
+
+            audio_buffer = decode_audio(actx[track], pkt_local, aud_frame,
+                  audio_buffer, &audio_buffer_cap, &resamplers[track],
+                  standby, true, NULL);
+            av_packet_unref(pkt_local);
+            standby_busy_us += av_gettime_relative() - now;
+         }
+      }
+
       if (audio_switch_requested)
          continue;
 
@@ -6288,25 +9528,27 @@ static void decode_thread(void *data)
        *  1. we already decoded an audio packet
        *  2. there is no audio stream to play
        *  3. EOF
+       *  4. trick-play, where no audio is decoded
        **/
-      if (!audio_clock_rebase_pending &&
-            !packet_buffer_empty(video_packet_buffer) &&
-            (
-               (!eof && earlier_or_close_enough(next_video_end, last_audio_end)) ||
-               !actx_active ||
-               eof
-            )
+      if (!packet_buffer_empty(video_packet_buffer) &&
+            (trick_play_active ||
+             (!audio_clock_rebase_pending &&
+              (
+                 (!eof && earlier_or_close_enough(next_video_end, last_audio_end)) ||
+                 !actx_active ||
+                 eof
+              )))
          )
       {
          packet_buffer_get_packet(video_packet_buffer, pkt_local);
 
-         decode_video(vctx, pkt_local, ass_track_active);
+         decode_video(vctx, pkt_local, subtitle_active);
 
          av_packet_unref(pkt_local);
       }
 
       if (eof && packet_buffer_empty(video_packet_buffer))
-         video_filter_drain_to_buffer(ass_track_active);
+         video_filter_drain_to_buffer(subtitle_active);
 
       bool break_out_loop = false;
 
@@ -6317,14 +9559,16 @@ static void decode_thread(void *data)
       {
       case MEDIA_TYPE_AUDIO:
          loop_content = packet_buffer_empty(audio_packet_buffer) && packet_buffer_empty(video_packet_buffer) && eof &&
-                        (!audio_decode_fifo || FIFO_READ_AVAIL(audio_decode_fifo) <= 1024 * 10);
+                        (!audio_queues[0].ring ||
+                         spsc_ring_fill(audio_queues[audio_queue_playing].ring) <= 1024 * 10);
          break;
       case MEDIA_TYPE_VIDEO:
       default:
          loop_content = packet_buffer_empty(audio_packet_buffer) &&
                         packet_buffer_empty(video_packet_buffer) &&
                         eof &&
-                        (!audio_decode_fifo || FIFO_READ_AVAIL(audio_decode_fifo) <= 1024 * 10) &&
+                        (!audio_queues[0].ring ||
+                         spsc_ring_fill(audio_queues[audio_queue_playing].ring) <= 1024 * 10) &&
                         (!video_buffer || !video_buffer_has_finished_slot(video_buffer));
          break;
       }
@@ -6448,11 +9692,28 @@ static void decode_thread(void *data)
       }
 
       // Read the next frame and stage it in case of audio or video frame.
-      if (av_read_frame(fctx, pkt_local) < 0)
+      // A loop replays the cached start of the track first, and after a
+      // seek served by the seek cache its packets come first.
+      if (loop_replaying && loop_head_read(pkt_local))
+         have_packet = true;
+      else if (packet_history_read(packet_history, pkt_local))
+         have_packet = true;
+      else if (av_read_frame(fctx, pkt_local) < 0)
       {
-         eof = true;
+         if (!loop_start())
+            eof = true;
       }
+      else if (loop_resync && loop_head_stale(pkt_local))
+         av_packet_unref(pkt_local);
       else
+      {
+         if (loop_head_filling)
+            loop_head_remember(pkt_local);
+         packet_history_remember(pkt_local);
+         have_packet = true;
+      }
+
+      if (have_packet)
       {
          // Update g_current_time if not NOPTS
          if (pkt_local->pts != AV_NOPTS_VALUE)
@@ -6465,7 +9726,14 @@ static void decode_thread(void *data)
          }
 
          int audio_slot = audio_slot_for_stream(pkt_local->stream_index);
-         if (audio_slot >= 0 && actx[audio_slot])
+         if (audio_slot >= 0 || pkt_local->stream_index == video_stream_index)
+            loop_packet_shift(pkt_local);
+
+         if (trick_play_active && (audio_slot >= 0 ||
+                  (pkt_local->stream_index == video_stream_index &&
+                   !(pkt_local->flags & AV_PKT_FLAG_KEY))))
+            av_packet_unref(pkt_local);
+         else if (audio_slot >= 0 && actx[audio_slot])
          {
             packet_buffer_add_packet(audio_packet_buffers[audio_slot], pkt_local);
             if (audio_slot != audio_stream_ptr)
@@ -6477,207 +9745,18 @@ static void decode_thread(void *data)
          else
          {
             int subtitle_slot = subtitle_slot_for_stream(pkt_local->stream_index);
-            AVCodecContext *sctx_sub = NULL;
-            ASS_Track *ass_track_sub = NULL;
-
-            if (subtitle_slot < 0)
-            {
-               av_packet_unref(pkt_local);
-               continue;
-            }
-
-            sctx_sub = sctx[subtitle_slot];
-            ass_track_sub = ass_track[subtitle_slot];
-            if (!sctx_sub)
-            {
-               av_packet_unref(pkt_local);
-               continue;
-            }
-
-            /* Decode subtitle packets immediately. Text/ASS are appended to
-             * libass tracks; bitmap subtitles are queued for later blending. */
-            AVSubtitle sub;
-            int finished = 0;
-            int subtitle_ret = 0;
-            int64_t base_time_ms = 0;
-            int64_t start_ms = 0;
-            int64_t end_ms = 0;
-            int64_t duration_ms = 0;
-            bool end_known = false;
-
-            memset(&sub, 0, sizeof(sub));
-
-            /* Subtitle decoders consume one packet at a time; some packets
-             * validly produce no completed subtitle. Do not retry them. */
-            subtitle_ret = avcodec_decode_subtitle2(sctx_sub, &sub, &finished,
-                  pkt_local);
-            if (subtitle_ret < 0)
-            {
-               log_cb(RETRO_LOG_ERROR, "[APLAYER] Decode subtitles failed.\n");
-               avsubtitle_free(&sub);
-               av_packet_unref(pkt_local);
-               continue;
-            }
-
-            if (!finished)
-            {
-               avsubtitle_free(&sub);
-               av_packet_unref(pkt_local);
-               continue;
-            }
-
-            if (pkt_local->pts != AV_NOPTS_VALUE)
-               base_time_ms = (int64_t)(pkt_local->pts *
-                     av_q2d(fctx->streams[pkt_local->stream_index]->time_base) * 1000.0);
-            else if (sub.pts != AV_NOPTS_VALUE)
-               base_time_ms = sub.pts / 1000;
-
-            start_ms = base_time_ms + (int64_t)sub.start_display_time;
-            if (sub.end_display_time != UINT32_MAX &&
-                  sub.end_display_time > sub.start_display_time)
-            {
-               duration_ms = (int64_t)sub.end_display_time - (int64_t)sub.start_display_time;
-               end_known = true;
-            }
-
-            if (duration_ms <= 0 && pkt_local->duration > 0)
-            {
-               double packet_duration_ms = pkt_local->duration *
-                     av_q2d(fctx->streams[pkt_local->stream_index]->time_base) * 1000.0;
-               if (packet_duration_ms > 0.0)
-               {
-                  duration_ms = (int64_t)(packet_duration_ms + 0.5);
-                  end_known = true;
-               }
-            }
-
-            if (end_known)
-               end_ms = start_ms + duration_ms;
-            else
-               end_ms = start_ms;
 
-            if (subtitle_track_is_bitmap((unsigned)subtitle_slot))
+            /* Only the selected track is decoded, the others are just
+             * indexed so they can be backfilled when selected. */
+            if (subtitle_slot >= 0)
             {
-               slock_lock(ass_lock);
-               bitmap_subtitle_end_previous_locked((unsigned)subtitle_slot, start_ms);
-
-               if (sub.num_rects > 0)
-               {
-                  struct bitmap_subtitle_event bitmap_event;
-
-                  if (bitmap_subtitle_build_event(sctx_sub, &sub, start_ms, end_ms,
-                           end_known, &bitmap_event))
-                  {
-                     if (!first_subtitle_event_logged)
-                     {
-                        if (first_subtitle_start_ms[subtitle_slot] < 0)
-                           first_subtitle_start_ms[subtitle_slot] = start_ms;
-                        log_cb(RETRO_LOG_INFO,
-                              "[APLAYER] First subtitle event (bitmap): stream=%d slot=%d start_ms=%lld end_ms=%s%lld rects=%u\n",
-                              pkt_local->stream_index, subtitle_slot,
-                              (long long)start_ms,
-                              end_known ? "" : "unknown/",
-                              (long long)end_ms,
-                              bitmap_event.rect_count);
-                        first_subtitle_event_logged = true;
-                     }
-
-                     if (!bitmap_subtitle_append_locked((unsigned)subtitle_slot,
-                              &bitmap_event))
-                     {
-                        bitmap_subtitle_clear_event(&bitmap_event);
-                     }
-                  }
-               }
-
-               slock_unlock(ass_lock);
-               avsubtitle_free(&sub);
-               av_packet_unref(pkt_local);
-               continue;
-            }
-
-            if (duration_ms <= 0)
-               duration_ms = SUBTITLE_UNKNOWN_DURATION_MS;
-
-            end_ms = start_ms + duration_ms;
+               AVStream *st = fctx->streams[pkt_local->stream_index];
 
-            for (i = 0; i < sub.num_rects; i++)
-            {
-               if (!sub.rects[i])
-                  continue;
-               slock_lock(ass_lock);
-               if (ass_track_sub)
-               {
-                  if (subtitle_is_ass[subtitle_slot])
-                  {
-                     if (sub.rects[i]->ass)
-                     {
-                        if (!first_subtitle_event_logged)
-                        {
-                           const char *payload = sub.rects[i]->ass;
-                           if (first_subtitle_start_ms[subtitle_slot] < 0)
-                              first_subtitle_start_ms[subtitle_slot] = start_ms;
-                           log_cb(RETRO_LOG_INFO,
-                                 "[APLAYER] First subtitle event (ass): stream=%d slot=%d start_ms=%lld end_ms=%lld text=\"%.200s\"\n",
-                                 pkt_local->stream_index, subtitle_slot,
-                                 (long long)start_ms, (long long)end_ms,
-                                 payload ? payload : "(null)");
-                           first_subtitle_event_logged = true;
-                        }
-                        ass_add_embedded_event(ass_track_sub,
-                              start_ms, end_ms, sub.rects[i]->ass);
-                     }
-                     else if (sub.rects[i]->text)
-                     {
-                        if (!first_subtitle_event_logged)
-                        {
-                           const char *payload = sub.rects[i]->text;
-                           if (first_subtitle_start_ms[subtitle_slot] < 0)
-                              first_subtitle_start_ms[subtitle_slot] = start_ms;
-                           log_cb(RETRO_LOG_INFO,
-                                 "[APLAYER] First subtitle event (text): stream=%d slot=%d start_ms=%lld end_ms=%lld text=\"%.200s\"\n",
-                                 pkt_local->stream_index, subtitle_slot,
-                                 (long long)start_ms, (long long)end_ms,
-                                 payload ? payload : "(null)");
-                           first_subtitle_event_logged = true;
-                        }
-                        ass_add_text_event(ass_track_sub,
-                              start_ms, end_ms, sub.rects[i]->text);
-                     }
-                  }
-                  else
-                  {
-                     const char *raw_text = sub.rects[i]->text;
-                     const char *ass_payload = sub.rects[i]->ass;
-
-                     if (!first_subtitle_event_logged)
-                     {
-                        const char *payload = ass_payload ? ass_payload : raw_text;
-                        if (first_subtitle_start_ms[subtitle_slot] < 0)
-                           first_subtitle_start_ms[subtitle_slot] = start_ms;
-                        log_cb(RETRO_LOG_INFO,
-                              "[APLAYER] First subtitle event (text): stream=%d slot=%d start_ms=%lld end_ms=%lld text=\"%.200s\"\n",
-                              pkt_local->stream_index, subtitle_slot,
-                              (long long)start_ms, (long long)end_ms,
-                              payload ? payload : "(null)");
-                        first_subtitle_event_logged = true;
-                     }
-
-                     if (ass_payload)
-                        ass_add_embedded_event(ass_track_sub, start_ms, end_ms, ass_payload);
-                     else if (raw_text)
-                        ass_add_text_event(ass_track_sub, start_ms, end_ms, raw_text);
-                  }
-               }
-               slock_unlock(ass_lock);
+               subtitle_packet_index_add((unsigned)subtitle_slot, pkt_local, st->time_base);
+               if (subtitle_slot == subtitle_active && sctx[subtitle_slot])
+                  subtitle_decode_packet(sctx[subtitle_slot], (unsigned)subtitle_slot,
+                        st->time_base, pkt_local, true, subtitle_stage_push);
             }
-            if (ass_track_sub && !subtitle_is_ass[subtitle_slot])
-            {
-               slock_lock(ass_lock);
-               ass_backfill_unknown_event_durations(ass_track_sub);
-               slock_unlock(ass_lock);
-            }
-            avsubtitle_free(&sub);
             av_packet_unref(pkt_local);
          }
       }
@@ -6685,9 +9764,17 @@ static void decode_thread(void *data)
 
 end:
    av_packet_free(&pkt_local);
+   packet_history_destroy(packet_history);
+   packet_history = NULL;
+   packet_history_destroy(loop_head);
+   loop_head = NULL;
+   free(loop_head_last_ts);
+   loop_head_last_ts = NULL;
+   loop_resync_ts    = NULL;
+   loop_head_streams = 0;
 
    for (i = 0; (int)i < audio_streams_num; i++)
-      swr_free(&swr[i]);
+      audio_resampler_free(&resamplers[i]);
 
    for (i = 0; (int)i < audio_streams_num; i++)
       packet_buffer_destroy(audio_packet_buffers[i]);
@@ -6734,6 +9821,7 @@ static void context_reset(void)
 
    frames_tex_width  = 0;
    frames_tex_height = 0;
+   video_present_valid = false;
    frames[0].pts     = 0.0;
    frames[1].pts     = 0.0;
    frames[0].valid   = false;
@@ -6744,6 +9832,11 @@ static void context_reset(void)
       fft = fft_new(11, hw_render.get_proc_address);
       if (fft)
          fft_init_multisample(fft);
+      else if (!cpu_fft)
+      {
+         log_cb(RETRO_LOG_INFO, "[APLAYER] GLES3 not available, using the CPU visualizer.\n");
+         cpu_fft = cpu_fft_new(11);
+      }
    }
 
    /* Already inits symbols. */
@@ -6817,6 +9910,11 @@ void retro_unload_game(void)
       sthread_join(decode_thread_handle);
       decode_thread_handle = NULL;
    }
+
+   /* The ingest thread writes into the external subtitle track. */
+   external_subtitle_ingest_release();
+   subtitle_backfill_release();
+   aplayer_stats_log(RETRO_LOG_INFO);
    
    /* Now that decode_thread is done, wait for all worker tasks */
    if (tpool)
@@ -6844,23 +9942,73 @@ void retro_unload_game(void)
       slock_free(fifo_lock);
    if (decode_thread_lock)
       slock_free(decode_thread_lock);
+   if (subtitle_stage)
+   {
+      subtitle_stage_drain_locked(false);
+      spsc_ring_free(subtitle_stage);
+   }
    if (ass_lock)
       slock_free(ass_lock);
    if (time_lock)
       slock_free(time_lock);
-   if (audio_decode_fifo)
-      fifo_free(audio_decode_fifo);
+   for (i = 0; i < ARRAY_SIZE(audio_queues); i++)
+   {
+      spsc_ring_free(audio_queues[i].ring);
+      audio_queues[i].ring     = NULL;
+      audio_queues[i].end_time = 0.0;
+      audio_queues[i].track    = -1;
+   }
+   audio_queue_playing = 0;
+   audio_low_power     = false;
+   fft_last_frame_us   = 0;
+   free(cover_art_frame);
+   cover_art_frame     = NULL;
+   cover_art_stream    = -1;
+   cover_art_presented = false;
+   frontend_can_dupe   = false;
+   video_present_valid = false;
+   stats_presents        = 0;
+   stats_presents_elided = 0;
+   stats_late_video      = 0;
+   stats_late_audio      = 0;
+   audio_faded_out       = true;
+   frame_time_enabled    = false;
+   frame_time_usec       = 0;
+   frame_clock_frac      = 0.0;
+   frame_clock_period    = 1.0;
+   stats_frame_times     = 0;
+   stats_frame_hiccups   = 0;
+   stats_frame_jitter_sum = 0.0;
+   stats_frame_jitter_max = 0.0;
+   if (audio_status_enabled)
+      environ_cb(RETRO_ENVIRONMENT_SET_AUDIO_BUFFER_STATUS_CALLBACK, NULL);
+   audio_status_enabled   = false;
+   trick_play_active      = false;
+   trick_hop_pending      = false;
+   trick_seek_dir         = 0;
+   scan_hold_dir          = 0;
+   audio_latency_pending  = false;
+   audio_device_starving  = false;
+   audio_device_occupancy_min = 100;
+   stats_audio_starving   = 0;
+   cpu_fft_free(cpu_fft);
+   cpu_fft             = NULL;
+   free(cpu_fft_frame);
+   cpu_fft_frame       = NULL;
+   cpu_fft_frame_size  = 0;
+   hw_render_enabled   = false;
+   decode_wakeups      = 0;
+   stats_wakeups_since_us = 0;
 
    fifo_cond = NULL;
    fifo_decode_cond = NULL;
    fifo_lock = NULL;
    decode_thread_lock = NULL;
-   audio_decode_fifo = NULL;
+   audio_ring_depth = 0;
    ass_lock = NULL;
+   subtitle_stage = NULL;
    time_lock = NULL;
 
-   decode_last_audio_time = 0.0;
-
    frames[0].pts = frames[1].pts = 0.0;
    frames[0].valid = frames[1].valid = false;
    pts_bias = 0.0;
@@ -6887,6 +10035,10 @@ void retro_unload_game(void)
       avformat_close_input(&fctx);
       fctx = NULL;
    }
+   avio_cache_close(io_cache);
+   io_cache = NULL;
+   avio_file_close(io_file);
+   io_file = NULL;
 
    for (i = 0; i < attachments_size; i++) {
       av_freep(&attachments[i].data);
@@ -6899,6 +10051,7 @@ void retro_unload_game(void)
       if (ass_track[i])
          ass_free_track(ass_track[i]);
       ass_track[i] = NULL;
+      subtitle_text_bytes[i] = 0;
       subtitle_is_bitmap[i] = false;
       subtitle_uses_native_text_header[i] = false;
 
@@ -6907,16 +10060,12 @@ void retro_unload_game(void)
       av_freep(&ass_extra_data[i]);
       ass_extra_data_size[i] = 0;
    }
-   if (ass_render) {
-      ass_renderer_done(ass_render);
-      ass_render = NULL;
-   }
+   subtitle_packet_index_free();
    if (ass) {
       ass_library_done(ass);
       ass = NULL;
    }
 
-   ass_render = NULL;
    ass = NULL;
 
    current_media_path[0] = '\0';
@@ -7026,6 +10175,44 @@ bool retro_load_game(const struct retro_game_info *info)
       goto error;
    }
 
+   /* The demuxer reads network media through the read-ahead cache,
+    * local files in large blocks. */
+   if (aplayer_path_is_network(local_info.path))
+   {
+      if (io_cache_max_bytes)
+      {
+         io_cache = avio_cache_open(local_info.path, io_cache_max_bytes);
+         if (io_cache && (fctx = avformat_alloc_context()))
+         {
+            fctx->pb = avio_cache_context(io_cache);
+            log_cb(RETRO_LOG_INFO, "[APLAYER] Reading network media up to %u MB ahead.\n",
+                  (unsigned)(io_cache_max_bytes / (1024 * 1024)));
+         }
+         else
+         {
+            avio_cache_close(io_cache);
+            io_cache = NULL;
+            log_cb(RETRO_LOG_WARN, "[APLAYER] Network read-ahead unavailable, reading directly.\n");
+         }
+      }
+   }
+   else if (io_file_block_bytes)
+   {
+      io_file = avio_file_open(local_info.path, io_file_block_bytes);
+      if (io_file && (fctx = avformat_alloc_context()))
+      {
+         fctx->pb = avio_file_context(io_file);
+         log_cb(RETRO_LOG_INFO, "[APLAYER] Reading media in %u MB blocks.\n",
+               (unsigned)(io_file_block_bytes / (1024 * 1024)));
+      }
+      else
+      {
+         avio_file_close(io_file);
+         io_file = NULL;
+         log_cb(RETRO_LOG_WARN, "[APLAYER] File read-ahead unavailable, reading directly.\n");
+      }
+   }
+
    if ((ret = avformat_open_input(&fctx, local_info.path, NULL, NULL)) < 0)
    {
       log_cb(RETRO_LOG_ERROR, "[APLAYER] Failed to open input: %s. %s\n", av_err2str(ret));
@@ -7062,7 +10249,41 @@ bool retro_load_game(const struct retro_game_info *info)
    if (have_bookmark)
       aplayer_bookmark_apply_stream_selection(&bookmark);
 
-   is_fft = video_stream_index < 0 && audio_streams_num > 0;
+   if (!environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &frontend_can_dupe))
+      frontend_can_dupe = false;
+
+   {
+      struct retro_frame_time_callback frame_time;
+
+      frame_time.callback  = aplayer_frame_time_cb;
+      frame_time.reference = (retro_usec_t)(AV_TIME_BASE / media.interpolate_fps);
+      frame_time_enabled   = environ_cb(RETRO_ENVIRONMENT_SET_FRAME_TIME_CALLBACK, &frame_time);
+      frame_clock_period   = 1.0;
+      if (!frame_time_enabled)
+         log_cb(RETRO_LOG_INFO, "[APLAYER] No frame time callback, clock runs at the nominal rate.\n");
+   }
+
+   if (audio_streams_num > 0)
+   {
+      struct retro_audio_buffer_status_callback buffer_status;
+
+      buffer_status.callback = aplayer_audio_buffer_status_cb;
+      audio_status_enabled   = environ_cb(
+            RETRO_ENVIRONMENT_SET_AUDIO_BUFFER_STATUS_CALLBACK, &buffer_status);
+      audio_latency_pending  = audio_status_enabled;
+   }
+
+   if (video_stream_index < 0 && audio_streams_num > 0 && cover_art_enabled &&
+         cover_art_stream >= 0)
+      cover_art_load();
+
+   /* Without the visualizer an audio file needs no HW context at all. */
+   audio_low_power = video_stream_index < 0 && audio_streams_num > 0 &&
+         (!fft_enabled || cover_art_frame);
+   is_fft          = video_stream_index < 0 && audio_streams_num > 0 && !audio_low_power;
+   if (audio_low_power)
+      log_cb(RETRO_LOG_INFO, "[APLAYER] Low-power audio mode, no HW render%s.\n",
+            cover_art_frame ? ", showing cover art" : "");
 
    if (video_stream_index >= 0 || is_fft)
    {
@@ -7076,6 +10297,15 @@ bool retro_load_game(const struct retro_game_info *info)
       {
          log_cb(RETRO_LOG_ERROR, "[APLAYER] Cannot initialize HW render.\n");
       }
+      else
+         hw_render_enabled = true;
+   }
+
+   /* Without a HW context the visualizer is drawn in software. */
+   if (is_fft && !hw_render_enabled)
+   {
+      log_cb(RETRO_LOG_INFO, "[APLAYER] Using the CPU visualizer.\n");
+      cpu_fft = cpu_fft_new(11);
    }
 
    /* NEW: advertise geometry/timing to the frontend right after we know them */
@@ -7088,10 +10318,19 @@ bool retro_load_game(const struct retro_game_info *info)
 
    if (audio_streams_num > 0)
    {
-      /* audio fifo is 2 seconds deep */
-      audio_decode_fifo = fifo_new(
-         media.sample_rate * sizeof(int16_t) * 2 * 2
-      );
+      /* aplayer_audio_buffer deep, 2 seconds by default */
+      audio_ring_depth = (size_t)((uint64_t)media.sample_rate * audio_buffer_ms / 1000) *
+            sizeof(int16_t) * 2;
+      audio_queues[0].ring  = spsc_ring_new(audio_ring_depth);
+      audio_queues[0].track = audio_streams_ptr;
+      if (!audio_queues[0].ring)
+         audio_ring_depth = 0;
+      /* Second queue for the standby track, the one Y switches to. */
+      else if (audio_standby_enabled && audio_streams_num > 1)
+      {
+         audio_queues[1].ring  = spsc_ring_new(audio_ring_depth);
+         audio_queues[1].track = (audio_streams_ptr + 1) % audio_streams_num;
+      }
    }
 
    fifo_cond        = scond_new();
@@ -7099,6 +10338,10 @@ bool retro_load_game(const struct retro_game_info *info)
    fifo_lock        = slock_new();
    ass_lock         = slock_new();
    time_lock        = slock_new();
+   subtitle_stage   = spsc_ring_new(
+         SUBTITLE_STAGE_CAPACITY * sizeof(struct subtitle_staged_event*));
+
+   external_subtitle_ingest_start();
 
    slock_lock(fifo_lock);
    decode_thread_dead = false;
@@ -30,6 +30,57 @@
 #define M_HALF_PI 1.57079632679489661923132169163975144
 #endif
 
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+#ifndef GL_QUERY_RESULT
+#define GL_QUERY_RESULT 0x8866
+#endif
+#ifndef GL_QUERY_RESULT_AVAILABLE
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+
+/* Timer queries are core on desktop GL 3.3 and an extension on GLES. */
+#ifdef HAVE_OPENGLES
+#define FFT_TIMER_EXTENSION        "GL_EXT_disjoint_timer_query"
+#define fft_glGenQueries           glGenQueriesEXT
+#define fft_glDeleteQueries        glDeleteQueriesEXT
+#define fft_glBeginQuery           glBeginQueryEXT
+#define fft_glEndQuery             glEndQueryEXT
+#define fft_glGetQueryObjectuiv    glGetQueryObjectuivEXT
+#define fft_glGetQueryObjectui64v  glGetQueryObjectui64vEXT
+#else
+#define FFT_TIMER_EXTENSION        "ARB_timer_query"
+#define fft_glGenQueries           glGenQueries
+#define fft_glDeleteQueries        glDeleteQueries
+#define fft_glBeginQuery           glBeginQuery
+#define fft_glEndQuery             glEndQuery
+#define fft_glGetQueryObjectuiv    glGetQueryObjectuiv
+#define fft_glGetQueryObjectui64v  glGetQueryObjectui64v
+#endif
+
+/* Most heightmap rows computed in one frame. Each row covers up to
+ * one FFT window of new audio, so this only kicks in after stalls. */
+#define FFT_MAX_BATCH_ROWS 4
+/* Frames in flight before a timer query result is read back. */
+#define FFT_TIMER_QUERIES 4
+
+/* Dynamic resolution: the render scale moves in FFT_SCALE_STEP
+ * increments, at most once per FFT_SCALE_INTERVAL measured frames. */
+#define FFT_SCALE_STEP 0.125f
+#define FFT_SCALE_INTERVAL 30
+/* Intervals to wait after a step down before stepping up again. */
+#define FFT_SCALE_HOLD 10
+/* Share of the frame period the visualizer may use on the GPU. */
+#define FFT_GPU_BUDGET 0.35
+/* Without GPU timing, frame intervals longer than this share of the
+ * frame period mean frames are being missed. */
+#define FFT_INTERVAL_BUDGET 1.15
+#define FFT_INTERVAL_HEADROOM 1.05
+
 extern retro_log_printf_t log_cb;
 
 struct target
@@ -74,11 +125,45 @@ struct GLFFT
       GLuint vbo;
       GLuint ibo;
       unsigned elems;
+      GLint resolution_loc;
+      GLint heightmap_size_loc;
+      GLint row_loc;
+      GLint time_loc;
    } block;
 
+   /* Uniform locations, looked up once at link time. */
+   GLint real_viewport_offset_loc;
+   GLint complex_viewport_offset_loc;
+   GLint resolve_offset_scale_loc;
+   GLint blur_offset_scale_loc;
+
    GLuint pbo;
    GLshort *sliding;
    unsigned sliding_size;
+   /* Stereo frames held in sliding, and how many of the newest ones
+    * have not been transformed yet. */
+   unsigned sliding_frames;
+   unsigned pending;
+
+   GLuint timer_queries[FFT_TIMER_QUERIES];
+   unsigned timer_head;
+   unsigned timer_in_flight;
+   bool timer_enabled;
+   uint64_t gpu_time_sum_ns;
+   uint64_t gpu_time_max_ns;
+   unsigned gpu_time_samples;
+
+   /* Offscreen target for rendering below the output resolution. */
+   struct target scaled;
+   unsigned scaled_width;
+   unsigned scaled_height;
+   float scale;
+   float scale_min;
+   float scale_max;
+   double frame_period_ms;
+   double frame_time_ms;
+   unsigned frame_time_samples;
+   unsigned scale_hold;
 
    unsigned steps;
    unsigned size;
@@ -284,6 +369,11 @@ static void fft_init(fft_t *fft)
    fft->prog_blur    = fft_compile_program(fft, fft_vertex_program, fft_fragment_program_blur);
    GL_CHECK_ERROR();
 
+   fft->real_viewport_offset_loc    = glGetUniformLocation(fft->prog_real, "uViewportOffset");
+   fft->complex_viewport_offset_loc = glGetUniformLocation(fft->prog_complex, "uViewportOffset");
+   fft->resolve_offset_scale_loc    = glGetUniformLocation(fft->prog_resolve, "uOffsetScale");
+   fft->blur_offset_scale_loc       = glGetUniformLocation(fft->prog_blur, "uOffsetScale");
+
    glUseProgram(fft->prog_real);
    glUniform1i(glGetUniformLocation(fft->prog_real, "sTexture"), 0);
    glUniform1i(glGetUniformLocation(fft->prog_real, "sParameterTexture"), 1);
@@ -326,15 +416,14 @@ static void fft_init(fft_t *fft)
 
    GL_CHECK_ERROR();
    fft_init_texture(fft, &fft->input_tex, GL_RG16I,
-         fft->size, 1, 1, GL_NEAREST, GL_NEAREST);
+         fft->size, FFT_MAX_BATCH_ROWS, 1, GL_NEAREST, GL_NEAREST);
    fft_init_target(fft, &fft->output, GL_RG32UI,
          fft->size, fft->depth, 1, GL_NEAREST, GL_NEAREST);
    fft_init_target(fft, &fft->resolve, GL_RGBA8,
          fft->size, fft->depth, 1, GL_NEAREST, GL_NEAREST);
+   /* The visualizer only samples level 0, so no mipmaps. */
    fft_init_target(fft, &fft->blur, GL_RGBA8,
-         fft->size, fft->depth,
-         log2i(MAX(fft->size, fft->depth)) + 1,
-         GL_NEAREST, GL_LINEAR_MIPMAP_LINEAR);
+         fft->size, fft->depth, 1, GL_NEAREST, GL_NEAREST);
 
    GL_CHECK_ERROR();
 
@@ -342,7 +431,7 @@ static void fft_init(fft_t *fft)
    {
       GLuint *param_buffer = NULL;
       fft_init_target(fft, &fft->passes[i].target,
-            GL_RG32UI, fft->size, 1, 1, GL_NEAREST, GL_NEAREST);
+            GL_RG32UI, fft->size, FFT_MAX_BATCH_ROWS, 1, GL_NEAREST, GL_NEAREST);
       fft_init_texture(fft, &fft->passes[i].parameter_tex,
             GL_RG32UI, fft->size, 1, 1, GL_NEAREST, GL_NEAREST);
 
@@ -362,7 +451,7 @@ static void fft_init(fft_t *fft)
    glGenBuffers(1, &fft->pbo);
    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, fft->pbo);
    glBufferData(GL_PIXEL_UNPACK_BUFFER,
-         fft->size * 2 * sizeof(GLshort), 0, GL_DYNAMIC_DRAW);
+         FFT_MAX_BATCH_ROWS * fft->size * 2 * sizeof(GLshort), 0, GL_DYNAMIC_DRAW);
    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
    free(window);
@@ -378,12 +467,31 @@ static void fft_init_block(fft_t *fft)
    glUseProgram(fft->block.prog);
    glUniform1i(glGetUniformLocation(fft->block.prog, "sHeight"), 0);
    glUniform4fv(glGetUniformLocation(fft->block.prog, "uOffsetScale"), 1, unity);
+   fft->block.resolution_loc     = glGetUniformLocation(fft->block.prog, "uResolution");
+   fft->block.heightmap_size_loc = glGetUniformLocation(fft->block.prog, "uHeightmapSize");
+   fft->block.row_loc            = glGetUniformLocation(fft->block.prog, "uRow");
+   fft->block.time_loc           = glGetUniformLocation(fft->block.prog, "uTime");
    fft->block.vao  = fft->vao;
    fft->block.vbo  = 0;
    fft->block.ibo  = 0;
    fft->block.elems = 4;
 }
 
+static void fft_init_timer(fft_t *fft)
+{
+   const char *exts = (const char*)(glGetString(GL_EXTENSIONS));
+
+   fft->timer_enabled = false;
+   if (!exts || !strstr(exts, FFT_TIMER_EXTENSION) ||
+         !fft_glGenQueries || !fft_glGetQueryObjectui64v)
+      return;
+
+   fft_glGenQueries(FFT_TIMER_QUERIES, fft->timer_queries);
+   fft->timer_head      = 0;
+   fft->timer_in_flight = 0;
+   fft->timer_enabled   = true;
+}
+
 static bool fft_context_reset(fft_t *fft, unsigned fft_steps,
       rglgen_proc_address_t proc, unsigned fft_depth)
 {
@@ -394,6 +502,10 @@ static bool fft_context_reset(fft_t *fft, unsigned fft_steps,
    fft->size        = 1 << fft_steps;
    fft->block_size  = fft->size / 4 + 1;
    fft->frame       = 0;
+   fft->scale       = 1.0f;
+   fft->scale_min   = 1.0f;
+   fft->scale_max   = 1.0f;
+   fft->frame_period_ms = 1000.0 / 60.0;
 
    fft->passes_size = fft_steps;
    fft->passes      = (struct Pass*)calloc(fft->passes_size, sizeof(struct Pass));
@@ -401,8 +513,11 @@ static bool fft_context_reset(fft_t *fft, unsigned fft_steps,
    if (!fft->passes)
       return false;
 
-   fft->sliding_size = 2 * fft->size;
-   fft->sliding      = (GLshort*)calloc(fft->sliding_size, sizeof(GLshort));
+   /* One window of history plus a full batch of new audio. */
+   fft->sliding_size   = 2 * fft->size * (FFT_MAX_BATCH_ROWS + 1);
+   fft->sliding        = (GLshort*)calloc(fft->sliding_size, sizeof(GLshort));
+   fft->sliding_frames = fft->size;
+   fft->pending        = 0;
 
    if (!fft->sliding)
       return false;
@@ -414,6 +529,7 @@ static bool fft_context_reset(fft_t *fft, unsigned fft_steps,
    GL_CHECK_ERROR();
    fft_init_block(fft);
    GL_CHECK_ERROR();
+   fft_init_timer(fft);
 
    return true;
 }
@@ -468,9 +584,25 @@ void fft_init_multisample(fft_t *fft)
    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+static void fft_free_scaled_target(fft_t *fft)
+{
+   if (fft->scaled.fbo)
+      glDeleteFramebuffers(1, &fft->scaled.fbo);
+   if (fft->scaled.tex)
+      glDeleteTextures(1, &fft->scaled.tex);
+   fft->scaled.fbo     = 0;
+   fft->scaled.tex     = 0;
+   fft->scaled_width   = 0;
+   fft->scaled_height  = 0;
+}
+
 static void fft_context_destroy(fft_t *fft)
 {
    fft_init_multisample(fft);
+   fft_free_scaled_target(fft);
+   if (fft->timer_enabled)
+      fft_glDeleteQueries(FFT_TIMER_QUERIES, fft->timer_queries);
+   fft->timer_enabled = false;
    if (fft->passes)
       free(fft->passes);
    fft->passes = NULL;
@@ -491,12 +623,60 @@ void fft_free(fft_t *fft)
 }
 
 void fft_step_fft(fft_t *fft, const GLshort *audio_buffer, unsigned frames)
+{
+   GLshort *slide    = (GLshort*)&fft->sliding[0];
+   unsigned capacity = fft->sliding_size / 2;
+
+   /* Only the newest audio of a batch can still be transformed. */
+   if (frames > capacity - fft->size)
+   {
+      audio_buffer += (frames - (capacity - fft->size)) * 2;
+      frames        = capacity - fft->size;
+   }
+
+   if (fft->sliding_frames + frames > capacity)
+   {
+      unsigned keep = capacity - frames;
+      memmove(slide, slide + (fft->sliding_frames - keep) * 2,
+            keep * 2 * sizeof(GLshort));
+      fft->sliding_frames = keep;
+   }
+
+   memcpy(slide + fft->sliding_frames * 2, audio_buffer,
+         2 * frames * sizeof(GLshort));
+   fft->sliding_frames += frames;
+   fft->pending         = MIN(fft->pending + frames,
+         fft->sliding_frames - fft->size);
+}
+
+/* Transforms the audio fed since the last frame into up to
+ * FFT_MAX_BATCH_ROWS new heightmap rows: one upload, and one draw
+ * per FFT step, resolve and blur for the whole batch. */
+static void fft_process(fft_t *fft)
 {
    unsigned i;
-   GLfloat resolve_offset[4];
+   unsigned rows;
+   unsigned first;
+   unsigned segments;
+   unsigned seg_start[2];
+   unsigned seg_rows[2];
+   unsigned seg_first[2];
    GLshort *buffer = NULL;
    GLshort *slide  = (GLshort*)&fft->sliding[0];
 
+   rows = (fft->pending + fft->size - 1) / fft->size;
+   rows = MAX(MIN(rows, FFT_MAX_BATCH_ROWS), 1);
+
+   /* Rows the batch lands on in the heightmap, split in two when it
+    * wraps around. */
+   seg_start[0] = fft->output_ptr;
+   seg_rows[0]  = MIN(rows, fft->depth - fft->output_ptr);
+   seg_first[0] = 0;
+   seg_start[1] = 0;
+   seg_rows[1]  = rows - seg_rows[0];
+   seg_first[1] = seg_rows[0];
+   segments     = seg_rows[1] ? 2 : 1;
+
    glEnable(GL_DEPTH_TEST);
    glEnable(GL_CULL_FACE);
    glBindVertexArray(fft->vao);
@@ -508,53 +688,62 @@ void fft_step_fft(fft_t *fft, const GLshort *audio_buffer, unsigned frames)
    glBindTexture(GL_TEXTURE_2D, fft->input_tex);
    glUseProgram(fft->prog_real);
 
-   memmove(slide, slide + frames * 2,
-         (fft->sliding_size - 2 * frames) * sizeof(GLshort));
-   memcpy(slide + fft->sliding_size - frames * 2, audio_buffer,
-         2 * frames * sizeof(GLshort));
-
-   /* Upload audio data to GPU. */
+   /* Upload one window per row, the windows ending evenly spaced
+    * across the new audio. */
    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, fft->pbo);
 
    buffer = (GLshort*)(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
-            2 * fft->size * sizeof(GLshort),
+            rows * 2 * fft->size * sizeof(GLshort),
             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
 
    if (buffer)
    {
-      memcpy(buffer, slide, fft->sliding_size * sizeof(GLshort));
+      first = fft->sliding_frames - fft->pending;
+      for (i = 0; i < rows; i++)
+      {
+         unsigned end = first + fft->pending * (i + 1) / rows;
+         memcpy(buffer + i * 2 * fft->size, slide + (end - fft->size) * 2,
+               2 * fft->size * sizeof(GLshort));
+      }
       glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
    }
-   glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, fft->size, 1,
+   glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, fft->size, rows,
          GL_RG_INTEGER, GL_SHORT, NULL);
    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-   /* Perform FFT of new block. */
-   glViewport(0, 0, fft->size, 1);
+   fft->pending = 0;
+
+   /* Perform FFT of the new rows. */
+   glViewport(0, 0, fft->size, rows);
 
    for (i = 0; i < fft->steps; i++)
    {
+      GLint offset_loc = i == 0
+         ? fft->real_viewport_offset_loc : fft->complex_viewport_offset_loc;
+
+      glActiveTexture(GL_TEXTURE1);
+      glBindTexture(GL_TEXTURE_2D, fft->passes[i].parameter_tex);
+
       if (i == fft->steps - 1)
       {
+         unsigned s;
+
          glBindFramebuffer(GL_FRAMEBUFFER, fft->output.fbo);
-         glUniform1i(glGetUniformLocation(i == 0
-                  ? fft->prog_real : fft->prog_complex, "uViewportOffset"),
-               fft->output_ptr);
-         glViewport(0, fft->output_ptr, fft->size, 1);
+         for (s = 0; s < segments; s++)
+         {
+            glUniform1i(offset_loc, (GLint)seg_start[s] - (GLint)seg_first[s]);
+            glViewport(0, seg_start[s], fft->size, seg_rows[s]);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+         }
       }
       else
       {
-         glUniform1i(glGetUniformLocation(i == 0
-                  ? fft->prog_real : fft->prog_complex, "uViewportOffset"), 0);
+         glUniform1i(offset_loc, 0);
          glBindFramebuffer(GL_FRAMEBUFFER, fft->passes[i].target.fbo);
          glClear(GL_COLOR_BUFFER_BIT);
+         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
       }
 
-      glActiveTexture(GL_TEXTURE1);
-      glBindTexture(GL_TEXTURE_2D, fft->passes[i].parameter_tex);
-
-      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-
       glActiveTexture(GL_TEXTURE0);
       glBindTexture(GL_TEXTURE_2D, fft->passes[i].target.tex);
 
@@ -563,35 +752,45 @@ void fft_step_fft(fft_t *fft, const GLshort *audio_buffer, unsigned frames)
    }
    glActiveTexture(GL_TEXTURE0);
 
-   /* Resolve new chunk to heightmap. */
-   glViewport(0, fft->output_ptr, fft->size, 1);
+   /* Resolve new rows to heightmap. */
    glUseProgram(fft->prog_resolve);
    glBindFramebuffer(GL_FRAMEBUFFER, fft->resolve.fbo);
+   glBindTexture(GL_TEXTURE_2D, fft->output.tex);
+   for (i = 0; i < segments; i++)
+   {
+      GLfloat offset_scale[4];
 
-   resolve_offset[0] = 0.0f;
-   resolve_offset[1] = (float)(fft->output_ptr) / fft->depth;
-   resolve_offset[2] = 1.0f;
-   resolve_offset[3] = 1.0f / fft->depth;
+      offset_scale[0] = 0.0f;
+      offset_scale[1] = (float)seg_start[i] / fft->depth;
+      offset_scale[2] = 1.0f;
+      offset_scale[3] = (float)seg_rows[i] / fft->depth;
 
-   glUniform4fv(glGetUniformLocation(fft->prog_resolve, "uOffsetScale"),
-         1, resolve_offset);
-   glBindTexture(GL_TEXTURE_2D, fft->output.tex);
-   glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+      glViewport(0, seg_start[i], fft->size, seg_rows[i]);
+      glUniform4fv(fft->resolve_offset_scale_loc, 1, offset_scale);
+      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+   }
 
-   /* Re-blur damaged regions of heightmap. */
+   /* Re-blur damaged regions of heightmap. Only once every new row
+    * is resolved, the kernel reaches two rows back. */
    glUseProgram(fft->prog_blur);
    glBindTexture(GL_TEXTURE_2D, fft->resolve.tex);
    glBindFramebuffer(GL_FRAMEBUFFER, fft->blur.fbo);
-   glUniform4fv(glGetUniformLocation(fft->prog_blur, "uOffsetScale"),
-         1, resolve_offset);
-   glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+   for (i = 0; i < segments; i++)
+   {
+      GLfloat offset_scale[4];
 
-   /* Mipmap the heightmap. */
-   glBindTexture(GL_TEXTURE_2D, fft->blur.tex);
-   glGenerateMipmap(GL_TEXTURE_2D);
+      offset_scale[0] = 0.0f;
+      offset_scale[1] = (float)seg_start[i] / fft->depth;
+      offset_scale[2] = 1.0f;
+      offset_scale[3] = (float)seg_rows[i] / fft->depth;
+
+      glViewport(0, seg_start[i], fft->size, seg_rows[i]);
+      glUniform4fv(fft->blur_offset_scale_loc, 1, offset_scale);
+      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+   }
    glBindTexture(GL_TEXTURE_2D, 0);
 
-   fft->output_ptr++;
+   fft->output_ptr += rows;
    fft->output_ptr &= fft->depth - 1;
 
    glDisable(GL_CULL_FACE);
@@ -602,27 +801,152 @@ void fft_step_fft(fft_t *fft, const GLshort *audio_buffer, unsigned frames)
    GL_CHECK_ERROR();
 }
 
+/* Averages the measured frame time and, every FFT_SCALE_INTERVAL
+ * samples, steps the render scale down when it is over @budget_ms or
+ * back up when it is below @headroom_ms. After a step down it holds
+ * for a while, so it does not bounce around the budget. */
+static void fft_update_scale(fft_t *fft, double frame_ms,
+      double budget_ms, double headroom_ms)
+{
+   fft->frame_time_ms += frame_ms;
+   if (++fft->frame_time_samples < FFT_SCALE_INTERVAL)
+      return;
+
+   frame_ms                = fft->frame_time_ms / fft->frame_time_samples;
+   fft->frame_time_ms      = 0.0;
+   fft->frame_time_samples = 0;
+
+   if (frame_ms > budget_ms)
+   {
+      fft->scale     -= FFT_SCALE_STEP;
+      fft->scale_hold = FFT_SCALE_HOLD;
+   }
+   else if (fft->scale_hold)
+      fft->scale_hold--;
+   else if (frame_ms < headroom_ms)
+      fft->scale += FFT_SCALE_STEP;
+
+   fft->scale = MAX(MIN(fft->scale, fft->scale_max), fft->scale_min);
+}
+
+/* Reads back finished timer queries without waiting on the GPU. */
+static void fft_timer_collect(fft_t *fft)
+{
+   bool disjoint = false;
+
+   while (fft->timer_in_flight)
+   {
+      GLuint available = 0;
+      GLuint64 elapsed = 0;
+      GLuint query     = fft->timer_queries[
+         (fft->timer_head + FFT_TIMER_QUERIES - fft->timer_in_flight)
+         % FFT_TIMER_QUERIES];
+
+      fft_glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available)
+         break;
+
+      fft_glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+      fft->timer_in_flight--;
+
+#ifdef HAVE_OPENGLES
+      if (!disjoint)
+      {
+         GLint value = 0;
+         glGetIntegerv(GL_GPU_DISJOINT_EXT, &value);
+         disjoint    = value != 0;
+      }
+#endif
+      /* Results that straddle a GPU clock change are meaningless. */
+      if (disjoint)
+         continue;
+
+      fft->gpu_time_sum_ns += elapsed;
+      fft->gpu_time_max_ns  = MAX(fft->gpu_time_max_ns, elapsed);
+      fft->gpu_time_samples++;
+      {
+         /* Shading cost follows the pixel count. */
+         double up = (fft->scale + FFT_SCALE_STEP) / fft->scale;
+         fft_update_scale(fft, (double)elapsed / 1000000.0,
+               fft->frame_period_ms * FFT_GPU_BUDGET,
+               fft->frame_period_ms * FFT_GPU_BUDGET * 0.8 / (up * up));
+      }
+   }
+}
+
+/* Makes sure the offscreen target can hold @width x @height. */
+static bool fft_prepare_scaled_target(fft_t *fft,
+      unsigned width, unsigned height)
+{
+   if (fft->scaled.fbo &&
+         fft->scaled_width >= width && fft->scaled_height >= height)
+      return true;
+
+   fft_free_scaled_target(fft);
+   fft_init_target(fft, &fft->scaled, GL_RGBA8,
+         width, height, 1, GL_LINEAR, GL_LINEAR);
+   fft->scaled_width  = width;
+   fft->scaled_height = height;
+
+   return fft->scaled.fbo != 0;
+}
+
 void fft_render(fft_t *fft, GLuint backbuffer, unsigned width, unsigned height)
 {
-   unsigned row = (fft->output_ptr + fft->depth - 1) & (fft->depth - 1);
+   unsigned row;
    float time = (float)fft->frame++;
+   bool timed = false;
+   unsigned render_width  = MAX((unsigned)(width * fft->scale + 0.5f), 1);
+   unsigned render_height = MAX((unsigned)(height * fft->scale + 0.5f), 1);
+   bool scaled = (render_width < width || render_height < height) &&
+         fft_prepare_scaled_target(fft, width, height);
 
-   /* Render scene. */
-   glBindFramebuffer(GL_FRAMEBUFFER, fft->ms_fbo ? fft->ms_fbo : backbuffer);
-   glViewport(0, 0, width, height);
-   glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+   if (!scaled)
+   {
+      render_width  = width;
+      render_height = height;
+   }
+
+   if (fft->timer_enabled)
+   {
+      fft_timer_collect(fft);
+      /* Skip timing this frame rather than wait for the GPU. */
+      if (fft->timer_in_flight < FFT_TIMER_QUERIES)
+      {
+         fft_glBeginQuery(GL_TIME_ELAPSED, fft->timer_queries[fft->timer_head]);
+         timed = true;
+      }
+   }
+
+   if (fft->pending)
+      fft_process(fft);
+   row = (fft->output_ptr + fft->depth - 1) & (fft->depth - 1);
+
+   /* Render scene, to the offscreen target when below the output
+    * resolution. */
+   if (scaled)
+   {
+      glBindFramebuffer(GL_FRAMEBUFFER, fft->scaled.fbo);
+      glViewport(0, 0, render_width, render_height);
+      glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+      glClear(GL_COLOR_BUFFER_BIT);
+   }
+   else
+   {
+      glBindFramebuffer(GL_FRAMEBUFFER, fft->ms_fbo ? fft->ms_fbo : backbuffer);
+      glViewport(0, 0, width, height);
+      glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+   }
    glDisable(GL_CULL_FACE);
    glDisable(GL_DEPTH_TEST);
 
    glUseProgram(fft->block.prog);
 
-   glUniform2f(glGetUniformLocation(fft->block.prog, "uResolution"),
-         (float)width, (float)height);
-   glUniform2f(glGetUniformLocation(fft->block.prog, "uHeightmapSize"),
-         (float)fft->size, (float)fft->depth);
-   glUniform1f(glGetUniformLocation(fft->block.prog, "uRow"), (float)row);
-   glUniform1f(glGetUniformLocation(fft->block.prog, "uTime"), time);
+   glUniform2f(fft->block.resolution_loc, (float)render_width, (float)render_height);
+   glUniform2f(fft->block.heightmap_size_loc, (float)fft->size, (float)fft->depth);
+   glUniform1f(fft->block.row_loc, (float)row);
+   glUniform1f(fft->block.time_loc, time);
 
    glActiveTexture(GL_TEXTURE0);
    glBindTexture(GL_TEXTURE_2D, fft->blur.tex);
@@ -632,7 +956,21 @@ void fft_render(fft_t *fft, GLuint backbuffer, unsigned width, unsigned height)
    glBindTexture(GL_TEXTURE_2D, 0);
    glUseProgram(0);
 
-   if (fft->ms_fbo)
+   if (scaled)
+   {
+      static const GLenum attachments[] = { GL_COLOR_ATTACHMENT0 };
+
+      /* Upscale to the output. */
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, fft->scaled.fbo);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, backbuffer);
+      glBlitFramebuffer(0, 0, render_width, render_height, 0, 0, width, height,
+            GL_COLOR_BUFFER_BIT, GL_LINEAR);
+
+      glBindFramebuffer(GL_FRAMEBUFFER, fft->scaled.fbo);
+      glInvalidateFramebuffer(GL_FRAMEBUFFER, 1, attachments);
+      GL_CHECK_ERROR();
+   }
+   else if (fft->ms_fbo)
    {
       static const GLenum attachments[] = { GL_COLOR_ATTACHMENT0, GL_DEPTH_STENCIL_ATTACHMENT };
 
@@ -646,6 +984,56 @@ void fft_render(fft_t *fft, GLuint backbuffer, unsigned width, unsigned height)
       GL_CHECK_ERROR();
    }
 
+   if (timed)
+   {
+      fft_glEndQuery(GL_TIME_ELAPSED);
+      fft->timer_head = (fft->timer_head + 1) % FFT_TIMER_QUERIES;
+      fft->timer_in_flight++;
+   }
+
    glBindFramebuffer(GL_FRAMEBUFFER, 0);
    GL_CHECK_ERROR();
 }
+
+bool fft_get_gpu_time(fft_t *fft, double *avg_ms, double *max_ms)
+{
+   if (!fft || !fft->gpu_time_samples)
+      return false;
+
+   *avg_ms = (double)fft->gpu_time_sum_ns / fft->gpu_time_samples / 1000000.0;
+   *max_ms = (double)fft->gpu_time_max_ns / 1000000.0;
+
+   fft->gpu_time_sum_ns  = 0;
+   fft->gpu_time_max_ns  = 0;
+   fft->gpu_time_samples = 0;
+   return true;
+}
+
+void fft_set_resolution(fft_t *fft, float scale_min, float scale_max,
+      double frame_period_ms)
+{
+   if (!fft)
+      return;
+
+   fft->scale_min       = scale_min;
+   fft->scale_max       = scale_max;
+   fft->frame_period_ms = frame_period_ms;
+   fft->scale           = MAX(MIN(fft->scale, scale_max), scale_min);
+}
+
+void fft_report_frame_time(fft_t *fft, double frame_ms)
+{
+   /* GPU timing is the better measure when it is there. Very long
+    * intervals are the frontend pausing (menu, loading), not us. */
+   if (!fft || fft->timer_enabled || frame_ms > fft->frame_period_ms * 4.0)
+      return;
+
+   fft_update_scale(fft, frame_ms,
+         fft->frame_period_ms * FFT_INTERVAL_BUDGET,
+         fft->frame_period_ms * FFT_INTERVAL_HEADROOM);
+}
+
+float fft_get_scale(fft_t *fft)
+{
+   return fft ? fft->scale : 1.0f;
+}
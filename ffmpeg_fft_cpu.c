@@ -0,0 +1,329 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON) || defined(HAVE_NEON)
+#include <arm_neon.h>
+#define CPU_FFT_NEON
+#endif
+
+#include <boolean.h>
+#include <retro_miscellaneous.h>
+#include <retro_inline.h>
+#include <filters.h>
+
+/* The vendored FFT shares its fft_* names with the GL visualizer, so
+ * build a renamed private copy of it here. */
+#define fft_t                       cpu_fft_core_t
+#define fft_new                     cpu_fft_core_new
+#define fft_free                    cpu_fft_core_free
+#define fft_process_forward_complex cpu_fft_core_process_forward_complex
+#define fft_process_forward         cpu_fft_core_process_forward
+#define fft_process_inverse         cpu_fft_core_process_inverse
+#include "libretro-common/audio/dsp_filters/fft/fft.c"
+#undef fft_t
+#undef fft_new
+#undef fft_free
+#undef fft_process_forward_complex
+#undef fft_process_forward
+#undef fft_process_inverse
+
+#include "include/ffmpeg_fft_cpu.h"
+
+/* Same window as the GL visualizer. */
+#define CPU_FFT_KAISER_BETA 12.0
+/* Spectrum bins the GL visualizer reads (0 to 240), padded for SIMD. */
+#define CPU_FFT_BINS 244
+/* Heightmap rows the GL blur pass spans. */
+#define CPU_FFT_ROWS 3
+#define CPU_FFT_BARS 60
+#define CPU_FFT_BAR_FALLOFF 0.03f
+
+struct cpu_fft
+{
+   cpu_fft_core_t *core;
+   /* Kaiser window, also scaled by 0.5 / 0x8000 to average the two
+    * channels and normalize them like the GL input texture. */
+   float *window;
+   float *input;
+   fft_complex_t *output;
+   /* Last size stereo frames. */
+   int16_t *sliding;
+
+   float heights[CPU_FFT_ROWS][CPU_FFT_BINS];
+   float kernel[CPU_FFT_ROWS][3];
+   float bars[CPU_FFT_BARS];
+
+   unsigned row;
+   unsigned size;
+   bool dirty;
+};
+
+/* Interleaved S16 stereo to windowed mono floats. */
+static void cpu_fft_window(const int16_t *in, const float *window,
+      float *out, unsigned frames)
+{
+   unsigned i = 0;
+#if defined(__SSE2__)
+   const __m128i ones = _mm_set1_epi16(1);
+
+   for (; i + 4 <= frames; i += 4)
+   {
+      __m128i samples = _mm_loadu_si128((const __m128i*)(in + i * 2));
+      /* Adds each L/R pair into one 32-bit lane. */
+      __m128 sum      = _mm_cvtepi32_ps(_mm_madd_epi16(samples, ones));
+      _mm_storeu_ps(out + i, _mm_mul_ps(sum, _mm_loadu_ps(window + i)));
+   }
+#elif defined(CPU_FFT_NEON)
+   for (; i + 4 <= frames; i += 4)
+   {
+      int16x4x2_t samples = vld2_s16(in + i * 2);
+      float32x4_t sum     = vcvtq_f32_s32(vaddl_s16(samples.val[0], samples.val[1]));
+      vst1q_f32(out + i, vmulq_f32(sum, vld1q_f32(window + i)));
+   }
+#endif
+   for (; i < frames; i++)
+      out[i] = (float)(in[i * 2] + in[i * 2 + 1]) * window[i];
+}
+
+/* Squared magnitude of the first @bins bins, @bins a multiple of 4
+ * when SIMD is available. */
+static void cpu_fft_power(const fft_complex_t *in, float *out, unsigned bins)
+{
+   unsigned i = 0;
+#if defined(__SSE2__)
+   for (; i + 4 <= bins; i += 4)
+   {
+      __m128 a  = _mm_loadu_ps(&in[i].real);
+      __m128 b  = _mm_loadu_ps(&in[i + 2].real);
+      __m128 re;
+      __m128 im;
+
+      a  = _mm_mul_ps(a, a);
+      b  = _mm_mul_ps(b, b);
+      re = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+      im = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+      _mm_storeu_ps(out + i, _mm_add_ps(re, im));
+   }
+#elif defined(CPU_FFT_NEON)
+   for (; i + 4 <= bins; i += 4)
+   {
+      float32x4x2_t c = vld2q_f32(&in[i].real);
+      vst1q_f32(out + i, vmlaq_f32(vmulq_f32(c.val[0], c.val[0]),
+               c.val[1], c.val[1]));
+   }
+#endif
+   for (; i < bins; i++)
+      out[i] = in[i].real * in[i].real + in[i].imag * in[i].imag;
+}
+
+cpu_fft_t *cpu_fft_new(unsigned fft_steps)
+{
+   unsigned i;
+   int x, y;
+   double window_mod;
+   float kernel_sum = 0.0f;
+   cpu_fft_t *fft   = (cpu_fft_t*)calloc(1, sizeof(*fft));
+
+   if (!fft)
+      return NULL;
+
+   fft->size    = 1 << fft_steps;
+   fft->core    = cpu_fft_core_new(fft_steps);
+   fft->window  = (float*)malloc(fft->size * sizeof(float));
+   fft->input   = (float*)malloc(fft->size * sizeof(float));
+   fft->output  = (fft_complex_t*)calloc(fft->size, sizeof(fft_complex_t));
+   fft->sliding = (int16_t*)calloc(fft->size * 2, sizeof(int16_t));
+
+   if (!fft->core || !fft->window || !fft->input || !fft->output ||
+         !fft->sliding || fft->size < CPU_FFT_BINS)
+   {
+      cpu_fft_free(fft);
+      return NULL;
+   }
+
+   window_mod = 1.0 / besseli0(CPU_FFT_KAISER_BETA);
+   for (i = 0; i < fft->size; i++)
+   {
+      double phase = (double)((int)i - (int)(fft->size) / 2) / ((int)(fft->size) / 2);
+      double     w = besseli0(CPU_FFT_KAISER_BETA * sqrt(1 - phase * phase));
+      /* Quantized like the GL window texture. */
+      fft->window[i] = (float)(round(0xffff * w * window_mod) / 0x10000 * 0.5 / 0x8000);
+   }
+
+   /* The GL blur kernel, over the two previous rows and the
+    * neighbouring bins. */
+   for (y = 0; y < CPU_FFT_ROWS; y++)
+   {
+      for (x = -1; x <= 1; x++)
+      {
+         fft->kernel[y][x + 1] = expf(-0.35f * (float)(x * x + y * y));
+         kernel_sum           += fft->kernel[y][x + 1];
+      }
+   }
+   for (y = 0; y < CPU_FFT_ROWS; y++)
+      for (x = 0; x < 3; x++)
+         fft->kernel[y][x] /= kernel_sum;
+
+   return fft;
+}
+
+void cpu_fft_free(cpu_fft_t *fft)
+{
+   if (!fft)
+      return;
+
+   cpu_fft_core_free(fft->core);
+   free(fft->window);
+   free(fft->input);
+   free(fft->output);
+   free(fft->sliding);
+   free(fft);
+}
+
+void cpu_fft_step(cpu_fft_t *fft, const int16_t *buffer, unsigned frames)
+{
+   if (!fft || !buffer || !frames)
+      return;
+
+   if (frames >= fft->size)
+      memcpy(fft->sliding, buffer + (frames - fft->size) * 2,
+            fft->size * 2 * sizeof(int16_t));
+   else
+   {
+      memmove(fft->sliding, fft->sliding + frames * 2,
+            (fft->size - frames) * 2 * sizeof(int16_t));
+      memcpy(fft->sliding + (fft->size - frames) * 2, buffer,
+            frames * 2 * sizeof(int16_t));
+   }
+
+   fft->dirty = true;
+}
+
+/* Adds one heightmap row from the current window, on the same log
+ * scale as the GL resolve pass and clamped like its RGBA8 target. */
+static void cpu_fft_analyse(cpu_fft_t *fft)
+{
+   unsigned i;
+   float power[CPU_FFT_BINS];
+   float *row;
+
+   fft->row = (fft->row + 1) % CPU_FFT_ROWS;
+   row      = fft->heights[fft->row];
+
+   cpu_fft_window(fft->sliding, fft->window, fft->input, fft->size);
+   cpu_fft_core_process_forward(fft->core, fft->output, fft->input, 1);
+   cpu_fft_power(fft->output, power, CPU_FFT_BINS);
+
+   for (i = 0; i < CPU_FFT_BINS; i++)
+   {
+      float h = (9.0f * logf(power[i] + 0.0001f) - 22.0f + 40.0f) / 80.0f;
+      row[i]  = h < 0.0f ? 0.0f : (h > 1.0f ? 1.0f : h);
+   }
+
+   fft->dirty = false;
+}
+
+/* Blurred height of @bin in the latest row, scaled like the GL
+ * visualizer's fftValue(). */
+static float cpu_fft_value(const cpu_fft_t *fft, int bin)
+{
+   int x, y;
+   float sum = 0.0f;
+
+   for (y = 0; y < CPU_FFT_ROWS; y++)
+   {
+      const float *row = fft->heights[(fft->row + CPU_FFT_ROWS - y) % CPU_FFT_ROWS];
+
+      for (x = -1; x <= 1; x++)
+      {
+         int b = bin + x;
+         if (b < 0)
+            b = 0;
+         else if (b >= CPU_FFT_BINS)
+            b = CPU_FFT_BINS - 1;
+         sum += fft->kernel[y][x + 1] * row[b];
+      }
+   }
+
+   return sum * 40.0f;
+}
+
+/* Full-scale value of a bin, per band as in the GL visualizer. */
+static float cpu_fft_band_range(int bin)
+{
+   if (bin < 80)
+      return 40.0f;
+   if (bin < 160)
+      return 3.0f;
+   return 0.8f;
+}
+
+void cpu_fft_render(cpu_fft_t *fft, uint32_t *output,
+      unsigned width, unsigned height, size_t pitch)
+{
+   unsigned b, x, y;
+   unsigned bar_width, bar_gap, left, base, max_height;
+   const int bins_per_bar = 240 / CPU_FFT_BARS;
+
+   if (!fft || !output || !width || !height)
+      return;
+
+   if (fft->dirty)
+      cpu_fft_analyse(fft);
+
+   for (b = 0; b < CPU_FFT_BARS; b++)
+   {
+      int bin;
+      float peak = 0.0f;
+
+      for (bin = (int)b * bins_per_bar; bin < (int)(b + 1) * bins_per_bar; bin++)
+      {
+         float v = cpu_fft_value(fft, bin) / cpu_fft_band_range(bin);
+         if (v > peak)
+            peak = v;
+      }
+      if (peak > 1.0f)
+         peak = 1.0f;
+
+      /* Fall off gradually rather than flicker. */
+      if (peak < fft->bars[b] - CPU_FFT_BAR_FALLOFF)
+         peak = fft->bars[b] - CPU_FFT_BAR_FALLOFF;
+      fft->bars[b] = peak;
+   }
+
+   for (y = 0; y < height; y++)
+      memset((uint8_t*)output + y * pitch, 0, width * sizeof(uint32_t));
+
+   bar_width  = MAX(width / CPU_FFT_BARS, 1);
+   bar_gap    = bar_width / 4;
+   left       = (width - MIN(width, bar_width * CPU_FFT_BARS)) / 2;
+   base       = height * 3 / 4;
+   max_height = base * 9 / 10;
+
+   /* Ground line, like the GL visualizer's. */
+   {
+      uint32_t *line = (uint32_t*)((uint8_t*)output + base * pitch);
+      for (x = 0; x < width; x++)
+         line[x] = 0x808080;
+   }
+
+   for (b = 0; b < CPU_FFT_BARS; b++)
+   {
+      unsigned x0 = left + b * bar_width;
+      unsigned x1 = MIN(x0 + bar_width - bar_gap, width);
+      unsigned h  = (unsigned)(fft->bars[b] * max_height);
+
+      if (x0 >= width)
+         break;
+
+      for (y = base - h; y < base; y++)
+      {
+         uint32_t *line = (uint32_t*)((uint8_t*)output + y * pitch);
+         for (x = x0; x < x1; x++)
+            line[x] = 0xffffff;
+      }
+   }
+}
@@ -0,0 +1,99 @@
+#ifndef __LIBRETRO_SDK_AVIOCACHE_H__
+#define __LIBRETRO_SDK_AVIOCACHE_H__
+
+#include <retro_common_api.h>
+
+#include <boolean.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavformat/avio.h>
+#ifdef __cplusplus
+}
+#endif
+
+#include <retro_miscellaneous.h>
+
+RETRO_BEGIN_DECLS
+
+/**
+ * avio_cache
+ *
+ * A read-ahead layer between the demuxer and a slow source, such as
+ * a network stream. A prefetch thread keeps reading from the source
+ * into a ring of bytes, so that the demuxer reads from memory and a
+ * short stall of the source does not stall playback.
+ *
+ * Part of the ring stays behind the read position, so that seeks
+ * into the bytes still kept, and short skips ahead, do not seek the
+ * source.
+ *
+ */
+struct avio_cache;
+typedef struct avio_cache avio_cache_t;
+
+/**
+ * avio_cache_stats
+ *
+ * Counters since the last avio_cache_get_stats() reset.
+ *
+ */
+struct avio_cache_stats
+{
+   uint64_t bytes_fetched;  /* read from the source */
+   int64_t fetch_us;        /* spent reading from the source */
+   unsigned stalls;         /* reads that had to wait for the source */
+   int64_t stall_us;        /* spent waiting in those */
+   unsigned seeks_reused;   /* seeks served from the bytes kept */
+   unsigned seeks_source;   /* seeks that seeked the source */
+   unsigned retries;        /* source reads retried after an error */
+   size_t ahead;            /* bytes read ahead right now */
+};
+
+/**
+ * avio_cache_open:
+ * @url               : media to open.
+ * @size              : size of the ring in bytes.
+ *
+ * Opens @url and starts reading ahead.
+ *
+ * Returns: A read-ahead cache, or NULL if @url could not be opened.
+ */
+avio_cache_t *avio_cache_open(const char *url, size_t size);
+
+/**
+ * avio_cache_close:
+ * @cache             : read-ahead cache.
+ *
+ * Stops the prefetch thread and closes the source. The demuxer using
+ * the context must have been closed first.
+ *
+ **/
+void avio_cache_close(avio_cache_t *cache);
+
+/**
+ * avio_cache_context:
+ * @cache             : read-ahead cache.
+ *
+ * Returns the I/O context to set as AVFormatContext.pb before
+ * avformat_open_input(). It stays owned by @cache.
+ */
+AVIOContext *avio_cache_context(avio_cache_t *cache);
+
+/**
+ * avio_cache_get_stats:
+ * @cache             : read-ahead cache.
+ * @stats             : counters to fill.
+ * @reset             : start counting again.
+ *
+ * Gets the counters, for the playback statistics.
+ */
+void avio_cache_get_stats(avio_cache_t *cache,
+      struct avio_cache_stats *stats, bool reset);
+
+RETRO_END_DECLS
+
+#endif
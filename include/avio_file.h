@@ -0,0 +1,95 @@
+#ifndef __LIBRETRO_SDK_AVIOFILE_H__
+#define __LIBRETRO_SDK_AVIOFILE_H__
+
+#include <retro_common_api.h>
+
+#include <boolean.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavformat/avio.h>
+#ifdef __cplusplus
+}
+#endif
+
+#include <retro_miscellaneous.h>
+
+RETRO_BEGIN_DECLS
+
+/**
+ * avio_file
+ *
+ * Reads a local file for the demuxer in large blocks at aligned
+ * offsets. Where the system supports it, the next block is prefetched
+ * by the kernel while the current one is used, and blocks well behind
+ * the read position are released from the file cache.
+ *
+ * Only used from the thread that reads the demuxer, except for
+ * avio_file_get_stats().
+ *
+ */
+struct avio_file;
+typedef struct avio_file avio_file_t;
+
+/**
+ * avio_file_stats
+ *
+ * Counters since the last avio_file_get_stats() reset.
+ *
+ */
+struct avio_file_stats
+{
+   uint64_t bytes_read;     /* read from the file */
+   int64_t read_us;         /* spent in reads */
+   int64_t read_max_us;     /* slowest single block */
+   unsigned blocks;         /* blocks read */
+};
+
+/**
+ * avio_file_open:
+ * @path              : local file to open.
+ * @block_size        : bytes read at once.
+ *
+ * Opens @path.
+ *
+ * Returns: A file reader, or NULL if @path could not be opened or the
+ * system has no 64-bit file offsets.
+ */
+avio_file_t *avio_file_open(const char *path, size_t block_size);
+
+/**
+ * avio_file_close:
+ * @file              : file reader.
+ *
+ * Closes the file. The demuxer using the context must have been
+ * closed first.
+ *
+ **/
+void avio_file_close(avio_file_t *file);
+
+/**
+ * avio_file_context:
+ * @file              : file reader.
+ *
+ * Returns the I/O context to set as AVFormatContext.pb before
+ * avformat_open_input(). It stays owned by @file.
+ */
+AVIOContext *avio_file_context(avio_file_t *file);
+
+/**
+ * avio_file_get_stats:
+ * @file              : file reader.
+ * @stats             : counters to fill.
+ * @reset             : start counting again.
+ *
+ * Gets the counters, for the playback statistics.
+ */
+void avio_file_get_stats(avio_file_t *file,
+      struct avio_file_stats *stats, bool reset);
+
+RETRO_END_DECLS
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <glsym/glsym.h>
 
+#include <boolean.h>
 #include <retro_common_api.h>
 
 RETRO_BEGIN_DECLS
@@ -15,10 +16,28 @@ void fft_free(fft_t *fft);
 
 void fft_init_multisample(fft_t *fft);
 
+/* Queues audio on the CPU side only, the next fft_render() uploads
+ * and transforms everything queued since the previous one. */
 void fft_step_fft(fft_t *fft, const GLshort *buffer, unsigned frames);
 
 void fft_render(fft_t *fft, GLuint backbuffer, unsigned width, unsigned height);
 
+/* GPU time of fft_render() since the previous call, when timer
+ * queries are available and at least one result came back. */
+bool fft_get_gpu_time(fft_t *fft, double *avg_ms, double *max_ms);
+
+/* Bounds of the render scale, relative to the output resolution, and
+ * the frame period the dynamic scale is budgeted against. Pass the
+ * same value twice for a fixed scale. */
+void fft_set_resolution(fft_t *fft, float scale_min, float scale_max,
+      double frame_period_ms);
+
+/* Measured frame interval, drives the dynamic scale when there is no
+ * GPU timing. */
+void fft_report_frame_time(fft_t *fft, double frame_ms);
+
+float fft_get_scale(fft_t *fft);
+
 RETRO_END_DECLS
 
 #endif
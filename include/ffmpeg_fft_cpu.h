@@ -0,0 +1,66 @@
+#ifndef FFMPEG_FFT_CPU_H_
+#define FFMPEG_FFT_CPU_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <retro_common_api.h>
+
+RETRO_BEGIN_DECLS
+
+/**
+ * cpu_fft
+ *
+ * Software fallback for the GL visualizer, used when there is no
+ * GLES3 context. It reads the same spectrum as the GL heightmap and
+ * draws it as bars into an XRGB8888 buffer.
+ *
+ */
+typedef struct cpu_fft cpu_fft_t;
+
+/**
+ * cpu_fft_new:
+ * @fft_steps         : log2 of the FFT size, 11 like the GL visualizer.
+ *
+ * Create a CPU visualizer.
+ *
+ * Returns: A CPU visualizer, or NULL on allocation failure.
+ */
+cpu_fft_t *cpu_fft_new(unsigned fft_steps);
+
+/**
+ * cpu_fft_free:
+ * @fft               : CPU visualizer.
+ *
+ * Frees a CPU visualizer.
+ **/
+void cpu_fft_free(cpu_fft_t *fft);
+
+/**
+ * cpu_fft_step:
+ * @fft               : CPU visualizer.
+ * @buffer            : Interleaved S16 stereo audio.
+ * @frames            : Number of stereo frames in @buffer.
+ *
+ * Feeds audio that was just played. Cheap, the transform itself
+ * runs in cpu_fft_render().
+ **/
+void cpu_fft_step(cpu_fft_t *fft, const int16_t *buffer, unsigned frames);
+
+/**
+ * cpu_fft_render:
+ * @fft               : CPU visualizer.
+ * @output            : XRGB8888 frame to draw into.
+ * @width             : Width of @output in pixels.
+ * @height            : Height of @output in pixels.
+ * @pitch             : Length of an @output row in bytes.
+ *
+ * Renders one frame. Runs at most one FFT per call, however much
+ * audio was fed since the last one.
+ **/
+void cpu_fft_render(cpu_fft_t *fft, uint32_t *output,
+      unsigned width, unsigned height, size_t pitch);
+
+RETRO_END_DECLS
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef __LIBRETRO_SDK_PACKETHISTORY_H__
+#define __LIBRETRO_SDK_PACKETHISTORY_H__
+
+#include <retro_common_api.h>
+
+#include <boolean.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavcodec/avcodec.h>
+#ifdef __cplusplus
+}
+#endif
+
+#include <retro_miscellaneous.h>
+
+RETRO_BEGIN_DECLS
+
+/**
+ * packet_history
+ *
+ * The packets most recently read from the demuxer, in read order,
+ * so that a short seek can replay them from memory instead of
+ * seeking the demuxer.
+ *
+ * The history always starts at a sync point (a video keyframe, or
+ * any audio packet for audio-only media) and drops whole sync point
+ * intervals from its start to stay within its byte and time budget.
+ * It is only used from the decode thread.
+ *
+ */
+struct packet_history;
+typedef struct packet_history packet_history_t;
+
+/**
+ * packet_history_create:
+ * @max_bytes         : budget for the packet payloads.
+ * @max_seconds       : longest span of media time to keep.
+ *
+ * Create a packet history.
+ *
+ * Returns: A packet history, or NULL on allocation failure.
+ */
+packet_history_t *packet_history_create(size_t max_bytes, double max_seconds);
+
+/**
+ * packet_history_destroy:
+ * @history           : packet history
+ *
+ * Destroys a packet history and unrefs its packets.
+ *
+ **/
+void packet_history_destroy(packet_history_t *history);
+
+/**
+ * packet_history_clear:
+ * @history           : packet history
+ *
+ * Drops all packets, for when the demuxer has been seeked and its
+ * position no longer follows the history.
+ *
+ **/
+void packet_history_clear(packet_history_t *history);
+
+/**
+ * packet_history_add:
+ * @history           : packet history
+ * @pkt               : packet just read from the demuxer
+ * @time              : start of @pkt in seconds, NAN if unknown
+ * @sync_point        : true if decoding can start at @pkt
+ *
+ * Keeps a reference to @pkt. Packets before the first sync point are
+ * not kept. Must not be called while replaying.
+ *
+ **/
+void packet_history_add(packet_history_t *history, const AVPacket *pkt,
+      double time, bool sync_point);
+
+/**
+ * packet_history_seek:
+ * @history           : packet history
+ * @time              : target in seconds
+ *
+ * Starts replaying from the last sync point at or before @time, if
+ * @time is within the history.
+ *
+ * Returns: true if the seek is served from the history, false if the
+ * demuxer has to be seeked.
+ */
+bool packet_history_seek(packet_history_t *history, double time);
+
+/**
+ * packet_history_rewind:
+ * @history           : packet history
+ *
+ * Starts replaying from the first packet.
+ *
+ * Returns: true if there is anything to replay.
+ */
+bool packet_history_rewind(packet_history_t *history);
+
+/**
+ * packet_history_read:
+ * @history           : packet history
+ * @pkt               : packet to fill
+ *
+ * Gets the next packet to replay as a new reference. User needs to
+ * unref the packet with av_packet_unref().
+ *
+ * Returns: true if @pkt was filled, false once the replay has caught
+ * up with the demuxer, which is then read again.
+ */
+bool packet_history_read(packet_history_t *history, AVPacket *pkt);
+
+/**
+ * packet_history_bytes:
+ * @history           : packet history
+ *
+ * Returns the payload bytes currently kept.
+ */
+size_t packet_history_bytes(packet_history_t *history);
+
+/**
+ * packet_history_span:
+ * @history           : packet history
+ *
+ * Returns the media time the history covers, in seconds.
+ */
+double packet_history_span(packet_history_t *history);
+
+RETRO_END_DECLS
+
+#endif
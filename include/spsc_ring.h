@@ -0,0 +1,175 @@
+#ifndef __LIBRETRO_SDK_SPSCRING_H__
+#define __LIBRETRO_SDK_SPSCRING_H__
+
+#include <retro_common_api.h>
+
+#include <boolean.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <retro_miscellaneous.h>
+
+RETRO_BEGIN_DECLS
+
+/**
+ * spsc_ring
+ *
+ * Lock-free single producer / single consumer byte ring.
+ *
+ * Exactly one thread may write and exactly one thread may read at
+ * any given time. Callers that hand the consumer role between threads
+ * need to serialize those threads themselves (e.g. with a mutex).
+ *
+ */
+struct spsc_ring;
+typedef struct spsc_ring spsc_ring_t;
+
+/**
+ * spsc_ring_new:
+ * @capacity      : Minimum capacity in bytes.
+ *
+ * Create a ring. The capacity is rounded up to the next power of two.
+ *
+ * Returns: A ring, or NULL on allocation failure.
+ */
+spsc_ring_t *spsc_ring_new(size_t capacity);
+
+/**
+ * spsc_ring_free:
+ * @ring      : ring
+ *
+ * Frees the ring and its storage.
+ *
+ **/
+void spsc_ring_free(spsc_ring_t *ring);
+
+/**
+ * spsc_ring_clear:
+ * @ring      : ring
+ *
+ * Discards all pending data. Only safe while neither the producer
+ * nor the consumer is accessing the ring.
+ *
+ **/
+void spsc_ring_clear(spsc_ring_t *ring);
+
+/**
+ * spsc_ring_capacity:
+ * @ring      : ring
+ *
+ * Returns the capacity of the ring in bytes.
+ *
+ **/
+size_t spsc_ring_capacity(spsc_ring_t *ring);
+
+/**
+ * spsc_ring_read_avail:
+ * @ring      : ring
+ *
+ * Returns the number of bytes ready to be read from the current read
+ * position. A pending spsc_ring_flush() is only applied by
+ * spsc_ring_begin_read(). Consumer side.
+ *
+ **/
+size_t spsc_ring_read_avail(spsc_ring_t *ring);
+
+/**
+ * spsc_ring_begin_read:
+ * @ring      : ring
+ *
+ * Starts a read: drops anything a pending spsc_ring_flush() asked for
+ * and fixes the read position until spsc_ring_consume(), so that a
+ * flush in between can not release peeked regions. Consumer side.
+ *
+ * Returns: the number of bytes ready to be read.
+ */
+size_t spsc_ring_begin_read(spsc_ring_t *ring);
+
+/**
+ * spsc_ring_write_avail:
+ * @ring      : ring
+ *
+ * Returns the number of bytes that can be written, including space
+ * up to a pending spsc_ring_flush() unless the consumer is between
+ * spsc_ring_begin_read() and spsc_ring_consume(). Producer side.
+ *
+ **/
+size_t spsc_ring_write_avail(spsc_ring_t *ring);
+
+/**
+ * spsc_ring_fill:
+ * @ring      : ring
+ *
+ * Returns the number of queued bytes, not counting flushed ones.
+ * Safe to call from either side; the result is only a snapshot.
+ *
+ **/
+size_t spsc_ring_fill(spsc_ring_t *ring);
+
+/**
+ * spsc_ring_flush:
+ * @ring      : ring
+ *
+ * Asks the consumer to drop everything written so far. The data is
+ * released on the consumer's next spsc_ring_begin_read(), or right
+ * away to the producer if the consumer is not reading, so the producer
+ * may keep writing right away. Producer side.
+ *
+ **/
+void spsc_ring_flush(spsc_ring_t *ring);
+
+/**
+ * spsc_ring_write:
+ * @ring      : ring
+ * @data      : source data
+ * @size      : size of @data in bytes
+ *
+ * Writes up to @size bytes and publishes them to the consumer.
+ *
+ * Returns: the number of bytes written.
+ */
+size_t spsc_ring_write(spsc_ring_t *ring, const void *data, size_t size);
+
+/**
+ * spsc_ring_read:
+ * @ring      : ring
+ * @data      : destination buffer
+ * @size      : size of @data in bytes
+ *
+ * Reads up to @size bytes and releases the space to the producer.
+ *
+ * Returns: the number of bytes read.
+ */
+size_t spsc_ring_read(spsc_ring_t *ring, void *data, size_t size);
+
+/**
+ * spsc_ring_peek:
+ * @ring      : ring
+ * @offset    : bytes to skip past the read position
+ * @size      : returns the size of the readable region in bytes
+ *
+ * Zero-copy read. Returns the largest contiguous readable region
+ * starting @offset bytes into the readable data. When the data wraps
+ * around, a second call with the first region's size as @offset
+ * returns the rest. Call spsc_ring_begin_read() first. Regions stay
+ * valid until they are released with spsc_ring_consume(), even if
+ * the producer flushes meanwhile.
+ *
+ * Returns: pointer to the readable region, or NULL if empty.
+ */
+const void *spsc_ring_peek(spsc_ring_t *ring, size_t offset, size_t *size);
+
+/**
+ * spsc_ring_consume:
+ * @ring      : ring
+ * @size      : bytes to release
+ *
+ * Releases @size bytes previously returned by spsc_ring_peek() and
+ * ends the read started by spsc_ring_begin_read(). @size may be 0.
+ *
+ **/
+void spsc_ring_consume(spsc_ring_t *ring, size_t size);
+
+RETRO_END_DECLS
+
+#endif
@@ -37,6 +37,11 @@ struct video_decoder_context
    AVFrame *filtered;
    AVFrame *target;
    ASS_Track *ass_track_active;
+   ASS_Renderer *ass_render;
+   int subtitle_ptr;
+   /* Subtitle time for frames without a timestamp, taken when the
+    * frame was queued. */
+   double fallback_time;
    uint8_t *frame_buf;
    int index;
 };
@@ -171,6 +176,18 @@ bool video_buffer_wait_for_open_slot(video_buffer_t *video_buffer);
  */
 bool video_buffer_wait_for_finished_slot(video_buffer_t *video_buffer);
 
+/**
+ * video_buffer_wait_for_finished_slot_timeout:
+ * @video_buffer      : video buffer.
+ * @timeout_us        : longest single wait in microseconds, 0 to
+ *                      only check.
+ *
+ * Same as video_buffer_wait_for_finished_slot(), with a caller
+ * chosen timeout.
+ */
+bool video_buffer_wait_for_finished_slot_timeout(video_buffer_t *video_buffer,
+      int64_t timeout_us);
+
 /**
  * video_buffer_interrupt_waiters:
  * @video_buffer      : video buffer.
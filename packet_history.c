@@ -0,0 +1,228 @@
+#include <math.h>
+
+#include "include/packet_history.h"
+
+struct packet_history_entry
+{
+   AVPacket *pkt;
+   double time;
+   bool sync_point;
+};
+
+struct packet_history
+{
+   /* Circular, entries[start] is always a sync point. */
+   struct packet_history_entry *entries;
+   size_t capacity;
+   size_t start;
+   size_t count;
+   /* Next entry to replay, count when not replaying. */
+   size_t replay;
+   size_t bytes;
+   size_t max_bytes;
+   double max_seconds;
+   double last_time;
+};
+
+static struct packet_history_entry *packet_history_at(
+      packet_history_t *history, size_t i)
+{
+   return &history->entries[(history->start + i) % history->capacity];
+}
+
+packet_history_t *packet_history_create(size_t max_bytes, double max_seconds)
+{
+   packet_history_t *h = (packet_history_t*)calloc(1, sizeof(packet_history_t));
+   if (!h)
+      return NULL;
+
+   h->capacity    = 1024;
+   h->entries     = (struct packet_history_entry*)
+      calloc(h->capacity, sizeof(struct packet_history_entry));
+   h->max_bytes   = max_bytes;
+   h->max_seconds = max_seconds;
+   h->last_time   = NAN;
+
+   if (!h->entries)
+   {
+      free(h);
+      return NULL;
+   }
+
+   return h;
+}
+
+void packet_history_destroy(packet_history_t *history)
+{
+   if (!history)
+      return;
+
+   packet_history_clear(history);
+   free(history->entries);
+   free(history);
+}
+
+static void packet_history_drop_first(packet_history_t *history)
+{
+   struct packet_history_entry *entry = packet_history_at(history, 0);
+
+   history->bytes -= entry->pkt->size;
+   av_packet_free(&entry->pkt);
+   history->start  = (history->start + 1) % history->capacity;
+   history->count--;
+   history->replay--;
+}
+
+void packet_history_clear(packet_history_t *history)
+{
+   if (!history)
+      return;
+
+   history->replay = history->count;
+   while (history->count)
+      packet_history_drop_first(history);
+
+   history->start     = 0;
+   history->replay    = 0;
+   history->bytes     = 0;
+   history->last_time = NAN;
+}
+
+static bool packet_history_grow(packet_history_t *history)
+{
+   size_t i;
+   size_t capacity = history->capacity * 2;
+   struct packet_history_entry *entries = (struct packet_history_entry*)
+      malloc(capacity * sizeof(struct packet_history_entry));
+
+   if (!entries)
+      return false;
+
+   for (i = 0; i < history->count; i++)
+      entries[i] = *packet_history_at(history, i);
+
+   free(history->entries);
+   history->entries  = entries;
+   history->capacity = capacity;
+   history->start    = 0;
+   return true;
+}
+
+/* Drops whole sync point intervals from the start, so that replaying
+ * can still begin at the first entry. */
+static void packet_history_trim(packet_history_t *history)
+{
+   while (history->count)
+   {
+      double first_time = packet_history_at(history, 0)->time;
+
+      if (history->bytes <= history->max_bytes &&
+            (isnan(first_time) || isnan(history->last_time) ||
+             history->last_time - first_time <= history->max_seconds))
+         break;
+
+      do
+      {
+         packet_history_drop_first(history);
+      } while (history->count && !packet_history_at(history, 0)->sync_point);
+   }
+}
+
+void packet_history_add(packet_history_t *history, const AVPacket *pkt,
+      double time, bool sync_point)
+{
+   struct packet_history_entry *entry;
+
+   if (!history || !pkt || history->replay != history->count)
+      return;
+   if (!history->count && !sync_point)
+      return;
+   if (history->count == history->capacity && !packet_history_grow(history))
+   {
+      packet_history_clear(history);
+      return;
+   }
+
+   entry = &history->entries[(history->start + history->count) % history->capacity];
+   entry->pkt = av_packet_alloc();
+   if (!entry->pkt || av_packet_ref(entry->pkt, pkt) < 0)
+   {
+      av_packet_free(&entry->pkt);
+      packet_history_clear(history);
+      return;
+   }
+   entry->time       = time;
+   entry->sync_point = sync_point;
+
+   history->count++;
+   history->replay  = history->count;
+   history->bytes  += pkt->size;
+   if (!isnan(time) && (isnan(history->last_time) || time > history->last_time))
+      history->last_time = time;
+
+   packet_history_trim(history);
+}
+
+bool packet_history_seek(packet_history_t *history, double time)
+{
+   size_t i;
+
+   if (!history || !history->count || isnan(history->last_time) ||
+         time > history->last_time)
+      return false;
+
+   for (i = history->count; i-- > 0; )
+   {
+      struct packet_history_entry *entry = packet_history_at(history, i);
+
+      if (entry->sync_point && !isnan(entry->time) && entry->time <= time)
+      {
+         history->replay = i;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+bool packet_history_rewind(packet_history_t *history)
+{
+   if (!history || !history->count)
+      return false;
+
+   history->replay = 0;
+   return true;
+}
+
+bool packet_history_read(packet_history_t *history, AVPacket *pkt)
+{
+   if (!history || history->replay >= history->count)
+      return false;
+
+   if (av_packet_ref(pkt, packet_history_at(history, history->replay)->pkt) < 0)
+   {
+      /* Whatever is left can not be replayed, so the demuxer would
+       * not follow on from it either. Start over. */
+      packet_history_clear(history);
+      return false;
+   }
+
+   history->replay++;
+   return true;
+}
+
+size_t packet_history_bytes(packet_history_t *history)
+{
+   return history ? history->bytes : 0;
+}
+
+double packet_history_span(packet_history_t *history)
+{
+   double first_time;
+
+   if (!history || !history->count || isnan(history->last_time))
+      return 0.0;
+
+   first_time = packet_history_at(history, 0)->time;
+   return isnan(first_time) ? 0.0 : history->last_time - first_time;
+}
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/spsc_ring.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SPSC_LOAD_ACQUIRE(ptr)       __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define SPSC_STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#else
+#error "spsc_ring requires GCC compatible atomic builtins"
+#endif
+
+struct spsc_ring
+{
+   uint8_t *data;
+   size_t mask;
+   /* Free running counters, only the producer advances head and
+    * only the consumer advances tail. */
+   size_t head;
+   size_t tail;
+   /* Producer position everything before which the consumer drops. */
+   size_t flush;
+   /* Set by the consumer between spsc_ring_begin_read() and
+    * spsc_ring_consume(), while it may hold peeked regions. */
+   int reading;
+};
+
+spsc_ring_t *spsc_ring_new(size_t capacity)
+{
+   size_t size = 1;
+   spsc_ring_t *ring = NULL;
+
+   if (capacity == 0)
+      return NULL;
+
+   while (size < capacity)
+      size <<= 1;
+
+   ring = (spsc_ring_t*)calloc(1, sizeof(*ring));
+   if (!ring)
+      return NULL;
+
+   ring->data = (uint8_t*)malloc(size);
+   if (!ring->data)
+   {
+      free(ring);
+      return NULL;
+   }
+
+   ring->mask = size - 1;
+   return ring;
+}
+
+void spsc_ring_free(spsc_ring_t *ring)
+{
+   if (!ring)
+      return;
+
+   free(ring->data);
+   free(ring);
+}
+
+void spsc_ring_clear(spsc_ring_t *ring)
+{
+   if (!ring)
+      return;
+
+   SPSC_STORE_RELEASE(&ring->tail, SPSC_LOAD_ACQUIRE(&ring->head));
+}
+
+size_t spsc_ring_capacity(spsc_ring_t *ring)
+{
+   return ring ? ring->mask + 1 : 0;
+}
+
+/* Tail after any pending flush, without applying it. */
+static size_t spsc_ring_effective_tail(spsc_ring_t *ring,
+      size_t head, size_t tail)
+{
+   size_t flush = SPSC_LOAD_ACQUIRE(&ring->flush);
+
+   /* Stale flush positions fall outside (tail, head]. */
+   if (flush - tail - 1 < head - tail)
+      return flush;
+   return tail;
+}
+
+size_t spsc_ring_read_avail(spsc_ring_t *ring)
+{
+   if (!ring)
+      return 0;
+
+   return SPSC_LOAD_ACQUIRE(&ring->head) - ring->tail;
+}
+
+size_t spsc_ring_begin_read(spsc_ring_t *ring)
+{
+   size_t head;
+   size_t effective;
+
+   if (!ring)
+      return 0;
+
+   /* Pairs with the fence in spsc_ring_write_avail(): either the
+    * producer sees the consumer reading, or the consumer sees the
+    * flush it would reclaim space up to. */
+   __atomic_store_n(&ring->reading, 1, __ATOMIC_SEQ_CST);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+   head      = SPSC_LOAD_ACQUIRE(&ring->head);
+   effective = spsc_ring_effective_tail(ring, head, ring->tail);
+   if (effective != ring->tail)
+      SPSC_STORE_RELEASE(&ring->tail, effective);
+
+   return head - effective;
+}
+
+size_t spsc_ring_write_avail(spsc_ring_t *ring)
+{
+   size_t tail;
+
+   if (!ring)
+      return 0;
+
+   tail = SPSC_LOAD_ACQUIRE(&ring->tail);
+
+   /* Space up to a pending flush can be written over unless the
+    * consumer holds peeked regions, in which case it is released by
+    * the consumer's next read. */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (!__atomic_load_n(&ring->reading, __ATOMIC_SEQ_CST))
+      tail = spsc_ring_effective_tail(ring, ring->head, tail);
+
+   return ring->mask + 1 - (ring->head - tail);
+}
+
+size_t spsc_ring_fill(spsc_ring_t *ring)
+{
+   size_t head;
+
+   if (!ring)
+      return 0;
+
+   head = SPSC_LOAD_ACQUIRE(&ring->head);
+   return head - spsc_ring_effective_tail(ring, head,
+         SPSC_LOAD_ACQUIRE(&ring->tail));
+}
+
+void spsc_ring_flush(spsc_ring_t *ring)
+{
+   if (!ring)
+      return;
+
+   SPSC_STORE_RELEASE(&ring->flush, ring->head);
+}
+
+size_t spsc_ring_write(spsc_ring_t *ring, const void *data, size_t size)
+{
+   size_t head;
+   size_t offset;
+   size_t first;
+   size_t avail = spsc_ring_write_avail(ring);
+
+   if (!ring || !data)
+      return 0;
+
+   if (size > avail)
+      size = avail;
+   if (size == 0)
+      return 0;
+
+   head   = ring->head;
+   offset = head & ring->mask;
+   first  = ring->mask + 1 - offset;
+   if (first > size)
+      first = size;
+
+   memcpy(ring->data + offset, data, first);
+   memcpy(ring->data, (const uint8_t*)data + first, size - first);
+
+   SPSC_STORE_RELEASE(&ring->head, head + size);
+   return size;
+}
+
+size_t spsc_ring_read(spsc_ring_t *ring, void *data, size_t size)
+{
+   size_t offset;
+   size_t first;
+   size_t avail;
+
+   if (!ring || !data)
+      return 0;
+
+   avail = spsc_ring_begin_read(ring);
+   if (size > avail)
+      size = avail;
+
+   offset = ring->tail & ring->mask;
+   first  = ring->mask + 1 - offset;
+   if (first > size)
+      first = size;
+
+   memcpy(data, ring->data + offset, first);
+   memcpy((uint8_t*)data + first, ring->data, size - first);
+
+   spsc_ring_consume(ring, size);
+   return size;
+}
+
+const void *spsc_ring_peek(spsc_ring_t *ring, size_t offset, size_t *size)
+{
+   size_t avail = spsc_ring_read_avail(ring);
+   size_t start;
+   size_t first;
+
+   if (size)
+      *size = 0;
+
+   if (!ring || avail <= offset)
+      return NULL;
+
+   avail -= offset;
+   start  = (ring->tail + offset) & ring->mask;
+   first  = ring->mask + 1 - start;
+   if (first > avail)
+      first = avail;
+
+   if (size)
+      *size = first;
+   return ring->data + start;
+}
+
+void spsc_ring_consume(spsc_ring_t *ring, size_t size)
+{
+   size_t avail = spsc_ring_read_avail(ring);
+
+   if (!ring)
+      return;
+
+   if (size > avail)
+      size = avail;
+
+   SPSC_STORE_RELEASE(&ring->tail, ring->tail + size);
+   __atomic_store_n(&ring->reading, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,283 @@
+/* Drives avio_cache against a local HTTP server that answers late and
+ * sends slowly, see tests/Makefile.
+ *
+ * The server serves a generated pattern, so every byte read through
+ * the cache can be checked, and honours ranges, so seeks the cache
+ * passes on to the source reconnect as they would to a real server.
+ * The counters are printed for comparing read-ahead sizes. */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+
+#include <rthreads/rthreads.h>
+
+#include "../include/avio_cache.h"
+
+#define MEDIA_SIZE   (8 * 1024 * 1024)
+#define RING_SIZE    (2 * 1024 * 1024)
+#define READ_SIZE    (32 * 1024)
+/* Injected before every response, and after every chunk sent, which
+ * limits the server to about 16 MB/s. */
+#define LATENCY_US   50000
+#define CHUNK_SIZE   (16 * 1024)
+#define CHUNK_US     1000
+/* The reader takes this long per READ_SIZE, about 8 MB/s. */
+#define READ_US      4000
+
+static int listen_fd = -1;
+static volatile bool server_stop;
+static unsigned failures;
+
+static void fail(const char *msg)
+{
+   failures++;
+   fprintf(stderr, "FAIL: %s\n", msg);
+}
+
+static uint8_t pattern_byte(int64_t pos)
+{
+   return (uint8_t)(pos ^ (pos >> 8) ^ (pos >> 16));
+}
+
+static bool send_all(int fd, const void *data, size_t size)
+{
+   const uint8_t *p = (const uint8_t*)data;
+
+   while (size)
+   {
+      ssize_t ret = send(fd, p, size, MSG_NOSIGNAL);
+
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return false;
+      p    += ret;
+      size -= (size_t)ret;
+   }
+   return true;
+}
+
+/* Serves one request, with Connection: close so that every seek of
+ * the source opens a new connection. */
+static void server_connection(void *data)
+{
+   int fd = (int)(intptr_t)data;
+   char request[4096] = {0};
+   char header[512];
+   uint8_t chunk[CHUNK_SIZE];
+   size_t len   = 0;
+   int64_t pos  = 0;
+   const char *range;
+
+   while (len < sizeof(request) - 1 && !strstr(request, "\r\n\r\n"))
+   {
+      ssize_t ret = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+
+      if (ret <= 0)
+         goto end;
+      len         += (size_t)ret;
+      request[len] = '\0';
+   }
+
+   if ((range = strstr(request, "Range: bytes=")))
+      pos = strtoll(range + strlen("Range: bytes="), NULL, 10);
+   if (pos > MEDIA_SIZE)
+      pos = MEDIA_SIZE;
+
+   av_usleep(LATENCY_US);
+
+   snprintf(header, sizeof(header),
+         "HTTP/1.1 206 Partial Content\r\n"
+         "Content-Type: application/octet-stream\r\n"
+         "Accept-Ranges: bytes\r\n"
+         "Content-Range: bytes %lld-%lld/%lld\r\n"
+         "Content-Length: %lld\r\n"
+         "Connection: close\r\n\r\n",
+         (long long)pos, (long long)MEDIA_SIZE - 1, (long long)MEDIA_SIZE,
+         (long long)(MEDIA_SIZE - pos));
+   if (!send_all(fd, header, strlen(header)))
+      goto end;
+
+   while (pos < MEDIA_SIZE && !server_stop)
+   {
+      size_t size = MIN((size_t)(MEDIA_SIZE - pos), sizeof(chunk));
+      size_t i;
+
+      for (i = 0; i < size; i++)
+         chunk[i] = pattern_byte(pos + (int64_t)i);
+      if (!send_all(fd, chunk, size))
+         break;
+      pos += (int64_t)size;
+      av_usleep(CHUNK_US);
+   }
+
+end:
+   close(fd);
+}
+
+static void server_thread(void *data)
+{
+   (void)data;
+
+   while (!server_stop)
+   {
+      int fd = accept(listen_fd, NULL, NULL);
+      sthread_t *thread;
+
+      if (fd < 0)
+         continue;
+      thread = sthread_create(server_connection, (void*)(intptr_t)fd);
+      if (thread)
+         sthread_detach(thread);
+      else
+         close(fd);
+   }
+}
+
+static int server_start(void)
+{
+   struct sockaddr_in addr;
+   socklen_t addr_len = sizeof(addr);
+   int one            = 1;
+
+   listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (listen_fd < 0)
+      return -1;
+   setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family      = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+         listen(listen_fd, 8) < 0 ||
+         getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len) < 0)
+      return -1;
+
+   return ntohs(addr.sin_port);
+}
+
+/* Reads @size bytes at the reader's pace and checks them. */
+static int64_t read_checked(AVIOContext *pb, int64_t size, const char *what)
+{
+   static uint8_t buf[READ_SIZE];
+   int64_t done = 0;
+
+   while (done < size)
+   {
+      int64_t pos = avio_tell(pb);
+      int want    = (int)MIN((int64_t)sizeof(buf), size - done);
+      int ret     = avio_read(pb, buf, want);
+      int i;
+
+      if (ret <= 0)
+         break;
+      for (i = 0; i < ret; i++)
+      {
+         if (buf[i] != pattern_byte(pos + i))
+         {
+            fprintf(stderr, "FAIL: %s: wrong byte at %lld\n", what,
+                  (long long)(pos + i));
+            failures++;
+            return done;
+         }
+      }
+      done += ret;
+      av_usleep(READ_US);
+   }
+   return done;
+}
+
+static void print_stats(const char *phase, avio_cache_t *cache)
+{
+   struct avio_cache_stats stats;
+
+   avio_cache_get_stats(cache, &stats, true);
+   printf("%-10s fetched %5.2f MB, %u stalls (%.1f ms), "
+         "%u seeks reused, %u seeks to the source, %u retries\n",
+         phase, stats.bytes_fetched / (1024.0 * 1024.0), stats.stalls,
+         stats.stall_us / 1000.0, stats.seeks_reused, stats.seeks_source,
+         stats.retries);
+}
+
+int main(void)
+{
+   struct avio_cache_stats stats;
+   char url[64];
+   avio_cache_t *cache;
+   AVIOContext *pb;
+   sthread_t *server;
+   int port;
+
+   signal(SIGPIPE, SIG_IGN);
+   av_log_set_level(AV_LOG_ERROR);
+   avformat_network_init();
+
+   if ((port = server_start()) < 0 ||
+         !(server = sthread_create(server_thread, NULL)))
+   {
+      fprintf(stderr, "FAIL: server setup\n");
+      return 1;
+   }
+   snprintf(url, sizeof(url), "http://127.0.0.1:%d/media", port);
+
+   if (!(cache = avio_cache_open(url, RING_SIZE)))
+   {
+      fprintf(stderr, "FAIL: avio_cache_open(%s)\n", url);
+      return 1;
+   }
+   pb = avio_cache_context(cache);
+
+   if (avio_size(pb) != MEDIA_SIZE)
+      fail("size not passed on");
+
+   /* The first reads wait for the server to answer. */
+   if (read_checked(pb, 4 * 1024 * 1024, "sequential") != 4 * 1024 * 1024)
+      fail("sequential read short");
+   print_stats("sequential", cache);
+
+   /* A short skip back is served from the bytes kept. */
+   avio_seek(pb, -256 * 1024, SEEK_CUR);
+   read_checked(pb, 64 * 1024, "seek back");
+   avio_cache_get_stats(cache, &stats, false);
+   if (stats.seeks_reused < 1 || stats.seeks_source)
+      fail("short seek back went to the source");
+   print_stats("seek back", cache);
+
+   /* A long jump ahead seeks the source. */
+   avio_seek(pb, 6 * 1024 * 1024 + 123, SEEK_SET);
+   if (read_checked(pb, MEDIA_SIZE, "seek ahead") != MEDIA_SIZE - (6 * 1024 * 1024 + 123))
+      fail("read after seek does not end at the end of the media");
+   if (!avio_feof(pb))
+      fail("no EOF at the end of the media");
+   avio_cache_get_stats(cache, &stats, false);
+   if (stats.seeks_source < 1)
+      fail("long seek ahead did not go to the source");
+   print_stats("seek ahead", cache);
+
+   avio_cache_close(cache);
+
+   server_stop = true;
+   shutdown(listen_fd, SHUT_RDWR);
+   close(listen_fd);
+   sthread_join(server);
+   avformat_network_deinit();
+
+   if (failures)
+   {
+      fprintf(stderr, "avio_cache_test: %u failures\n", failures);
+      return 1;
+   }
+
+   printf("avio_cache_test: OK\n");
+   return 0;
+}
@@ -0,0 +1,158 @@
+/* Demuxes a local file through FFmpeg's own file protocol and through
+ * avio_file, and compares how long it takes, see tests/Makefile.
+ *
+ *    avio_file_bench <file> [block MB] [passes]
+ *
+ * Where the system can, the file is dropped from the page cache before
+ * each pass, so that the passes measure reads from the disk rather
+ * than from memory. */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+
+#include "../include/avio_file.h"
+
+struct bench_result
+{
+   int64_t total_us;
+   int64_t read_max_us;
+   uint64_t bytes;
+   unsigned packets;
+};
+
+static void drop_page_cache(const char *path)
+{
+#ifdef POSIX_FADV_DONTNEED
+   int fd = open(path, O_RDONLY);
+
+   if (fd < 0)
+      return;
+   posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+   close(fd);
+#else
+   (void)path;
+#endif
+}
+
+/* Demuxes @path to the end, through avio_file if @block_size is set. */
+static int bench_pass(const char *path, size_t block_size,
+      struct bench_result *result)
+{
+   AVFormatContext *fctx = NULL;
+   avio_file_t *file     = NULL;
+   AVPacket *pkt         = av_packet_alloc();
+   int64_t start;
+   int ret;
+
+   if (!pkt)
+      return AVERROR(ENOMEM);
+
+   drop_page_cache(path);
+   start = av_gettime_relative();
+
+   if (block_size)
+   {
+      file = avio_file_open(path, block_size);
+      fctx = avformat_alloc_context();
+      if (!file || !fctx)
+      {
+         ret = AVERROR(ENOMEM);
+         goto end;
+      }
+      fctx->pb = avio_file_context(file);
+   }
+
+   if ((ret = avformat_open_input(&fctx, path, NULL, NULL)) < 0)
+      goto end;
+
+   for (;;)
+   {
+      int64_t read_start = av_gettime_relative();
+      int64_t elapsed;
+
+      if ((ret = av_read_frame(fctx, pkt)) < 0)
+         break;
+
+      elapsed = av_gettime_relative() - read_start;
+      if (elapsed > result->read_max_us)
+         result->read_max_us = elapsed;
+      result->bytes += (uint64_t)pkt->size;
+      result->packets++;
+      av_packet_unref(pkt);
+   }
+   if (ret == AVERROR_EOF)
+      ret = 0;
+
+   result->total_us = av_gettime_relative() - start;
+
+end:
+   avformat_close_input(&fctx);
+   avio_file_close(file);
+   av_packet_free(&pkt);
+   return ret;
+}
+
+static void print_result(const char *name, const struct bench_result *result)
+{
+   double seconds = result->total_us / 1000000.0;
+
+   printf("%-10s %8.1f MB/s  %7.2f s  %u packets, slowest read %.2f ms\n",
+         name, seconds > 0.0 ? result->bytes / (1024.0 * 1024.0) / seconds : 0.0,
+         seconds, result->packets, result->read_max_us / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+   const char *path;
+   size_t block_size = 4 * 1024 * 1024;
+   unsigned passes   = 3;
+   unsigned i;
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "usage: %s <file> [block MB] [passes]\n", argv[0]);
+      return 1;
+   }
+
+   path = argv[1];
+   if (argc > 2)
+      block_size = (size_t)strtoul(argv[2], NULL, 10) * 1024 * 1024;
+   if (argc > 3)
+      passes = (unsigned)strtoul(argv[3], NULL, 10);
+   if (!block_size)
+   {
+      fprintf(stderr, "block size must be at least 1 MB\n");
+      return 1;
+   }
+
+   av_log_set_level(AV_LOG_ERROR);
+
+   for (i = 0; i < passes; i++)
+   {
+      struct bench_result direct = {0};
+      struct bench_result blocks = {0};
+      int ret;
+
+      if ((ret = bench_pass(path, 0, &direct)) < 0 ||
+            (ret = bench_pass(path, block_size, &blocks)) < 0)
+      {
+         fprintf(stderr, "%s: %s\n", path, av_err2str(ret));
+         return 1;
+      }
+
+      printf("pass %u\n", i + 1);
+      print_result("file:", &direct);
+      print_result("avio_file", &blocks);
+   }
+
+   return 0;
+}
@@ -0,0 +1,151 @@
+/* Standalone test for spsc_ring flushes landing while the consumer
+ * holds peeked regions, see tests/Makefile.
+ *
+ * The producer steps are run from the consumer's thread at the points
+ * where the decode thread may flush during retro_run(), so each
+ * interleaving is hit every time rather than by chance. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/spsc_ring.h"
+
+#define RING_SIZE 4096
+
+static unsigned failures;
+
+static void fail(const char *msg)
+{
+   failures++;
+   fprintf(stderr, "FAIL: %s\n", msg);
+}
+
+/* Writes @size bytes of @value, returns the bytes written. */
+static size_t produce(spsc_ring_t *r, size_t size, uint8_t value)
+{
+   uint8_t buf[RING_SIZE];
+
+   memset(buf, value, size);
+   return spsc_ring_write(r, buf, size);
+}
+
+/* Leaves the ring with its contents wrapped around the end, so that a
+ * read needs both peeked regions. */
+static spsc_ring_t *wrapped_ring(void)
+{
+   spsc_ring_t *r = spsc_ring_new(RING_SIZE);
+
+   produce(r, RING_SIZE / 2, 0);
+   spsc_ring_begin_read(r);
+   spsc_ring_consume(r, RING_SIZE / 2);
+   produce(r, RING_SIZE, 1);
+   return r;
+}
+
+static bool region_is(const void *region, size_t size, uint8_t value)
+{
+   const uint8_t *p = (const uint8_t*)region;
+   size_t i;
+
+   for (i = 0; i < size; i++)
+      if (p[i] != value)
+         return false;
+   return true;
+}
+
+/* A flush between the two peeks must neither move the second region
+ * nor hand the first one back to the producer. */
+static void test_flush_between_peeks(void)
+{
+   spsc_ring_t *r = wrapped_ring();
+   size_t avail   = spsc_ring_begin_read(r);
+   size_t first   = 0;
+   size_t rest    = 0;
+   const void *region[2];
+
+   region[0] = spsc_ring_peek(r, 0, &first);
+
+   /* Decode thread: seek flush, then as much new audio as fits. */
+   spsc_ring_flush(r);
+   produce(r, RING_SIZE, 2);
+
+   region[1] = spsc_ring_peek(r, first, &rest);
+
+   if (avail != RING_SIZE || first != RING_SIZE / 2 || rest != RING_SIZE / 2)
+      fail("peeked regions changed by a flush");
+   if (!region_is(region[0], first, 1) || !region[1] ||
+         !region_is(region[1], rest, 1))
+      fail("peeked region overwritten before consume");
+
+   spsc_ring_consume(r, first + rest);
+   spsc_ring_free(r);
+}
+
+/* Data written after a flush that lands before the consume must not
+ * be consumed with the data that was read. */
+static void test_flush_before_consume(void)
+{
+   spsc_ring_t *r = spsc_ring_new(RING_SIZE);
+   size_t size    = 0;
+   const void *region;
+
+   produce(r, RING_SIZE / 2, 1);
+   spsc_ring_begin_read(r);
+   region = spsc_ring_peek(r, 0, &size);
+   if (!region || size != RING_SIZE / 2)
+      fail("peek before the flush");
+
+   spsc_ring_flush(r);
+   produce(r, RING_SIZE / 4, 2);
+   spsc_ring_consume(r, size / 2);
+
+   /* The next read drops the rest of the flushed data only. */
+   if (spsc_ring_begin_read(r) != RING_SIZE / 4)
+      fail("data written after a flush dropped by consume");
+   region = spsc_ring_peek(r, 0, &size);
+   if (!region || size != RING_SIZE / 4 || !region_is(region, size, 2))
+      fail("read after a flush does not start at the flush");
+   spsc_ring_consume(r, size);
+
+   spsc_ring_free(r);
+}
+
+/* Space up to a pending flush is the producer's once the consumer is
+ * not reading, and stays the consumer's while it is. */
+static void test_reclaim(void)
+{
+   uint8_t buf[RING_SIZE] = {0};
+   spsc_ring_t *r = spsc_ring_new(RING_SIZE);
+
+   spsc_ring_write(r, buf, RING_SIZE);
+   spsc_ring_begin_read(r);
+   spsc_ring_flush(r);
+   if (spsc_ring_write_avail(r) != 0)
+      fail("flushed space reclaimed while the consumer reads");
+   spsc_ring_consume(r, 0);
+   if (spsc_ring_write_avail(r) != RING_SIZE)
+      fail("flushed space not reclaimed");
+   if (spsc_ring_write(r, buf, RING_SIZE / 2) != RING_SIZE / 2)
+      fail("write after flush truncated");
+   if (spsc_ring_begin_read(r) != RING_SIZE / 2)
+      fail("flushed data still readable");
+   spsc_ring_consume(r, RING_SIZE / 2);
+
+   spsc_ring_free(r);
+}
+
+int main(void)
+{
+   test_flush_between_peeks();
+   test_flush_before_consume();
+   test_reclaim();
+
+   if (failures)
+   {
+      fprintf(stderr, "spsc_ring_test: %u failures\n", failures);
+      return 1;
+   }
+
+   printf("spsc_ring_test: OK\n");
+   return 0;
+}
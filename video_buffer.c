@@ -67,6 +67,9 @@ video_buffer_t *video_buffer_create(
       b->buffer[i].index     = i;
       b->buffer[i].pts       = 0;
       b->buffer[i].sws       = NULL;
+      b->buffer[i].ass_track_active = NULL;
+      b->buffer[i].ass_render       = NULL;
+      b->buffer[i].subtitle_ptr     = -1;
       b->buffer[i].source    = av_frame_alloc();
       b->buffer[i].filtered  = av_frame_alloc();
       b->buffer[i].target    = av_frame_alloc();
@@ -106,6 +109,8 @@ void video_buffer_destroy(video_buffer_t *video_buffer)
          av_freep((AVFrame*)video_buffer->buffer[i].target);
          av_frame_free(&video_buffer->buffer[i].target);
          sws_freeContext(video_buffer->buffer[i].sws);
+         if (video_buffer->buffer[i].ass_render)
+            ass_renderer_done(video_buffer->buffer[i].ass_render);
       }
    }
    free(video_buffer->buffer);
@@ -236,6 +241,12 @@ bool video_buffer_wait_for_open_slot(video_buffer_t *video_buffer)
 }
 
 bool video_buffer_wait_for_finished_slot(video_buffer_t *video_buffer)
+{
+   return video_buffer_wait_for_finished_slot_timeout(video_buffer, 2000);
+}
+
+bool video_buffer_wait_for_finished_slot_timeout(
+      video_buffer_t *video_buffer, int64_t timeout_us)
 {
    uint64_t clear_count = 0;
    bool ready = false;
@@ -245,8 +256,9 @@ bool video_buffer_wait_for_finished_slot(video_buffer_t *video_buffer)
 
    while (video_buffer->status[video_buffer->tail] != KB_FINISHED)
    {
-      if (!scond_wait_timeout(video_buffer->finished_cond,
-            video_buffer->lock, 2000))
+      if (timeout_us <= 0 ||
+            !scond_wait_timeout(video_buffer->finished_cond,
+            video_buffer->lock, timeout_us))
          break;
       if (clear_count != video_buffer->clear_count &&
             video_buffer->status[video_buffer->tail] != KB_FINISHED)